@@ -0,0 +1,711 @@
+/**
+ * @brief Throughput benchmark of the DNS tunneling sender and receiver
+ * @file dns_bench.c
+ * @author Patrik Skaloš
+ * @year 2022
+ *
+ * Starts the receiver on a loopback port and transfers generated files by
+ * the sender for every combination of file size, chunk length and FEC group
+ * size. Every transfer and a summary (medians) of every combination are
+ * written to stdout as JSON lines
+ */
+
+
+// Standard libraries
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+// Header files
+#include "dns_bench.h"
+
+
+/*
+ *
+ * GLOBAL VARIABLES
+ *
+ */
+
+
+char *SENDER_PATH = "./sender/dns_sender";
+char *RECEIVER_PATH = "./receiver/dns_receiver";
+char *BASE_HOST = "bench.test";
+char *BASELINE_PATH = NULL; // Summaries of a previous run (for -B)
+char *PROXY_PATH = "./bench/dns_proxy";
+char *PROXY_ARGS = NULL; // Impairments of the network (for -X)
+
+int PORT = 5353;
+int REPEATS = 3;
+double THRESHOLD = 10; // Max throughput drop against the baseline in percent
+
+long SIZES[BENCH_MAX_VALUES] = {1024, 65536, 1048576};
+int SIZES_COUNT = 3;
+long CHUNK_LENS[BENCH_MAX_VALUES] = {63, 126, 189};
+int CHUNK_LENS_COUNT = 3;
+long FEC_GROUPS[BENCH_MAX_VALUES] = {0, 4};
+int FEC_GROUPS_COUNT = 2;
+
+char WORK_DIR[] = "/tmp/dns_bench.XXXXXX";
+int WORK_DIR_CREATED = 0;
+pid_t RECEIVER_PID = 0;
+pid_t PROXY_PID = 0;
+
+
+/*
+ *
+ * MISC
+ *
+ */
+
+
+/**
+ * @brief Free all resources, write the error message to stderr and exit
+ *
+ * @param As for printf and similar functions
+ */
+void err(char *format, ...){
+    stop_proxy();
+    stop_receiver();
+
+    fprintf(stderr, "Error! ");
+    va_list argptr;
+    va_start(argptr, format);
+    vfprintf(stderr, format, argptr);
+    va_end(argptr);
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+
+/**
+ * @brief Get time from a monotonic clock
+ *
+ * @return seconds
+ */
+static double now(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/**
+ * @brief Comparator of doubles for qsort
+ */
+static int compare_doubles(const void *a, const void *b){
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+
+/**
+ * @brief Get a median of values (the array gets sorted)
+ *
+ * @param values
+ * @param count
+ *
+ * @return median
+ */
+static double median(double *values, int count){
+    qsort(values, count, sizeof(double), compare_doubles);
+    if(count % 2){
+        return values[count / 2];
+    }
+    return (values[count / 2 - 1] + values[count / 2]) / 2;
+}
+
+
+/**
+ * @brief Remove the work directory and files created in it
+ */
+static void remove_work_dir(){
+    char path[64];
+    if(!WORK_DIR_CREATED){
+        return;
+    }
+    for(int i = 0; i < SIZES_COUNT; i++){
+        snprintf(path, sizeof(path), "%s/src_%ld", WORK_DIR, SIZES[i]);
+        unlink(path);
+    }
+    snprintf(path, sizeof(path), "%s/recv/out", WORK_DIR);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/recv", WORK_DIR);
+    rmdir(path);
+    snprintf(path, sizeof(path), "%s/metrics.json", WORK_DIR);
+    unlink(path);
+    rmdir(WORK_DIR);
+    WORK_DIR_CREATED = 0;
+}
+
+
+/*
+ *
+ * PARSING
+ *
+ */
+
+
+/**
+ * @brief Parse a comma separated list of numbers
+ *
+ * @param list - string to parse
+ * @param values - output array of BENCH_MAX_VALUES numbers
+ *
+ * @return number of values
+ */
+int parse_list(char *list, long *values){
+    int count = 0;
+    char *ptr = list;
+    while(*ptr){
+        char *end;
+        long value = strtol(ptr, &end, 10);
+        if(end == ptr || value < 0 || (*end && *end != ',')){
+            err("Invalid list of numbers: \"%s\"", list);
+        }
+        if(count == BENCH_MAX_VALUES){
+            err("Too many values in \"%s\" (max %d)", list, BENCH_MAX_VALUES);
+        }
+        values[count++] = value;
+        ptr = *end ? end + 1 : end;
+    }
+    if(!count){
+        err("Empty list of numbers");
+    }
+    return count;
+}
+
+
+/**
+ * @brief Parse user provided options and save settings to global variables
+ *
+ * @param argc
+ * @param argv
+ */
+void parse_args(int argc, char **argv){
+    for(int i = 1; i < argc; i++){ // Start from one to ignore filename
+        if(argv[i][0] != '-' || strlen(argv[i]) != 2){
+            err("Unknown argument \"%s\"", argv[i]);
+        }
+        if(i + 1 >= argc){
+            err("No argument following \"%s\"", argv[i]);
+        }
+        char option = argv[i][1];
+        char *value = argv[++i];
+
+        switch(option){
+            case 'p':
+                PORT = atoi(value);
+                if(PORT < 1 || PORT > 65535){
+                    err("Invalid port \"%s\"", value);
+                }
+                break;
+            case 'r':
+                REPEATS = atoi(value);
+                if(REPEATS < 1 || REPEATS > BENCH_MAX_REPEATS){
+                    err("Repeats must be 1 to %d", BENCH_MAX_REPEATS);
+                }
+                break;
+            case 's':
+                SIZES_COUNT = parse_list(value, SIZES);
+                break;
+            case 'c':
+                CHUNK_LENS_COUNT = parse_list(value, CHUNK_LENS);
+                break;
+            case 'f':
+                FEC_GROUPS_COUNT = parse_list(value, FEC_GROUPS);
+                break;
+            case 'B':
+                BASELINE_PATH = value;
+                break;
+            case 't':
+                THRESHOLD = atof(value);
+                break;
+            case 'S':
+                SENDER_PATH = value;
+                break;
+            case 'R':
+                RECEIVER_PATH = value;
+                break;
+            case 'X':
+                PROXY_ARGS = value;
+                break;
+            case 'P':
+                PROXY_PATH = value;
+                break;
+            default:
+                err("Unknown argument \"%s\"", argv[i - 1]);
+        }
+    }
+}
+
+
+/*
+ *
+ * MEASUREMENT
+ *
+ */
+
+
+/**
+ * @brief Write a file of pseudo-random data (the same for the same size)
+ *
+ * @param path
+ * @param size - in bytes
+ */
+void generate_file(char *path, long size){
+    FILE *f = fopen(path, "wb");
+    if(!f){
+        err("Could not create file %s", path);
+    }
+    uint64_t state = 0x9E3779B97F4A7C15ULL ^ size;
+    for(long i = 0; i < size; i++){
+        // xorshift64
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        fputc(state & 0xFF, f);
+    }
+    fclose(f);
+}
+
+
+/**
+ * @brief Check if two files have the same content
+ *
+ * @param path1
+ * @param path2
+ *
+ * @return 1 if the files are equal
+ */
+int files_equal(char *path1, char *path2){
+    FILE *f1 = fopen(path1, "rb");
+    FILE *f2 = fopen(path2, "rb");
+    int equal = f1 && f2;
+    while(equal){
+        int c1 = fgetc(f1), c2 = fgetc(f2);
+        if(c1 != c2){
+            equal = 0;
+        }else if(c1 == EOF){
+            break;
+        }
+    }
+    if(f1){
+        fclose(f1);
+    }
+    if(f2){
+        fclose(f2);
+    }
+    return equal;
+}
+
+
+/**
+ * @brief Get CPU time (user + system) used by a running process
+ *
+ * @param pid
+ *
+ * @return seconds
+ */
+double process_cpu(pid_t pid){
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    FILE *f = fopen(path, "r");
+    if(!f){
+        return 0;
+    }
+    char buffer[1024];
+    size_t len = fread(buffer, 1, sizeof(buffer) - 1, f);
+    fclose(f);
+    buffer[len] = '\0';
+
+    // Fields after the command name (which may contain spaces) - utime and
+    // stime are the 12th and 13th of them
+    char *ptr = strrchr(buffer, ')');
+    unsigned long utime = 0, stime = 0;
+    if(!ptr || sscanf(ptr + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+                &utime, &stime) != 2){
+        return 0;
+    }
+    return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+
+/**
+ * @brief Get peak resident set size of a running process
+ *
+ * @param pid
+ *
+ * @return kB
+ */
+long process_peak_rss(pid_t pid){
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    FILE *f = fopen(path, "r");
+    if(!f){
+        return 0;
+    }
+    char line[256];
+    long rss = 0;
+    while(fgets(line, sizeof(line), f)){
+        if(sscanf(line, "VmHWM: %ld", &rss) == 1){
+            break;
+        }
+    }
+    fclose(f);
+    return rss;
+}
+
+
+/**
+ * @brief Get value of a counter from a JSON metrics snapshot
+ *
+ * @param path - snapshot file
+ * @param name - name of the counter
+ *
+ * @return value or -1 if not found
+ */
+long metrics_counter(char *path, char *name){
+    FILE *f = fopen(path, "r");
+    if(!f){
+        return -1;
+    }
+    char buffer[4096];
+    size_t len = fread(buffer, 1, sizeof(buffer) - 1, f);
+    fclose(f);
+    buffer[len] = '\0';
+
+    char key[64];
+    snprintf(key, sizeof(key), "\"%s\": ", name);
+    char *ptr = strstr(buffer, key);
+    if(!ptr){
+        return -1;
+    }
+    return atol(ptr + strlen(key));
+}
+
+
+/*
+ *
+ * PROCESSES
+ *
+ */
+
+
+/**
+ * @brief Start the receiver in the background
+ */
+void start_receiver(){
+    char dst_dir[64], port[8];
+    snprintf(dst_dir, sizeof(dst_dir), "%s/recv", WORK_DIR);
+    snprintf(port, sizeof(port), "%d", PORT);
+
+    RECEIVER_PID = fork();
+    if(RECEIVER_PID < 0){
+        err("Could not start the receiver");
+    }
+    if(!RECEIVER_PID){
+        // Events would only measure the terminal
+        setenv("DNS_EVENTS", "off", 1);
+        unsetenv("DNS_METRICS_FILE");
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        execl(RECEIVER_PATH, RECEIVER_PATH, "-p", port, BASE_HOST, dst_dir, (char *)NULL);
+        perror(RECEIVER_PATH);
+        _exit(127);
+    }
+
+    // Give the receiver time to bind its socket
+    usleep(200000);
+    if(waitpid(RECEIVER_PID, NULL, WNOHANG)){
+        RECEIVER_PID = 0;
+        err("Receiver exited right after start (is port %d free?)", PORT);
+    }
+}
+
+
+/**
+ * @brief Stop the receiver
+ */
+void stop_receiver(){
+    if(RECEIVER_PID > 0){
+        kill(RECEIVER_PID, SIGTERM);
+        waitpid(RECEIVER_PID, NULL, 0);
+        RECEIVER_PID = 0;
+    }
+    remove_work_dir();
+}
+
+
+/**
+ * @brief Start the proxy impairing the network between the sender and the
+ * receiver in the background - it listens on PORT + 1 and forwards to PORT
+ */
+void start_proxy(){
+    char listen_port[8], port[8];
+    snprintf(listen_port, sizeof(listen_port), "%d", PORT + 1);
+    snprintf(port, sizeof(port), "%d", PORT);
+
+    PROXY_PID = fork();
+    if(PROXY_PID < 0){
+        err("Could not start the proxy");
+    }
+    if(!PROXY_PID){
+        // Split the arguments by spaces
+        char *args[64] = {PROXY_PATH, "-l", listen_port, "-p", port};
+        int count = 5;
+        char *arg = strtok(strdup(PROXY_ARGS), " ");
+        while(arg && count < 63){
+            args[count++] = arg;
+            arg = strtok(NULL, " ");
+        }
+        args[count] = NULL;
+        execv(PROXY_PATH, args);
+        perror(PROXY_PATH);
+        _exit(127);
+    }
+
+    // Give the proxy time to bind its socket
+    usleep(100000);
+    if(waitpid(PROXY_PID, NULL, WNOHANG)){
+        PROXY_PID = 0;
+        err("Proxy exited right after start (is port %d free?)", PORT + 1);
+    }
+}
+
+
+/**
+ * @brief Stop the proxy
+ */
+void stop_proxy(){
+    if(PROXY_PID > 0){
+        kill(PROXY_PID, SIGTERM);
+        waitpid(PROXY_PID, NULL, 0);
+        PROXY_PID = 0;
+    }
+}
+
+
+/**
+ * @brief Transfer a file from the sender to the receiver and measure it
+ *
+ * @param run - output
+ * @param src_path - file to send
+ * @param size - file size in bytes
+ * @param chunk_len - base64 characters per query
+ * @param fec - FEC group size (0 to disable FEC)
+ */
+void bench_transfer(struct bench_run *run, char *src_path, long size, long chunk_len, long fec){
+    char metrics_path[64], dst_path[64], port[8], chunk[16], group[16];
+    snprintf(metrics_path, sizeof(metrics_path), "%s/metrics.json", WORK_DIR);
+    snprintf(dst_path, sizeof(dst_path), "%s/recv/out", WORK_DIR);
+    snprintf(port, sizeof(port), "%d", PROXY_PID ? PORT + 1 : PORT);
+    snprintf(chunk, sizeof(chunk), "%ld", chunk_len);
+    snprintf(group, sizeof(group), "%ld", fec);
+    unlink(dst_path);
+    unlink(metrics_path);
+
+    double receiver_cpu = process_cpu(RECEIVER_PID);
+    double start = now();
+
+    pid_t pid = fork();
+    if(pid < 0){
+        err("Could not start the sender");
+    }
+    if(!pid){
+        setenv("DNS_EVENTS", "off", 1);
+        setenv("DNS_METRICS_FILE", metrics_path, 1);
+        char *args[16] = {SENDER_PATH, "-u", "127.0.0.1", "-p", port, "-c", chunk};
+        int count = 7;
+        if(fec){
+            args[count++] = "-f";
+            args[count++] = group;
+        }
+        args[count++] = BASE_HOST;
+        args[count++] = "out";
+        args[count++] = src_path;
+        args[count] = NULL;
+        execv(SENDER_PATH, args);
+        perror(SENDER_PATH);
+        _exit(127);
+    }
+
+    int status;
+    struct rusage usage;
+    if(wait4(pid, &status, 0, &usage) < 0){
+        err("Could not wait for the sender");
+    }
+
+    run->seconds = now() - start;
+    run->sender_cpu = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6
+                      + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+    run->sender_rss = usage.ru_maxrss;
+    run->receiver_cpu = process_cpu(RECEIVER_PID) - receiver_cpu;
+    run->receiver_rss = process_peak_rss(RECEIVER_PID);
+    run->packets = metrics_counter(metrics_path, "packets_out");
+    run->ok = WIFEXITED(status) && !WEXITSTATUS(status) && files_equal(src_path, dst_path);
+}
+
+
+/*
+ *
+ * REPORTING
+ *
+ */
+
+
+/**
+ * @brief Compare a summary with the summary of the same configuration in
+ * the baseline file
+ *
+ * @param size
+ * @param chunk_len
+ * @param fec
+ * @param mb_per_s - median throughput measured now
+ *
+ * @return 1 if the throughput dropped more than the threshold
+ */
+int check_regression(long size, long chunk_len, long fec, double mb_per_s){
+    FILE *f = fopen(BASELINE_PATH, "r");
+    if(!f){
+        err("Could not open baseline %s", BASELINE_PATH);
+    }
+
+    // Only compare runs under the same network conditions
+    char proxy[256];
+    snprintf(proxy, sizeof(proxy), "\"proxy\": \"%s\"", PROXY_ARGS ? PROXY_ARGS : "");
+
+    char line[1024];
+    int regression = 0;
+    while(fgets(line, sizeof(line), f)){
+        long b_size, b_chunk_len, b_fec;
+        double b_mb_per_s;
+        if(sscanf(line, "{\"type\": \"summary\", \"size\": %ld, \"chunk_len\": %ld, \"fec\": %ld, "
+                    "\"mb_per_s\": %lf", &b_size, &b_chunk_len, &b_fec, &b_mb_per_s) != 4){
+            continue;
+        }
+        if(b_size != size || b_chunk_len != chunk_len || b_fec != fec || !strstr(line, proxy)){
+            continue;
+        }
+        double change = b_mb_per_s > 0 ? (mb_per_s / b_mb_per_s - 1) * 100 : 0;
+        if(change < -THRESHOLD){
+            fprintf(stderr, "Regression: size %ld, chunk_len %ld, fec %ld: "
+                    "%.3f MB/s (baseline %.3f MB/s, %.1f %%)\n",
+                    size, chunk_len, fec, mb_per_s, b_mb_per_s, change);
+            regression = 1;
+        }
+        break;
+    }
+    fclose(f);
+    return regression;
+}
+
+
+/*
+ *
+ * MAIN
+ *
+ */
+
+
+int main(int argc, char **argv){
+    parse_args(argc, argv);
+
+    if(!mkdtemp(WORK_DIR)){
+        err("Could not create a work directory");
+    }
+    WORK_DIR_CREATED = 1;
+    char path[64];
+    snprintf(path, sizeof(path), "%s/recv", WORK_DIR);
+    if(mkdir(path, 0700)){
+        err("Could not create a work directory");
+    }
+
+    start_receiver();
+    if(PROXY_ARGS){
+        start_proxy();
+    }
+
+    int failed = 0, regressions = 0;
+    for(int s = 0; s < SIZES_COUNT; s++){
+        char src_path[64];
+        snprintf(src_path, sizeof(src_path), "%s/src_%ld", WORK_DIR, SIZES[s]);
+        generate_file(src_path, SIZES[s]);
+
+        for(int c = 0; c < CHUNK_LENS_COUNT; c++){
+            for(int f = 0; f < FEC_GROUPS_COUNT; f++){
+                long size = SIZES[s], chunk_len = CHUNK_LENS[c], fec = FEC_GROUPS[f];
+                double mb_per_s[BENCH_MAX_REPEATS], packets_per_s[BENCH_MAX_REPEATS];
+                double cpu_per_mb[BENCH_MAX_REPEATS];
+                long peak_rss = 0;
+                int ok = 0;
+
+                for(int r = 0; r < REPEATS; r++){
+                    struct bench_run run;
+                    bench_transfer(&run, src_path, size, chunk_len, fec);
+                    double mb = size / 1e6;
+
+                    printf("{\"type\": \"run\", \"size\": %ld, \"chunk_len\": %ld, \"fec\": %ld, "
+                           "\"repeat\": %d, \"ok\": %s, \"seconds\": %.6f, \"packets\": %ld, "
+                           "\"sender_cpu_s\": %.3f, \"receiver_cpu_s\": %.3f, "
+                           "\"sender_peak_rss_kb\": %ld, \"receiver_peak_rss_kb\": %ld, \"proxy\": \"%s\"}\n",
+                           size, chunk_len, fec, r, run.ok ? "true" : "false", run.seconds,
+                           run.packets, run.sender_cpu, run.receiver_cpu, run.sender_rss,
+                           run.receiver_rss, PROXY_ARGS ? PROXY_ARGS : "");
+                    fflush(stdout);
+
+                    if(!run.ok){
+                        failed += 1;
+                        continue;
+                    }
+                    mb_per_s[ok] = mb / run.seconds;
+                    packets_per_s[ok] = run.packets / run.seconds;
+                    cpu_per_mb[ok] = mb > 0 ? (run.sender_cpu + run.receiver_cpu) / mb : 0;
+                    if(run.sender_rss > peak_rss){
+                        peak_rss = run.sender_rss;
+                    }
+                    if(run.receiver_rss > peak_rss){
+                        peak_rss = run.receiver_rss;
+                    }
+                    ok += 1;
+                }
+
+                if(!ok){
+                    continue;
+                }
+                double mb_median = median(mb_per_s, ok);
+                printf("{\"type\": \"summary\", \"size\": %ld, \"chunk_len\": %ld, \"fec\": %ld, "
+                       "\"mb_per_s\": %.6f, \"packets_per_s\": %.1f, \"cpu_s_per_mb\": %.3f, "
+                       "\"peak_rss_kb\": %ld, \"runs\": %d, \"proxy\": \"%s\"}\n",
+                       size, chunk_len, fec, mb_median, median(packets_per_s, ok),
+                       median(cpu_per_mb, ok), peak_rss, ok, PROXY_ARGS ? PROXY_ARGS : "");
+                fflush(stdout);
+
+                if(BASELINE_PATH){
+                    regressions += check_regression(size, chunk_len, fec, mb_median);
+                }
+            }
+        }
+    }
+
+    stop_proxy();
+    stop_receiver();
+
+    if(failed){
+        fprintf(stderr, "%d transfers failed\n", failed);
+        return 1;
+    }
+    if(regressions){
+        fprintf(stderr, "%d configurations regressed by more than %.1f %%\n", regressions, THRESHOLD);
+        return 2;
+    }
+    return 0;
+}
@@ -0,0 +1,163 @@
+/**
+ * @brief Throughput benchmark of the DNS tunneling sender and receiver
+ * @file dns_bench.h
+ * @author Patrik Skaloš
+ * @year 2022
+ */
+
+#ifndef DNS_BENCH_H
+#define DNS_BENCH_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+
+#define BENCH_MAX_VALUES 16 // Max values of one swept parameter
+#define BENCH_MAX_REPEATS 64
+
+
+/**
+ * Result of one transfer
+ */
+struct bench_run{
+    int ok; // 1 if the received file equals the sent one
+    double seconds;
+    double sender_cpu; // Seconds of user + system time
+    double receiver_cpu;
+    long sender_rss; // Peak resident set size in kB
+    long receiver_rss;
+    long packets; // Packets sent by the sender
+};
+
+
+/**
+ * @brief Free all resources, write the error message to stderr and exit
+ *
+ * @param As for printf and similar functions
+ */
+void err(char *format, ...);
+
+
+/**
+ * @brief Parse a comma separated list of numbers
+ *
+ * @param list - string to parse
+ * @param values - output array of BENCH_MAX_VALUES numbers
+ *
+ * @return number of values
+ */
+int parse_list(char *list, long *values);
+
+
+/**
+ * @brief Parse user provided options and save settings to global variables
+ *
+ * @param argc
+ * @param argv
+ */
+void parse_args(int argc, char **argv);
+
+
+/**
+ * @brief Write a file of pseudo-random data (the same for the same size)
+ *
+ * @param path
+ * @param size - in bytes
+ */
+void generate_file(char *path, long size);
+
+
+/**
+ * @brief Check if two files have the same content
+ *
+ * @param path1
+ * @param path2
+ *
+ * @return 1 if the files are equal
+ */
+int files_equal(char *path1, char *path2);
+
+
+/**
+ * @brief Get CPU time (user + system) used by a running process
+ *
+ * @param pid
+ *
+ * @return seconds
+ */
+double process_cpu(pid_t pid);
+
+
+/**
+ * @brief Get peak resident set size of a running process
+ *
+ * @param pid
+ *
+ * @return kB
+ */
+long process_peak_rss(pid_t pid);
+
+
+/**
+ * @brief Get value of a counter from a JSON metrics snapshot
+ *
+ * @param path - snapshot file
+ * @param name - name of the counter
+ *
+ * @return value or -1 if not found
+ */
+long metrics_counter(char *path, char *name);
+
+
+/**
+ * @brief Start the receiver in the background
+ */
+void start_receiver();
+
+
+/**
+ * @brief Stop the receiver
+ */
+void stop_receiver();
+
+
+/**
+ * @brief Start the proxy impairing the network between the sender and the
+ * receiver in the background - it listens on PORT + 1 and forwards to PORT
+ */
+void start_proxy();
+
+
+/**
+ * @brief Stop the proxy
+ */
+void stop_proxy();
+
+
+/**
+ * @brief Transfer a file from the sender to the receiver and measure it
+ *
+ * @param run - output
+ * @param src_path - file to send
+ * @param size - file size in bytes
+ * @param chunk_len - base64 characters per query
+ * @param fec - FEC group size (0 to disable FEC)
+ */
+void bench_transfer(struct bench_run *run, char *src_path, long size, long chunk_len, long fec);
+
+
+/**
+ * @brief Compare a summary with the summary of the same configuration in
+ * the baseline file
+ *
+ * @param size
+ * @param chunk_len
+ * @param fec
+ * @param mb_per_s - median throughput measured now
+ *
+ * @return 1 if the throughput dropped more than the threshold
+ */
+int check_regression(long size, long chunk_len, long fec, double mb_per_s);
+
+
+#endif //DNS_BENCH_H
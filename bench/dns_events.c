@@ -0,0 +1,134 @@
+/**
+ * @brief Decoder of binary event files (DNS_EVENTS=binary) - records are
+ * written in the text format of the program which stored them
+ * @file dns_events.c
+ * @author Patrik Skaloš
+ * @year 2022
+ *
+ * Records don't say which program stored them (types of events are numbered
+ * by each program), so the program is given by "-s" (sender) or "-r"
+ * (receiver). Records are read from the file, or from stdin if there is
+ * none, in the byte order of this machine, and written to stdout
+ */
+
+
+// Standard libraries
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+// Header files
+#include "dns_events.h"
+#include "../common/dns_event_sink.h"
+#include "../sender/dns_sender_events.h"
+#include "../receiver/dns_receiver_events.h"
+
+
+/*
+ *
+ * GLOBAL VARIABLES
+ *
+ */
+
+
+event_formatter_t FORMATTER = NULL;
+char *EVENTS_PATH = NULL; // NULL for stdin
+
+
+/*
+ *
+ * MISC
+ *
+ */
+
+
+/**
+ * @brief Write the error message to stderr and exit
+ *
+ * @param As for printf and similar functions
+ */
+void err(char *format, ...){
+    fprintf(stderr, "Error! ");
+    va_list argptr;
+    va_start(argptr, format);
+    vfprintf(stderr, format, argptr);
+    va_end(argptr);
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+
+/*
+ *
+ * PARSING
+ *
+ */
+
+
+/**
+ * @brief Parse user provided options and save settings to global variables
+ *
+ * @param argc
+ * @param argv
+ */
+void parse_args(int argc, char **argv){
+    for(int i = 1; i < argc; i++){ // Start from one to ignore filename
+        if(!strcmp(argv[i], "-s")){
+            FORMATTER = dns_sender__format_event;
+        }else if(!strcmp(argv[i], "-r")){
+            FORMATTER = dns_receiver__format_event;
+        }else if(argv[i][0] == '-'){
+            err("Unknown argument \"%s\"", argv[i]);
+        }else if(!EVENTS_PATH){
+            EVENTS_PATH = argv[i];
+        }else{
+            err("Invalid amount of arguments");
+        }
+    }
+
+    if(!FORMATTER){
+        err("Program which stored the events missing (\"-s\" for the sender, \"-r\" for the receiver)");
+    }
+}
+
+
+/*
+ *
+ * MAIN
+ *
+ */
+
+
+int main(int argc, char **argv){
+    parse_args(argc, argv);
+
+    FILE *in = stdin;
+    if(EVENTS_PATH){
+        in = fopen(EVENTS_PATH, "rb");
+        if(!in){
+            err("Failed to open the events file \"%s\"", EVENTS_PATH);
+        }
+    }
+
+    struct event_record record;
+    size_t len = 0;
+    while((len = fread(&record, 1, sizeof(record), in)) == sizeof(record)){
+        // Strings are terminated by the sink, but don't trust the file
+        record.path[EVENT_PATH_LEN - 1] = '\0';
+        record.data[EVENT_DATA_LEN - 1] = '\0';
+        FORMATTER(stdout, &record);
+    }
+    if(ferror(in)){
+        err("Failed to read the events");
+    }
+    if(len){
+        // Eg. the program still writes it
+        err("The events end with an incomplete record (%zu of %zu bytes)", len, sizeof(record));
+    }
+
+    if(in != stdin){
+        fclose(in);
+    }
+    return 0;
+}
@@ -0,0 +1,30 @@
+/**
+ * @brief Decoder of binary event files (DNS_EVENTS=binary) - records are
+ * written in the text format of the program which stored them
+ * @file dns_events.h
+ * @author Patrik Skaloš
+ * @year 2022
+ */
+
+#ifndef DNS_EVENTS_H
+#define DNS_EVENTS_H
+
+
+/**
+ * @brief Write the error message to stderr and exit
+ *
+ * @param As for printf and similar functions
+ */
+void err(char *format, ...);
+
+
+/**
+ * @brief Parse user provided options and save settings to global variables
+ *
+ * @param argc
+ * @param argv
+ */
+void parse_args(int argc, char **argv);
+
+
+#endif //DNS_EVENTS_H
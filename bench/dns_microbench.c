@@ -0,0 +1,655 @@
+/**
+ * @brief Microbenchmarks of the hot-path functions of the sender and the
+ * receiver, compared with alternative implementations
+ * @file dns_microbench.c
+ * @author Patrik Skaloš
+ * @year 2022
+ *
+ * Every function is measured for every input size, first as implemented in
+ * common/ and then in the alternative implementations below, which are
+ * checked to give the same results. Results are written to stdout as JSON
+ * lines. To quantify a change of a hot-path function, add the new version as
+ * an alternative here, compare, and only then replace the function
+ */
+
+
+// Standard libraries
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+
+// Networking libraries
+#include <arpa/inet.h>
+
+// Header files
+#include "dns_microbench.h"
+#include "../common/dns_base64.h"
+#include "../common/dns_packet.h"
+
+
+/*
+ *
+ * GLOBAL VARIABLES
+ *
+ */
+
+
+char *BASE_HOST = "bench.test";
+char *FILTER = NULL; // Only measure functions containing this string
+
+int REPEATS = 5;
+int WARMUP_MS = 20; // Run every function this long before measuring
+int MIN_MS = 20; // Minimal time of one repetition
+
+long SIZES[MICRO_MAX_VALUES] = {16, 256, 4096, 65536, 1048576};
+int SIZES_COUNT = 5;
+long CHUNK_LENS[MICRO_MAX_VALUES] = {16, 63, 126, 189};
+int CHUNK_LENS_COUNT = 4;
+
+volatile unsigned long SINK = 0; // Results are added here not to be optimized out
+
+
+/*
+ *
+ * MISC
+ *
+ */
+
+
+/**
+ * @brief Write the error message to stderr and exit
+ *
+ * @param As for printf and similar functions
+ */
+void err(char *format, ...){
+    fprintf(stderr, "Error! ");
+    va_list argptr;
+    va_start(argptr, format);
+    vfprintf(stderr, format, argptr);
+    va_end(argptr);
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+
+/**
+ * @brief Get time from a monotonic clock
+ *
+ * @return nanoseconds
+ */
+static double now_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+/**
+ * @brief Comparator of doubles for qsort
+ */
+static int compare_doubles(const void *a, const void *b){
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+
+/**
+ * @brief Parse a comma separated list of numbers
+ *
+ * @param list - string to parse
+ * @param values - output array of MICRO_MAX_VALUES numbers
+ *
+ * @return number of values
+ */
+static int parse_list(char *list, long *values){
+    int count = 0;
+    char *ptr = list;
+    while(*ptr){
+        char *end;
+        long value = strtol(ptr, &end, 10);
+        if(end == ptr || value < 1 || (*end && *end != ',')){
+            err("Invalid list of numbers: \"%s\"", list);
+        }
+        if(count == MICRO_MAX_VALUES){
+            err("Too many values in \"%s\" (max %d)", list, MICRO_MAX_VALUES);
+        }
+        values[count++] = value;
+        ptr = *end ? end + 1 : end;
+    }
+    if(!count){
+        err("Empty list of numbers");
+    }
+    return count;
+}
+
+
+/**
+ * @brief Check if a chunk fits to a question with the base host
+ *
+ * @param chunk_len - base64 characters
+ *
+ * @return 1 if it fits
+ */
+static int chunk_fits(int chunk_len){
+    return chunk_len + (chunk_len + 62) / 63 + (int)strlen(BASE_HOST) + 1 <= PACKET_MAX_NAME_LEN;
+}
+
+
+/*
+ *
+ * ALTERNATIVE IMPLEMENTATIONS
+ *
+ */
+
+
+static const char alt_encoding_table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+static char alt_pair_table[4096][2]; // Two characters for every 12 bits
+static unsigned char alt_decoding_table[256];
+
+
+/**
+ * @brief Fill the lookup tables of the alternative implementations
+ */
+static void alt_init(){
+    for(int i = 0; i < 4096; i++){
+        alt_pair_table[i][0] = alt_encoding_table[i >> 6];
+        alt_pair_table[i][1] = alt_encoding_table[i & 0x3F];
+    }
+    for(int i = 0; i < 64; i++){
+        alt_decoding_table[(unsigned char)alt_encoding_table[i]] = i;
+    }
+}
+
+
+/**
+ * @brief base64_encode looking up two characters (12 bits) at once, without
+ * branches in the main loop
+ */
+static char *alt_base64_encode_pairs(const unsigned char *data, int input_length, int *output_length){
+    char *encoded_data = malloc(4 * ((input_length + 2) / 3));
+    if(encoded_data == NULL) return NULL;
+
+    int i = 0, j = 0;
+    for(; i + 3 <= input_length; i += 3){
+        uint32_t triple = (data[i] << 16) | (data[i + 1] << 8) | data[i + 2];
+        memcpy(encoded_data + j, alt_pair_table[triple >> 12], 2);
+        memcpy(encoded_data + j + 2, alt_pair_table[triple & 0xFFF], 2);
+        j += 4;
+    }
+
+    // Last one or two bytes, without padding
+    if(i < input_length){
+        uint32_t triple = data[i] << 16;
+        if(i + 1 < input_length){
+            triple |= data[i + 1] << 8;
+        }
+        encoded_data[j++] = alt_encoding_table[triple >> 18];
+        encoded_data[j++] = alt_encoding_table[(triple >> 12) & 0x3F];
+        if(i + 1 < input_length){
+            encoded_data[j++] = alt_encoding_table[(triple >> 6) & 0x3F];
+        }
+    }
+
+    *output_length = j;
+    return encoded_data;
+}
+
+
+/**
+ * @brief base64_decode with a table built in advance, checking for '=' only
+ * in the last quadruple
+ */
+static unsigned char *alt_base64_decode_static(const char *data, int input_length, int *output_length){
+    if(input_length % 4 != 0) return NULL;
+
+    *output_length = input_length / 4 * 3;
+    if(input_length && data[input_length - 1] == '=') (*output_length)--;
+    if(input_length && data[input_length - 2] == '=') (*output_length)--;
+
+    unsigned char *decoded_data = malloc(*output_length + 2);
+    if(decoded_data == NULL) return NULL;
+
+    const unsigned char *in = (const unsigned char *)data;
+    unsigned char *out = decoded_data;
+    for(int i = 0; i < input_length; i += 4){
+        uint32_t triple = (alt_decoding_table[in[i]] << 18)
+            | (alt_decoding_table[in[i + 1]] << 12)
+            | (in[i + 2] == '=' ? 0 : alt_decoding_table[in[i + 2]] << 6)
+            | (in[i + 3] == '=' ? 0 : alt_decoding_table[in[i + 3]]);
+        out[0] = triple >> 16;
+        out[1] = triple >> 8;
+        out[2] = triple;
+        out += 3;
+    }
+
+    return decoded_data;
+}
+
+
+/**
+ * @brief packet_build as it was before packets were built from a template:
+ * the header and the base host labels are prepared for every packet and the
+ * data are copied byte by byte
+ */
+static int alt_packet_build_per_packet(const char *base_host, unsigned char *buffer,
+        uint16_t xid, const char *data, int len){
+
+    struct dns_header_t *header = (struct dns_header_t *)buffer;
+    memset(header, 0, sizeof(*header));
+    header->xid = htons(xid);
+    header->flags = htons(256);
+    header->qdcount = htons(1);
+
+    unsigned char *ptr = &buffer[sizeof(struct dns_header_t)];
+    for(int i = 0; i < len; i += 63){
+        int label_len = len - i > 63 ? 63 : len - i;
+        *ptr++ = label_len;
+        for(int k = 0; k < label_len; k++){
+            *ptr++ = data[i + k];
+        }
+    }
+
+    const char *label = base_host;
+    while(*label){
+        const char *dot = strchr(label, '.');
+        int label_len = dot ? dot - label : strlen(label);
+        *ptr++ = label_len;
+        for(int k = 0; k < label_len; k++){
+            *ptr++ = label[k];
+        }
+        label += dot ? label_len + 1 : label_len;
+    }
+    *ptr++ = 0;
+
+    struct dns_question_info_t question_info = {htons(1), htons(1)};
+    memcpy(ptr, &question_info, sizeof(question_info));
+    ptr += sizeof(question_info);
+
+    return ptr - buffer;
+}
+
+
+/**
+ * @brief packet_parse_query as it was in the receiver originally: labels are
+ * appended to the URL character by character, finding the end by strlen
+ */
+static int alt_packet_parse_strlen(const unsigned char *buffer, const char *base_host,
+        char *payload_b64, int *query_id){
+
+    *query_id = ((struct dns_header_t *)buffer)->xid;
+    const unsigned char *query_tmp_ptr = &buffer[sizeof(struct dns_header_t)];
+
+    char url[512] = {'\0'};
+    while(1){
+        uint8_t label_len = *query_tmp_ptr;
+        query_tmp_ptr += 1;
+        if(label_len == 0){
+            break;
+        }
+        for(int i = 0; i < label_len; i++){
+            url[strlen(url)] = *query_tmp_ptr;
+            query_tmp_ptr += 1;
+        }
+        url[strlen(url)] = '.';
+    }
+    url[strlen(url) - 1] = '\0';
+
+    int payload_url_len = (int)strlen(url) - (int)strlen(base_host) - 1;
+    if(payload_url_len < 0 || url[payload_url_len] != '.'
+            || strcmp(url + payload_url_len + 1, base_host)){
+        return 1;
+    }
+
+    memcpy(payload_b64, url, payload_url_len);
+    payload_b64[payload_url_len] = '\0';
+
+    int payload_len = 0;
+    for(int i = 0; payload_b64[i] != '\0'; i++){
+        if(payload_b64[i] != '.'){
+            payload_b64[payload_len++] = payload_b64[i];
+        }
+    }
+    payload_b64[payload_len] = '\0';
+    return 0;
+}
+
+
+/*
+ *
+ * BENCHMARKED CALLS
+ *
+ */
+
+
+static void run_encode(struct micro_input *input){
+    int len;
+    char *out = base64_encode(input->data, input->size, &len);
+    SINK += out[len - 1];
+    free(out);
+}
+
+
+static void run_encode_pairs(struct micro_input *input){
+    int len;
+    char *out = alt_base64_encode_pairs(input->data, input->size, &len);
+    SINK += out[len - 1];
+    free(out);
+}
+
+
+static void run_decode(struct micro_input *input){
+    int len;
+    unsigned char *out = base64_decode(input->b64, input->b64_len, &len);
+    SINK += out[len - 1];
+    free(out);
+}
+
+
+static void run_decode_static(struct micro_input *input){
+    int len;
+    unsigned char *out = alt_base64_decode_static(input->b64, input->b64_len, &len);
+    SINK += out[len - 1];
+    free(out);
+}
+
+
+static void run_build(struct micro_input *input){
+    unsigned char buffer[512];
+    SINK += packet_build(&input->template, buffer, input->xid++, NULL, input->chunk, input->size);
+}
+
+
+static void run_build_per_packet(struct micro_input *input){
+    unsigned char buffer[512];
+    SINK += alt_packet_build_per_packet(BASE_HOST, buffer, input->xid++, input->chunk, input->size);
+}
+
+
+static void run_parse(struct micro_input *input){
+    char url[512], payload_b64[256], control[64];
+    int query_id;
+    packet_parse_query(input->packet, input->packet_len, &input->domains, NULL, url, payload_b64, control, &query_id);
+    SINK += payload_b64[0];
+}
+
+
+static void run_parse_strlen(struct micro_input *input){
+    char payload_b64[256];
+    int query_id;
+    alt_packet_parse_strlen(input->packet, BASE_HOST, payload_b64, &query_id);
+    SINK += payload_b64[0];
+}
+
+
+static const struct micro_case CASES[] = {
+    {"base64_encode", "repo", 0, run_encode},
+    {"base64_encode", "pair_table", 0, run_encode_pairs},
+    {"base64_decode", "repo", 0, run_decode},
+    {"base64_decode", "static_table", 0, run_decode_static},
+    {"packet_build", "repo", 1, run_build},
+    {"packet_build", "per_packet", 1, run_build_per_packet},
+    {"packet_parse_query", "repo", 1, run_parse},
+    {"packet_parse_query", "strlen", 1, run_parse_strlen},
+};
+#define CASES_COUNT (int)(sizeof(CASES) / sizeof(CASES[0]))
+
+
+/*
+ *
+ * PARSING
+ *
+ */
+
+
+/**
+ * @brief Parse user provided options and save settings to global variables
+ *
+ * @param argc
+ * @param argv
+ */
+void parse_args(int argc, char **argv){
+    for(int i = 1; i < argc; i++){ // Start from one to ignore filename
+        if(argv[i][0] != '-' || strlen(argv[i]) != 2){
+            err("Unknown argument \"%s\"", argv[i]);
+        }
+        if(i + 1 >= argc){
+            err("No argument following \"%s\"", argv[i]);
+        }
+        char option = argv[i][1];
+        char *value = argv[++i];
+
+        switch(option){
+            case 'r':
+                REPEATS = atoi(value);
+                if(REPEATS < 1 || REPEATS > MICRO_MAX_REPEATS){
+                    err("Repeats must be 1 to %d", MICRO_MAX_REPEATS);
+                }
+                break;
+            case 'w':
+                WARMUP_MS = atoi(value);
+                break;
+            case 'm':
+                MIN_MS = atoi(value);
+                break;
+            case 's':
+                SIZES_COUNT = parse_list(value, SIZES);
+                break;
+            case 'c':
+                CHUNK_LENS_COUNT = parse_list(value, CHUNK_LENS);
+                break;
+            case 'F':
+                FILTER = value;
+                break;
+            default:
+                err("Unknown argument \"%s\"", argv[i - 1]);
+        }
+    }
+    if(WARMUP_MS < 1 || MIN_MS < 1){
+        err("Warmup and minimal time must be at least 1 ms");
+    }
+}
+
+
+/*
+ *
+ * MEASUREMENT
+ *
+ */
+
+
+/**
+ * @brief Prepare inputs of all benchmarked functions
+ *
+ * @param input - output
+ * @param size - size of the data (or of the chunk for packet functions)
+ */
+void prepare_input(struct micro_input *input, int size){
+    memset(input, 0, sizeof(*input));
+    input->size = size;
+
+    input->data = malloc(size);
+    uint64_t state = 0x9E3779B97F4A7C15ULL ^ size;
+    for(int i = 0; i < size; i++){
+        // xorshift64
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        input->data[i] = state & 0xFF;
+    }
+
+    // Padded base64, as decoded by the receiver
+    int len;
+    char *b64 = base64_encode(input->data, size, &len);
+    input->b64_len = (len + 3) / 4 * 4;
+    input->b64 = malloc(input->b64_len + 1);
+    memcpy(input->b64, b64, len);
+    memset(input->b64 + len, '=', input->b64_len - len);
+    input->b64[input->b64_len] = '\0';
+
+    // Chunk of size characters
+    input->chunk = malloc(size + 1);
+    for(int i = 0; i < size; i++){
+        input->chunk[i] = b64[i % len];
+    }
+    input->chunk[size] = '\0';
+    free(b64);
+
+    if(packet_template_init(&input->template, BASE_HOST) || packet_domains_init(&input->domains, BASE_HOST)){
+        err("Invalid base host \"%s\"", BASE_HOST);
+    }
+    if(chunk_fits(size)){
+        input->packet_len = packet_build(&input->template, input->packet, 1, NULL, input->chunk, size);
+    }
+}
+
+
+/**
+ * @brief Free inputs prepared by prepare_input
+ *
+ * @param input
+ */
+void free_input(struct micro_input *input){
+    free(input->data);
+    free(input->b64);
+    free(input->chunk);
+}
+
+
+/**
+ * @brief Check that the alternative implementations give the same results
+ * as the functions in common/
+ *
+ * @param input
+ */
+static void check_alternatives(struct micro_input *input){
+    int len, alt_len;
+    char *encoded = base64_encode(input->data, input->size, &len);
+    char *alt_encoded = alt_base64_encode_pairs(input->data, input->size, &alt_len);
+    if(len != alt_len || memcmp(encoded, alt_encoded, len)){
+        err("pair_table base64_encode differs for size %d", input->size);
+    }
+    free(encoded);
+    free(alt_encoded);
+
+    unsigned char *decoded = base64_decode(input->b64, input->b64_len, &len);
+    unsigned char *alt_decoded = alt_base64_decode_static(input->b64, input->b64_len, &alt_len);
+    if(len != alt_len || memcmp(decoded, alt_decoded, len)){
+        err("static_table base64_decode differs for size %d", input->size);
+    }
+    free(decoded);
+    free(alt_decoded);
+
+    if(input->packet_len){
+        unsigned char packet[512];
+        len = alt_packet_build_per_packet(BASE_HOST, packet, 1, input->chunk, input->size);
+        if(len != input->packet_len || memcmp(packet, input->packet, len)){
+            err("per_packet packet_build differs for size %d", input->size);
+        }
+
+        char url[512], payload_b64[256], alt_payload_b64[256], control[64];
+        int query_id;
+        if(packet_parse_query(input->packet, input->packet_len, &input->domains, NULL, url, payload_b64, control, &query_id)
+                || alt_packet_parse_strlen(input->packet, BASE_HOST, alt_payload_b64, &query_id)
+                || strcmp(payload_b64, alt_payload_b64)){
+            err("strlen packet_parse_query differs for size %d", input->size);
+        }
+    }
+}
+
+
+/**
+ * @brief Measure a function: run it for the warmup time to estimate the
+ * number of calls that takes the minimal time, then measure that number of
+ * calls REPEATS times
+ *
+ * @param c - function to measure
+ * @param input - its input
+ * @param calls - output, calls in one repetition
+ *
+ * @return median time of one call in nanoseconds
+ */
+double measure(const struct micro_case *c, struct micro_input *input, long *calls){
+    long warmup_calls = 0;
+    double start = now_ns();
+    double elapsed;
+    do{
+        c->run(input);
+        warmup_calls += 1;
+        elapsed = now_ns() - start;
+    }while(elapsed < WARMUP_MS * 1e6);
+
+    *calls = (long)(warmup_calls * (MIN_MS / (double)WARMUP_MS));
+    if(*calls < 1){
+        *calls = 1;
+    }
+
+    double times[MICRO_MAX_REPEATS];
+    for(int r = 0; r < REPEATS; r++){
+        start = now_ns();
+        for(long i = 0; i < *calls; i++){
+            c->run(input);
+        }
+        times[r] = (now_ns() - start) / *calls;
+    }
+    qsort(times, REPEATS, sizeof(double), compare_doubles);
+    return times[REPEATS / 2];
+}
+
+
+/*
+ *
+ * MAIN
+ *
+ */
+
+
+int main(int argc, char **argv){
+    parse_args(argc, argv);
+    alt_init();
+
+    double repo_ns[MICRO_MAX_VALUES]; // Times of the implementation in common/
+
+    for(int i = 0; i < CASES_COUNT; i++){
+        const struct micro_case *c = &CASES[i];
+        if(FILTER && !strstr(c->function, FILTER) && !strstr(c->impl, FILTER)){
+            continue;
+        }
+
+        if(!i || strcmp(CASES[i - 1].function, c->function)){
+            memset(repo_ns, 0, sizeof(repo_ns));
+        }
+
+        long *sizes = c->packet ? CHUNK_LENS : SIZES;
+        int sizes_count = c->packet ? CHUNK_LENS_COUNT : SIZES_COUNT;
+        for(int s = 0; s < sizes_count; s++){
+            if(c->packet && !chunk_fits(sizes[s])){
+                err("Chunk length %ld does not fit to a packet with base host \"%s\"", sizes[s], BASE_HOST);
+            }
+
+            struct micro_input input;
+            prepare_input(&input, sizes[s]);
+            check_alternatives(&input);
+
+            long calls;
+            double ns = measure(c, &input, &calls);
+
+            // Speedup against the implementation in common/ (measured first)
+            if(!strcmp(c->impl, "repo")){
+                repo_ns[s] = ns;
+            }
+            double speedup = repo_ns[s] > 0 ? repo_ns[s] / ns : 1;
+
+            printf("{\"type\": \"micro\", \"function\": \"%s\", \"impl\": \"%s\", \"size\": %ld, "
+                   "\"calls\": %ld, \"repeats\": %d, \"ns_per_op\": %.1f, \"mb_per_s\": %.1f, "
+                   "\"speedup\": %.3f}\n",
+                   c->function, c->impl, sizes[s], calls, REPEATS, ns,
+                   sizes[s] / ns * 1e3, speedup);
+            fflush(stdout);
+            free_input(&input);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,97 @@
+/**
+ * @brief Microbenchmarks of the hot-path functions of the sender and the
+ * receiver, compared with alternative implementations
+ * @file dns_microbench.h
+ * @author Patrik Skaloš
+ * @year 2022
+ */
+
+#ifndef DNS_MICROBENCH_H
+#define DNS_MICROBENCH_H
+
+#include "../common/dns_packet.h"
+
+
+#define MICRO_MAX_VALUES 16 // Max values of one swept parameter
+#define MICRO_MAX_REPEATS 64
+
+
+/**
+ * Inputs of benchmarked functions, prepared for one size
+ */
+struct micro_input{
+    int size; // Size of the input in bytes
+    unsigned char *data; // Random data (size bytes)
+    char *b64; // Data encoded to base64, padded to a multiple of 4 characters
+    int b64_len;
+    char *chunk; // Base64 chunk to put to a packet (size characters)
+    struct packet_template template;
+    struct packet_domains domains; // Of the base host, to parse the packet
+    unsigned char packet[512]; // Query carrying the chunk
+    int packet_len;
+    uint16_t xid;
+};
+
+
+/**
+ * A benchmarked function and the implementation it belongs to. Every
+ * function is first measured in the implementation used by the programs
+ * ("repo") and then in the alternatives
+ */
+struct micro_case{
+    const char *function;
+    const char *impl;
+    int packet; // 1 if the function works with chunks of a packet
+    void (*run)(struct micro_input *input);
+};
+
+
+/**
+ * @brief Write the error message to stderr and exit
+ *
+ * @param As for printf and similar functions
+ */
+void err(char *format, ...);
+
+
+/**
+ * @brief Parse user provided options and save settings to global variables
+ *
+ * @param argc
+ * @param argv
+ */
+void parse_args(int argc, char **argv);
+
+
+/**
+ * @brief Prepare inputs of all benchmarked functions
+ *
+ * @param input - output
+ * @param size - size of the data (or of the chunk for packet functions)
+ */
+void prepare_input(struct micro_input *input, int size);
+
+
+/**
+ * @brief Free inputs prepared by prepare_input
+ *
+ * @param input
+ */
+void free_input(struct micro_input *input);
+
+
+/**
+ * @brief Measure a function: run it for the warmup time to estimate the
+ * number of calls that takes the minimal time, then measure that number of
+ * calls REPEATS times
+ *
+ * @param c - function to measure
+ * @param input - its input
+ * @param calls - output, calls in one repetition
+ *
+ * @return median time of one call in nanoseconds
+ */
+double measure(const struct micro_case *c, struct micro_input *input, long *calls);
+
+
+#endif //DNS_MICROBENCH_H
@@ -0,0 +1,591 @@
+/**
+ * @brief UDP proxy between the sender and the receiver, impairing the
+ * network like a real path through a recursive resolver would
+ * @file dns_proxy.c
+ * @author Patrik Skaloš
+ * @year 2022
+ *
+ * Queries received on the listening port are forwarded to the upstream (the
+ * receiver) and responses back to the client, each of them subject to loss,
+ * delay with jitter, reordering and duplication. Like a recursive resolver,
+ * the proxy uses its own query IDs upstream, sends unanswered queries again,
+ * can randomize the case of questions (0x20 encoding, dropping responses
+ * which don't echo it) and can limit the rate of queries. All random
+ * decisions come from a seeded generator, so a run can be repeated
+ */
+
+
+// Standard libraries
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+
+// Networking libraries
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+// Header files
+#include "dns_proxy.h"
+#include "../common/dns_packet.h"
+
+
+/*
+ *
+ * GLOBAL VARIABLES
+ *
+ */
+
+
+int LISTEN_PORT = 5300;
+char *UPSTREAM_IP = "127.0.0.1";
+int UPSTREAM_PORT = 5353;
+
+double LOSS = 0; // Percent of packets lost (in each direction)
+int DELAY_MS = 0; // One-way delay
+int JITTER_MS = 0; // Max random deviation of the delay
+double REORDER = 0; // Percent of packets held back to be overtaken
+double DUPLICATE = 0; // Percent of packets delivered twice
+int RETRY_MS = 0; // Resend unanswered queries upstream after this (0 = off)
+int RETRIES = 2; // Max resends of a query
+int CASE_RANDOMIZATION = 0; // 1 to randomize case of questions (0x20)
+int RATE_LIMIT = 0; // Max queries per second from clients (0 = unlimited)
+uint64_t SEED = 1;
+
+int CLIENT_SOCK = -1; // Socket receiving queries from clients
+int UPSTREAM_SOCK = -1; // Socket connected to the upstream
+
+struct proxy_packet PENDING[PROXY_MAX_PENDING];
+struct proxy_query QUERIES[PROXY_MAX_QUERIES];
+uint16_t NEXT_XID = 0;
+
+double TOKENS = 0; // Token bucket of the rate limit
+uint64_t TOKENS_TIME = 0;
+
+volatile sig_atomic_t RUNNING = 1;
+
+// Statistics written at exit
+struct{
+    long queries;
+    long responses;
+    long lost;
+    long duplicated;
+    long reordered;
+    long retried;
+    long rate_limited;
+    long case_mismatches;
+    long unmatched; // Responses to no waiting query (late or duplicate)
+    long overflows; // Packets dropped because too many were delayed
+} STATS;
+
+
+/*
+ *
+ * MISC
+ *
+ */
+
+
+/**
+ * @brief Write the error message to stderr and exit
+ *
+ * @param As for printf and similar functions
+ */
+void err(char *format, ...){
+    fprintf(stderr, "Error! ");
+    va_list argptr;
+    va_start(argptr, format);
+    vfprintf(stderr, format, argptr);
+    va_end(argptr);
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+
+/**
+ * @brief Get time from a monotonic clock
+ *
+ * @return microseconds
+ */
+static uint64_t now_us(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+/**
+ * @brief Get a pseudo-random number (xorshift64 seeded by SEED)
+ *
+ * @return number in the range 0 to 1
+ */
+static double random_unit(){
+    SEED ^= SEED << 13;
+    SEED ^= SEED >> 7;
+    SEED ^= SEED << 17;
+    return (SEED >> 11) * (1.0 / 9007199254740992.0);
+}
+
+
+/**
+ * @brief Decide randomly
+ *
+ * @param percent - probability in percent
+ *
+ * @return 1 with the probability
+ */
+static int chance(double percent){
+    return percent > 0 && random_unit() * 100 < percent;
+}
+
+
+/**
+ * @brief Get length of the question name of a query in the wire format
+ *
+ * @param data - packet
+ * @param len - packet length in bytes
+ *
+ * @return length in bytes including the terminating zero byte, 0 if invalid
+ */
+static int question_name_len(unsigned char *data, int len){
+    int i = sizeof(struct dns_header_t);
+    while(i < len && data[i]){
+        i += 1 + data[i];
+    }
+    if(i >= len){
+        return 0;
+    }
+    return i + 1 - sizeof(struct dns_header_t);
+}
+
+
+/*
+ *
+ * PARSING
+ *
+ */
+
+
+/**
+ * @brief Parse user provided options and save settings to global variables
+ *
+ * @param argc
+ * @param argv
+ */
+void parse_args(int argc, char **argv){
+    for(int i = 1; i < argc; i++){ // Start from one to ignore filename
+        if(!strcmp(argv[i], "-x")){
+            CASE_RANDOMIZATION = 1;
+            continue;
+        }
+        if(argv[i][0] != '-' || strlen(argv[i]) != 2){
+            err("Unknown argument \"%s\"", argv[i]);
+        }
+        if(i + 1 >= argc){
+            err("No argument following \"%s\"", argv[i]);
+        }
+        char option = argv[i][1];
+        char *value = argv[++i];
+
+        switch(option){
+            case 'l':
+                LISTEN_PORT = atoi(value);
+                break;
+            case 'u':
+                UPSTREAM_IP = value;
+                break;
+            case 'p':
+                UPSTREAM_PORT = atoi(value);
+                break;
+            case 'L':
+                LOSS = atof(value);
+                break;
+            case 'd':
+                DELAY_MS = atoi(value);
+                break;
+            case 'j':
+                JITTER_MS = atoi(value);
+                break;
+            case 'o':
+                REORDER = atof(value);
+                break;
+            case 'D':
+                DUPLICATE = atof(value);
+                break;
+            case 't':
+                RETRY_MS = atoi(value);
+                break;
+            case 'n':
+                RETRIES = atoi(value);
+                break;
+            case 'q':
+                RATE_LIMIT = atoi(value);
+                break;
+            case 's':
+                SEED = strtoull(value, NULL, 10);
+                break;
+            default:
+                err("Unknown argument \"%s\"", argv[i - 1]);
+        }
+    }
+
+    if(LISTEN_PORT < 1 || LISTEN_PORT > 65535 || UPSTREAM_PORT < 1 || UPSTREAM_PORT > 65535){
+        err("Invalid port");
+    }
+    if(DELAY_MS < 0 || JITTER_MS < 0 || RETRY_MS < 0 || RETRIES < 0 || RATE_LIMIT < 0){
+        err("Times, retries and the rate limit must not be negative");
+    }
+    if(!SEED){
+        SEED = 1; // xorshift never leaves zero
+    }
+}
+
+
+/*
+ *
+ * FORWARDING
+ *
+ */
+
+
+/**
+ * @brief Schedule delivery of a packet
+ *
+ * @param to_upstream - 1 if the packet goes to the upstream
+ * @param client - address of the client (if the packet goes to it)
+ * @param data - packet
+ * @param len - packet length in bytes
+ * @param due - time of delivery in microseconds
+ */
+static void schedule(int to_upstream, struct sockaddr_in *client, unsigned char *data, int len, uint64_t due){
+    for(int i = 0; i < PROXY_MAX_PENDING; i++){
+        if(!PENDING[i].used){
+            PENDING[i].used = 1;
+            PENDING[i].due = due;
+            PENDING[i].to_upstream = to_upstream;
+            if(client){
+                PENDING[i].client = *client;
+            }
+            PENDING[i].len = len;
+            memcpy(PENDING[i].data, data, len);
+            return;
+        }
+    }
+    STATS.overflows += 1;
+}
+
+
+/**
+ * @brief Apply loss, delay, jitter, reordering and duplication to a packet
+ * and schedule its delivery
+ *
+ * @param to_upstream - 1 if the packet goes to the upstream
+ * @param client - address of the client (if the packet goes to it)
+ * @param data - packet
+ * @param len - packet length in bytes
+ */
+void impair(int to_upstream, struct sockaddr_in *client, unsigned char *data, int len){
+    if(chance(LOSS)){
+        STATS.lost += 1;
+        return;
+    }
+
+    int copies = 1;
+    if(chance(DUPLICATE)){
+        STATS.duplicated += 1;
+        copies = 2;
+    }
+
+    for(int i = 0; i < copies; i++){
+        double delay = DELAY_MS + (random_unit() * 2 - 1) * JITTER_MS;
+        if(chance(REORDER)){
+            // Hold the packet back long enough for the next ones to overtake
+            STATS.reordered += 1;
+            delay += 2 * (DELAY_MS + JITTER_MS) + 10;
+        }
+        if(delay < 0){
+            delay = 0;
+        }
+        schedule(to_upstream, client, data, len, now_us() + (uint64_t)(delay * 1000));
+    }
+}
+
+
+/**
+ * @brief Check the rate limit (token bucket of RATE_LIMIT queries per
+ * second, allowing bursts of RATE_LIMIT queries)
+ *
+ * @return 1 if the query may pass
+ */
+static int rate_limit_pass(){
+    if(!RATE_LIMIT){
+        return 1;
+    }
+    uint64_t now = now_us();
+    TOKENS += (now - TOKENS_TIME) / 1e6 * RATE_LIMIT;
+    TOKENS_TIME = now;
+    if(TOKENS > RATE_LIMIT){
+        TOKENS = RATE_LIMIT;
+    }
+    if(TOKENS < 1){
+        return 0;
+    }
+    TOKENS -= 1;
+    return 1;
+}
+
+
+/**
+ * @brief Handle a query from a client - forward it upstream with a new query
+ * ID (and randomized case of the question if enabled)
+ *
+ * @param client - address of the client
+ * @param data - packet
+ * @param len - packet length in bytes
+ */
+void handle_query(struct sockaddr_in *client, unsigned char *data, int len){
+    STATS.queries += 1;
+
+    int name_len = question_name_len(data, len);
+    if(!name_len){
+        return;
+    }
+    if(!rate_limit_pass()){
+        STATS.rate_limited += 1;
+        return;
+    }
+
+    uint16_t xid = NEXT_XID++;
+    struct proxy_query *query = &QUERIES[xid % PROXY_MAX_QUERIES];
+    query->used = 1;
+    query->xid = xid;
+    query->client_xid = ((struct dns_header_t *)data)->xid;
+    query->client = *client;
+    query->created = now_us();
+    query->sent = query->created;
+    query->retries = 0;
+    query->len = len;
+    query->question_len = name_len;
+    memcpy(query->question, data + sizeof(struct dns_header_t), name_len);
+
+    memcpy(query->data, data, len);
+    ((struct dns_header_t *)query->data)->xid = htons(xid);
+    if(CASE_RANDOMIZATION){
+        unsigned char *name = query->data + sizeof(struct dns_header_t);
+        for(int i = 0; name[i]; i += 1 + name[i]){
+            for(int j = i + 1; j <= i + name[i]; j++){
+                if(((name[j] | 0x20) >= 'a' && (name[j] | 0x20) <= 'z') && chance(50)){
+                    name[j] ^= 0x20;
+                }
+            }
+        }
+    }
+
+    impair(1, NULL, query->data, len);
+}
+
+
+/**
+ * @brief Handle a response from the upstream - check it answers a waiting
+ * query and forward it to the client with its query ID and question
+ *
+ * @param data - packet
+ * @param len - packet length in bytes
+ */
+void handle_response(unsigned char *data, int len){
+    STATS.responses += 1;
+    if(len < (int)sizeof(struct dns_header_t)){
+        return;
+    }
+
+    uint16_t xid = ntohs(((struct dns_header_t *)data)->xid);
+    struct proxy_query *query = &QUERIES[xid % PROXY_MAX_QUERIES];
+    int name_len = question_name_len(data, len);
+    if(!query->used || query->xid != xid || name_len != query->question_len){
+        STATS.unmatched += 1;
+        return;
+    }
+
+    unsigned char *name = data + sizeof(struct dns_header_t);
+    if(CASE_RANDOMIZATION && memcmp(name, query->data + sizeof(struct dns_header_t), name_len)){
+        // The upstream did not echo the case - treated as spoofed
+        STATS.case_mismatches += 1;
+        return;
+    }
+
+    // Answered - further responses to this query are dropped
+    query->used = 0;
+
+    ((struct dns_header_t *)data)->xid = query->client_xid;
+    memcpy(name, query->question, name_len);
+    impair(0, &query->client, data, len);
+}
+
+
+/**
+ * @brief Send queries again which were not answered in time, like a
+ * resolver does, and forget queries which are too old
+ */
+void retry_queries(){
+    uint64_t now = now_us();
+    for(int i = 0; i < PROXY_MAX_QUERIES; i++){
+        struct proxy_query *query = &QUERIES[i];
+        if(!query->used){
+            continue;
+        }
+        if(now - query->created > PROXY_QUERY_TTL_US){
+            query->used = 0;
+        }else if(RETRY_MS && query->retries < RETRIES && now - query->sent > (uint64_t)RETRY_MS * 1000){
+            query->retries += 1;
+            query->sent = now;
+            STATS.retried += 1;
+            impair(1, NULL, query->data, query->len);
+        }
+    }
+}
+
+
+/**
+ * @brief Send packets whose time of delivery has come
+ */
+void deliver_packets(){
+    uint64_t now = now_us();
+    for(int i = 0; i < PROXY_MAX_PENDING; i++){
+        struct proxy_packet *packet = &PENDING[i];
+        if(!packet->used || packet->due > now){
+            continue;
+        }
+        if(packet->to_upstream){
+            send(UPSTREAM_SOCK, packet->data, packet->len, 0);
+        }else{
+            sendto(CLIENT_SOCK, packet->data, packet->len, 0,
+                    (struct sockaddr *)&packet->client, sizeof(packet->client));
+        }
+        packet->used = 0;
+    }
+}
+
+
+/**
+ * @brief Get time until the next packet should be delivered
+ *
+ * @return milliseconds (rounded up), at most 10 so that retries are checked
+ */
+static int next_timeout(){
+    uint64_t now = now_us();
+    uint64_t timeout = 10000;
+    for(int i = 0; i < PROXY_MAX_PENDING; i++){
+        if(PENDING[i].used){
+            uint64_t left = PENDING[i].due > now ? PENDING[i].due - now : 0;
+            if(left < timeout){
+                timeout = left;
+            }
+        }
+    }
+    return (timeout + 999) / 1000;
+}
+
+
+/**
+ * @brief Stop the proxy on a signal
+ *
+ * @param signum - signal number
+ */
+void stop_proxy(int signum){
+    (void)signum;
+    RUNNING = 0;
+}
+
+
+/*
+ *
+ * MAIN
+ *
+ */
+
+
+int main(int argc, char **argv){
+    parse_args(argc, argv);
+
+    // Socket for clients
+    CLIENT_SOCK = socket(AF_INET, SOCK_DGRAM, 0);
+    if(CLIENT_SOCK == -1){
+        err("Failed to open socket");
+    }
+    int optval = 1;
+    setsockopt(CLIENT_SOCK, SOL_SOCKET, SO_REUSEADDR, (const void *)&optval, sizeof(int));
+    struct sockaddr_in listen_addr;
+    memset(&listen_addr, 0, sizeof(listen_addr));
+    listen_addr.sin_family = AF_INET;
+    listen_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    listen_addr.sin_port = htons(LISTEN_PORT);
+    if(bind(CLIENT_SOCK, (struct sockaddr *)&listen_addr, sizeof(listen_addr))){
+        err("Failed to bind socket to port %d.", LISTEN_PORT);
+    }
+
+    // Socket for the upstream
+    UPSTREAM_SOCK = socket(AF_INET, SOCK_DGRAM, 0);
+    if(UPSTREAM_SOCK == -1){
+        err("Failed to open socket");
+    }
+    struct sockaddr_in upstream_addr;
+    memset(&upstream_addr, 0, sizeof(upstream_addr));
+    upstream_addr.sin_family = AF_INET;
+    upstream_addr.sin_port = htons(UPSTREAM_PORT);
+    if(inet_pton(AF_INET, UPSTREAM_IP, &upstream_addr.sin_addr) != 1){
+        err("Invalid upstream IP address \"%s\"", UPSTREAM_IP);
+    }
+    if(connect(UPSTREAM_SOCK, (struct sockaddr *)&upstream_addr, sizeof(upstream_addr))){
+        err("Failed to connect to the upstream");
+    }
+
+    // Stop on SIGINT and SIGTERM
+    struct sigaction stop_action;
+    memset(&stop_action, 0, sizeof(stop_action));
+    stop_action.sa_handler = stop_proxy;
+    sigaction(SIGINT, &stop_action, NULL);
+    sigaction(SIGTERM, &stop_action, NULL);
+
+    TOKENS = RATE_LIMIT;
+    TOKENS_TIME = now_us();
+
+    struct pollfd fds[2] = {{CLIENT_SOCK, POLLIN, 0}, {UPSTREAM_SOCK, POLLIN, 0}};
+    unsigned char buffer[512];
+    while(RUNNING){
+        if(poll(fds, 2, next_timeout()) > 0){
+            if(fds[0].revents & POLLIN){
+                struct sockaddr_in client;
+                socklen_t client_len = sizeof(client);
+                int len = recvfrom(CLIENT_SOCK, buffer, sizeof(buffer), 0,
+                        (struct sockaddr *)&client, &client_len);
+                if(len > 0){
+                    handle_query(&client, buffer, len);
+                }
+            }
+            if(fds[1].revents & POLLIN){
+                int len = recv(UPSTREAM_SOCK, buffer, sizeof(buffer), 0);
+                if(len > 0){
+                    handle_response(buffer, len);
+                }
+            }
+        }
+        deliver_packets();
+        retry_queries();
+    }
+
+    fprintf(stderr, "{\"queries\": %ld, \"responses\": %ld, \"lost\": %ld, \"duplicated\": %ld, "
+            "\"reordered\": %ld, \"retried\": %ld, \"rate_limited\": %ld, \"case_mismatches\": %ld, "
+            "\"unmatched\": %ld, \"overflows\": %ld}\n",
+            STATS.queries, STATS.responses, STATS.lost, STATS.duplicated, STATS.reordered,
+            STATS.retried, STATS.rate_limited, STATS.case_mismatches, STATS.unmatched,
+            STATS.overflows);
+
+    close(CLIENT_SOCK);
+    close(UPSTREAM_SOCK);
+    return 0;
+}
@@ -0,0 +1,123 @@
+/**
+ * @brief UDP proxy between the sender and the receiver, impairing the
+ * network like a real path through a recursive resolver would
+ * @file dns_proxy.h
+ * @author Patrik Skaloš
+ * @year 2022
+ */
+
+#ifndef DNS_PROXY_H
+#define DNS_PROXY_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+
+#define PROXY_MAX_PENDING 4096 // Packets delayed at once
+#define PROXY_MAX_QUERIES 4096 // Queries waiting for a response at once
+#define PROXY_QUERY_TTL_US 10000000 // Forget unanswered queries after this
+
+
+/**
+ * Packet waiting to be delivered
+ */
+struct proxy_packet{
+    int used;
+    uint64_t due; // Time of delivery in microseconds
+    int to_upstream; // 1 if the packet goes to the upstream, 0 to a client
+    struct sockaddr_in client;
+    int len;
+    unsigned char data[512];
+};
+
+
+/**
+ * Query forwarded upstream, waiting for a response
+ */
+struct proxy_query{
+    int used;
+    uint16_t xid; // Query ID used upstream
+    uint16_t client_xid; // Query ID used by the client
+    struct sockaddr_in client;
+    uint64_t created;
+    uint64_t sent; // Time of the last send upstream
+    int retries;
+    int len;
+    unsigned char data[512]; // Query as sent upstream
+    unsigned char question[512]; // Question as sent by the client
+    int question_len;
+};
+
+
+/**
+ * @brief Write the error message to stderr and exit
+ *
+ * @param As for printf and similar functions
+ */
+void err(char *format, ...);
+
+
+/**
+ * @brief Parse user provided options and save settings to global variables
+ *
+ * @param argc
+ * @param argv
+ */
+void parse_args(int argc, char **argv);
+
+
+/**
+ * @brief Apply loss, delay, jitter, reordering and duplication to a packet
+ * and schedule its delivery
+ *
+ * @param to_upstream - 1 if the packet goes to the upstream
+ * @param client - address of the client (if the packet goes to it)
+ * @param data - packet
+ * @param len - packet length in bytes
+ */
+void impair(int to_upstream, struct sockaddr_in *client, unsigned char *data, int len);
+
+
+/**
+ * @brief Handle a query from a client - forward it upstream with a new query
+ * ID (and randomized case of the question if enabled)
+ *
+ * @param client - address of the client
+ * @param data - packet
+ * @param len - packet length in bytes
+ */
+void handle_query(struct sockaddr_in *client, unsigned char *data, int len);
+
+
+/**
+ * @brief Handle a response from the upstream - check it answers a waiting
+ * query and forward it to the client with its query ID and question
+ *
+ * @param data - packet
+ * @param len - packet length in bytes
+ */
+void handle_response(unsigned char *data, int len);
+
+
+/**
+ * @brief Send queries again which were not answered in time, like a
+ * resolver does, and forget queries which are too old
+ */
+void retry_queries();
+
+
+/**
+ * @brief Send packets whose time of delivery has come
+ */
+void deliver_packets();
+
+
+/**
+ * @brief Stop the proxy on a signal
+ *
+ * @param signum - signal number
+ */
+void stop_proxy(int signum);
+
+
+#endif //DNS_PROXY_H
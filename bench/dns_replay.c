@@ -0,0 +1,355 @@
+/**
+ * @brief Replay of captured queries to a receiver - at the original speed,
+ * faster or as fast as possible
+ * @file dns_replay.c
+ * @author Patrik Skaloš
+ * @year 2022
+ *
+ * Queries captured by the receiver (option "-w") or by tcpdump are sent to a
+ * receiver in the order and with the spacing in which they were captured
+ * (divided by the speed). Responses are matched to the queries by query IDs,
+ * and the rate, the number of queries which got no response and the latency
+ * of responses are written to stdout as JSON once the replay ends
+ */
+
+
+// Standard libraries
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+
+// Networking libraries
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+// Header files
+#include "dns_replay.h"
+#include "../common/dns_capture.h"
+
+
+/*
+ *
+ * GLOBAL VARIABLES
+ *
+ */
+
+
+char *TARGET_IP = "127.0.0.1";
+int TARGET_PORT = 5353;
+double SPEED = 1; // Multiple of the original speed, 0 as fast as possible
+int DST_PORT = 0; // Replay only datagrams sent to this port (0 = all)
+int WAIT_MS = 1000; // Time to wait for responses after the last query
+char *CAPTURE_PATH = NULL;
+
+int SOCK = -1; // Socket connected to the receiver
+
+uint64_t SENT_AT[REPLAY_QUERY_IDS]; // Time queries waiting for a response were sent, by query IDs (0 if none)
+
+// Latencies of responses in microseconds
+uint64_t *LATENCIES = NULL;
+long LATENCIES_SIZE = 0;
+
+volatile sig_atomic_t RUNNING = 1;
+
+// Statistics written at exit
+struct{
+    long packets; // UDP datagrams in the capture (to DST_PORT)
+    long sent;
+    long send_errors;
+    long responses;
+    long unmatched; // Responses to no waiting query (late or duplicate)
+} STATS;
+
+
+/*
+ *
+ * MISC
+ *
+ */
+
+
+/**
+ * @brief Write the error message to stderr and exit
+ *
+ * @param As for printf and similar functions
+ */
+void err(char *format, ...){
+    fprintf(stderr, "Error! ");
+    va_list argptr;
+    va_start(argptr, format);
+    vfprintf(stderr, format, argptr);
+    va_end(argptr);
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+
+/**
+ * @brief Get time from a monotonic clock
+ *
+ * @return microseconds
+ */
+static uint64_t now_us(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+/**
+ * @brief Compare latencies for qsort
+ */
+static int compare_latencies(const void *a, const void *b){
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+
+/**
+ * @brief Get a percentile of the sorted latencies
+ *
+ * @param percentile - 0 to 100
+ *
+ * @return the latency in microseconds (0 if there are none)
+ */
+static uint64_t latency_percentile(double percentile){
+    if(!STATS.responses){
+        return 0;
+    }
+    long i = (long)(percentile / 100.0 * STATS.responses);
+    return LATENCIES[i < STATS.responses ? i : STATS.responses - 1];
+}
+
+
+/*
+ *
+ * PARSING
+ *
+ */
+
+
+/**
+ * @brief Parse user provided options and save settings to global variables
+ *
+ * @param argc
+ * @param argv
+ */
+void parse_args(int argc, char **argv){
+    for(int i = 1; i < argc; i++){ // Start from one to ignore filename
+        if(argv[i][0] != '-'){
+            if(CAPTURE_PATH){
+                err("Invalid amount of arguments");
+            }
+            CAPTURE_PATH = argv[i];
+            continue;
+        }
+        if(strlen(argv[i]) != 2){
+            err("Unknown argument \"%s\"", argv[i]);
+        }
+        if(i + 1 >= argc){
+            err("No argument following \"%s\"", argv[i]);
+        }
+        char option = argv[i][1];
+        char *value = argv[++i];
+
+        switch(option){
+            case 'u':
+                TARGET_IP = value;
+                break;
+            case 'p':
+                TARGET_PORT = atoi(value);
+                break;
+            case 's':
+                SPEED = atof(value);
+                break;
+            case 'd':
+                DST_PORT = atoi(value);
+                break;
+            case 'w':
+                WAIT_MS = atoi(value);
+                break;
+            default:
+                err("Unknown argument \"%s\"", argv[i - 1]);
+        }
+    }
+
+    if(!CAPTURE_PATH){
+        err("Capture file argument missing");
+    }
+    if(TARGET_PORT < 1 || TARGET_PORT > 65535 || DST_PORT < 0 || DST_PORT > 65535){
+        err("Invalid port");
+    }
+    if(SPEED < 0 || WAIT_MS < 0){
+        err("The speed and the time to wait must not be negative");
+    }
+}
+
+
+/*
+ *
+ * REPLAY
+ *
+ */
+
+
+/**
+ * @brief Receive the responses which came, waiting for them until a time
+ *
+ * @param until - time to wait until (monotonic, in microseconds), 0 not to
+ * wait
+ */
+void receive_responses(uint64_t until){
+    struct pollfd fd = {SOCK, POLLIN, 0};
+    while(RUNNING){
+        uint64_t now = now_us();
+        int timeout_ms = until > now ? (until - now + 999) / 1000 : 0;
+        if(poll(&fd, 1, timeout_ms) != 1){
+            if(until <= now_us()){
+                return;
+            }
+            continue;
+        }
+
+        unsigned char buffer[512];
+        int len = recv(SOCK, buffer, sizeof(buffer), 0);
+        if(len < 2){
+            continue;
+        }
+        int xid = buffer[0] << 8 | buffer[1];
+        if(!SENT_AT[xid]){
+            STATS.unmatched += 1;
+            continue;
+        }
+        if(STATS.responses == LATENCIES_SIZE){
+            LATENCIES_SIZE = LATENCIES_SIZE ? 2 * LATENCIES_SIZE : 4096;
+            LATENCIES = realloc(LATENCIES, LATENCIES_SIZE * sizeof(uint64_t));
+            if(!LATENCIES){
+                err("Failed to allocate memory.");
+            }
+        }
+        LATENCIES[STATS.responses++] = now_us() - SENT_AT[xid];
+        SENT_AT[xid] = 0;
+    }
+}
+
+
+/**
+ * @brief Send a captured query to the receiver
+ *
+ * @param data - the query
+ * @param len - its length in bytes
+ */
+void send_query(const unsigned char *data, int len){
+    if(send(SOCK, data, len, 0) != len){
+        STATS.send_errors += 1;
+        return;
+    }
+    STATS.sent += 1;
+    if(len >= 2){
+        SENT_AT[data[0] << 8 | data[1]] = now_us();
+    }
+}
+
+
+/**
+ * @brief Stop the replay on a signal
+ *
+ * @param signum - signal number
+ */
+void stop_replay(int signum){
+    (void)signum;
+    RUNNING = 0;
+}
+
+
+/*
+ *
+ * MAIN
+ *
+ */
+
+
+int main(int argc, char **argv){
+    parse_args(argc, argv);
+
+    struct capture capture;
+    if(capture_open(&capture, CAPTURE_PATH)){
+        err("Failed to open the capture \"%s\" (a pcap file of raw IP, Ethernet or Linux cooked frames).", CAPTURE_PATH);
+    }
+
+    // Socket connected to the receiver (IPv4 or IPv6)
+    struct sockaddr_storage target;
+    socklen_t target_len;
+    memset(&target, 0, sizeof(target));
+    struct sockaddr_in *target4 = (struct sockaddr_in *)&target;
+    struct sockaddr_in6 *target6 = (struct sockaddr_in6 *)&target;
+    if(inet_pton(AF_INET, TARGET_IP, &target4->sin_addr) == 1){
+        target4->sin_family = AF_INET;
+        target4->sin_port = htons(TARGET_PORT);
+        target_len = sizeof(*target4);
+    }else if(inet_pton(AF_INET6, TARGET_IP, &target6->sin6_addr) == 1){
+        target6->sin6_family = AF_INET6;
+        target6->sin6_port = htons(TARGET_PORT);
+        target_len = sizeof(*target6);
+    }else{
+        err("Invalid receiver IP address \"%s\"", TARGET_IP);
+    }
+    SOCK = socket(target.ss_family, SOCK_DGRAM, 0);
+    if(SOCK == -1 || connect(SOCK, (struct sockaddr *)&target, target_len)){
+        err("Failed to connect to the receiver");
+    }
+
+    // Stop on SIGINT and SIGTERM
+    struct sigaction stop_action;
+    memset(&stop_action, 0, sizeof(stop_action));
+    stop_action.sa_handler = stop_replay;
+    sigaction(SIGINT, &stop_action, NULL);
+    sigaction(SIGTERM, &stop_action, NULL);
+
+    // Send the queries at the times they were captured at (relative to the
+    // first one, divided by the speed), receiving responses in the meantime
+    unsigned char buffer[CAPTURE_SNAPLEN];
+    uint64_t first_captured = 0;
+    uint64_t start = now_us();
+    int len = 0;
+    uint64_t captured = 0;
+    int dst_port = 0;
+    while(RUNNING && (len = capture_read(&capture, &captured, buffer, sizeof(buffer), NULL, &dst_port)) >= 0){
+        if(DST_PORT && dst_port != DST_PORT){
+            continue;
+        }
+        if(!STATS.packets++){
+            first_captured = captured;
+        }
+        if(SPEED > 0 && captured > first_captured){
+            receive_responses(start + (uint64_t)((captured - first_captured) / SPEED));
+        }else{
+            receive_responses(0);
+        }
+        send_query(buffer, len);
+    }
+    uint64_t duration = now_us() - start;
+    receive_responses(now_us() + (uint64_t)WAIT_MS * 1000);
+    capture_close(&capture);
+    close(SOCK);
+
+    qsort(LATENCIES, STATS.responses, sizeof(uint64_t), compare_latencies);
+    double seconds = duration / 1000000.0;
+    printf("{\"type\": \"replay\", \"speed\": %.2f, \"packets\": %ld, \"sent\": %ld, \"send_errors\": %ld, "
+            "\"responses\": %ld, \"dropped\": %ld, \"unmatched\": %ld, \"duration_s\": %.3f, "
+            "\"packets_per_s\": %.1f, \"responses_per_s\": %.1f, \"latency_us_p50\": %llu, "
+            "\"latency_us_p99\": %llu}\n",
+            SPEED, STATS.packets, STATS.sent, STATS.send_errors, STATS.responses,
+            STATS.sent - STATS.responses, STATS.unmatched, seconds,
+            seconds > 0 ? STATS.sent / seconds : 0.0, seconds > 0 ? STATS.responses / seconds : 0.0,
+            (unsigned long long)latency_percentile(50), (unsigned long long)latency_percentile(99));
+    free(LATENCIES);
+    return 0;
+}
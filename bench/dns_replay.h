@@ -0,0 +1,66 @@
+/**
+ * @brief Replay of captured queries to a receiver - at the original speed,
+ * faster or as fast as possible
+ * @file dns_replay.h
+ * @author Patrik Skaloš
+ * @year 2022
+ */
+
+#ifndef DNS_REPLAY_H
+#define DNS_REPLAY_H
+
+#include <stdint.h>
+
+
+/**
+ * Queries are matched to their responses by query IDs - a query which is
+ * not answered until REPLAY_QUERY_IDS other queries are sent is counted as
+ * dropped even if it is answered later
+ */
+#define REPLAY_QUERY_IDS 65536
+
+
+/**
+ * @brief Write the error message to stderr and exit
+ *
+ * @param As for printf and similar functions
+ */
+void err(char *format, ...);
+
+
+/**
+ * @brief Parse user provided options and save settings to global variables
+ *
+ * @param argc
+ * @param argv
+ */
+void parse_args(int argc, char **argv);
+
+
+/**
+ * @brief Receive the responses which came, waiting for them until a time
+ *
+ * @param until - time to wait until (monotonic, in microseconds), 0 not to
+ * wait
+ */
+void receive_responses(uint64_t until);
+
+
+/**
+ * @brief Send a captured query to the receiver
+ *
+ * @param data - the query
+ * @param len - its length in bytes
+ */
+void send_query(const unsigned char *data, int len);
+
+
+/**
+ * @brief Stop the replay on a signal
+ *
+ * @param signum - signal number
+ */
+void stop_replay(int signum);
+
+
+#endif //DNS_REPLAY_H
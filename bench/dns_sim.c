@@ -0,0 +1,982 @@
+/**
+ * @brief Deterministic simulation of transfers between the sender and the
+ * receiver over an in-memory lossy network with a virtual clock
+ * @file dns_sim.c
+ * @author Patrik Skaloš
+ * @year 2022
+ *
+ * Both programs are built as shared libraries (with main renamed) and loaded
+ * into this process, each with its NET_IO pointed to the simulated network.
+ * Every scenario runs in a forked process, so the programs start from their
+ * initial global state and a failing program can't affect other scenarios.
+ * Within a scenario, the programs run in threads but never at the same time:
+ * when a program waits for a datagram, the scheduler advances the virtual
+ * clock to the next arrival or timeout and runs the program which can go on.
+ * Waiting thus takes no real time and, with the network's random decisions
+ * seeded per scenario, every scenario can be repeated exactly
+ *
+ * Functions are prefixed by "sim_" not to be confused with the functions of
+ * the loaded programs
+ */
+
+
+// Standard libraries
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+// Networking libraries
+#include <arpa/inet.h>
+
+// Header files
+#include "dns_sim.h"
+
+
+/*
+ *
+ * GLOBAL VARIABLES
+ *
+ */
+
+
+char *SENDER_LIB = "./bench/libdns_sender_sim.so";
+char *RECEIVER_LIB = "./bench/libdns_receiver_sim.so";
+char *BASE_HOST = "sim.test";
+
+int SCENARIOS = 1000;
+int JOBS = 1; // Scenarios run in parallel
+int VERBOSE = 0; // 1 to write every scenario and output of the programs
+int REQUIRE_ALL = 0; // 1 to fail unless all scenarios completed
+uint64_t SEED = 1; // Seed of the first scenario, the next ones add one
+long SIZE = 4096; // Bytes transferred in every scenario
+char CHUNK_LEN[16] = "126";
+char FEC_GROUP[16] = "0";
+
+double LOSS = 0; // Percent of datagrams lost
+int DELAY_MS = 10; // One-way delay
+int JITTER_MS = 0; // Max random deviation of the delay
+double REORDER = 0; // Percent of datagrams held back to be overtaken
+double DUPLICATE = 0; // Percent of datagrams delivered twice
+double UPDATE = -1; // Percent of KiB parts changed in an older version of the file at the destination (-1 if none)
+double STORE = -1; // Percent of KiB parts changed in an older version of the file in the receiver's store (-1 if no store)
+
+char WORK_DIR[] = "/tmp/dns_sim.XXXXXX";
+char SRC_PATH[64];
+
+struct sim_program SENDER;
+struct sim_program RECEIVER;
+
+// State of the simulated network (of the scenario being run)
+uint64_t SIM_NOW = 0;
+uint64_t SIM_RANDOM = 1;
+uint64_t SIM_SEQ = 0;
+struct sim_socket SIM_SOCKETS[SIM_MAX_SOCKETS];
+struct sim_packet SIM_PACKETS[SIM_MAX_PACKETS];
+long SIM_SENT = 0;
+long SIM_LOST = 0;
+
+int SIM_RESULT_FD = -1; // Pipe to write the result of the scenario to
+
+pthread_mutex_t SIM_LOCK = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t SIM_SCHEDULER_COND = PTHREAD_COND_INITIALIZER;
+struct sim_program *SIM_CURRENT = NULL; // Running program (NULL = scheduler)
+
+
+/*
+ *
+ * MISC
+ *
+ */
+
+
+/**
+ * @brief Write the error message to stderr and exit
+ *
+ * @param As for printf and similar functions
+ */
+void sim_err(char *format, ...){
+    fprintf(stderr, "Error! ");
+    va_list argptr;
+    va_start(argptr, format);
+    vfprintf(stderr, format, argptr);
+    va_end(argptr);
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+
+/**
+ * @brief Get a pseudo-random number (xorshift64)
+ *
+ * @return number in the range 0 to 1
+ */
+static double sim_random(){
+    SIM_RANDOM ^= SIM_RANDOM << 13;
+    SIM_RANDOM ^= SIM_RANDOM >> 7;
+    SIM_RANDOM ^= SIM_RANDOM << 17;
+    return (SIM_RANDOM >> 11) * (1.0 / 9007199254740992.0);
+}
+
+
+/**
+ * @brief Decide randomly
+ *
+ * @param percent - probability in percent
+ *
+ * @return 1 with the probability
+ */
+static int sim_chance(double percent){
+    return percent > 0 && sim_random() * 100 < percent;
+}
+
+
+/**
+ * @brief Comparator of doubles for qsort
+ */
+static int sim_compare_doubles(const void *a, const void *b){
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+
+/**
+ * @brief Check if two files have the same content
+ *
+ * @param path1
+ * @param path2
+ *
+ * @return 1 if the files are equal
+ */
+static int sim_files_equal(char *path1, char *path2){
+    FILE *f1 = fopen(path1, "rb");
+    FILE *f2 = fopen(path2, "rb");
+    int equal = f1 && f2;
+    while(equal){
+        int c1 = fgetc(f1), c2 = fgetc(f2);
+        if(c1 != c2){
+            equal = 0;
+        }else if(c1 == EOF){
+            break;
+        }
+    }
+    if(f1){
+        fclose(f1);
+    }
+    if(f2){
+        fclose(f2);
+    }
+    return equal;
+}
+
+
+/**
+ * @brief Write an older version of the file to send, so that the sender
+ * sends a delta against it
+ *
+ * @param path - where to write it
+ * @param changed - percent of its KiB parts which differ
+ */
+static void sim_write_old_file(char *path, double changed){
+    FILE *src = fopen(SRC_PATH, "rb");
+    FILE *dst = fopen(path, "wb");
+    if(!src || !dst){
+        sim_err("Could not create %s", path);
+    }
+    unsigned char part[1024];
+    size_t len;
+    while((len = fread(part, 1, sizeof(part), src))){
+        if(sim_chance(changed)){
+            // Change a run of bytes at a random position of the part
+            size_t start = sim_random() * len;
+            for(size_t i = start; i < start + 32 && i < len; i++){
+                part[i] ^= 0x5A;
+            }
+        }
+        fwrite(part, 1, len, dst);
+    }
+    fclose(src);
+    fclose(dst);
+}
+
+
+/**
+ * @brief Get the directory where the receiver saves the file of a scenario -
+ * its own one if the receiver keeps a store, which scenarios running in
+ * parallel must not share
+ *
+ * @param recv_dir - output, at least 64 bytes long
+ * @param seed - of the scenario
+ */
+static void sim_recv_dir(char *recv_dir, uint64_t seed){
+    if(STORE >= 0){
+        snprintf(recv_dir, 64, "%s/recv_%llu", WORK_DIR, (unsigned long long)seed);
+        mkdir(recv_dir, 0700);
+    }else{
+        snprintf(recv_dir, 64, "%s/recv", WORK_DIR);
+    }
+}
+
+
+/**
+ * @brief Put blocks of an older version of the file to send (STORE percent
+ * of its KiB parts differ) to the receiver's store, by the functions of the
+ * loaded receiver
+ *
+ * @param recv_dir - directory of the store
+ */
+static void sim_fill_store(char *recv_dir){
+    int (*store_open)(const char *) = dlsym(RECEIVER.handle, "store_open");
+    void (*store_add_file)(const char *) = dlsym(RECEIVER.handle, "store_add_file");
+    void (*store_close)() = dlsym(RECEIVER.handle, "store_close");
+    if(!store_open || !store_add_file || !store_close){
+        sim_err("%s does not define store_open, store_add_file and store_close", RECEIVER_LIB);
+    }
+    char old_path[128];
+    snprintf(old_path, sizeof(old_path), "%s/old", recv_dir);
+    sim_write_old_file(old_path, STORE);
+    if(store_open(recv_dir)){
+        sim_err("Could not open the store in %s", recv_dir);
+    }
+    store_add_file(old_path);
+    store_close();
+    unlink(old_path);
+}
+
+
+/**
+ * @brief Remove the receiver's store and directory of a scenario
+ *
+ * @param seed - of the scenario
+ */
+static void sim_remove_store(uint64_t seed){
+    char recv_dir[64], path[128];
+    snprintf(recv_dir, sizeof(recv_dir), "%s/recv_%llu", WORK_DIR, (unsigned long long)seed);
+    snprintf(path, sizeof(path), "%s/.dns-blocks/pack", recv_dir);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/.dns-blocks/index", recv_dir);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/.dns-blocks", recv_dir);
+    rmdir(path);
+    rmdir(recv_dir);
+}
+
+
+/*
+ *
+ * PARSING
+ *
+ */
+
+
+/**
+ * @brief Parse user provided options and save settings to global variables
+ *
+ * @param argc
+ * @param argv
+ */
+void sim_parse_args(int argc, char **argv){
+    for(int i = 1; i < argc; i++){ // Start from one to ignore filename
+        if(!strcmp(argv[i], "-v")){
+            VERBOSE = 1;
+            continue;
+        }
+        if(!strcmp(argv[i], "-a")){
+            REQUIRE_ALL = 1;
+            continue;
+        }
+        if(argv[i][0] != '-' || strlen(argv[i]) != 2){
+            sim_err("Unknown argument \"%s\"", argv[i]);
+        }
+        if(i + 1 >= argc){
+            sim_err("No argument following \"%s\"", argv[i]);
+        }
+        char option = argv[i][1];
+        char *value = argv[++i];
+
+        switch(option){
+            case 'n':
+                SCENARIOS = atoi(value);
+                break;
+            case 'J':
+                JOBS = atoi(value);
+                break;
+            case 'S':
+                SEED = strtoull(value, NULL, 10);
+                break;
+            case 's':
+                SIZE = atol(value);
+                break;
+            case 'c':
+                snprintf(CHUNK_LEN, sizeof(CHUNK_LEN), "%s", value);
+                break;
+            case 'f':
+                snprintf(FEC_GROUP, sizeof(FEC_GROUP), "%s", value);
+                break;
+            case 'L':
+                LOSS = atof(value);
+                break;
+            case 'd':
+                DELAY_MS = atoi(value);
+                break;
+            case 'j':
+                JITTER_MS = atoi(value);
+                break;
+            case 'o':
+                REORDER = atof(value);
+                break;
+            case 'D':
+                DUPLICATE = atof(value);
+                break;
+            case 'u':
+                UPDATE = atof(value);
+                break;
+            case 'k':
+                STORE = atof(value);
+                break;
+            default:
+                sim_err("Unknown argument \"%s\"", argv[i - 1]);
+        }
+    }
+
+    if(SCENARIOS < 1 || JOBS < 1 || SIZE < 0 || DELAY_MS < 0 || JITTER_MS < 0){
+        sim_err("Scenarios and jobs must be positive, size and times must not be negative");
+    }
+}
+
+
+/*
+ *
+ * SIMULATED NETWORK
+ *
+ */
+
+
+/**
+ * @brief Give control to a program and wait until it blocks or ends (call
+ * with SIM_LOCK held)
+ *
+ * @param program
+ */
+static void sim_switch_to(struct sim_program *program){
+    SIM_CURRENT = program;
+    program->state = SIM_RUNNING;
+    pthread_cond_signal(&program->cond);
+    while(SIM_CURRENT){
+        pthread_cond_wait(&SIM_SCHEDULER_COND, &SIM_LOCK);
+    }
+}
+
+
+/**
+ * @brief Give control back to the scheduler and wait until it is given back
+ * (call from a program with SIM_LOCK held)
+ *
+ * @param program - the calling program
+ */
+static void sim_yield(struct sim_program *program){
+    SIM_CURRENT = NULL;
+    pthread_cond_signal(&SIM_SCHEDULER_COND);
+    while(SIM_CURRENT != program){
+        pthread_cond_wait(&program->cond, &SIM_LOCK);
+    }
+}
+
+
+/**
+ * @brief Find the first datagram which arrived to a socket
+ *
+ * @param sock
+ *
+ * @return the datagram or NULL
+ */
+static struct sim_packet *sim_first_delivered(int sock){
+    struct sim_packet *first = NULL;
+    for(int i = 0; i < SIM_MAX_PACKETS; i++){
+        struct sim_packet *packet = &SIM_PACKETS[i];
+        if(packet->used && packet->delivered && packet->sock == sock
+                && (!first || packet->seq < first->seq)){
+            first = packet;
+        }
+    }
+    return first;
+}
+
+
+/**
+ * @brief Put a datagram to the network, to arrive after a delay
+ *
+ * @param sock - destination socket
+ * @param from - source address
+ * @param data
+ * @param len - length of data in bytes
+ */
+static void sim_schedule(int sock, struct sockaddr_storage *from, const void *data, int len){
+    double delay = DELAY_MS + (sim_random() * 2 - 1) * JITTER_MS;
+    if(sim_chance(REORDER)){
+        // Hold the datagram back long enough for the next ones to overtake
+        delay += 2 * (DELAY_MS + JITTER_MS) + 10;
+    }
+    if(delay < 0){
+        delay = 0;
+    }
+
+    for(int i = 0; i < SIM_MAX_PACKETS; i++){
+        struct sim_packet *packet = &SIM_PACKETS[i];
+        if(!packet->used){
+            packet->used = 1;
+            packet->delivered = 0;
+            packet->due = SIM_NOW + (uint64_t)(delay * 1000);
+            packet->sock = sock;
+            packet->from = *from;
+            packet->len = len;
+            memcpy(packet->data, data, len);
+            return;
+        }
+    }
+    SIM_LOST += 1; // The network is full
+}
+
+
+// Implementation of struct net_io by the simulated network
+
+static int sim_io_socket(void *ctx, int family, int port){
+    (void)ctx;
+    if(family != AF_INET && family != AF_INET6){
+        return -1;
+    }
+    pthread_mutex_lock(&SIM_LOCK);
+    int sock = -1;
+    for(int i = 0; i < SIM_MAX_SOCKETS; i++){
+        if(!SIM_SOCKETS[i].used){
+            SIM_SOCKETS[i].used = 1;
+            SIM_SOCKETS[i].family = family;
+            SIM_SOCKETS[i].port = port ? port : 40000 + i;
+            sock = i;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&SIM_LOCK);
+    return sock;
+}
+
+
+static int sim_io_send(void *ctx, int sock, const void *data, int len, int flags,
+        const struct sockaddr *addr, socklen_t addr_len){
+    (void)ctx;
+    (void)flags;
+    // Sockets are identified by ports only, all addresses are loopback
+    int port;
+    const void *host = NULL;
+    int family = net_addr_host(addr, &host);
+    if(addr->sa_family == AF_INET6 && addr_len >= sizeof(struct sockaddr_in6)){
+        port = ntohs(((struct sockaddr_in6 *)addr)->sin6_port);
+    }else if(addr->sa_family == AF_INET && addr_len >= sizeof(struct sockaddr_in)){
+        port = ntohs(((struct sockaddr_in *)addr)->sin_port);
+    }else{
+        return -1;
+    }
+    if(len > 512){
+        return -1;
+    }
+
+    pthread_mutex_lock(&SIM_LOCK);
+    SIM_SENT += 1;
+
+    int dst = -1;
+    for(int i = 0; i < SIM_MAX_SOCKETS; i++){
+        if(SIM_SOCKETS[i].used && SIM_SOCKETS[i].port == port){
+            dst = i;
+        }
+    }
+    if(dst >= 0 && family == AF_INET6 && SIM_SOCKETS[dst].family == AF_INET){
+        dst = -1; // IPv6 can't reach an IPv4 socket
+    }
+
+    // Source address of the family of the destination
+    struct sockaddr_storage from;
+    socklen_t from_len = sizeof(struct sockaddr_in);
+    memset(&from, 0, sizeof(from));
+    struct sockaddr_in *from4 = (struct sockaddr_in *)&from;
+    from4->sin_family = AF_INET;
+    from4->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    from4->sin_port = htons(SIM_SOCKETS[sock].port);
+    if(family == AF_INET6){
+        struct sockaddr_in6 *from6 = (struct sockaddr_in6 *)&from;
+        from6->sin6_family = AF_INET6;
+        from6->sin6_addr = in6addr_loopback;
+        from6->sin6_port = htons(SIM_SOCKETS[sock].port);
+    }else if(dst >= 0 && SIM_SOCKETS[dst].family == AF_INET6){
+        net_addr_map_v6(&from, &from_len);
+    }
+
+    if(dst < 0 || sim_chance(LOSS)){
+        SIM_LOST += 1;
+    }else{
+        sim_schedule(dst, &from, data, len);
+        if(sim_chance(DUPLICATE)){
+            sim_schedule(dst, &from, data, len);
+        }
+    }
+    pthread_mutex_unlock(&SIM_LOCK);
+    return len;
+}
+
+
+static int sim_io_recv(void *ctx, int sock, void *buffer, int len,
+        struct sockaddr *addr, socklen_t *addr_len, int timeout_ms){
+    struct sim_program *program = ctx;
+    pthread_mutex_lock(&SIM_LOCK);
+    uint64_t deadline = timeout_ms < 0 ? SIM_FOREVER : SIM_NOW + (uint64_t)timeout_ms * 1000;
+
+    while(1){
+        struct sim_packet *packet = sim_first_delivered(sock);
+        if(packet){
+            int packet_len = packet->len < len ? packet->len : len;
+            memcpy(buffer, packet->data, packet_len);
+            if(addr && addr_len){
+                socklen_t from_len = packet->from.ss_family == AF_INET6
+                    ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+                memcpy(addr, &packet->from, from_len < *addr_len ? from_len : *addr_len);
+                *addr_len = from_len;
+            }
+            packet->used = 0;
+            pthread_mutex_unlock(&SIM_LOCK);
+            return packet_len;
+        }
+        if(SIM_NOW >= deadline){
+            pthread_mutex_unlock(&SIM_LOCK);
+            return -1;
+        }
+
+        program->state = SIM_BLOCKED;
+        program->wait_sock = sock;
+        program->deadline = deadline;
+        sim_yield(program);
+    }
+}
+
+
+static void sim_io_close(void *ctx, int sock){
+    (void)ctx;
+    pthread_mutex_lock(&SIM_LOCK);
+    SIM_SOCKETS[sock].used = 0;
+    pthread_mutex_unlock(&SIM_LOCK);
+}
+
+
+static uint64_t sim_io_now_us(void *ctx){
+    (void)ctx;
+    return SIM_NOW;
+}
+
+
+// TCP is not simulated - the receiver serves UDP only and the sender fails
+// to connect
+
+static int sim_io_listen(void *ctx, int family, int port){
+    return -1;
+}
+
+
+static int sim_io_accept(void *ctx, int sock, struct sockaddr *addr, socklen_t *addr_len){
+    return -1;
+}
+
+
+static int sim_io_connect(void *ctx, const struct sockaddr *addr, socklen_t addr_len){
+    return -1;
+}
+
+
+static int sim_io_read(void *ctx, int sock, void *buffer, int len, int timeout_ms){
+    return -1;
+}
+
+
+static int sim_io_write(void *ctx, int sock, const void *data, int len){
+    return -1;
+}
+
+
+/*
+ *
+ * SCENARIOS
+ *
+ */
+
+
+/**
+ * @brief Load a program built as a shared library, with main renamed to
+ * main_name, and point its NET_IO to the simulated network
+ *
+ * @param program - output
+ * @param path - path to the library
+ * @param main_name - name of the main function in the library
+ */
+void sim_load(struct sim_program *program, char *path, char *main_name){
+    // Local symbols - the sender and the receiver define the same names
+    void *handle = dlopen(path, RTLD_NOW | RTLD_LOCAL | RTLD_DEEPBIND);
+    if(!handle){
+        sim_err("Could not load %s: %s", path, dlerror());
+    }
+    program->handle = handle;
+    program->main = dlsym(handle, main_name);
+    struct net_io **net_io = dlsym(handle, "NET_IO");
+    if(!program->main || !net_io){
+        sim_err("%s does not define %s and NET_IO", path, main_name);
+    }
+
+    struct net_io io = {program, sim_io_socket, sim_io_send, sim_io_recv, sim_io_close, sim_io_now_us,
+        sim_io_listen, sim_io_accept, sim_io_connect, sim_io_read, sim_io_write, NULL, NULL};
+    program->io = io;
+    *net_io = &program->io;
+    pthread_cond_init(&program->cond, NULL);
+}
+
+
+/**
+ * @brief Thread of a program - waits for the scheduler to run it, runs its
+ * main and gives control back to the scheduler
+ *
+ * @param arg - struct sim_program
+ */
+static void *sim_thread(void *arg){
+    struct sim_program *program = arg;
+
+    pthread_mutex_lock(&SIM_LOCK);
+    while(SIM_CURRENT != program){
+        pthread_cond_wait(&program->cond, &SIM_LOCK);
+    }
+    pthread_mutex_unlock(&SIM_LOCK);
+
+    program->ret = program->main(program->argc, program->argv);
+
+    pthread_mutex_lock(&SIM_LOCK);
+    program->state = SIM_DONE;
+    SIM_CURRENT = NULL;
+    pthread_cond_signal(&SIM_SCHEDULER_COND);
+    pthread_mutex_unlock(&SIM_LOCK);
+    return NULL;
+}
+
+
+/**
+ * @brief Check if a program can continue - it waits for a datagram which
+ * arrived or its wait ended
+ *
+ * @param program
+ *
+ * @return 1 if it can continue
+ */
+static int sim_can_run(struct sim_program *program){
+    return program->state == SIM_BLOCKED
+        && (program->deadline <= SIM_NOW || sim_first_delivered(program->wait_sock));
+}
+
+
+/**
+ * @brief Run one scenario: start the receiver and the sender and deliver
+ * datagrams between them in the order of their virtual arrival times until
+ * the sender ends
+ *
+ * @param seed - seed of random decisions of the network
+ * @param result - output
+ * @param out_path - where the receiver saves the file
+ */
+void sim_run_scenario(uint64_t seed, struct sim_result *result, char *out_path){
+    SIM_RANDOM = seed ? seed : 1;
+
+    char recv_dir[64], dst_path[64], port[8] = "53";
+    sim_recv_dir(recv_dir, seed);
+    snprintf(dst_path, sizeof(dst_path), "out_%llu", (unsigned long long)seed);
+    snprintf(out_path, 128, "%s/%s", recv_dir, dst_path);
+    if(UPDATE >= 0){
+        sim_write_old_file(out_path, UPDATE);
+    }
+
+    char *receiver_argv[] = {"dns_receiver", "-p", port, BASE_HOST, recv_dir, NULL, NULL};
+    char *sender_argv[] = {"dns_sender", "-u", "127.0.0.1", "-p", port, "-c", CHUNK_LEN,
+        "-f", FEC_GROUP, BASE_HOST, dst_path, SRC_PATH, NULL};
+    RECEIVER.argc = 5;
+    RECEIVER.argv = receiver_argv;
+    if(STORE >= 0){
+        sim_fill_store(recv_dir);
+        receiver_argv[5] = "-d";
+        RECEIVER.argc = 6;
+    }
+    SENDER.argc = 12;
+    SENDER.argv = sender_argv;
+    if(!strcmp(FEC_GROUP, "0")){
+        // Without "-f 0"
+        memmove(&sender_argv[7], &sender_argv[9], 4 * sizeof(char *));
+        SENDER.argc = 10;
+    }
+
+    pthread_mutex_lock(&SIM_LOCK);
+    pthread_create(&RECEIVER.thread, NULL, sim_thread, &RECEIVER);
+    pthread_create(&SENDER.thread, NULL, sim_thread, &SENDER);
+
+    // Both programs run until they wait for a datagram
+    sim_switch_to(&RECEIVER);
+    sim_switch_to(&SENDER);
+
+    result->exit_code = SIM_STUCK;
+    while(SENDER.state != SIM_DONE){
+
+        // Deliver datagrams which arrived
+        for(int i = 0; i < SIM_MAX_PACKETS; i++){
+            struct sim_packet *packet = &SIM_PACKETS[i];
+            if(packet->used && !packet->delivered && packet->due <= SIM_NOW){
+                packet->delivered = 1;
+                packet->seq = SIM_SEQ++;
+            }
+        }
+
+        // Run a program which can continue, the receiver first
+        if(sim_can_run(&RECEIVER)){
+            sim_switch_to(&RECEIVER);
+            continue;
+        }
+        if(sim_can_run(&SENDER)){
+            sim_switch_to(&SENDER);
+            continue;
+        }
+
+        // Nothing can happen now - advance the clock to the next arrival or
+        // timeout
+        uint64_t next = SIM_FOREVER;
+        for(int i = 0; i < SIM_MAX_PACKETS; i++){
+            struct sim_packet *packet = &SIM_PACKETS[i];
+            if(packet->used && !packet->delivered && packet->due < next){
+                next = packet->due;
+            }
+        }
+        if(RECEIVER.state == SIM_BLOCKED && RECEIVER.deadline < next){
+            next = RECEIVER.deadline;
+        }
+        if(SENDER.state == SIM_BLOCKED && SENDER.deadline < next){
+            next = SENDER.deadline;
+        }
+        if(next == SIM_FOREVER || next > SIM_TIME_LIMIT_US){
+            // Stuck - the process exits with the threads still waiting
+            break;
+        }
+        SIM_NOW = next;
+    }
+
+    if(SENDER.state == SIM_DONE){
+        result->exit_code = SENDER.ret;
+    }
+    result->virtual_us = SIM_NOW;
+    result->packets = SIM_SENT;
+    result->lost = SIM_LOST;
+    pthread_mutex_unlock(&SIM_LOCK);
+}
+
+
+/**
+ * @brief Report the result when a program exits the scenario's process (eg.
+ * by err) before the scenario ends
+ */
+static void sim_report_exit(){
+    if(SIM_RESULT_FD < 0){
+        return;
+    }
+    struct sim_result result;
+    memset(&result, 0, sizeof(result));
+    result.exit_code = SIM_EXITED;
+    result.virtual_us = SIM_NOW;
+    result.packets = SIM_SENT;
+    result.lost = SIM_LOST;
+    if(write(SIM_RESULT_FD, &result, sizeof(result)) != sizeof(result)){
+        _exit(1);
+    }
+}
+
+
+/**
+ * @brief Start a scenario in a forked process
+ *
+ * @param seed
+ * @param fd - output, pipe to read the result from
+ *
+ * @return pid of the process
+ */
+static pid_t sim_start_scenario(uint64_t seed, int *fd){
+    int fds[2];
+    if(pipe(fds)){
+        sim_err("Could not create a pipe");
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if(pid < 0){
+        sim_err("Could not fork");
+    }
+    if(!pid){
+        close(fds[0]);
+        if(!VERBOSE){
+            int null = open("/dev/null", O_WRONLY);
+            dup2(null, STDOUT_FILENO);
+            dup2(null, STDERR_FILENO);
+        }
+        SIM_RESULT_FD = fds[1];
+        atexit(sim_report_exit);
+
+        struct sim_result result;
+        char out_path[128];
+        memset(&result, 0, sizeof(result));
+        sim_run_scenario(seed, &result, out_path);
+        result.equal = result.exit_code == 0 && sim_files_equal(SRC_PATH, out_path);
+        unlink(out_path);
+        if(STORE >= 0){
+            sim_remove_store(seed);
+        }
+
+        SIM_RESULT_FD = -1;
+        if(write(fds[1], &result, sizeof(result)) != sizeof(result)){
+            _exit(1);
+        }
+        _exit(0);
+    }
+    close(fds[1]);
+    *fd = fds[0];
+    return pid;
+}
+
+
+/**
+ * @brief Collect the result of a scenario
+ *
+ * @param pid - of its process
+ * @param fd - pipe to read the result from
+ * @param result - output
+ */
+static void sim_collect_scenario(pid_t pid, int fd, struct sim_result *result){
+    if(read(fd, result, sizeof(*result)) != sizeof(*result)){
+        // The process crashed
+        memset(result, 0, sizeof(*result));
+        result->exit_code = SIM_EXITED;
+    }
+    close(fd);
+    waitpid(pid, NULL, 0);
+}
+
+
+/*
+ *
+ * MAIN
+ *
+ */
+
+
+int main(int argc, char **argv){
+    sim_parse_args(argc, argv);
+
+    // The programs only write to the simulated network
+    setenv("DNS_EVENTS", VERBOSE ? "text" : "off", 1);
+    unsetenv("DNS_METRICS_FILE");
+
+    // A writer thread would run outside of the virtual clock
+    setenv("DNS_WRITER", "sync", 1);
+
+    if(!mkdtemp(WORK_DIR)){
+        sim_err("Could not create a work directory");
+    }
+    char recv_dir[64];
+    snprintf(recv_dir, sizeof(recv_dir), "%s/recv", WORK_DIR);
+    mkdir(recv_dir, 0700);
+
+    // File to send
+    snprintf(SRC_PATH, sizeof(SRC_PATH), "%s/src", WORK_DIR);
+    FILE *f = fopen(SRC_PATH, "wb");
+    if(!f){
+        sim_err("Could not create %s", SRC_PATH);
+    }
+    uint64_t state = 0x9E3779B97F4A7C15ULL ^ SIZE;
+    for(long i = 0; i < SIZE; i++){
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        fputc(state & 0xFF, f);
+    }
+    fclose(f);
+
+    sim_load(&RECEIVER, RECEIVER_LIB, "dns_receiver_main");
+    sim_load(&SENDER, SENDER_LIB, "dns_sender_main");
+
+    double *times = malloc(SCENARIOS * sizeof(double));
+    int completed = 0, failed = 0, corrupted = 0, stuck = 0, exited = 0;
+    long packets = 0, lost = 0;
+
+    struct timespec wall_start, wall_end;
+    clock_gettime(CLOCK_MONOTONIC, &wall_start);
+
+    pid_t pids[64];
+    int fds[64];
+    uint64_t seeds[64];
+    int jobs = JOBS < 64 ? JOBS : 64;
+    for(int started = 0, done = 0; done < SCENARIOS; ){
+        // Start scenarios up to the number of jobs, then collect them in order
+        int running = started - done;
+        while(running < jobs && started < SCENARIOS){
+            int slot = started % jobs;
+            seeds[slot] = SEED + started;
+            pids[slot] = sim_start_scenario(seeds[slot], &fds[slot]);
+            started += 1;
+            running += 1;
+        }
+
+        int slot = done % jobs;
+        struct sim_result result;
+        sim_collect_scenario(pids[slot], fds[slot], &result);
+        done += 1;
+
+        packets += result.packets;
+        lost += result.lost;
+        if(result.exit_code == SIM_STUCK){
+            stuck += 1;
+        }else if(result.exit_code == SIM_EXITED){
+            exited += 1;
+        }else if(result.exit_code){
+            failed += 1;
+        }else if(!result.equal){
+            corrupted += 1;
+        }else{
+            times[completed++] = result.virtual_us / 1e6;
+        }
+
+        if(VERBOSE){
+            printf("{\"type\": \"scenario\", \"seed\": %llu, \"exit_code\": %d, \"equal\": %s, "
+                   "\"virtual_s\": %.3f, \"packets\": %ld, \"lost\": %ld}\n",
+                   (unsigned long long)seeds[slot], result.exit_code, result.equal ? "true" : "false",
+                   result.virtual_us / 1e6, result.packets, result.lost);
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &wall_end);
+    double wall = (wall_end.tv_sec - wall_start.tv_sec) + (wall_end.tv_nsec - wall_start.tv_nsec) / 1e9;
+
+    qsort(times, completed, sizeof(double), sim_compare_doubles);
+    printf("{\"type\": \"sim_summary\", \"scenarios\": %d, \"size\": %ld, \"chunk_len\": %s, \"fec\": %s, "
+           "\"loss\": %.2f, \"delay_ms\": %d, \"jitter_ms\": %d, \"reorder\": %.2f, \"duplicate\": %.2f, \"update\": %.2f, \"store\": %.2f, "
+           "\"completed\": %d, \"failed\": %d, \"corrupted\": %d, \"stuck\": %d, \"exited\": %d, "
+           "\"virtual_s_median\": %.3f, \"virtual_s_p90\": %.3f, \"packets_mean\": %.1f, "
+           "\"lost_mean\": %.1f, \"wall_s\": %.3f, \"scenarios_per_s\": %.1f}\n",
+           SCENARIOS, SIZE, CHUNK_LEN, FEC_GROUP, LOSS, DELAY_MS, JITTER_MS, REORDER, DUPLICATE, UPDATE, STORE,
+           completed, failed, corrupted, stuck, exited,
+           completed ? times[completed / 2] : 0, completed ? times[completed * 9 / 10] : 0,
+           (double)packets / SCENARIOS, (double)lost / SCENARIOS, wall, SCENARIOS / wall);
+
+    free(times);
+    unlink(SRC_PATH);
+    rmdir(recv_dir);
+    rmdir(WORK_DIR);
+    return corrupted || (REQUIRE_ALL && completed < SCENARIOS) ? 1 : 0;
+}
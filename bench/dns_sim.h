@@ -0,0 +1,128 @@
+/**
+ * @brief Deterministic simulation of transfers between the sender and the
+ * receiver over an in-memory lossy network with a virtual clock
+ * @file dns_sim.h
+ * @author Patrik Skaloš
+ * @year 2022
+ */
+
+#ifndef DNS_SIM_H
+#define DNS_SIM_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <netinet/in.h>
+
+#include "../common/dns_net_io.h"
+
+
+#define SIM_MAX_SOCKETS 16
+#define SIM_MAX_PACKETS 1024 // Packets in flight or waiting to be received
+#define SIM_TIME_LIMIT_US 3600000000ULL // Give up a scenario after an hour of virtual time
+#define SIM_FOREVER UINT64_MAX
+
+
+/**
+ * Datagram in the simulated network
+ */
+struct sim_packet{
+    int used;
+    int delivered; // 1 once it arrived and waits to be received
+    uint64_t due; // Time of arrival
+    uint64_t seq; // Order of arrival
+    int sock; // Destination socket
+    struct sockaddr_storage from;
+    int len;
+    unsigned char data[512];
+};
+
+
+/**
+ * Socket in the simulated network, addressed only by its port
+ */
+struct sim_socket{
+    int used;
+    int family; // AF_INET6 sockets are dual-stack
+    int port;
+};
+
+
+/**
+ * Program running in its own thread. Only one program runs at a time - it
+ * gives control back to the scheduler when it waits for a datagram
+ */
+struct sim_program{
+    struct net_io io; // I/O of the program, ctx points to this structure
+    int (*main)(int argc, char **argv);
+    int argc;
+    char **argv;
+    pthread_t thread;
+    pthread_cond_t cond;
+    int state; // SIM_RUNNING, SIM_BLOCKED or SIM_DONE
+    int wait_sock;
+    uint64_t deadline; // When waiting for a datagram ends
+    int ret; // Return value of main
+    void *handle; // Of the loaded library
+};
+
+#define SIM_RUNNING 0
+#define SIM_BLOCKED 1
+#define SIM_DONE 2
+
+
+/**
+ * Result of one scenario, passed from its process to the parent
+ */
+struct sim_result{
+    int exit_code; // Of the sender, SIM_STUCK or SIM_EXITED
+    int equal; // 1 if the received file equals the sent one
+    uint64_t virtual_us; // Virtual time the transfer took
+    long packets; // Datagrams sent by both programs
+    long lost;
+};
+
+#define SIM_STUCK -1 // Neither program could continue
+#define SIM_EXITED -2 // A program exited the process (eg. the receiver by err)
+
+
+/**
+ * @brief Write the error message to stderr and exit
+ *
+ * @param As for printf and similar functions
+ */
+void sim_err(char *format, ...);
+
+
+/**
+ * @brief Parse user provided options and save settings to global variables
+ *
+ * @param argc
+ * @param argv
+ */
+void sim_parse_args(int argc, char **argv);
+
+
+/**
+ * @brief Load a program built as a shared library, with main renamed to
+ * main_name, and point its NET_IO to the simulated network
+ *
+ * @param program - output
+ * @param path - path to the library
+ * @param main_name - name of the main function in the library
+ */
+void sim_load(struct sim_program *program, char *path, char *main_name);
+
+
+/**
+ * @brief Run one scenario: start the receiver and the sender and deliver
+ * datagrams between them in the order of their virtual arrival times until
+ * the sender ends
+ *
+ * @param seed - seed of random decisions of the network
+ * @param result - output
+ * @param out_path - where the receiver saves the file
+ */
+void sim_run_scenario(uint64_t seed, struct sim_result *result, char *out_path);
+
+
+#endif //DNS_SIM_H
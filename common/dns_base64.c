@@ -0,0 +1,182 @@
+/**
+ * @brief Base64 encoding and decoding of the data carried in DNS questions
+ * @file dns_base64.c
+ * @author Patrik Skaloš
+ * @year 2022
+ */
+
+
+// Standard libraries
+#include <stdlib.h>
+#include <stdint.h>
+
+// Header files
+#include "dns_base64.h"
+
+
+static char encoding_table[] = {'A', 'B', 'C', 'D', 'E', 'F', 'G', 'H',
+                                'I', 'J', 'K', 'L', 'M', 'N', 'O', 'P',
+                                'Q', 'R', 'S', 'T', 'U', 'V', 'W', 'X',
+                                'Y', 'Z', 'a', 'b', 'c', 'd', 'e', 'f',
+                                'g', 'h', 'i', 'j', 'k', 'l', 'm', 'n',
+                                'o', 'p', 'q', 'r', 's', 't', 'u', 'v',
+                                'w', 'x', 'y', 'z', '0', '1', '2', '3',
+                                '4', '5', '6', '7', '8', '9', '+', '/'};
+static char decoding_table[256];
+static int decoding_table_built = 0;
+static int mod_table[] = {0, 2, 1};
+
+
+/**
+ * @brief Encode data to base64 without the '=' padding to a buffer provided
+ * by the caller
+ *
+ * @param output - buffer of at least (input_length + 2) / 3 * 4 characters
+ * @param data to encode
+ * @param input_length in characters
+ *
+ * @return output length in chars (not terminated)
+ */
+int base64_encode_to(char *output, const unsigned char *data, int input_length){
+
+    for (int i = 0, j = 0; i < input_length;) {
+
+        uint32_t octet_a = i < input_length ? (unsigned char)data[i++] : 0;
+        uint32_t octet_b = i < input_length ? (unsigned char)data[i++] : 0;
+        uint32_t octet_c = i < input_length ? (unsigned char)data[i++] : 0;
+
+        uint32_t triple = (octet_a << 0x10) + (octet_b << 0x08) + octet_c;
+
+        output[j++] = encoding_table[(triple >> 3 * 6) & 0x3F];
+        output[j++] = encoding_table[(triple >> 2 * 6) & 0x3F];
+        output[j++] = encoding_table[(triple >> 1 * 6) & 0x3F];
+        output[j++] = encoding_table[(triple >> 0 * 6) & 0x3F];
+    }
+
+    // Length without the '=' padding
+    return 4 * ((input_length + 2) / 3) - mod_table[input_length % 3];
+}
+
+
+/**
+ * @brief Encode data to base64 without the '=' padding
+ *
+ * @param data to encode
+ * @param input_length in characters
+ * @param output_length - pointer where the output length in chars will be
+ * written
+ *
+ * @return allocated string containing the output (not terminated)
+ *
+ * Taken and modified from: https://stackoverflow.com/a/6782480/17580261
+ */
+char *base64_encode(const unsigned char *data, int input_length, int *output_length){
+
+    char *encoded_data = malloc(4 * ((input_length + 2) / 3) + 1);
+    if (encoded_data == NULL) return NULL;
+
+    *output_length = base64_encode_to(encoded_data, data, input_length);
+    return encoded_data;
+}
+
+
+/**
+ * @brief Get the 6-bit value of a base64 character
+ *
+ * @param c - base64 character
+ *
+ * @return value 0-63 (0 for characters outside of the alphabet)
+ */
+int base64_sextet(char c){
+    if(c >= 'A' && c <= 'Z') return c - 'A';
+    if(c >= 'a' && c <= 'z') return c - 'a' + 26;
+    if(c >= '0' && c <= '9') return c - '0' + 52;
+    if(c == '+') return 62;
+    if(c == '/') return 63;
+    return 0;
+}
+
+
+/**
+ * @brief Get the base64 character of a 6-bit value
+ *
+ * @param sextet - value 0-63
+ *
+ * @return the character
+ */
+char base64_char(int sextet){
+    return encoding_table[sextet & 0x3F];
+}
+
+
+static void build_decoding_table() {
+
+    for (int i = 0; i < 64; i++)
+        decoding_table[(unsigned char) encoding_table[i]] = i;
+    decoding_table_built = 1;
+}
+
+
+/**
+ * @brief Decode a base64 string (padded to a multiple of 4 characters) to a
+ * buffer provided by the caller
+ *
+ * @param output - buffer of at least input_length / 4 * 3 bytes
+ * @param data to decode
+ * @param input_length in characters
+ *
+ * @return output length in chars, -1 if the input length is invalid
+ */
+int base64_decode_to(unsigned char *output, const char *data, int input_length){
+
+    if (!decoding_table_built) build_decoding_table();
+
+    if (input_length % 4 != 0) return -1;
+
+    int output_length = input_length / 4 * 3;
+    if (input_length && data[input_length - 1] == '=') output_length--;
+    if (input_length && data[input_length - 2] == '=') output_length--;
+
+    for (int i = 0, j = 0; i < input_length;) {
+
+        uint32_t sextet_a = data[i] == '=' ? 0 & i++ : decoding_table[(unsigned char)data[i++]];
+        uint32_t sextet_b = data[i] == '=' ? 0 & i++ : decoding_table[(unsigned char)data[i++]];
+        uint32_t sextet_c = data[i] == '=' ? 0 & i++ : decoding_table[(unsigned char)data[i++]];
+        uint32_t sextet_d = data[i] == '=' ? 0 & i++ : decoding_table[(unsigned char)data[i++]];
+
+        uint32_t triple = (sextet_a << 3 * 6)
+            + (sextet_b << 2 * 6)
+            + (sextet_c << 1 * 6)
+            + (sextet_d << 0 * 6);
+
+        if (j < output_length) output[j++] = (triple >> 2 * 8) & 0xFF;
+        if (j < output_length) output[j++] = (triple >> 1 * 8) & 0xFF;
+        if (j < output_length) output[j++] = (triple >> 0 * 8) & 0xFF;
+    }
+
+    return output_length;
+}
+
+
+/**
+ * @brief Decode a base64 string (padded to a multiple of 4 characters)
+ *
+ * @param data to decode
+ * @param input_length in characters
+ * @param output_length - pointer where the output length in chars will be
+ * written
+ *
+ * @return allocated string containing the output
+ *
+ * Taken and modified from: https://stackoverflow.com/a/6782480/17580261
+ */
+unsigned char *base64_decode(const char *data, int input_length, int *output_length){
+
+    if (input_length % 4 != 0) return NULL;
+
+    unsigned char *decoded_data = malloc(input_length / 4 * 3);
+    if (decoded_data == NULL) return NULL;
+
+    *output_length = base64_decode_to(decoded_data, data, input_length);
+    return decoded_data;
+}
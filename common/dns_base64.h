@@ -0,0 +1,88 @@
+/**
+ * @brief Base64 encoding and decoding of the data carried in DNS questions
+ * @file dns_base64.h
+ * @author Patrik Skaloš
+ * @year 2022
+ */
+
+#ifndef DNS_BASE64_H
+#define DNS_BASE64_H
+
+
+/**
+ * @brief Encode data to base64 without the '=' padding to a buffer provided
+ * by the caller
+ *
+ * @param output - buffer of at least (input_length + 2) / 3 * 4 characters
+ * @param data to encode
+ * @param input_length in characters
+ *
+ * @return output length in chars (not terminated)
+ */
+int base64_encode_to(char *output, const unsigned char *data, int input_length);
+
+
+/**
+ * @brief Encode data to base64 without the '=' padding
+ *
+ * @param data to encode
+ * @param input_length in characters
+ * @param output_length - pointer where the output length in chars will be
+ * written
+ *
+ * @return allocated string containing the output (not terminated)
+ *
+ * Taken and modified from: https://stackoverflow.com/a/6782480/17580261
+ */
+char *base64_encode(const unsigned char *data, int input_length, int *output_length);
+
+
+/**
+ * @brief Decode a base64 string (padded to a multiple of 4 characters)
+ *
+ * @param data to decode
+ * @param input_length in characters
+ * @param output_length - pointer where the output length in chars will be
+ * written
+ *
+ * @return allocated string containing the output
+ *
+ * Taken and modified from: https://stackoverflow.com/a/6782480/17580261
+ */
+unsigned char *base64_decode(const char *data, int input_length, int *output_length);
+
+
+/**
+ * @brief Decode a base64 string (padded to a multiple of 4 characters) to a
+ * buffer provided by the caller
+ *
+ * @param output - buffer of at least input_length / 4 * 3 bytes
+ * @param data to decode
+ * @param input_length in characters
+ *
+ * @return output length in chars, -1 if the input length is invalid
+ */
+int base64_decode_to(unsigned char *output, const char *data, int input_length);
+
+
+/**
+ * @brief Get the 6-bit value of a base64 character
+ *
+ * @param c - base64 character
+ *
+ * @return value 0-63 (0 for characters outside of the alphabet)
+ */
+int base64_sextet(char c);
+
+
+/**
+ * @brief Get the base64 character of a 6-bit value
+ *
+ * @param sextet - value 0-63
+ *
+ * @return the character
+ */
+char base64_char(int sextet);
+
+
+#endif //DNS_BASE64_H
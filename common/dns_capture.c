@@ -0,0 +1,333 @@
+/**
+ * @brief Capture of received datagrams to a pcap file and reading them back
+ * (by the receiver and the replay tool)
+ * @file dns_capture.c
+ * @author Patrik Skaloš
+ * @year 2022
+ */
+
+
+// Standard libraries
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+// Networking libraries
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+// Header files
+#include "dns_capture.h"
+
+
+#define IPV4_HEADER_LEN 20
+#define IPV6_HEADER_LEN 40
+#define UDP_HEADER_LEN 8
+#define IP_PROTOCOL_UDP 17
+
+
+/*
+ *
+ * WRITING
+ *
+ */
+
+
+/**
+ * @brief Compute the checksum of an IPv4 header
+ *
+ * @param header - with the checksum field zeroed
+ *
+ * @return the checksum (in network byte order)
+ */
+static uint16_t ipv4_checksum(const unsigned char *header){
+    uint32_t sum = 0;
+    for(int i = 0; i < IPV4_HEADER_LEN; i += 2){
+        sum += (header[i] << 8) | header[i + 1];
+    }
+    while(sum >> 16){
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return htons(~sum & 0xffff);
+}
+
+
+/**
+ * @brief Create a capture file to write datagrams to
+ *
+ * @param capture - output
+ * @param path
+ * @param port - port the datagrams are received on
+ *
+ * @return 0 on success, 1 if the file can't be created
+ */
+int capture_create(struct capture *capture, const char *path, int port){
+    memset(capture, 0, sizeof(*capture));
+    capture->file = fopen(path, "wb");
+    if(!capture->file){
+        return 1;
+    }
+    capture->port = port;
+    capture->linktype = CAPTURE_LINKTYPE_RAW;
+
+    struct capture_file_header header = {CAPTURE_MAGIC, 2, 4, 0, 0, CAPTURE_SNAPLEN, CAPTURE_LINKTYPE_RAW};
+    if(fwrite(&header, sizeof(header), 1, capture->file) != 1){
+        fclose(capture->file);
+        capture->file = NULL;
+        return 1;
+    }
+    return 0;
+}
+
+
+/**
+ * @brief Write a received datagram to a capture with the current time
+ *
+ * @param capture - created by capture_create
+ * @param data - the datagram
+ * @param len - its length in bytes
+ * @param from - address of its sender
+ * @param from_len
+ */
+void capture_write(struct capture *capture, const void *data, int len, const struct sockaddr *from, socklen_t from_len){
+    unsigned char headers[IPV6_HEADER_LEN + UDP_HEADER_LEN];
+    int ip_len = 0;
+    uint16_t src_port = 0;
+    memset(headers, 0, sizeof(headers));
+
+    // IPv4 (also mapped to IPv6 by the dual-stack socket) or IPv6 header
+    const struct sockaddr_in6 *from6 = (const struct sockaddr_in6 *)from;
+    if(from->sa_family == AF_INET || (from->sa_family == AF_INET6
+            && from_len >= sizeof(*from6) && IN6_IS_ADDR_V4MAPPED(&from6->sin6_addr))){
+        ip_len = IPV4_HEADER_LEN;
+        uint16_t total_len = htons(IPV4_HEADER_LEN + UDP_HEADER_LEN + len);
+        headers[0] = 0x45; // Version 4, 5 words of header
+        memcpy(&headers[2], &total_len, 2);
+        headers[6] = 0x40; // Don't fragment
+        headers[8] = 64; // TTL
+        headers[9] = IP_PROTOCOL_UDP;
+        if(from->sa_family == AF_INET){
+            memcpy(&headers[12], &((const struct sockaddr_in *)from)->sin_addr, 4);
+            src_port = ((const struct sockaddr_in *)from)->sin_port;
+        }else{
+            memcpy(&headers[12], &from6->sin6_addr.s6_addr[12], 4);
+            src_port = from6->sin6_port;
+        }
+        uint16_t checksum = ipv4_checksum(headers);
+        memcpy(&headers[10], &checksum, 2);
+    }else if(from->sa_family == AF_INET6){
+        ip_len = IPV6_HEADER_LEN;
+        uint16_t payload_len = htons(UDP_HEADER_LEN + len);
+        headers[0] = 0x60; // Version 6
+        memcpy(&headers[4], &payload_len, 2);
+        headers[6] = IP_PROTOCOL_UDP;
+        headers[7] = 64; // Hop limit
+        memcpy(&headers[8], &from6->sin6_addr, 16);
+        src_port = from6->sin6_port;
+    }else{
+        return;
+    }
+
+    // UDP header, without a checksum
+    uint16_t dst_port = htons(capture->port);
+    uint16_t udp_len = htons(UDP_HEADER_LEN + len);
+    memcpy(&headers[ip_len], &src_port, 2);
+    memcpy(&headers[ip_len + 2], &dst_port, 2);
+    memcpy(&headers[ip_len + 4], &udp_len, 2);
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    struct capture_packet_header packet;
+    packet.ts_sec = now.tv_sec;
+    packet.ts_frac = now.tv_nsec / 1000;
+    packet.caplen = ip_len + UDP_HEADER_LEN + len;
+    packet.len = packet.caplen;
+    fwrite(&packet, sizeof(packet), 1, capture->file);
+    fwrite(headers, ip_len + UDP_HEADER_LEN, 1, capture->file);
+    fwrite(data, len, 1, capture->file);
+}
+
+
+/*
+ *
+ * READING
+ *
+ */
+
+
+/**
+ * @brief Get a 32-bit number of the read file in the host byte order
+ *
+ * @param capture
+ * @param value - as read
+ *
+ * @return the number
+ */
+static uint32_t capture_u32(struct capture *capture, uint32_t value){
+    return capture->swapped ? __builtin_bswap32(value) : value;
+}
+
+
+/**
+ * @brief Open a capture file to read datagrams from
+ *
+ * @param capture - output
+ * @param path
+ *
+ * @return 0 on success, 1 if the file can't be opened or is not a pcap file
+ * of a supported link type
+ */
+int capture_open(struct capture *capture, const char *path){
+    memset(capture, 0, sizeof(*capture));
+    capture->file = fopen(path, "rb");
+    if(!capture->file){
+        return 1;
+    }
+
+    struct capture_file_header header;
+    if(fread(&header, sizeof(header), 1, capture->file) != 1){
+        capture_close(capture);
+        return 1;
+    }
+    uint32_t magic = header.magic;
+    if(magic == __builtin_bswap32(CAPTURE_MAGIC) || magic == __builtin_bswap32(CAPTURE_MAGIC_NS)){
+        capture->swapped = 1;
+        magic = __builtin_bswap32(magic);
+    }
+    capture->nanoseconds = magic == CAPTURE_MAGIC_NS;
+    capture->linktype = capture_u32(capture, header.linktype);
+    if((magic != CAPTURE_MAGIC && magic != CAPTURE_MAGIC_NS)
+            || (capture->linktype != CAPTURE_LINKTYPE_RAW && capture->linktype != CAPTURE_LINKTYPE_ETHERNET
+                && capture->linktype != CAPTURE_LINKTYPE_LINUX_SLL)){
+        capture_close(capture);
+        return 1;
+    }
+    return 0;
+}
+
+
+/**
+ * @brief Find the IP packet in a captured frame - skip the link layer header
+ *
+ * @param capture
+ * @param frame
+ * @param len - length of the frame, replaced by the length of the packet
+ *
+ * @return the packet, NULL if the frame doesn't carry IPv4 or IPv6
+ */
+static const unsigned char *capture_ip_packet(struct capture *capture, const unsigned char *frame, int *len){
+    int offset = 0;
+    if(capture->linktype == CAPTURE_LINKTYPE_ETHERNET){
+        offset = 14;
+        if(*len >= 18 && frame[12] == 0x81 && frame[13] == 0x00){
+            offset += 4; // VLAN tag
+        }
+    }else if(capture->linktype == CAPTURE_LINKTYPE_LINUX_SLL){
+        offset = 16;
+    }
+    if(*len <= offset){
+        return NULL;
+    }
+    *len -= offset;
+    return frame + offset;
+}
+
+
+/**
+ * @brief Read the next UDP datagram of a capture (other packets are skipped)
+ *
+ * @param capture - opened by capture_open
+ * @param time_us - output, when the datagram was captured (microseconds
+ * since the epoch)
+ * @param data - output, payload of the datagram
+ * @param size - size of data (longer payloads are cut)
+ * @param from - output, address of the sender of the datagram (or NULL)
+ * @param dst_port - output, port the datagram was sent to (or NULL)
+ *
+ * @return length of the payload, -1 at the end of the capture
+ */
+int capture_read(struct capture *capture, uint64_t *time_us, void *data, int size,
+        struct sockaddr_storage *from, int *dst_port){
+    static unsigned char frame[CAPTURE_SNAPLEN];
+    struct capture_packet_header header;
+    while(fread(&header, sizeof(header), 1, capture->file) == 1){
+        uint32_t caplen = capture_u32(capture, header.caplen);
+        if(caplen > sizeof(frame) || fread(frame, caplen, 1, capture->file) != 1){
+            return -1;
+        }
+        uint64_t frac = capture_u32(capture, header.ts_frac);
+        *time_us = (uint64_t)capture_u32(capture, header.ts_sec) * 1000000
+            + (capture->nanoseconds ? frac / 1000 : frac);
+
+        int len = caplen;
+        const unsigned char *ip = capture_ip_packet(capture, frame, &len);
+        if(!ip){
+            continue;
+        }
+
+        // UDP in IPv4 (not fragmented) or IPv6 (without extension headers)
+        const unsigned char *udp = NULL;
+        struct sockaddr_storage src;
+        memset(&src, 0, sizeof(src));
+        if(ip[0] >> 4 == 4 && len >= IPV4_HEADER_LEN){
+            int header_len = (ip[0] & 0x0f) * 4;
+            int fragmented = (ip[6] & 0x20) || ((ip[6] & 0x1f) << 8 | ip[7]); // More fragments or an offset
+            if(ip[9] != IP_PROTOCOL_UDP || fragmented || len < header_len + UDP_HEADER_LEN){
+                continue;
+            }
+            udp = ip + header_len;
+            len -= header_len;
+            struct sockaddr_in *src4 = (struct sockaddr_in *)&src;
+            src4->sin_family = AF_INET;
+            memcpy(&src4->sin_addr, &ip[12], 4);
+            memcpy(&src4->sin_port, udp, 2);
+        }else if(ip[0] >> 4 == 6 && len >= IPV6_HEADER_LEN + UDP_HEADER_LEN){
+            if(ip[6] != IP_PROTOCOL_UDP){
+                continue;
+            }
+            udp = ip + IPV6_HEADER_LEN;
+            len -= IPV6_HEADER_LEN;
+            struct sockaddr_in6 *src6 = (struct sockaddr_in6 *)&src;
+            src6->sin6_family = AF_INET6;
+            memcpy(&src6->sin6_addr, &ip[8], 16);
+            memcpy(&src6->sin6_port, udp, 2);
+        }else{
+            continue;
+        }
+
+        // Payload up to the length in the UDP header (frames may be padded)
+        int payload_len = (udp[4] << 8 | udp[5]) - UDP_HEADER_LEN;
+        if(payload_len < 0){
+            continue;
+        }
+        if(payload_len > len - UDP_HEADER_LEN){
+            payload_len = len - UDP_HEADER_LEN;
+        }
+        if(payload_len > size){
+            payload_len = size;
+        }
+        memcpy(data, udp + UDP_HEADER_LEN, payload_len);
+        if(from){
+            *from = src;
+        }
+        if(dst_port){
+            *dst_port = udp[2] << 8 | udp[3];
+        }
+        return payload_len;
+    }
+    return -1;
+}
+
+
+/**
+ * @brief Close a capture file (written datagrams are flushed)
+ *
+ * @param capture
+ */
+void capture_close(struct capture *capture){
+    if(capture->file){
+        fclose(capture->file);
+        capture->file = NULL;
+    }
+}
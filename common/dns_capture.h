@@ -0,0 +1,130 @@
+/**
+ * @brief Capture of received datagrams to a pcap file and reading them back
+ * (by the receiver and the replay tool)
+ * @file dns_capture.h
+ * @author Patrik Skaloš
+ * @year 2022
+ */
+
+#ifndef DNS_CAPTURE_H
+#define DNS_CAPTURE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+
+/**
+ * Captures are written in the classic pcap format with raw IP packets (no
+ * link layer) - every datagram gets an IPv4 or IPv6 and a UDP header with
+ * the address of its sender, the destination address is unspecified (0.0.0.0
+ * or ::). Captures of tcpdump with raw IP, Ethernet or Linux cooked headers
+ * can be read as well
+ */
+#define CAPTURE_MAGIC 0xa1b2c3d4 // Microsecond timestamps
+#define CAPTURE_MAGIC_NS 0xa1b23c4d // Nanosecond timestamps
+#define CAPTURE_LINKTYPE_ETHERNET 1
+#define CAPTURE_LINKTYPE_RAW 101
+#define CAPTURE_LINKTYPE_LINUX_SLL 113
+#define CAPTURE_SNAPLEN 65535
+
+
+/**
+ * Header of a pcap file
+ */
+struct capture_file_header{
+    uint32_t magic;
+    uint16_t version_major;
+    uint16_t version_minor;
+    int32_t thiszone;
+    uint32_t sigfigs;
+    uint32_t snaplen;
+    uint32_t linktype;
+};
+
+
+/**
+ * Header of a packet of a pcap file
+ */
+struct capture_packet_header{
+    uint32_t ts_sec;
+    uint32_t ts_frac; // Microseconds or nanoseconds
+    uint32_t caplen;
+    uint32_t len;
+};
+
+
+/**
+ * Open capture file
+ */
+struct capture{
+    FILE *file;
+    int port; // Destination port of the written datagrams
+    int swapped; // 1 if the file is read in the other byte order
+    int nanoseconds; // 1 if timestamps of the read file are in nanoseconds
+    uint32_t linktype;
+};
+
+
+/**
+ * @brief Create a capture file to write datagrams to
+ *
+ * @param capture - output
+ * @param path
+ * @param port - port the datagrams are received on
+ *
+ * @return 0 on success, 1 if the file can't be created
+ */
+int capture_create(struct capture *capture, const char *path, int port);
+
+
+/**
+ * @brief Write a received datagram to a capture with the current time
+ *
+ * @param capture - created by capture_create
+ * @param data - the datagram
+ * @param len - its length in bytes
+ * @param from - address of its sender
+ * @param from_len
+ */
+void capture_write(struct capture *capture, const void *data, int len, const struct sockaddr *from, socklen_t from_len);
+
+
+/**
+ * @brief Open a capture file to read datagrams from
+ *
+ * @param capture - output
+ * @param path
+ *
+ * @return 0 on success, 1 if the file can't be opened or is not a pcap file
+ * of a supported link type
+ */
+int capture_open(struct capture *capture, const char *path);
+
+
+/**
+ * @brief Read the next UDP datagram of a capture (other packets are skipped)
+ *
+ * @param capture - opened by capture_open
+ * @param time_us - output, when the datagram was captured (microseconds
+ * since the epoch)
+ * @param data - output, payload of the datagram
+ * @param size - size of data (longer payloads are cut)
+ * @param from - output, address of the sender of the datagram (or NULL)
+ * @param dst_port - output, port the datagram was sent to (or NULL)
+ *
+ * @return length of the payload, -1 at the end of the capture
+ */
+int capture_read(struct capture *capture, uint64_t *time_us, void *data, int size,
+        struct sockaddr_storage *from, int *dst_port);
+
+
+/**
+ * @brief Close a capture file (written datagrams are flushed)
+ *
+ * @param capture
+ */
+void capture_close(struct capture *capture);
+
+
+#endif //DNS_CAPTURE_H
@@ -0,0 +1,142 @@
+/**
+ * @brief Checksums and formats of delta transfers (like rsync) shared by the
+ * sender and the receiver
+ * @file dns_delta.c
+ * @author Patrik Skaloš
+ * @year 2022
+ */
+
+
+// Header files
+#include "dns_delta.h"
+
+
+/**
+ * @brief Get the block size of a file - about the square root of its size
+ * (like rsync), so that signatures and the delta are both small
+ *
+ * @param size - of the existing file in bytes
+ *
+ * @return block size, a multiple of 64 between DELTA_MIN_BLOCK and
+ * DELTA_MAX_BLOCK
+ */
+int delta_block_size(int64_t size){
+    int64_t block = 64;
+    while(block * block < size && block < DELTA_MAX_BLOCK){
+        block += 64;
+    }
+    return block < DELTA_MIN_BLOCK ? DELTA_MIN_BLOCK : block;
+}
+
+
+/**
+ * @brief Compute the weak checksum of a block (rsync's rolling checksum - two
+ * 16-bit sums), which can be rolled over the data byte by byte
+ *
+ * @param data
+ * @param len - length of the block
+ *
+ * @return checksum
+ */
+uint32_t delta_weak(const unsigned char *data, int len){
+    uint32_t a = 0, b = 0;
+    for(int i = 0; i < len; i++){
+        a += data[i];
+        b += (uint32_t)(len - i) * data[i];
+    }
+    return (a & 0xFFFF) | (b << 16);
+}
+
+
+/**
+ * @brief Move the window of a weak checksum one byte forward
+ *
+ * @param weak - checksum of the window
+ * @param out - first byte of the window, leaving it
+ * @param in - byte entering the window
+ * @param len - length of the window
+ *
+ * @return checksum of the moved window
+ */
+uint32_t delta_weak_roll(uint32_t weak, unsigned char out, unsigned char in, int len){
+    uint32_t a = ((weak & 0xFFFF) - out + in) & 0xFFFF;
+    uint32_t b = ((weak >> 16) - (uint32_t)len * out + a) & 0xFFFF;
+    return a | (b << 16);
+}
+
+
+/**
+ * @brief Read up to 8 bytes as a little-endian number (the same on every
+ * machine)
+ *
+ * @param data
+ * @param len - number of bytes
+ *
+ * @return the number
+ */
+static uint64_t delta_load(const unsigned char *data, int len){
+    uint64_t word = 0;
+    for(int i = len - 1; i >= 0; i--){
+        word = (word << 8) | data[i];
+    }
+    return word;
+}
+
+
+/**
+ * @brief Compute the strong hash of data (64-bit, 8 bytes at a time)
+ *
+ * @param data
+ * @param len - in bytes
+ *
+ * @return hash
+ */
+uint64_t delta_strong(const unsigned char *data, int64_t len){
+    uint64_t hash = 0x9E3779B97F4A7C15ULL ^ (uint64_t)len;
+    int64_t i = 0;
+    for(; i + 8 <= len; i += 8){
+        hash = (hash ^ delta_load(data + i, 8)) * 0xFF51AFD7ED558CCDULL;
+        hash ^= hash >> 32;
+    }
+    hash = (hash ^ delta_load(data + i, len - i)) * 0xC4CEB9FE1A85EC53ULL;
+
+    // Mix all bits (finalizer of MurmurHash3)
+    hash ^= hash >> 33;
+    hash *= 0xFF51AFD7ED558CCDULL;
+    hash ^= hash >> 33;
+    hash *= 0xC4CEB9FE1A85EC53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+
+/**
+ * @brief Write a number in big-endian
+ *
+ * @param buffer - output
+ * @param value
+ * @param bytes - length of the number in bytes (up to 8)
+ */
+void delta_put(unsigned char *buffer, uint64_t value, int bytes){
+    for(int i = bytes - 1; i >= 0; i--){
+        buffer[i] = value & 0xFF;
+        value >>= 8;
+    }
+}
+
+
+/**
+ * @brief Read a number written by delta_put
+ *
+ * @param buffer
+ * @param bytes - length of the number in bytes (up to 8)
+ *
+ * @return the number
+ */
+uint64_t delta_get(const unsigned char *buffer, int bytes){
+    uint64_t value = 0;
+    for(int i = 0; i < bytes; i++){
+        value = (value << 8) | buffer[i];
+    }
+    return value;
+}
@@ -0,0 +1,137 @@
+/**
+ * @brief Checksums and formats of delta transfers (like rsync) shared by the
+ * sender and the receiver
+ * @file dns_delta.h
+ * @author Patrik Skaloš
+ * @year 2022
+ */
+
+#ifndef DNS_DELTA_H
+#define DNS_DELTA_H
+
+#include <stdint.h>
+
+
+/**
+ * When the destination file exists, the receiver splits it to blocks of
+ * DELTA_BLOCK_SIZE (chosen by the size of the file) and the sender gets a
+ * signature of every full block by queries "g-PAGE" - every answer is a TXT
+ * record with DELTA_PAGE_HEADER bytes (block size and number of blocks)
+ * followed by up to DELTA_PAGE_SIGNATURES signatures of DELTA_SIGNATURE_SIZE
+ * bytes (weak rolling checksum and strong hash), all numbers big-endian.
+ *
+ * The sender then sends a delta instead of the file - a stream of
+ * instructions, each starting with its type:
+ * - DELTA_COPY, 8 bytes index of a block, 4 bytes count - copy count blocks
+ *   of the existing file from the index
+ * - DELTA_LITERAL, 4 bytes length - the length of new data follow
+ * - DELTA_STORED, 8 bytes hash - copy a block of DEDUP_BLOCK_SIZE bytes from
+ *   the receiver's store of received blocks
+ * - DELTA_END, 8 bytes size, 8 bytes hash - the last instruction, size and
+ *   strong hash of the new file
+ *
+ * Before that, if the receiver keeps a store, the sender offers strong
+ * hashes of the blocks of DEDUP_BLOCK_SIZE at offsets which are multiples of
+ * it by queries "h-INDEX" (index of the first block), carrying up to
+ * DEDUP_MAX_OFFER hashes as data. The receiver answers with an A record - a
+ * bitmap of the offered blocks it has (the highest bit is the first block)
+ */
+#define DELTA_MIN_BLOCK 2048
+#define DELTA_MAX_BLOCK 131072
+#define DELTA_PAGE_HEADER 12
+#define DELTA_PAGE_SIGNATURES 24
+#define DELTA_SIGNATURE_SIZE 12
+#define DELTA_PAGE_SIZE (DELTA_PAGE_HEADER + DELTA_PAGE_SIGNATURES * DELTA_SIGNATURE_SIZE)
+
+#define DEDUP_BLOCK_SIZE 4096
+#define DEDUP_MAX_OFFER 32
+
+#define DELTA_COPY 'C'
+#define DELTA_LITERAL 'L'
+#define DELTA_STORED 'S'
+#define DELTA_END 'E'
+#define DELTA_COPY_LEN 13
+#define DELTA_LITERAL_LEN 5
+#define DELTA_STORED_LEN 9
+#define DELTA_END_LEN 17
+
+
+/**
+ * Signature of a block of the existing file
+ */
+struct delta_signature{
+    uint32_t weak;
+    uint64_t strong;
+};
+
+
+/**
+ * @brief Get the block size of a file - about the square root of its size
+ * (like rsync), so that signatures and the delta are both small
+ *
+ * @param size - of the existing file in bytes
+ *
+ * @return block size, a multiple of 64 between DELTA_MIN_BLOCK and
+ * DELTA_MAX_BLOCK
+ */
+int delta_block_size(int64_t size);
+
+
+/**
+ * @brief Compute the weak checksum of a block (rsync's rolling checksum - two
+ * 16-bit sums), which can be rolled over the data byte by byte
+ *
+ * @param data
+ * @param len - length of the block
+ *
+ * @return checksum
+ */
+uint32_t delta_weak(const unsigned char *data, int len);
+
+
+/**
+ * @brief Move the window of a weak checksum one byte forward
+ *
+ * @param weak - checksum of the window
+ * @param out - first byte of the window, leaving it
+ * @param in - byte entering the window
+ * @param len - length of the window
+ *
+ * @return checksum of the moved window
+ */
+uint32_t delta_weak_roll(uint32_t weak, unsigned char out, unsigned char in, int len);
+
+
+/**
+ * @brief Compute the strong hash of data (64-bit, 8 bytes at a time)
+ *
+ * @param data
+ * @param len - in bytes
+ *
+ * @return hash
+ */
+uint64_t delta_strong(const unsigned char *data, int64_t len);
+
+
+/**
+ * @brief Write a number in big-endian
+ *
+ * @param buffer - output
+ * @param value
+ * @param bytes - length of the number in bytes (up to 8)
+ */
+void delta_put(unsigned char *buffer, uint64_t value, int bytes);
+
+
+/**
+ * @brief Read a number written by delta_put
+ *
+ * @param buffer
+ * @param bytes - length of the number in bytes (up to 8)
+ *
+ * @return the number
+ */
+uint64_t delta_get(const unsigned char *buffer, int bytes);
+
+
+#endif //DNS_DELTA_H
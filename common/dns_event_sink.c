@@ -0,0 +1,315 @@
+/**
+ * @brief Event sink shared by the sender and the receiver - events are
+ * stored as fixed-size binary records to a lock-free ring buffer, which is
+ * drained by a background thread (default), or formatted right away
+ * @file dns_event_sink.c
+ * @author Patrik Skaloš
+ * @year 2022
+ */
+
+
+// Standard libraries
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <sched.h>
+
+// Header files
+#include "dns_event_sink.h"
+
+
+#define EVENT_RING_SIZE 4096 // Must be a power of two
+
+enum event_mode{
+    EVENT_MODE_OFF,
+    EVENT_MODE_TEXT,
+    EVENT_MODE_ASYNC,
+    EVENT_MODE_BINARY
+};
+
+
+/**
+ * Cell of the ring buffer. The sequence number tells whether the cell is free
+ * for the producer which reserved position 'seq', or full for the consumer
+ * at position 'seq - 1' (bounded MPMC queue by Dmitry Vyukov)
+ */
+struct event_cell{
+    atomic_size_t seq;
+    struct event_record record;
+};
+
+static struct event_cell EVENT_RING[EVENT_RING_SIZE];
+static atomic_size_t EVENT_ENQUEUE_POS = 0;
+static size_t EVENT_DEQUEUE_POS = 0; // Only used by the background thread
+static atomic_long EVENT_DROPPED = 0;
+
+static atomic_int EVENT_INITIALIZED = 0; // 1 while a thread initializes the sink, 2 once it did
+static enum event_mode EVENT_MODE = EVENT_MODE_ASYNC;
+static event_formatter_t EVENT_FORMATTER = NULL;
+static FILE *EVENT_OUT = NULL;
+
+static pthread_t EVENT_THREAD;
+static atomic_int EVENT_THREAD_RUNNING = 0;
+static atomic_int EVENT_STOP = 0;
+
+
+/**
+ * @brief Take one record from the ring buffer
+ *
+ * @param record - where to copy the record
+ *
+ * @return 1 if a record was taken, 0 if the buffer is empty
+ */
+static int event_ring_pop(struct event_record *record){
+    struct event_cell *cell = &EVENT_RING[EVENT_DEQUEUE_POS & (EVENT_RING_SIZE - 1)];
+    size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+    if(seq != EVENT_DEQUEUE_POS + 1){
+        return 0;
+    }
+    *record = cell->record;
+    atomic_store_explicit(&cell->seq, EVENT_DEQUEUE_POS + EVENT_RING_SIZE, memory_order_release);
+    EVENT_DEQUEUE_POS += 1;
+    return 1;
+}
+
+
+/**
+ * @brief Put one record to the ring buffer
+ *
+ * @param record
+ *
+ * @return 0 on success, 1 if the buffer is full
+ */
+static int event_ring_push(const struct event_record *record){
+    size_t pos = atomic_load_explicit(&EVENT_ENQUEUE_POS, memory_order_relaxed);
+    while(1){
+        struct event_cell *cell = &EVENT_RING[pos & (EVENT_RING_SIZE - 1)];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        long dif = (long)seq - (long)pos;
+        if(dif == 0){
+            if(atomic_compare_exchange_weak_explicit(&EVENT_ENQUEUE_POS, &pos, pos + 1,
+                        memory_order_relaxed, memory_order_relaxed)){
+                cell->record = *record;
+                atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+                return 0;
+            }
+        }else if(dif < 0){
+            return 1;
+        }else{
+            pos = atomic_load_explicit(&EVENT_ENQUEUE_POS, memory_order_relaxed);
+        }
+    }
+}
+
+
+/**
+ * @brief Write a record to the output - as text or as it is
+ *
+ * @param record
+ */
+static void event_write(const struct event_record *record){
+    if(EVENT_MODE == EVENT_MODE_BINARY){
+        fwrite(record, sizeof(*record), 1, EVENT_OUT);
+    }else{
+        EVENT_FORMATTER(EVENT_OUT, record);
+    }
+}
+
+
+/**
+ * @brief Background thread - drain the ring buffer until stopped
+ *
+ * @param arg - unused
+ */
+static void *event_thread(void *arg){
+    struct event_record record;
+    while(1){
+        int written = 0;
+        while(event_ring_pop(&record)){
+            event_write(&record);
+            written = 1;
+        }
+        if(written){
+            fflush(EVENT_OUT);
+        }else if(atomic_load(&EVENT_STOP)){
+            break;
+        }else{
+            struct timespec pause = {0, 1000000}; // 1 ms
+            nanosleep(&pause, NULL);
+        }
+    }
+    return NULL;
+}
+
+
+/**
+ * @brief Set the sink up from the environment (see event_sink_init)
+ *
+ * @param formatter - function formatting records of the program as text
+ */
+static void event_sink_setup(event_formatter_t formatter){
+    EVENT_FORMATTER = formatter;
+    EVENT_OUT = stderr;
+
+    char *mode = getenv("DNS_EVENTS");
+    if(!mode || !strcmp(mode, "async")){
+        EVENT_MODE = EVENT_MODE_ASYNC;
+    }else if(!strcmp(mode, "off")){
+        EVENT_MODE = EVENT_MODE_OFF;
+    }else if(!strcmp(mode, "text")){
+        EVENT_MODE = EVENT_MODE_TEXT;
+    }else if(!strcmp(mode, "binary")){
+        EVENT_MODE = EVENT_MODE_BINARY;
+    }else{
+        fprintf(stderr, "Unknown DNS_EVENTS mode \"%s\", using \"async\".\n", mode);
+        EVENT_MODE = EVENT_MODE_ASYNC;
+    }
+
+    if(EVENT_MODE != EVENT_MODE_ASYNC && EVENT_MODE != EVENT_MODE_BINARY){
+        return;
+    }
+
+    char *path = getenv("DNS_EVENTS_FILE");
+    if(path){
+        EVENT_OUT = fopen(path, EVENT_MODE == EVENT_MODE_BINARY ? "ab" : "a");
+        if(!EVENT_OUT){
+            fprintf(stderr, "Could not open events file \"%s\", using stderr.\n", path);
+            EVENT_OUT = stderr;
+        }
+    }
+
+    for(size_t i = 0; i < EVENT_RING_SIZE; i++){
+        atomic_init(&EVENT_RING[i].seq, i);
+    }
+
+    if(pthread_create(&EVENT_THREAD, NULL, event_thread, NULL)){
+        // Without the thread, format the events right away
+        fprintf(stderr, "Could not start events thread, writing events synchronously.\n");
+        return;
+    }
+    atomic_store(&EVENT_THREAD_RUNNING, 1);
+    atexit(event_sink_shutdown);
+}
+
+
+/**
+ * @brief Initialize the sink from the environment (only the first call has
+ * an effect, calls from other threads meanwhile wait until it's done).
+ * DNS_EVENTS selects the backend:
+ * - "async" (default) - records are formatted by a background thread
+ * - "text" - records are formatted to stderr right away
+ * - "binary" - records are written as they are by a background thread
+ * - "off" - events are dropped
+ * Background thread writes to DNS_EVENTS_FILE if it is set, else to stderr.
+ *
+ * @param formatter - function formatting records of the program as text
+ */
+void event_sink_init(event_formatter_t formatter){
+    if(atomic_load_explicit(&EVENT_INITIALIZED, memory_order_acquire) == 2){
+        return;
+    }
+
+    // The receiver's threads may all emit their first events at once - only
+    // one of them sets the sink up, the others wait until it's done
+    int expected = 0;
+    if(atomic_compare_exchange_strong(&EVENT_INITIALIZED, &expected, 1)){
+        event_sink_setup(formatter);
+        atomic_store_explicit(&EVENT_INITIALIZED, 2, memory_order_release);
+        return;
+    }
+    while(atomic_load_explicit(&EVENT_INITIALIZED, memory_order_acquire) != 2){
+        sched_yield();
+    }
+}
+
+
+/**
+ * @brief Check if events are written at all
+ *
+ * @return 1 if events are written
+ */
+int event_sink_enabled(){
+    return EVENT_MODE != EVENT_MODE_OFF;
+}
+
+
+/**
+ * @brief Prepare a record with the current time and no address or strings
+ *
+ * @param record - record to prepare
+ * @param type - type of the event
+ */
+void event_record_init(struct event_record *record, int type){
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    memset(record, 0, sizeof(*record));
+    record->timestamp = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+    record->type = type;
+}
+
+
+/**
+ * @brief Copy a string to a record field, truncating it if necessary
+ *
+ * @param dst - field of the record
+ * @param src - string (may be NULL)
+ * @param size - size of the field
+ */
+void event_record_string(char *dst, const char *src, int size){
+    if(!src){
+        // Keep the text output of NULL strings as it was with printf
+        src = "(null)";
+    }
+    int i = 0;
+    for( ; i < size - 1 && src[i] != '\0'; i++){
+        dst[i] = src[i];
+    }
+    dst[i] = '\0';
+}
+
+
+/**
+ * @brief Write a record - format it, or push it to the ring buffer if a
+ * background thread is used (the record is dropped if the buffer is full, so
+ * the caller is never blocked)
+ *
+ * @param record
+ */
+void event_sink_emit(const struct event_record *record){
+    if(EVENT_MODE == EVENT_MODE_OFF){
+        return;
+    }
+    if(!atomic_load_explicit(&EVENT_THREAD_RUNNING, memory_order_relaxed)){
+        event_write(record);
+        return;
+    }
+    if(event_ring_push(record)){
+        atomic_fetch_add_explicit(&EVENT_DROPPED, 1, memory_order_relaxed);
+    }
+}
+
+
+/**
+ * @brief Write all pending records and stop the background thread. Called
+ * automatically at exit
+ */
+void event_sink_shutdown(){
+    if(!atomic_exchange(&EVENT_THREAD_RUNNING, 0)){
+        return;
+    }
+    atomic_store(&EVENT_STOP, 1);
+    pthread_join(EVENT_THREAD, NULL);
+
+    long dropped = atomic_load(&EVENT_DROPPED);
+    if(dropped){
+        fprintf(stderr, "%ld events were dropped, the events buffer was full.\n", dropped);
+    }
+    if(EVENT_OUT != stderr){
+        fclose(EVENT_OUT);
+    }
+    EVENT_OUT = stderr;
+    EVENT_MODE = EVENT_MODE_OFF;
+}
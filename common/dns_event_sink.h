@@ -0,0 +1,102 @@
+/**
+ * @brief Event sink shared by the sender and the receiver - events are
+ * stored as fixed-size binary records to a lock-free ring buffer, which is
+ * drained by a background thread (default), or formatted right away
+ * @file dns_event_sink.h
+ * @author Patrik Skaloš
+ * @year 2022
+ */
+
+#ifndef DNS_EVENT_SINK_H
+#define DNS_EVENT_SINK_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+
+#define EVENT_PATH_LEN 256
+#define EVENT_DATA_LEN 256
+
+
+/**
+ * Event record. Records are written to binary event files as they are, in
+ * the byte order of the machine (bench/dns_events formats them as text)
+ */
+struct event_record{
+    uint64_t timestamp; // Nanoseconds since the epoch
+    int32_t type; // Type of the event, defined by the program
+    int32_t chunk_id;
+    int64_t size; // Chunk or file size in bytes
+    int32_t family; // Family of the address (AF_INET, AF_INET6 or 0 if none)
+    unsigned char address[16];
+    char path[EVENT_PATH_LEN]; // Destination file path
+    char data[EVENT_DATA_LEN]; // Encoded data
+};
+
+
+/**
+ * Function formatting a record as text
+ */
+typedef void (*event_formatter_t)(FILE *out, const struct event_record *record);
+
+
+/**
+ * @brief Initialize the sink from the environment (only the first call has
+ * an effect, calls from other threads meanwhile wait until it's done).
+ * DNS_EVENTS selects the backend:
+ * - "async" (default) - records are formatted by a background thread
+ * - "text" - records are formatted to stderr right away
+ * - "binary" - records are written as they are by a background thread
+ * - "off" - events are dropped
+ * Background thread writes to DNS_EVENTS_FILE if it is set, else to stderr.
+ *
+ * @param formatter - function formatting records of the program as text
+ */
+void event_sink_init(event_formatter_t formatter);
+
+
+/**
+ * @brief Check if events are written at all
+ *
+ * @return 1 if events are written
+ */
+int event_sink_enabled();
+
+
+/**
+ * @brief Prepare a record with the current time and no address or strings
+ *
+ * @param record - record to prepare
+ * @param type - type of the event
+ */
+void event_record_init(struct event_record *record, int type);
+
+
+/**
+ * @brief Copy a string to a record field, truncating it if necessary
+ *
+ * @param dst - field of the record
+ * @param src - string (may be NULL)
+ * @param size - size of the field
+ */
+void event_record_string(char *dst, const char *src, int size);
+
+
+/**
+ * @brief Write a record - format it, or push it to the ring buffer if a
+ * background thread is used (the record is dropped if the buffer is full, so
+ * the caller is never blocked)
+ *
+ * @param record
+ */
+void event_sink_emit(const struct event_record *record);
+
+
+/**
+ * @brief Write all pending records and stop the background thread. Called
+ * automatically at exit
+ */
+void event_sink_shutdown();
+
+
+#endif //DNS_EVENT_SINK_H
@@ -0,0 +1,371 @@
+/**
+ * @brief Metrics of a running sender or receiver - counters and latency
+ * histograms, periodically written to a JSON snapshot file
+ * @file dns_metrics.c
+ * @author Patrik Skaloš
+ * @year 2022
+ */
+
+
+// Standard libraries
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+// Header files
+#include "dns_metrics.h"
+#include "dns_net_io.h"
+
+
+static const char *METRIC_NAMES[METRIC_COUNTER_COUNT] = {
+    "packets_in",
+    "packets_out",
+    "bytes_in",
+    "bytes_out",
+    "retransmits",
+    "timeouts",
+    "drops",
+    "active_sessions",
+    "transfers_completed",
+    "transfers_failed",
+    "sessions_expired",
+    "duplicates"
+};
+
+static atomic_int_fast64_t METRIC_COUNTERS[METRIC_COUNTER_COUNT];
+
+struct metrics_histogram METRIC_ACK_LATENCY;
+
+static const char *STAGE_NAMES[STAGE_COUNT] = {
+    "build",
+    "send",
+    "kernel_tx",
+    "kernel_rx",
+    "parse",
+    "handle"
+};
+
+struct metrics_histogram METRIC_STAGES[STAGE_COUNT];
+static int METRICS_STAGES = 0; // 1 if stages are timed
+
+static const char *METRICS_PROGRAM = "";
+static const char *METRICS_FILE = NULL;
+static int METRICS_INTERVAL = 1000; // Milliseconds
+static uint64_t METRICS_START = 0;
+
+// Counter values at the previous snapshot, to compute rates
+static int64_t METRICS_PREV_COUNTERS[METRIC_COUNTER_COUNT];
+static uint64_t METRICS_PREV_TIME = 0;
+static pthread_mutex_t METRICS_SNAPSHOT_MUTEX = PTHREAD_MUTEX_INITIALIZER;
+
+
+/**
+ * @brief Get index of the bucket for a value
+ *
+ * @param value
+ *
+ * @return bucket index
+ */
+static int histogram_bucket(uint64_t value){
+    if(value < 2 * HISTOGRAM_SUB_BUCKETS){
+        return value;
+    }
+    int exponent = 63 - __builtin_clzll(value);
+    if(exponent >= HISTOGRAM_MAX_EXPONENT){
+        return HISTOGRAM_BUCKETS - 1;
+    }
+    int shift = exponent - HISTOGRAM_SUB_BITS;
+    int sub = (value >> shift) - HISTOGRAM_SUB_BUCKETS;
+    return 2 * HISTOGRAM_SUB_BUCKETS + (exponent - HISTOGRAM_SUB_BITS - 1) * HISTOGRAM_SUB_BUCKETS + sub;
+}
+
+
+/**
+ * @brief Get the highest value which belongs to a bucket
+ *
+ * @param bucket - bucket index
+ *
+ * @return highest value of the bucket
+ */
+static uint64_t histogram_bucket_upper(int bucket){
+    if(bucket < 2 * HISTOGRAM_SUB_BUCKETS){
+        return bucket;
+    }
+    int j = bucket - 2 * HISTOGRAM_SUB_BUCKETS;
+    int exponent = j / HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BITS + 1;
+    int shift = exponent - HISTOGRAM_SUB_BITS;
+    uint64_t lower = (uint64_t)(j % HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BUCKETS) << shift;
+    return lower + ((uint64_t)1 << shift) - 1;
+}
+
+
+/**
+ * @brief Record a value to a histogram
+ *
+ * @param histogram
+ * @param value
+ */
+void histogram_record(struct metrics_histogram *histogram, uint64_t value){
+    atomic_fetch_add_explicit(&histogram->buckets[histogram_bucket(value)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->sum, value, memory_order_relaxed);
+    uint64_t max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+    while(value > max && !atomic_compare_exchange_weak_explicit(&histogram->max, &max, value,
+                memory_order_relaxed, memory_order_relaxed));
+}
+
+
+/**
+ * @brief Get a percentile of the values recorded to a histogram
+ *
+ * @param histogram
+ * @param percentile - 0 to 100
+ *
+ * @return upper bound of the bucket containing the percentile (0 if empty)
+ */
+uint64_t histogram_percentile(struct metrics_histogram *histogram, double percentile){
+    uint64_t count = atomic_load_explicit(&histogram->count, memory_order_relaxed);
+    if(!count){
+        return 0;
+    }
+    uint64_t target = (uint64_t)(percentile / 100.0 * count);
+    if(target < 1){
+        target = 1;
+    }
+    uint64_t seen = 0;
+    for(int i = 0; i < HISTOGRAM_BUCKETS; i++){
+        seen += atomic_load_explicit(&histogram->buckets[i], memory_order_relaxed);
+        if(seen >= target){
+            uint64_t upper = histogram_bucket_upper(i);
+            uint64_t max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+            return upper < max ? upper : max;
+        }
+    }
+    return atomic_load_explicit(&histogram->max, memory_order_relaxed);
+}
+
+
+/**
+ * @brief Get current time of a monotonic clock in microseconds
+ *
+ * @return time in microseconds
+ */
+uint64_t metrics_now_us(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+
+/**
+ * @brief Start timing a stage
+ *
+ * @return the start time in nanoseconds, 0 if stages are not timed
+ */
+uint64_t metrics_stage_start(){
+    if(!METRICS_STAGES){
+        return 0;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+
+/**
+ * @brief Record the time of a stage (nothing happens if it was not timed)
+ *
+ * @param stage
+ * @param start - returned by metrics_stage_start
+ */
+void metrics_stage_end(enum metric_stage stage, uint64_t start){
+    if(!start){
+        return;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    histogram_record(&METRIC_STAGES[stage], (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec - start);
+}
+
+
+/**
+ * @brief Record a delay measured by kernel timestamps (passed to
+ * net_timestamping)
+ *
+ * @param direction - NET_RX or NET_TX
+ * @param delay_ns
+ */
+void metrics_kernel_delay(int direction, uint64_t delay_ns){
+    histogram_record(&METRIC_STAGES[direction == NET_TX ? STAGE_KERNEL_TX : STAGE_KERNEL_RX], delay_ns);
+}
+
+
+/**
+ * @brief Check if stages are timed, so that the UDP socket should be
+ * timestamped
+ *
+ * @return 1 if they are
+ */
+int metrics_stages_enabled(){
+    return METRICS_STAGES;
+}
+
+
+/**
+ * @brief Add to a counter
+ *
+ * @param counter
+ * @param value - may be negative for METRIC_ACTIVE_SESSIONS
+ */
+void metrics_add(enum metric_counter counter, int64_t value){
+    atomic_fetch_add_explicit(&METRIC_COUNTERS[counter], value, memory_order_relaxed);
+}
+
+
+/**
+ * @brief Get value of a counter
+ *
+ * @param counter
+ *
+ * @return current value
+ */
+int64_t metrics_get(enum metric_counter counter){
+    return atomic_load_explicit(&METRIC_COUNTERS[counter], memory_order_relaxed);
+}
+
+
+/**
+ * @brief Write a histogram as a JSON object
+ *
+ * @param f - output file
+ * @param name - key of the object
+ * @param histogram
+ */
+static void histogram_write_json(FILE *f, const char *name, struct metrics_histogram *histogram){
+    uint64_t count = atomic_load(&histogram->count);
+    uint64_t sum = atomic_load(&histogram->sum);
+    fprintf(f, "  \"%s\": {\"count\": %llu, \"mean\": %.1f, \"p50\": %llu, \"p90\": %llu, "
+            "\"p99\": %llu, \"p999\": %llu, \"max\": %llu}",
+            name, (unsigned long long)count, count ? (double)sum / count : 0.0,
+            (unsigned long long)histogram_percentile(histogram, 50),
+            (unsigned long long)histogram_percentile(histogram, 90),
+            (unsigned long long)histogram_percentile(histogram, 99),
+            (unsigned long long)histogram_percentile(histogram, 99.9),
+            (unsigned long long)atomic_load(&histogram->max));
+}
+
+
+/**
+ * @brief Write a JSON snapshot of all metrics to DNS_METRICS_FILE (if set).
+ * The snapshot is written to a temporary file which then replaces the
+ * previous snapshot, so readers never see a partial one
+ */
+void metrics_write_snapshot(){
+    if(!METRICS_FILE){
+        return;
+    }
+    pthread_mutex_lock(&METRICS_SNAPSHOT_MUTEX);
+
+    char tmp_path[4096];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", METRICS_FILE);
+    FILE *f = fopen(tmp_path, "w");
+    if(!f){
+        pthread_mutex_unlock(&METRICS_SNAPSHOT_MUTEX);
+        return;
+    }
+
+    uint64_t now = metrics_now_us();
+    double elapsed = (now - METRICS_PREV_TIME) / 1000000.0;
+    int64_t counters[METRIC_COUNTER_COUNT];
+    for(int i = 0; i < METRIC_COUNTER_COUNT; i++){
+        counters[i] = metrics_get(i);
+    }
+
+    fprintf(f, "{\n  \"program\": \"%s\",\n  \"timestamp\": %ld,\n  \"uptime_s\": %.3f,\n",
+            METRICS_PROGRAM, (long)time(NULL), (now - METRICS_START) / 1000000.0);
+
+    fprintf(f, "  \"counters\": {");
+    for(int i = 0; i < METRIC_COUNTER_COUNT; i++){
+        fprintf(f, "%s\"%s\": %lld", i ? ", " : "", METRIC_NAMES[i], (long long)counters[i]);
+    }
+    fprintf(f, "},\n");
+
+    // Throughput since the previous snapshot
+    fprintf(f, "  \"rates\": {");
+    int first = 1;
+    for(int i = 0; i < METRIC_COUNTER_COUNT; i++){
+        if(i == METRIC_ACTIVE_SESSIONS){
+            continue;
+        }
+        double rate = elapsed > 0 ? (counters[i] - METRICS_PREV_COUNTERS[i]) / elapsed : 0;
+        fprintf(f, "%s\"%s_per_s\": %.1f", first ? "" : ", ", METRIC_NAMES[i], rate);
+        first = 0;
+        METRICS_PREV_COUNTERS[i] = counters[i];
+    }
+    fprintf(f, "},\n");
+    METRICS_PREV_TIME = now;
+
+    histogram_write_json(f, "ack_latency_us", &METRIC_ACK_LATENCY);
+    for(int i = 0; i < STAGE_COUNT && METRICS_STAGES; i++){
+        char name[64];
+        snprintf(name, sizeof(name), "stage_%s_ns", STAGE_NAMES[i]);
+        fprintf(f, ",\n");
+        histogram_write_json(f, name, &METRIC_STAGES[i]);
+    }
+    fprintf(f, "\n}\n");
+    fclose(f);
+
+    rename(tmp_path, METRICS_FILE);
+    pthread_mutex_unlock(&METRICS_SNAPSHOT_MUTEX);
+}
+
+
+/**
+ * @brief Background thread - write snapshots periodically
+ *
+ * @param arg - unused
+ */
+static void *metrics_thread(void *arg){
+    struct timespec pause = {METRICS_INTERVAL / 1000, (METRICS_INTERVAL % 1000) * 1000000};
+    while(1){
+        nanosleep(&pause, NULL);
+        metrics_write_snapshot();
+    }
+    return NULL;
+}
+
+
+/**
+ * @brief Start collecting metrics. If the DNS_METRICS_FILE environment
+ * variable is set, a background thread writes a JSON snapshot to that file
+ * every DNS_METRICS_INTERVAL milliseconds (default 1000) and at exit, with
+ * times of stages if DNS_METRICS_STAGES is 1
+ *
+ * @param program - name of the program, written to the snapshots
+ */
+void metrics_init(const char *program){
+    METRICS_PROGRAM = program;
+    METRICS_START = metrics_now_us();
+    METRICS_PREV_TIME = METRICS_START;
+
+    METRICS_FILE = getenv("DNS_METRICS_FILE");
+    if(!METRICS_FILE){
+        return;
+    }
+    char *interval = getenv("DNS_METRICS_INTERVAL");
+    if(interval && atoi(interval) > 0){
+        METRICS_INTERVAL = atoi(interval);
+    }
+    char *stages = getenv("DNS_METRICS_STAGES");
+    METRICS_STAGES = stages && !strcmp(stages, "1");
+
+    pthread_t thread;
+    if(pthread_create(&thread, NULL, metrics_thread, NULL)){
+        fprintf(stderr, "Could not start metrics thread, writing metrics only at exit.\n");
+    }else{
+        pthread_detach(thread);
+    }
+    atexit(metrics_write_snapshot);
+}
@@ -0,0 +1,179 @@
+/**
+ * @brief Metrics of a running sender or receiver - counters and latency
+ * histograms, periodically written to a JSON snapshot file
+ * @file dns_metrics.h
+ * @author Patrik Skaloš
+ * @year 2022
+ */
+
+#ifndef DNS_METRICS_H
+#define DNS_METRICS_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+
+/**
+ * Counters. Counters only grow, except for METRIC_ACTIVE_SESSIONS
+ */
+enum metric_counter{
+    METRIC_PACKETS_IN,
+    METRIC_PACKETS_OUT,
+    METRIC_BYTES_IN,
+    METRIC_BYTES_OUT,
+    METRIC_RETRANSMITS, // Packets sent again
+    METRIC_TIMEOUTS, // Confirmations not received in time
+    METRIC_DROPS, // Received packets ignored as invalid or unexpected
+    METRIC_ACTIVE_SESSIONS, // Transfers in progress
+    METRIC_TRANSFERS_COMPLETED,
+    METRIC_TRANSFERS_FAILED,
+    METRIC_SESSIONS_EXPIRED, // Communications closed by the receiver when idle
+    METRIC_DUPLICATES, // Repeated queries answered from the receiver's cache
+    METRIC_COUNTER_COUNT
+};
+
+
+/**
+ * Histogram with log-linear buckets (like HDR histogram) - values are
+ * recorded with precision of 1/HISTOGRAM_SUB_BUCKETS (about 3 %) up to
+ * 2^HISTOGRAM_MAX_EXPONENT
+ */
+#define HISTOGRAM_SUB_BITS 5
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_MAX_EXPONENT 40
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_EXPONENT - HISTOGRAM_SUB_BITS + 2) * HISTOGRAM_SUB_BUCKETS)
+
+struct metrics_histogram{
+    atomic_uint_fast64_t buckets[HISTOGRAM_BUCKETS];
+    atomic_uint_fast64_t count;
+    atomic_uint_fast64_t sum;
+    atomic_uint_fast64_t max;
+};
+
+
+/**
+ * Latency of confirmations of chunks in microseconds (sender)
+ */
+extern struct metrics_histogram METRIC_ACK_LATENCY;
+
+
+/**
+ * Stages a query goes through, timed in nanoseconds if the environment
+ * variable DNS_METRICS_STAGES is 1 (and metrics are written), to tell where
+ * the time of a transfer goes. The kernel stages are measured by kernel
+ * timestamps of the UDP socket (see net_timestamping)
+ */
+enum metric_stage{
+    STAGE_BUILD, // Building a query (sender)
+    STAGE_SEND, // Sending a query (sender) or a response (receiver) by sendto
+    STAGE_KERNEL_TX, // From sendto until the kernel passed the datagram to the device
+    STAGE_KERNEL_RX, // From the kernel getting a datagram until it was read
+    STAGE_PARSE, // Getting the payload of a query (receiver)
+    STAGE_HANDLE, // Handling a query, including parsing it (receiver)
+    STAGE_COUNT
+};
+
+extern struct metrics_histogram METRIC_STAGES[STAGE_COUNT];
+
+
+/**
+ * @brief Start collecting metrics. If the DNS_METRICS_FILE environment
+ * variable is set, a background thread writes a JSON snapshot to that file
+ * every DNS_METRICS_INTERVAL milliseconds (default 1000) and at exit, with
+ * times of stages if DNS_METRICS_STAGES is 1
+ *
+ * @param program - name of the program, written to the snapshots
+ */
+void metrics_init(const char *program);
+
+
+/**
+ * @brief Add to a counter
+ *
+ * @param counter
+ * @param value - may be negative for METRIC_ACTIVE_SESSIONS
+ */
+void metrics_add(enum metric_counter counter, int64_t value);
+
+
+/**
+ * @brief Get value of a counter
+ *
+ * @param counter
+ *
+ * @return current value
+ */
+int64_t metrics_get(enum metric_counter counter);
+
+
+/**
+ * @brief Record a value to a histogram
+ *
+ * @param histogram
+ * @param value
+ */
+void histogram_record(struct metrics_histogram *histogram, uint64_t value);
+
+
+/**
+ * @brief Get a percentile of the values recorded to a histogram
+ *
+ * @param histogram
+ * @param percentile - 0 to 100
+ *
+ * @return upper bound of the bucket containing the percentile (0 if empty)
+ */
+uint64_t histogram_percentile(struct metrics_histogram *histogram, double percentile);
+
+
+/**
+ * @brief Get current time of a monotonic clock in microseconds
+ *
+ * @return time in microseconds
+ */
+uint64_t metrics_now_us();
+
+
+/**
+ * @brief Start timing a stage
+ *
+ * @return the start time in nanoseconds, 0 if stages are not timed
+ */
+uint64_t metrics_stage_start();
+
+
+/**
+ * @brief Record the time of a stage (nothing happens if it was not timed)
+ *
+ * @param stage
+ * @param start - returned by metrics_stage_start
+ */
+void metrics_stage_end(enum metric_stage stage, uint64_t start);
+
+
+/**
+ * @brief Record a delay measured by kernel timestamps (passed to
+ * net_timestamping)
+ *
+ * @param direction - NET_RX or NET_TX
+ * @param delay_ns
+ */
+void metrics_kernel_delay(int direction, uint64_t delay_ns);
+
+
+/**
+ * @brief Check if stages are timed, so that the UDP socket should be
+ * timestamped
+ *
+ * @return 1 if they are
+ */
+int metrics_stages_enabled();
+
+
+/**
+ * @brief Write a JSON snapshot of all metrics to DNS_METRICS_FILE (if set)
+ */
+void metrics_write_snapshot();
+
+
+#endif //DNS_METRICS_H
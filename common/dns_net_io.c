@@ -0,0 +1,738 @@
+/**
+ * @brief Socket I/O and time of the sender and the receiver, behind an
+ * interface which can be replaced (eg. by a simulated network)
+ * @file dns_net_io.c
+ * @author Patrik Skaloš
+ * @year 2022
+ */
+
+
+// Standard libraries
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <stdatomic.h>
+
+// Networking libraries
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+
+// Header files
+#include "dns_net_io.h"
+
+
+/*
+ *
+ * SOCKETS
+ *
+ */
+
+
+// Implementation of struct net_io by real sockets and the monotonic clock
+
+/**
+ * @brief Open a socket, dual-stack for AF_INET6, bound to the port if it is
+ * not 0
+ *
+ * @param family - AF_INET or AF_INET6
+ * @param type - SOCK_DGRAM or SOCK_STREAM
+ * @param port
+ *
+ * @return socket or -1
+ */
+static int socket_bound(int family, int type, int port){
+    int sock = socket(family, type, 0);
+    if(sock == -1){
+        return -1;
+    }
+
+    // Dual-stack - IPv4 addresses are reached as IPv4-mapped IPv6 addresses
+    int v6only = 0;
+    if(family == AF_INET6 && setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only))){
+        close(sock);
+        return -1;
+    }
+    if(!port){
+        return sock;
+    }
+
+    // Set reuse address option
+    int optval = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const void *)&optval, sizeof(int));
+
+    // Listen on all addresses of the family
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    memset(&addr, 0, sizeof(addr));
+    if(family == AF_INET6){
+        struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)&addr;
+        addr6->sin6_family = AF_INET6;
+        addr6->sin6_addr = in6addr_any;
+        addr6->sin6_port = htons(port);
+        addr_len = sizeof(*addr6);
+    }else{
+        struct sockaddr_in *addr4 = (struct sockaddr_in *)&addr;
+        addr4->sin_family = AF_INET;
+        addr4->sin_addr.s_addr = htonl(INADDR_ANY);
+        addr4->sin_port = htons(port);
+        addr_len = sizeof(*addr4);
+    }
+    if(bind(sock, (struct sockaddr *)&addr, addr_len)){
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+
+// Kernel timestamps of the timestamped socket (see socket_timestamping) -
+// times when datagrams were sent by their timestamp IDs, which the kernel
+// counts from 0 by datagrams sent
+#define SOCKET_TX_SLOTS 4096
+static int STAMPED_SOCK = -1;
+static void (*STAMPED_RECORD)(int direction, uint64_t delay_ns) = NULL;
+static uint64_t STAMPED_SENT_NS[SOCKET_TX_SLOTS];
+static atomic_uint STAMPED_SENT = 0;
+
+
+/**
+ * @brief Get the time of the clock of kernel timestamps
+ *
+ * @return nanoseconds
+ */
+static uint64_t stamp_now_ns(){
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+
+/**
+ * @brief Find the software timestamp in control messages of a datagram
+ *
+ * @param msg - received with the control messages
+ *
+ * @return the timestamp in nanoseconds, 0 if there is none
+ */
+static uint64_t stamp_find(struct msghdr *msg){
+    for(struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)){
+        if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING){
+            struct scm_timestamping *stamps = (struct scm_timestamping *)CMSG_DATA(cmsg);
+            return (uint64_t)stamps->ts[0].tv_sec * 1000000000 + stamps->ts[0].tv_nsec;
+        }
+    }
+    return 0;
+}
+
+
+/**
+ * @brief Read the timestamps of sent datagrams from the error queue of the
+ * timestamped socket - they have to be read, as they take space of its
+ * receive buffer
+ */
+static void stamp_read_sent(){
+    for(;;){
+        char control[512];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if(recvmsg(STAMPED_SOCK, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0){
+            return;
+        }
+
+        // The ID of the datagram is in the extended error (of IPv4 or IPv6)
+        uint64_t stamp = stamp_find(&msg);
+        for(struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg && stamp; cmsg = CMSG_NXTHDR(&msg, cmsg)){
+            if(!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR)
+                    && !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)){
+                continue;
+            }
+            struct sock_extended_err *ee = (struct sock_extended_err *)CMSG_DATA(cmsg);
+            if(ee->ee_origin != SO_EE_ORIGIN_TIMESTAMPING){
+                continue;
+            }
+
+            // The slot is cleared, so that a timestamp which comes before
+            // its send is recorded doesn't take the time of an older one
+            uint64_t sent = STAMPED_SENT_NS[ee->ee_data % SOCKET_TX_SLOTS];
+            STAMPED_SENT_NS[ee->ee_data % SOCKET_TX_SLOTS] = 0;
+            if(sent && stamp >= sent){
+                STAMPED_RECORD(NET_TX, stamp - sent);
+            }
+        }
+    }
+}
+
+
+/**
+ * @brief Wait until a socket can be read (timestamps of datagrams sent by
+ * the timestamped socket are read meanwhile)
+ *
+ * @param sock
+ * @param timeout_ms - forever if negative
+ *
+ * @return 0 if it can be read, 1 if the time ran out
+ */
+static int socket_wait(int sock, int timeout_ms){
+    if(timeout_ms < 0 && sock != STAMPED_SOCK){
+        return 0;
+    }
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(;;){
+        struct pollfd fd = {sock, POLLIN, 0};
+        if(poll(&fd, 1, timeout_ms) != 1){
+            return 1;
+        }
+        if(fd.revents & POLLIN || sock != STAMPED_SOCK){
+            return 0;
+        }
+
+        // Only timestamps came, wait for the rest of the time
+        stamp_read_sent();
+        if(timeout_ms > 0){
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            int elapsed_ms = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+            if(elapsed_ms >= timeout_ms){
+                return 1;
+            }
+            timeout_ms -= elapsed_ms;
+            start = now;
+        }
+    }
+}
+
+
+/**
+ * @brief Receive a datagram of the timestamped socket and record how long it
+ * waited since the kernel got it
+ *
+ * @param flags - as for recvfrom
+ *
+ * @return as recvfrom
+ */
+static int stamp_recv(void *buffer, int len, int flags, struct sockaddr *addr, socklen_t *addr_len){
+    char control[512];
+    struct iovec iov = {buffer, len};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = addr;
+    msg.msg_namelen = addr_len ? *addr_len : 0;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    int ret = recvmsg(STAMPED_SOCK, &msg, flags);
+    if(ret < 0){
+        return ret;
+    }
+    if(addr_len){
+        *addr_len = msg.msg_namelen;
+    }
+    uint64_t stamp = stamp_find(&msg);
+    uint64_t now = stamp_now_ns();
+    if(stamp && now >= stamp){
+        STAMPED_RECORD(NET_RX, now - stamp);
+    }
+    stamp_read_sent();
+    return ret;
+}
+
+
+static int socket_open(void *ctx, int family, int port){
+    (void)ctx;
+    return socket_bound(family, SOCK_DGRAM, port);
+}
+
+
+static int socket_send(void *ctx, int sock, const void *data, int len, int flags,
+        const struct sockaddr *addr, socklen_t addr_len){
+    (void)ctx;
+    if(sock != STAMPED_SOCK){
+        return sendto(sock, data, len, flags, addr, addr_len);
+    }
+
+    // The kernel only counts datagrams which were sent, so a datagram which
+    // wasn't (eg. to an unreachable address) doesn't take an ID. IDs of
+    // datagrams sent at once by more threads may be swapped, then their
+    // delays are a bit off
+    uint64_t now = stamp_now_ns();
+    int ret = sendto(sock, data, len, flags, addr, addr_len);
+    if(ret >= 0){
+        STAMPED_SENT_NS[atomic_fetch_add(&STAMPED_SENT, 1) % SOCKET_TX_SLOTS] = now;
+    }
+    return ret;
+}
+
+
+static int socket_recv(void *ctx, int sock, void *buffer, int len,
+        struct sockaddr *addr, socklen_t *addr_len, int timeout_ms){
+    (void)ctx;
+
+    // Without waiting, one system call is enough
+    if(!timeout_ms){
+        return sock == STAMPED_SOCK
+            ? stamp_recv(buffer, len, MSG_DONTWAIT, addr, addr_len)
+            : recvfrom(sock, buffer, len, MSG_DONTWAIT, addr, addr_len);
+    }
+    if(socket_wait(sock, timeout_ms)){
+        return -1;
+    }
+    return sock == STAMPED_SOCK
+        ? stamp_recv(buffer, len, 0, addr, addr_len)
+        : recvfrom(sock, buffer, len, 0, addr, addr_len);
+}
+
+
+static void socket_close(void *ctx, int sock){
+    (void)ctx;
+    if(sock == STAMPED_SOCK){
+        STAMPED_SOCK = -1;
+    }
+    close(sock);
+}
+
+
+static uint64_t socket_now_us(void *ctx){
+    (void)ctx;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+static int socket_listen(void *ctx, int family, int port){
+    (void)ctx;
+    int sock = socket_bound(family, SOCK_STREAM, port);
+    if(sock != -1 && listen(sock, 16)){
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+
+static int socket_accept(void *ctx, int sock, struct sockaddr *addr, socklen_t *addr_len){
+    (void)ctx;
+    int conn = accept(sock, addr, addr_len);
+    if(conn != -1){
+        // Responses are sent right away, not delayed to be merged
+        int nodelay = 1;
+        setsockopt(conn, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    }
+    return conn;
+}
+
+
+static int socket_connect(void *ctx, const struct sockaddr *addr, socklen_t addr_len){
+    (void)ctx;
+    int sock = socket(addr->sa_family, SOCK_STREAM, 0);
+    if(sock == -1){
+        return -1;
+    }
+    int v6only = 0; // To reach IPv4-mapped addresses
+    if(addr->sa_family == AF_INET6){
+        setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only));
+    }
+    if(connect(sock, addr, addr_len)){
+        close(sock);
+        return -1;
+    }
+    int nodelay = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    return sock;
+}
+
+
+static int socket_read(void *ctx, int sock, void *buffer, int len, int timeout_ms){
+    (void)ctx;
+    if(socket_wait(sock, timeout_ms)){
+        return -1;
+    }
+    return recv(sock, buffer, len, 0);
+}
+
+
+static int socket_write(void *ctx, int sock, const void *data, int len){
+    (void)ctx;
+    for(int written = 0; written < len; ){
+        int ret = send(sock, (const char *)data + written, len - written, MSG_NOSIGNAL);
+        if(ret <= 0){
+            return -1;
+        }
+        written += ret;
+    }
+    return len;
+}
+
+
+static int socket_busy_poll(void *ctx, int sock, int budget_us){
+    (void)ctx;
+#ifdef SO_BUSY_POLL
+    return setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, &budget_us, sizeof(budget_us));
+#else
+    (void)sock;
+    (void)budget_us;
+    return -1;
+#endif
+}
+
+
+static int socket_timestamping(void *ctx, int sock, void (*record)(int direction, uint64_t delay_ns)){
+    (void)ctx;
+    int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE
+        | SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+    if(STAMPED_SOCK != -1 || setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags))){
+        return -1;
+    }
+    STAMPED_RECORD = record;
+    STAMPED_SOCK = sock;
+    return 0;
+}
+
+
+static struct net_io SOCKET_IO = {
+    NULL, socket_open, socket_send, socket_recv, socket_close, socket_now_us,
+    socket_listen, socket_accept, socket_connect, socket_read, socket_write,
+    socket_busy_poll, socket_timestamping
+};
+
+struct net_io *NET_IO = &SOCKET_IO;
+
+
+/*
+ *
+ * DISPATCH
+ *
+ */
+
+
+/**
+ * @brief Open a UDP socket through NET_IO
+ *
+ * @param family - AF_INET or AF_INET6 (dual-stack, reaching also IPv4
+ * addresses mapped to IPv6)
+ * @param port - port to bind to or 0 to not bind
+ *
+ * @return socket or -1 on error
+ */
+int net_socket(int family, int port){
+    return NET_IO->socket(NET_IO->ctx, family, port);
+}
+
+
+/**
+ * @brief Send a datagram through NET_IO
+ *
+ * @param sock
+ * @param data
+ * @param len - length of data in bytes
+ * @param flags - as for sendto
+ * @param addr - destination address
+ * @param addr_len
+ *
+ * @return number of bytes sent or -1 on error
+ */
+int net_send(int sock, const void *data, int len, int flags, const struct sockaddr *addr, socklen_t addr_len){
+    return NET_IO->send(NET_IO->ctx, sock, data, len, flags, addr, addr_len);
+}
+
+
+/**
+ * @brief Receive a datagram through NET_IO
+ *
+ * @param sock
+ * @param buffer - output
+ * @param len - size of the buffer
+ * @param addr - output, source address (or NULL)
+ * @param addr_len - size of addr, replaced by the length of the address
+ * @param timeout_ms - max time to wait (forever if negative)
+ *
+ * @return length of the datagram or -1 if none came in time
+ */
+int net_recv(int sock, void *buffer, int len, struct sockaddr *addr, socklen_t *addr_len, int timeout_ms){
+    return NET_IO->recv(NET_IO->ctx, sock, buffer, len, addr, addr_len, timeout_ms);
+}
+
+
+/**
+ * @brief Let reads of a socket busy-poll the network device for a while
+ * before they sleep (SO_BUSY_POLL) - saves the wakeup latency of blocking
+ * reads at the cost of CPU time
+ *
+ * @param sock
+ * @param budget_us - time to busy-poll in microseconds
+ *
+ * @return 0 on success, 1 if NET_IO or the kernel doesn't support it (or
+ * the budget is over net.core.busy_read without CAP_NET_ADMIN)
+ */
+int net_busy_poll(int sock, int budget_us){
+    if(!NET_IO->busy_poll){
+        return 1;
+    }
+    return NET_IO->busy_poll(NET_IO->ctx, sock, budget_us) != 0;
+}
+
+
+/**
+ * @brief Timestamp datagrams of a UDP socket in the kernel (SO_TIMESTAMPING,
+ * software timestamps) - the delays they measure are passed to a function
+ * as datagrams are received and sent. Only one socket of a program can be
+ * timestamped
+ *
+ * @param sock - opened by net_socket
+ * @param record - called with NET_RX or NET_TX and the delay in nanoseconds
+ *
+ * @return 0 on success, 1 if NET_IO or the kernel doesn't support it
+ */
+int net_timestamping(int sock, void (*record)(int direction, uint64_t delay_ns)){
+    if(!NET_IO->timestamping){
+        return 1;
+    }
+    return NET_IO->timestamping(NET_IO->ctx, sock, record) != 0;
+}
+
+
+/**
+ * @brief Close a socket opened by net_socket
+ *
+ * @param sock
+ */
+void net_close(int sock){
+    NET_IO->close(NET_IO->ctx, sock);
+}
+
+
+/**
+ * @brief Get current time of NET_IO
+ *
+ * @return microseconds
+ */
+uint64_t net_now_us(){
+    return NET_IO->now_us(NET_IO->ctx);
+}
+
+
+/**
+ * @brief Open a TCP socket listening on a port through NET_IO
+ *
+ * @param family - AF_INET or AF_INET6 (dual-stack)
+ * @param port
+ *
+ * @return socket or -1 on error
+ */
+int net_listen(int family, int port){
+    return NET_IO->listen(NET_IO->ctx, family, port);
+}
+
+
+/**
+ * @brief Accept a connection through NET_IO
+ *
+ * @param sock - listening socket
+ * @param addr - output, address of the peer (or NULL)
+ * @param addr_len - size of addr, replaced by the length of the address
+ *
+ * @return connected socket or -1 on error
+ */
+int net_accept(int sock, struct sockaddr *addr, socklen_t *addr_len){
+    return NET_IO->accept(NET_IO->ctx, sock, addr, addr_len);
+}
+
+
+/**
+ * @brief Open a TCP connection through NET_IO
+ *
+ * @param addr - address to connect to
+ * @param addr_len
+ *
+ * @return socket or -1 on error
+ */
+int net_connect(const struct sockaddr *addr, socklen_t addr_len){
+    return NET_IO->connect(NET_IO->ctx, addr, addr_len);
+}
+
+
+/*
+ *
+ * TCP MESSAGES
+ *
+ */
+
+
+/**
+ * @brief Send a DNS message over a TCP connection, prefixed by its length
+ *
+ * @param sock - connected socket
+ * @param data - message
+ * @param len - length of the message in bytes, at most NET_MAX_MESSAGE_LEN
+ *
+ * @return len or -1 on error
+ */
+int net_send_message(int sock, const void *data, int len){
+    if(len < 0 || len > NET_MAX_MESSAGE_LEN){
+        return -1;
+    }
+
+    // One write, so the length and the message go in one segment
+    unsigned char message[2 + NET_MAX_MESSAGE_LEN];
+    message[0] = len >> 8;
+    message[1] = len & 0xFF;
+    memcpy(message + 2, data, len);
+    if(NET_IO->write(NET_IO->ctx, sock, message, 2 + len) != 2 + len){
+        return -1;
+    }
+    return len;
+}
+
+
+/**
+ * @brief Read exactly len bytes of a stream
+ *
+ * @param sock
+ * @param buffer - output
+ * @param len
+ * @param deadline - time (of NET_IO) when to stop waiting, 0 to wait forever
+ *
+ * @return 0 if all bytes were read
+ */
+static int read_exactly(int sock, unsigned char *buffer, int len, uint64_t deadline){
+    for(int done = 0; done < len; ){
+        int timeout_ms = -1;
+        if(deadline){
+            uint64_t now = net_now_us();
+            timeout_ms = now < deadline ? (deadline - now + 999) / 1000 : 0;
+        }
+        int ret = NET_IO->read(NET_IO->ctx, sock, buffer + done, len - done, timeout_ms);
+        if(ret <= 0){
+            return 1;
+        }
+        done += ret;
+    }
+    return 0;
+}
+
+
+/**
+ * @brief Receive a DNS message (prefixed by its length) from a TCP
+ * connection
+ *
+ * @param sock - connected socket
+ * @param buffer - output
+ * @param len - size of the buffer, longer messages are truncated
+ * @param timeout_ms - max time to wait for the whole message (forever if
+ * negative)
+ *
+ * @return length of the message (in the buffer) or -1 if the connection was
+ * closed or broken or the message did not come in time
+ */
+int net_recv_message(int sock, void *buffer, int len, int timeout_ms){
+    uint64_t deadline = timeout_ms < 0 ? 0 : net_now_us() + (uint64_t)timeout_ms * 1000;
+
+    unsigned char prefix[2];
+    if(read_exactly(sock, prefix, 2, deadline)){
+        return -1;
+    }
+    int message_len = prefix[0] << 8 | prefix[1];
+    int kept_len = message_len < len ? message_len : len;
+    if(read_exactly(sock, buffer, kept_len, deadline)){
+        return -1;
+    }
+
+    // Skip the rest of a truncated message
+    unsigned char rest[512];
+    for(int skipped = kept_len; skipped < message_len; ){
+        int chunk = message_len - skipped < 512 ? message_len - skipped : 512;
+        if(read_exactly(sock, rest, chunk, deadline)){
+            return -1;
+        }
+        skipped += chunk;
+    }
+    return kept_len;
+}
+
+
+/*
+ *
+ * ADDRESSES
+ *
+ */
+
+
+/**
+ * @brief Get the host part of an address - IPv4 addresses mapped to IPv6 are
+ * treated as IPv4
+ *
+ * @param addr - sockaddr_in or sockaddr_in6
+ * @param host - output, pointer to the struct in_addr or struct in6_addr in
+ * addr
+ *
+ * @return AF_INET or AF_INET6
+ */
+int net_addr_host(const struct sockaddr *addr, const void **host){
+    if(addr->sa_family == AF_INET6){
+        const struct in6_addr *addr6 = &((const struct sockaddr_in6 *)addr)->sin6_addr;
+        if(!IN6_IS_ADDR_V4MAPPED(addr6)){
+            *host = addr6;
+            return AF_INET6;
+        }
+        *host = &addr6->s6_addr[12];
+        return AF_INET;
+    }
+    *host = &((const struct sockaddr_in *)addr)->sin_addr;
+    return AF_INET;
+}
+
+
+/**
+ * @brief Compare two addresses - IPv4 addresses mapped to IPv6 equal the
+ * IPv4 ones
+ *
+ * @param a - sockaddr_in or sockaddr_in6
+ * @param b - sockaddr_in or sockaddr_in6
+ *
+ * @return 1 if the hosts and the ports are the same, 0 if not
+ */
+int net_addr_equal(const struct sockaddr *a, const struct sockaddr *b){
+    const void *a_host = NULL, *b_host = NULL;
+    int family = net_addr_host(a, &a_host);
+    if(family != net_addr_host(b, &b_host)
+            || memcmp(a_host, b_host, family == AF_INET6 ? 16 : 4)){
+        return 0;
+    }
+    in_port_t a_port = a->sa_family == AF_INET6
+        ? ((const struct sockaddr_in6 *)a)->sin6_port : ((const struct sockaddr_in *)a)->sin_port;
+    in_port_t b_port = b->sa_family == AF_INET6
+        ? ((const struct sockaddr_in6 *)b)->sin6_port : ((const struct sockaddr_in *)b)->sin_port;
+    return a_port == b_port;
+}
+
+
+/**
+ * @brief Convert an IPv4 address to an IPv4-mapped IPv6 address, to be
+ * reached through a dual-stack socket. IPv6 addresses are kept
+ *
+ * @param addr - sockaddr_in or sockaddr_in6, replaced by sockaddr_in6
+ * @param addr_len - length of addr, replaced by the new length
+ */
+void net_addr_map_v6(struct sockaddr_storage *addr, socklen_t *addr_len){
+    if(addr->ss_family != AF_INET){
+        return;
+    }
+    struct sockaddr_in addr4 = *(struct sockaddr_in *)addr;
+    struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)addr;
+    memset(addr6, 0, sizeof(*addr6));
+    addr6->sin6_family = AF_INET6;
+    addr6->sin6_port = addr4.sin_port;
+    addr6->sin6_addr.s6_addr[10] = 0xFF;
+    addr6->sin6_addr.s6_addr[11] = 0xFF;
+    memcpy(&addr6->sin6_addr.s6_addr[12], &addr4.sin_addr, 4);
+    *addr_len = sizeof(*addr6);
+}
@@ -0,0 +1,274 @@
+/**
+ * @brief Socket I/O and time of the sender and the receiver, behind an
+ * interface which can be replaced (eg. by a simulated network)
+ * @file dns_net_io.h
+ * @author Patrik Skaloš
+ * @year 2022
+ */
+
+#ifndef DNS_NET_IO_H
+#define DNS_NET_IO_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+
+/**
+ * Implementation of the I/O. Every function gets ctx as the first argument
+ */
+struct net_io{
+    void *ctx;
+
+    // Open a UDP socket (dual-stack for AF_INET6), bound to the port if it
+    // is not 0. Returns the socket or -1
+    int (*socket)(void *ctx, int family, int port);
+
+    // Send a datagram. Returns number of bytes sent or -1
+    int (*send)(void *ctx, int sock, const void *data, int len, int flags,
+            const struct sockaddr *addr, socklen_t addr_len);
+
+    // Receive a datagram, waiting at most timeout_ms milliseconds (forever if
+    // negative). Returns its length or -1 if none came in time
+    int (*recv)(void *ctx, int sock, void *buffer, int len,
+            struct sockaddr *addr, socklen_t *addr_len, int timeout_ms);
+
+    void (*close)(void *ctx, int sock);
+
+    // Current time in microseconds (monotonic)
+    uint64_t (*now_us)(void *ctx);
+
+    // Open a TCP socket (dual-stack for AF_INET6) listening on the port.
+    // Returns the socket or -1
+    int (*listen)(void *ctx, int family, int port);
+
+    // Accept a connection of a listening socket. Returns the connected
+    // socket or -1
+    int (*accept)(void *ctx, int sock, struct sockaddr *addr, socklen_t *addr_len);
+
+    // Open a TCP connection. Returns the socket or -1
+    int (*connect)(void *ctx, const struct sockaddr *addr, socklen_t addr_len);
+
+    // Read at most len bytes of a stream, waiting at most timeout_ms
+    // milliseconds (forever if negative). Returns number of bytes read, 0 at
+    // the end of the stream or -1 on error or if nothing came in time
+    int (*read)(void *ctx, int sock, void *buffer, int len, int timeout_ms);
+
+    // Write all len bytes to a stream. Returns len or -1
+    int (*write)(void *ctx, int sock, const void *data, int len);
+
+    // Let reads of a socket busy-poll the device queue for up to budget_us
+    // microseconds before sleeping. Returns 0 or -1 (NULL if not supported)
+    int (*busy_poll)(void *ctx, int sock, int budget_us);
+
+    // Timestamp datagrams of a UDP socket in the kernel and pass the delays
+    // they measure to record. Returns 0 or -1 (NULL if not supported)
+    int (*timestamping)(void *ctx, int sock, void (*record)(int direction, uint64_t delay_ns));
+};
+
+
+/**
+ * Delays measured by kernel timestamps (see net_timestamping): NET_RX from
+ * when the kernel got a datagram until it was read, NET_TX from when a
+ * datagram was being sent until the kernel passed it to the device
+ */
+#define NET_RX 0
+#define NET_TX 1
+
+
+/**
+ * Maximum length of a DNS message over TCP (RFC 7766), which is prefixed by
+ * its length in two bytes
+ */
+#define NET_MAX_MESSAGE_LEN 65535
+
+
+/**
+ * I/O used by the program - real sockets and the monotonic clock by default
+ */
+extern struct net_io *NET_IO;
+
+
+/**
+ * @brief Open a UDP socket through NET_IO
+ *
+ * @param family - AF_INET or AF_INET6 (dual-stack, reaching also IPv4
+ * addresses mapped to IPv6)
+ * @param port - port to bind to or 0 to not bind
+ *
+ * @return socket or -1 on error
+ */
+int net_socket(int family, int port);
+
+
+/**
+ * @brief Send a datagram through NET_IO
+ *
+ * @param sock
+ * @param data
+ * @param len - length of data in bytes
+ * @param flags - as for sendto
+ * @param addr - destination address
+ * @param addr_len
+ *
+ * @return number of bytes sent or -1 on error
+ */
+int net_send(int sock, const void *data, int len, int flags, const struct sockaddr *addr, socklen_t addr_len);
+
+
+/**
+ * @brief Receive a datagram through NET_IO
+ *
+ * @param sock
+ * @param buffer - output
+ * @param len - size of the buffer
+ * @param addr - output, source address (or NULL)
+ * @param addr_len - size of addr, replaced by the length of the address
+ * @param timeout_ms - max time to wait (forever if negative)
+ *
+ * @return length of the datagram or -1 if none came in time
+ */
+int net_recv(int sock, void *buffer, int len, struct sockaddr *addr, socklen_t *addr_len, int timeout_ms);
+
+
+/**
+ * @brief Let reads of a socket busy-poll the network device for a while
+ * before they sleep (SO_BUSY_POLL) - saves the wakeup latency of blocking
+ * reads at the cost of CPU time
+ *
+ * @param sock
+ * @param budget_us - time to busy-poll in microseconds
+ *
+ * @return 0 on success, 1 if NET_IO or the kernel doesn't support it (or
+ * the budget is over net.core.busy_read without CAP_NET_ADMIN)
+ */
+int net_busy_poll(int sock, int budget_us);
+
+
+/**
+ * @brief Timestamp datagrams of a UDP socket in the kernel (SO_TIMESTAMPING,
+ * software timestamps) - the delays they measure are passed to a function
+ * as datagrams are received and sent. Only one socket of a program can be
+ * timestamped
+ *
+ * @param sock - opened by net_socket
+ * @param record - called with NET_RX or NET_TX and the delay in nanoseconds
+ *
+ * @return 0 on success, 1 if NET_IO or the kernel doesn't support it
+ */
+int net_timestamping(int sock, void (*record)(int direction, uint64_t delay_ns));
+
+
+/**
+ * @brief Close a socket opened by net_socket
+ *
+ * @param sock
+ */
+void net_close(int sock);
+
+
+/**
+ * @brief Get current time of NET_IO
+ *
+ * @return microseconds
+ */
+uint64_t net_now_us();
+
+
+/**
+ * @brief Open a TCP socket listening on a port through NET_IO
+ *
+ * @param family - AF_INET or AF_INET6 (dual-stack)
+ * @param port
+ *
+ * @return socket or -1 on error
+ */
+int net_listen(int family, int port);
+
+
+/**
+ * @brief Accept a connection through NET_IO
+ *
+ * @param sock - listening socket
+ * @param addr - output, address of the peer (or NULL)
+ * @param addr_len - size of addr, replaced by the length of the address
+ *
+ * @return connected socket or -1 on error
+ */
+int net_accept(int sock, struct sockaddr *addr, socklen_t *addr_len);
+
+
+/**
+ * @brief Open a TCP connection through NET_IO
+ *
+ * @param addr - address to connect to
+ * @param addr_len
+ *
+ * @return socket or -1 on error
+ */
+int net_connect(const struct sockaddr *addr, socklen_t addr_len);
+
+
+/**
+ * @brief Send a DNS message over a TCP connection, prefixed by its length
+ *
+ * @param sock - connected socket
+ * @param data - message
+ * @param len - length of the message in bytes, at most NET_MAX_MESSAGE_LEN
+ *
+ * @return len or -1 on error
+ */
+int net_send_message(int sock, const void *data, int len);
+
+
+/**
+ * @brief Receive a DNS message (prefixed by its length) from a TCP
+ * connection
+ *
+ * @param sock - connected socket
+ * @param buffer - output
+ * @param len - size of the buffer, longer messages are truncated
+ * @param timeout_ms - max time to wait for the whole message (forever if
+ * negative)
+ *
+ * @return length of the message (in the buffer) or -1 if the connection was
+ * closed or broken or the message did not come in time
+ */
+int net_recv_message(int sock, void *buffer, int len, int timeout_ms);
+
+
+/**
+ * @brief Get the host part of an address - IPv4 addresses mapped to IPv6 are
+ * treated as IPv4
+ *
+ * @param addr - sockaddr_in or sockaddr_in6
+ * @param host - output, pointer to the struct in_addr or struct in6_addr in
+ * addr
+ *
+ * @return AF_INET or AF_INET6
+ */
+int net_addr_host(const struct sockaddr *addr, const void **host);
+
+
+/**
+ * @brief Compare two addresses - IPv4 addresses mapped to IPv6 equal the
+ * IPv4 ones
+ *
+ * @param a - sockaddr_in or sockaddr_in6
+ * @param b - sockaddr_in or sockaddr_in6
+ *
+ * @return 1 if the hosts and the ports are the same, 0 if not
+ */
+int net_addr_equal(const struct sockaddr *a, const struct sockaddr *b);
+
+
+/**
+ * @brief Convert an IPv4 address to an IPv4-mapped IPv6 address, to be
+ * reached through a dual-stack socket. IPv6 addresses are kept
+ *
+ * @param addr - sockaddr_in or sockaddr_in6, replaced by sockaddr_in6
+ * @param addr_len - length of addr, replaced by the new length
+ */
+void net_addr_map_v6(struct sockaddr_storage *addr, socklen_t *addr_len);
+
+
+#endif //DNS_NET_IO_H
@@ -0,0 +1,542 @@
+/**
+ * @brief Building DNS queries carrying base64 data and parsing them back
+ * @file dns_packet.c
+ * @author Patrik Skaloš
+ * @year 2022
+ */
+
+
+// Standard libraries
+#include <string.h>
+#include <strings.h>
+
+// Networking libraries
+#include <arpa/inet.h>
+
+// Header files
+#include "dns_packet.h"
+
+
+/**
+ * @brief Write a label (length byte followed by the characters) to a question
+ *
+ * @param ptr - where to write the label
+ * @param label - characters of the label
+ * @param len - length of the label (1 to 63)
+ *
+ * @return pointer right after the written label
+ */
+static unsigned char *write_label(unsigned char *ptr, const char *label, int len){
+    *ptr = (unsigned char)len;
+    memcpy(ptr + 1, label, len);
+    return ptr + 1 + len;
+}
+
+
+/**
+ * @brief Prepare a packet template for a base host
+ *
+ * @param template - output
+ * @param base_host - domain of any number of labels (eg. "example.com")
+ *
+ * @return 0 on success, 1 if the base host contains an invalid label
+ */
+int packet_template_init(struct packet_template *template, const char *base_host){
+
+    template->header.xid = 0;
+    template->header.flags = htons(256); // 00000001 00000000b = 256: Standard query, desire recursion
+    template->header.qdcount = htons(1); // Number of questions
+    // Leave ancount (answers), nscount (authority RRs) and arcount (additional
+    // RRs) as 0
+    template->header.ancount = 0;
+    template->header.nscount = 0;
+    template->header.arcount = 0;
+
+    if(strlen(base_host) > PACKET_MAX_NAME_LEN - 1){
+        return 1;
+    }
+
+    // Base host labels, of any count
+    unsigned char *ptr = template->suffix;
+    const char *label = base_host;
+    while(*label){
+        const char *dot = strchr(label, '.');
+        int label_len = dot ? dot - label : strlen(label);
+        if(label_len < 1 || label_len > 63){
+            return 1;
+        }
+        ptr = write_label(ptr, label, label_len);
+        label += dot ? label_len + 1 : label_len;
+    }
+
+    // Terminate with zero byte
+    *ptr = (unsigned char)'\0';
+    ptr += 1;
+
+    // Set type and class of the DNS query
+    struct dns_question_info_t question_info;
+    question_info.type = htons(1); // Type is A - host address
+    question_info.class = htons(1); // Class is internet address
+    memcpy(ptr, &question_info, sizeof(question_info));
+    ptr += sizeof(question_info);
+
+    template->suffix_len = ptr - template->suffix;
+    return 0;
+}
+
+
+/**
+ * @brief Add a character to a hash of the end of a domain name - names are
+ * hashed from their last character, so the hashes of all ends of a name are
+ * got in one pass
+ *
+ * @param hash - of the characters after c
+ * @param c - the character (case insensitive)
+ *
+ * @return hash of c and the characters after it
+ */
+static uint32_t domain_hash_step(uint32_t hash, char c){
+    if(c >= 'A' && c <= 'Z'){
+        c += 'a' - 'A';
+    }
+    return (hash ^ (unsigned char)c) * 16777619u; // FNV-1a
+}
+
+
+/**
+ * @brief Split a list of base hosts separated by commas and prepare the hash
+ * table to find them by
+ *
+ * @param domains - output
+ * @param list - base hosts (eg. "example.com,example.org")
+ *
+ * @return 0 on success, 1 if the list is empty, contains an empty or too
+ * long base host or more than PACKET_MAX_DOMAINS of them
+ */
+int packet_domains_init(struct packet_domains *domains, const char *list){
+    domains->count = 0;
+    domains->max_len = 0;
+    memset(domains->slots, 0, sizeof(domains->slots));
+
+    const char *name = list;
+    while(1){
+        const char *comma = strchr(name, ',');
+        int len = comma ? comma - name : (int)strlen(name);
+        if(len < 1 || len > PACKET_MAX_NAME_LEN - 1 || domains->count == PACKET_MAX_DOMAINS){
+            return 1;
+        }
+
+        int i = domains->count++;
+        memcpy(domains->names[i], name, len);
+        domains->names[i][len] = '\0';
+        domains->lens[i] = len;
+        if(len > domains->max_len){
+            domains->max_len = len;
+        }
+        domains->hashes[i] = 2166136261u;
+        for(int j = len - 1; j >= 0; j--){
+            domains->hashes[i] = domain_hash_step(domains->hashes[i], name[j]);
+        }
+
+        // Open addressing, the table is never full
+        int slot = domains->hashes[i] % PACKET_DOMAIN_SLOTS;
+        while(domains->slots[slot]){
+            slot = (slot + 1) % PACKET_DOMAIN_SLOTS;
+        }
+        domains->slots[slot] = i + 1;
+
+        if(!comma){
+            return 0;
+        }
+        name = comma + 1;
+    }
+}
+
+
+/**
+ * @brief Find the base host a domain name ends with (preceded by '.') - the
+ * longest one if more do, case insensitively
+ *
+ * @param domains - prepared by packet_domains_init
+ * @param name - domain name in the dotted form
+ * @param len - its length
+ *
+ * @return index of the base host, -1 if the name ends with none
+ */
+int packet_domains_match(const struct packet_domains *domains, const char *name, int len){
+    int match = -1;
+    uint32_t hash = 2166136261u;
+
+    // Ends of the name following a dot, from the shortest one to the length
+    // of the longest base host
+    int first = len - domains->max_len > 1 ? len - domains->max_len : 1;
+    for(int start = len - 1; start >= first; start--){
+        hash = domain_hash_step(hash, name[start]);
+        if(name[start - 1] != '.'){
+            continue;
+        }
+        for(int slot = hash % PACKET_DOMAIN_SLOTS; domains->slots[slot]; slot = (slot + 1) % PACKET_DOMAIN_SLOTS){
+            int i = domains->slots[slot] - 1;
+            if(domains->hashes[i] == hash && domains->lens[i] == len - start
+                    && !strncasecmp(domains->names[i], name + start, len - start)){
+                match = i;
+                break;
+            }
+        }
+    }
+    return match;
+}
+
+
+/**
+ * @brief Construct a DNS query containing data. The data are written right
+ * from the source to labels of up to 63 characters and the rest of the
+ * question is copied from the template, so the buffer does not have to be
+ * cleared beforehand
+ *
+ * @param template - prepared by packet_template_init
+ * @param buffer - output, at least 512 bytes long
+ * @param xid - query ID (in host byte order)
+ * @param control - control label to put before the data (eg. FEC chunk
+ * identification) or NULL
+ * @param data - data to encapsulate in the packet. If null, datagram with
+ * question a.a.BASE_HOST will be created
+ * @param len - length of the data in bytes
+ *
+ * @return length of the packet in bytes
+ */
+int packet_build(const struct packet_template *template, unsigned char *buffer,
+        uint16_t xid, const char *control, const char *data, int len){
+
+    // Copy the DNS header, only the query ID differs between packets
+    struct dns_header_t *header = (struct dns_header_t *)buffer;
+    *header = template->header;
+    header->xid = htons(xid);
+
+    // Get pointer to question in the buffer (right after the header)
+    unsigned char *question_tmp_ptr = &buffer[sizeof(struct dns_header_t)];
+
+    if(data){
+        // If data is not NULL, put the control label and the data to labels
+        if(control){
+            question_tmp_ptr = write_label(question_tmp_ptr, control, strlen(control));
+        }
+        for(int i = 0; i < len; i += 63){
+            int label_len = len - i > 63 ? 63 : len - i;
+            question_tmp_ptr = write_label(question_tmp_ptr, data + i, label_len);
+        }
+
+    }else{
+        // Otherwise, put a.a.BASE_HOST to the question as an empty message
+        // which will signal end of communication
+        question_tmp_ptr = write_label(question_tmp_ptr, "a", 1);
+        question_tmp_ptr = write_label(question_tmp_ptr, "a", 1);
+    }
+
+    // Base host, terminating zero byte, type and class of the question
+    memcpy(question_tmp_ptr, template->suffix, template->suffix_len);
+    question_tmp_ptr += template->suffix_len;
+
+    return question_tmp_ptr - buffer;
+}
+
+
+/**
+ * @brief Extract b64 payload from a received query
+ *
+ * @param buffer - packet
+ * @param buffer_len - packet length in bytes
+ * @param domains - base hosts expected in the question
+ * @param domain - output, index of the base host of the question (or NULL)
+ * @param url - output, the question in the dotted form, at least 512 bytes
+ * long
+ * @param payload_b64 - output, labels preceding the base host without dots
+ * (empty for the fin question a.a.BASE_HOST), at least 256 bytes long
+ * @param control - output, control label (first label if it contains '-',
+ * which is not a base64 character) or empty, at least 64 bytes long
+ * @param query_id - pointer where to save xid from the header (in network
+ * byte order)
+ *
+ * @return 0 if the packet carries a question with one of the base hosts, 1
+ * if it should be ignored
+ */
+int packet_parse_query(const unsigned char *buffer, int buffer_len,
+        const struct packet_domains *domains, int *domain, char *url,
+        char *payload_b64, char *control, int *query_id){
+
+    payload_b64[0] = '\0';
+    control[0] = '\0';
+    if(buffer_len < (int)sizeof(struct dns_header_t) + 1){
+        return 1;
+    }
+
+    *query_id = ((struct dns_header_t *)buffer)->xid;
+
+    // Skip the header to get to the question
+    const unsigned char *query_tmp_ptr = &buffer[sizeof(struct dns_header_t)];
+    const unsigned char *buffer_end = buffer + buffer_len;
+
+    // Get the question URL - labels joined by '.' (the packet is at most 512
+    // bytes long, so is the URL)
+    int url_len = 0;
+    while(1){
+
+        // Get label length: first byte
+        uint8_t label_len = *query_tmp_ptr;
+        query_tmp_ptr += 1;
+
+        // If label length is zero, this is end of labels
+        if(label_len == 0){
+            break;
+        }
+
+        // Labels must not reach out of the packet (or be compressed) and the
+        // name must not be longer than 255 bytes (a message over TCP may be
+        // longer than the URL buffer)
+        if(label_len > 63 || query_tmp_ptr + label_len >= buffer_end
+                || url_len + label_len + 1 > PACKET_MAX_NAME_LEN){
+            return 1;
+        }
+
+        // Otherwise, write the label to 'url'
+        memcpy(url + url_len, query_tmp_ptr, label_len);
+        query_tmp_ptr += label_len;
+        url_len += label_len;
+        url[url_len++] = '.';
+    }
+    if(!url_len){
+        return 1;
+    }
+    url[--url_len] = '\0'; // Remove the trailing '.'
+
+    // Check the domain - url has to end with one of the base hosts preceded
+    // by '.' (base hosts may have any number of labels)
+    int matched = packet_domains_match(domains, url, url_len);
+    if(matched < 0){
+        // If the domain is not what the user set up, ignore this packet
+        return 1;
+    }
+    if(domain){
+        *domain = matched;
+    }
+    int payload_url_len = url_len - domains->lens[matched] - 1;
+
+    // If the url equals url of a fin question (a.a.BASE_HOST), return with
+    // payload being empty
+    if(payload_url_len == 3 && !memcmp(url, "a.a", 3)){
+        return 0;
+    }
+
+    // Move the control label (if there is one) to 'control' and skip it
+    const char *first_dot = memchr(url, '.', payload_url_len + 1);
+    int first_len = first_dot - url;
+    int payload_start = 0;
+    if(memchr(url, '-', first_len)){
+        memcpy(control, url, first_len);
+        control[first_len] = '\0';
+        payload_start = first_len + 1;
+    }
+
+    // Get the real payload - labels preceding the base host, without '.'
+    int payload_len = 0;
+    for(int i = payload_start; i < payload_url_len; i++){
+        if(url[i] != '.'){
+            payload_b64[payload_len++] = url[i];
+        }
+    }
+    payload_b64[payload_len] = '\0';
+
+    return 0;
+}
+
+
+/**
+ * @brief Find the end of the question of a DNS message
+ *
+ * @param buffer - message
+ * @param buffer_len - message length in bytes
+ *
+ * @return offset of the first byte after the question, -1 if the message
+ * has no valid question
+ */
+static int question_end(const unsigned char *buffer, int buffer_len){
+    if(buffer_len < (int)sizeof(struct dns_header_t)
+            || ntohs(((struct dns_header_t *)buffer)->qdcount) != 1){
+        return -1;
+    }
+    int offset = sizeof(struct dns_header_t);
+    while(offset < buffer_len && buffer[offset]){
+        if(buffer[offset] > 63){
+            return -1;
+        }
+        offset += 1 + buffer[offset];
+    }
+    offset += 1 + sizeof(struct dns_question_info_t);
+    return offset <= buffer_len ? offset : -1;
+}
+
+
+/**
+ * @brief Replace the records of a response by one answer of type A to its
+ * question (the name of the answer points to the question)
+ *
+ * @param buffer - response, at least 512 bytes long
+ * @param buffer_len - response length in bytes
+ * @param rdata - address of the answer (4 bytes)
+ *
+ * @return new length of the response, buffer_len if the response has no
+ * valid question
+ */
+int packet_add_answer(unsigned char *buffer, int buffer_len, const unsigned char *rdata){
+    int offset = question_end(buffer, buffer_len);
+    if(offset < 0 || offset + 16 > 512){
+        return buffer_len;
+    }
+
+    // Records of the query (eg. EDNS option of a resolver) are dropped
+    struct dns_header_t *header = (struct dns_header_t *)buffer;
+    header->ancount = htons(1);
+    header->nscount = 0;
+    header->arcount = 0;
+
+    unsigned char *ptr = buffer + offset;
+    *ptr++ = 0xC0; // Pointer to the name of the question
+    *ptr++ = sizeof(struct dns_header_t);
+    uint16_t fields[] = {htons(1), htons(1), 0, 0, htons(4)}; // Type A, class IN, TTL 0, length
+    memcpy(ptr, fields, sizeof(fields));
+    ptr += sizeof(fields);
+    memcpy(ptr, rdata, 4);
+    return offset + 16;
+}
+
+
+/**
+ * @brief Get the address of the first answer of a response, if it is of
+ * type A
+ *
+ * @param buffer - response
+ * @param buffer_len - response length in bytes
+ * @param rdata - output, address of the answer (4 bytes)
+ *
+ * @return 0 if the response has an answer of type A, 1 if not
+ */
+int packet_parse_answer(const unsigned char *buffer, int buffer_len, unsigned char *rdata){
+    int offset = question_end(buffer, buffer_len);
+    if(offset < 0 || !((struct dns_header_t *)buffer)->ancount){
+        return 1;
+    }
+
+    // Skip the name of the answer - a pointer or labels
+    if(offset < buffer_len && (buffer[offset] & 0xC0) == 0xC0){
+        offset += 2;
+    }else{
+        while(offset < buffer_len && buffer[offset]){
+            offset += 1 + buffer[offset];
+        }
+        offset += 1;
+    }
+
+    if(offset + 14 > buffer_len){
+        return 1;
+    }
+    uint16_t type, rdlength;
+    memcpy(&type, buffer + offset, 2);
+    memcpy(&rdlength, buffer + offset + 8, 2);
+    if(ntohs(type) != 1 || ntohs(rdlength) != 4){
+        return 1;
+    }
+    memcpy(rdata, buffer + offset + 10, 4);
+    return 0;
+}
+
+
+/**
+ * @brief Replace the records of a response by one answer of type TXT to its
+ * question, carrying binary data split to strings of up to 255 bytes
+ *
+ * @param buffer - response, at least 512 bytes long
+ * @param buffer_len - response length in bytes
+ * @param data - data of the answer
+ * @param data_len - length of data in bytes
+ *
+ * @return new length of the response, buffer_len if the response has no
+ * valid question or the answer doesn't fit to 512 bytes
+ */
+int packet_add_txt_answer(unsigned char *buffer, int buffer_len, const unsigned char *data, int data_len){
+    int offset = question_end(buffer, buffer_len);
+    int rdlength = data_len + (data_len + 254) / 255;
+    if(offset < 0 || data_len < 1 || offset + 12 + rdlength > 512){
+        return buffer_len;
+    }
+
+    struct dns_header_t *header = (struct dns_header_t *)buffer;
+    header->ancount = htons(1);
+    header->nscount = 0;
+    header->arcount = 0;
+
+    unsigned char *ptr = buffer + offset;
+    *ptr++ = 0xC0;
+    *ptr++ = sizeof(struct dns_header_t);
+    uint16_t fields[] = {htons(16), htons(1), 0, 0, htons(rdlength)}; // Type TXT, class IN, TTL 0, length
+    memcpy(ptr, fields, sizeof(fields));
+    ptr += sizeof(fields);
+    for(int i = 0; i < data_len; i += 255){
+        int len = data_len - i < 255 ? data_len - i : 255;
+        *ptr++ = len;
+        memcpy(ptr, data + i, len);
+        ptr += len;
+    }
+    return offset + 12 + rdlength;
+}
+
+
+/**
+ * @brief Get the data of the first answer of a response, if it is of type
+ * TXT (its strings joined)
+ *
+ * @param buffer - response
+ * @param buffer_len - response length in bytes
+ * @param data - output, at least 512 bytes long
+ *
+ * @return length of the data, -1 if the response has no answer of type TXT
+ */
+int packet_parse_txt_answer(const unsigned char *buffer, int buffer_len, unsigned char *data){
+    int offset = question_end(buffer, buffer_len);
+    if(offset < 0 || !((struct dns_header_t *)buffer)->ancount){
+        return -1;
+    }
+
+    // Skip the name of the answer - a pointer or labels
+    if(offset < buffer_len && (buffer[offset] & 0xC0) == 0xC0){
+        offset += 2;
+    }else{
+        while(offset < buffer_len && buffer[offset]){
+            offset += 1 + buffer[offset];
+        }
+        offset += 1;
+    }
+
+    if(offset + 10 > buffer_len){
+        return -1;
+    }
+    uint16_t type, rdlength;
+    memcpy(&type, buffer + offset, 2);
+    memcpy(&rdlength, buffer + offset + 8, 2);
+    offset += 10;
+    int end = offset + ntohs(rdlength);
+    if(ntohs(type) != 16 || end > buffer_len){
+        return -1;
+    }
+
+    int data_len = 0;
+    while(offset < end){
+        int len = buffer[offset++];
+        if(offset + len > end){
+            return -1;
+        }
+        memcpy(data + data_len, buffer + offset, len);
+        data_len += len;
+        offset += len;
+    }
+    return data_len;
+}
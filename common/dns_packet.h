@@ -0,0 +1,238 @@
+/**
+ * @brief Building DNS queries carrying base64 data and parsing them back
+ * @file dns_packet.h
+ * @author Patrik Skaloš
+ * @year 2022
+ */
+
+#ifndef DNS_PACKET_H
+#define DNS_PACKET_H
+
+#include <stdint.h>
+
+
+/**
+ * Maximum length of a domain name in the dotted form
+ */
+#define PACKET_MAX_NAME_LEN 255
+
+
+/**
+ * Base hosts can be given as a list separated by commas (eg.
+ * "example.com,example.org") - queries of one transfer are spread over all
+ * of them, so that no zone gets all of them. The hosts of a list are found
+ * by hashes of the ends of questions in a table of PACKET_DOMAIN_SLOTS slots
+ */
+#define PACKET_MAX_DOMAINS 16
+#define PACKET_DOMAIN_SLOTS 64
+
+
+/**
+ * Version of the protocol and capabilities, negotiated by the first query of
+ * a communication. The first query has no control label, its data are the
+ * destination path, a zero byte and the handshake of HANDSHAKE_LEN bytes:
+ * VERSION, CAPABILITIES, WINDOW (chunks sent without waiting for
+ * confirmations) and the size of the file (8 bytes, big-endian). Old
+ * receivers take the data for a string, so they only read the path. The
+ * receiver answers with an address of type A of bytes VERSION, CAPABILITIES
+ * (those supported by both), WINDOW and CHUNK_LEN (max base64 characters in a
+ * query). An old receiver only echoes the query and understands data chunks
+ * without control labels
+ */
+#define PROTOCOL_VERSION 1
+#define HANDSHAKE_LEN 11
+#define CAP_INDEX 0x01 // Data chunks with an index "i-INDEX"
+#define CAP_FEC 0x02 // Data and parity chunks "f-G-I-N-C-L"
+#define CAP_OFFSET 0x04 // Pipelined chunks "o-OFFSET"
+#define CAP_DELTA 0x08 // Delta of the existing file (see dns_delta.h)
+#define CAP_DEDUP 0x10 // Blocks the receiver has stored (see dns_delta.h)
+
+
+/**
+ * DNS header structure
+ * https://opensource.apple.com/source/netinfo/netinfo-208/common/dns.h.auto.html
+ */
+struct dns_header_t{
+    uint16_t xid;
+    uint16_t flags;
+    uint16_t qdcount;
+    uint16_t ancount;
+    uint16_t nscount;
+    uint16_t arcount;
+};
+
+
+/**
+ * DNS question structure
+ * https://opensource.apple.com/source/netinfo/netinfo-208/common/dns.h.auto.html
+ */
+struct dns_question_info_t{
+    uint16_t type;
+    uint16_t class;
+};
+
+
+/**
+ * Parts of queries which are the same for all packets: the DNS header
+ * (except for the query ID) and the end of the question - base host in the
+ * wire format, terminating zero byte, type and class of the question
+ */
+struct packet_template{
+    struct dns_header_t header;
+    unsigned char suffix[PACKET_MAX_NAME_LEN + 1 + sizeof(struct dns_question_info_t)];
+    int suffix_len;
+};
+
+
+/**
+ * Base hosts of a list and the hash table to find them by
+ */
+struct packet_domains{
+    int count;
+    char names[PACKET_MAX_DOMAINS][PACKET_MAX_NAME_LEN + 1];
+    int lens[PACKET_MAX_DOMAINS];
+    int max_len; // Of the longest base host
+    uint32_t hashes[PACKET_MAX_DOMAINS];
+    int8_t slots[PACKET_DOMAIN_SLOTS]; // Index of a base host + 1, 0 if empty
+};
+
+
+/**
+ * @brief Split a list of base hosts separated by commas and prepare the hash
+ * table to find them by
+ *
+ * @param domains - output
+ * @param list - base hosts (eg. "example.com,example.org")
+ *
+ * @return 0 on success, 1 if the list is empty, contains an empty or too
+ * long base host or more than PACKET_MAX_DOMAINS of them
+ */
+int packet_domains_init(struct packet_domains *domains, const char *list);
+
+
+/**
+ * @brief Find the base host a domain name ends with (preceded by '.') - the
+ * longest one if more do, case insensitively
+ *
+ * @param domains - prepared by packet_domains_init
+ * @param name - domain name in the dotted form
+ * @param len - its length
+ *
+ * @return index of the base host, -1 if the name ends with none
+ */
+int packet_domains_match(const struct packet_domains *domains, const char *name, int len);
+
+
+/**
+ * @brief Prepare a packet template for a base host
+ *
+ * @param template - output
+ * @param base_host - domain of any number of labels (eg. "example.com")
+ *
+ * @return 0 on success, 1 if the base host contains an invalid label
+ */
+int packet_template_init(struct packet_template *template, const char *base_host);
+
+
+/**
+ * @brief Construct a DNS query containing data. The data are written right
+ * from the source to labels of up to 63 characters and the rest of the
+ * question is copied from the template, so the buffer does not have to be
+ * cleared beforehand
+ *
+ * @param template - prepared by packet_template_init
+ * @param buffer - output, at least 512 bytes long
+ * @param xid - query ID (in host byte order)
+ * @param control - control label to put before the data (eg. FEC chunk
+ * identification) or NULL
+ * @param data - data to encapsulate in the packet. If null, datagram with
+ * question a.a.BASE_HOST will be created
+ * @param len - length of the data in bytes
+ *
+ * @return length of the packet in bytes
+ */
+int packet_build(const struct packet_template *template, unsigned char *buffer,
+        uint16_t xid, const char *control, const char *data, int len);
+
+
+/**
+ * @brief Extract b64 payload from a received query
+ *
+ * @param buffer - packet
+ * @param buffer_len - packet length in bytes
+ * @param domains - base hosts expected in the question
+ * @param domain - output, index of the base host of the question (or NULL)
+ * @param url - output, the question in the dotted form, at least 512 bytes
+ * long
+ * @param payload_b64 - output, labels preceding the base host without dots
+ * (empty for the fin question a.a.BASE_HOST), at least 256 bytes long
+ * @param control - output, control label (first label if it contains '-',
+ * which is not a base64 character) or empty, at least 64 bytes long
+ * @param query_id - pointer where to save xid from the header (in network
+ * byte order)
+ *
+ * @return 0 if the packet carries a question with one of the base hosts, 1
+ * if it should be ignored
+ */
+int packet_parse_query(const unsigned char *buffer, int buffer_len,
+        const struct packet_domains *domains, int *domain, char *url,
+        char *payload_b64, char *control, int *query_id);
+
+
+
+/**
+ * @brief Replace the records of a response by one answer of type A to its
+ * question (the name of the answer points to the question)
+ *
+ * @param buffer - response, at least 512 bytes long
+ * @param buffer_len - response length in bytes
+ * @param rdata - address of the answer (4 bytes)
+ *
+ * @return new length of the response, buffer_len if the response has no
+ * valid question
+ */
+int packet_add_answer(unsigned char *buffer, int buffer_len, const unsigned char *rdata);
+
+
+/**
+ * @brief Get the address of the first answer of a response, if it is of
+ * type A
+ *
+ * @param buffer - response
+ * @param buffer_len - response length in bytes
+ * @param rdata - output, address of the answer (4 bytes)
+ *
+ * @return 0 if the response has an answer of type A, 1 if not
+ */
+int packet_parse_answer(const unsigned char *buffer, int buffer_len, unsigned char *rdata);
+
+
+/**
+ * @brief Replace the records of a response by one answer of type TXT to its
+ * question, carrying binary data split to strings of up to 255 bytes
+ *
+ * @param buffer - response, at least 512 bytes long
+ * @param buffer_len - response length in bytes
+ * @param data - data of the answer
+ * @param data_len - length of data in bytes
+ *
+ * @return new length of the response, buffer_len if the response has no
+ * valid question or the answer doesn't fit to 512 bytes
+ */
+int packet_add_txt_answer(unsigned char *buffer, int buffer_len, const unsigned char *data, int data_len);
+
+
+/**
+ * @brief Get the data of the first answer of a response, if it is of type
+ * TXT (its strings joined)
+ *
+ * @param buffer - response
+ * @param buffer_len - response length in bytes
+ * @param data - output, at least 512 bytes long
+ *
+ * @return length of the data, -1 if the response has no answer of type TXT
+ */
+int packet_parse_txt_answer(const unsigned char *buffer, int buffer_len, unsigned char *data);
+
+
+#endif //DNS_PACKET_H
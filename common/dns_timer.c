@@ -0,0 +1,253 @@
+/**
+ * @brief Hierarchical timing wheel shared by the sender and the receiver -
+ * timers are armed, cancelled and expired in constant time, however many of
+ * them are armed
+ * @file dns_timer.c
+ * @author Patrik Skaloš
+ * @year 2022
+ */
+
+
+// Standard libraries
+#include <stddef.h>
+
+// Header files
+#include "dns_timer.h"
+
+
+// Index of the list of expired timers
+#define TIMER_EXPIRED (TIMER_LEVELS * TIMER_SLOTS)
+
+
+/**
+ * @brief Add a timer to a list of the wheel
+ *
+ * @param wheel
+ * @param timer
+ * @param slot - index of the list
+ */
+static void timer_link(struct timer_wheel *wheel, struct timer *timer, int slot){
+    struct timer *head = &wheel->slots[slot];
+    timer->next = head->next;
+    timer->prev = head;
+    head->next->prev = timer;
+    head->next = timer;
+    timer->slot = slot;
+    if(slot != TIMER_EXPIRED){
+        wheel->occupied[slot / TIMER_SLOTS] |= 1ULL << (slot % TIMER_SLOTS);
+    }
+}
+
+
+/**
+ * @brief Remove a timer from its list
+ *
+ * @param wheel
+ * @param timer - armed
+ */
+static void timer_unlink(struct timer_wheel *wheel, struct timer *timer){
+    struct timer *head = &wheel->slots[timer->slot];
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    if(head->next == head && timer->slot != TIMER_EXPIRED){
+        wheel->occupied[timer->slot / TIMER_SLOTS] &= ~(1ULL << (timer->slot % TIMER_SLOTS));
+    }
+    timer->slot = -1;
+}
+
+
+/**
+ * @brief Put a timer to the slot of its expiry - on the level of the highest
+ * group of TIMER_BITS bits in which the tick differs from the current one
+ * (the first level if it expired already)
+ *
+ * @param wheel
+ * @param timer - not linked
+ */
+static void timer_place(struct timer_wheel *wheel, struct timer *timer){
+    uint64_t expires = timer->expires > wheel->now ? timer->expires : wheel->now;
+    uint64_t last = wheel->now | ((1ULL << (TIMER_BITS * TIMER_LEVELS)) - 1);
+    if(expires > last){
+        expires = last;
+    }
+
+    int level = 0;
+    while(level < TIMER_LEVELS - 1 && (expires ^ wheel->now) >> (TIMER_BITS * (level + 1))){
+        level += 1;
+    }
+    int slot = (expires >> (TIMER_BITS * level)) % TIMER_SLOTS;
+    timer_link(wheel, timer, level * TIMER_SLOTS + slot);
+}
+
+
+/**
+ * @brief Get the first tick the wheel has to get to - when the timers of the
+ * first occupied slot of the lowest occupied level expire (on the first
+ * level) or are moved down (on higher levels)
+ *
+ * @param wheel
+ *
+ * @return the tick, TIMER_NEVER if no timer is armed
+ */
+static uint64_t timer_next_tick(struct timer_wheel *wheel){
+    for(int level = 0; level < TIMER_LEVELS; level++){
+        int shift = TIMER_BITS * level;
+        int current = (wheel->now >> shift) % TIMER_SLOTS;
+
+        // Slots of higher levels at the current tick were moved down already
+        int first = level ? current + 1 : current;
+        uint64_t occupied = first < TIMER_SLOTS ? wheel->occupied[level] & (~0ULL << first) : 0;
+        if(occupied){
+            uint64_t window = (wheel->now >> shift) - current;
+            return (window + __builtin_ctzll(occupied)) << shift;
+        }
+    }
+    return TIMER_NEVER;
+}
+
+
+/**
+ * @brief Move the wheel to a tick - collect timers of the ticks it gets to
+ * to the list of expired timers and move the timers of the slots of higher
+ * levels it gets to down. Only the ticks with something to do are visited
+ *
+ * @param wheel
+ * @param target - the tick
+ */
+static void timer_advance(struct timer_wheel *wheel, uint64_t target){
+    for(;;){
+        struct timer *head = &wheel->slots[wheel->now % TIMER_SLOTS];
+        while(head->next != head){
+            struct timer *timer = head->next;
+            timer_unlink(wheel, timer);
+            timer_link(wheel, timer, TIMER_EXPIRED);
+        }
+        if(wheel->now >= target){
+            return;
+        }
+
+        uint64_t previous = wheel->now;
+        uint64_t next = timer_next_tick(wheel);
+        wheel->now = next < target ? next : target;
+
+        // Timers of higher levels are moved down from the highest level,
+        // none of them can get to a slot which should be moved down too
+        for(int level = TIMER_LEVELS - 1; level > 0; level--){
+            int shift = TIMER_BITS * level;
+            if(previous >> shift == wheel->now >> shift){
+                continue;
+            }
+            head = &wheel->slots[level * TIMER_SLOTS + (wheel->now >> shift) % TIMER_SLOTS];
+            while(head->next != head){
+                struct timer *timer = head->next;
+                timer_unlink(wheel, timer);
+                timer_place(wheel, timer);
+            }
+        }
+    }
+}
+
+
+/**
+ * @brief Initialize a wheel without timers
+ *
+ * @param wheel
+ * @param tick_us - length of a tick, timers expire up to a tick late
+ * @param now_us - current time
+ */
+void timer_wheel_init(struct timer_wheel *wheel, uint64_t tick_us, uint64_t now_us){
+    wheel->tick_us = tick_us;
+    wheel->start_us = now_us;
+    wheel->now = 0;
+    for(int level = 0; level < TIMER_LEVELS; level++){
+        wheel->occupied[level] = 0;
+    }
+    for(int i = 0; i <= TIMER_EXPIRED; i++){
+        wheel->slots[i].next = &wheel->slots[i];
+        wheel->slots[i].prev = &wheel->slots[i];
+        wheel->slots[i].slot = -1;
+    }
+}
+
+
+/**
+ * @brief Initialize a timer which is not armed
+ *
+ * @param timer
+ * @param arg - owner of the timer
+ */
+void timer_init(struct timer *timer, void *arg){
+    timer->next = NULL;
+    timer->prev = NULL;
+    timer->expires = 0;
+    timer->slot = -1;
+    timer->arg = arg;
+}
+
+
+/**
+ * @brief Arm a timer (again, if it is armed already)
+ *
+ * @param wheel
+ * @param timer
+ * @param deadline_us - when it expires
+ */
+void timer_arm(struct timer_wheel *wheel, struct timer *timer, uint64_t deadline_us){
+    if(timer->slot >= 0){
+        timer_unlink(wheel, timer);
+    }
+    timer->expires = deadline_us > wheel->start_us
+        ? (deadline_us - wheel->start_us + wheel->tick_us - 1) / wheel->tick_us : 0;
+    timer_place(wheel, timer);
+}
+
+
+/**
+ * @brief Cancel a timer (nothing happens if it is not armed)
+ *
+ * @param wheel
+ * @param timer
+ */
+void timer_cancel(struct timer_wheel *wheel, struct timer *timer){
+    if(timer->slot >= 0){
+        timer_unlink(wheel, timer);
+    }
+}
+
+
+/**
+ * @brief Take the next timer which expired - call until it returns NULL
+ *
+ * @param wheel
+ * @param now_us - current time
+ *
+ * @return the timer, no longer armed, NULL if no other timer expired
+ */
+struct timer *timer_expire(struct timer_wheel *wheel, uint64_t now_us){
+    struct timer *expired = &wheel->slots[TIMER_EXPIRED];
+    if(expired->next == expired && now_us >= wheel->start_us){
+        timer_advance(wheel, (now_us - wheel->start_us) / wheel->tick_us);
+    }
+    if(expired->next == expired){
+        return NULL;
+    }
+    struct timer *timer = expired->next;
+    timer_unlink(wheel, timer);
+    return timer;
+}
+
+
+/**
+ * @brief Get the time when the wheel should be checked for expired timers -
+ * never after the first timer expires, but possibly before it (when timers
+ * of a higher level are to be moved down)
+ *
+ * @param wheel
+ *
+ * @return the time, TIMER_NEVER if no timer is armed
+ */
+uint64_t timer_next_us(struct timer_wheel *wheel){
+    struct timer *expired = &wheel->slots[TIMER_EXPIRED];
+    uint64_t tick = expired->next != expired ? wheel->now : timer_next_tick(wheel);
+    return tick == TIMER_NEVER ? TIMER_NEVER : wheel->start_us + tick * wheel->tick_us;
+}
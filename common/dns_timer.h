@@ -0,0 +1,117 @@
+/**
+ * @brief Hierarchical timing wheel shared by the sender and the receiver -
+ * timers are armed, cancelled and expired in constant time, however many of
+ * them are armed
+ * @file dns_timer.h
+ * @author Patrik Skaloš
+ * @year 2022
+ */
+
+#ifndef DNS_TIMER_H
+#define DNS_TIMER_H
+
+#include <stdint.h>
+
+
+/**
+ * Time is counted in ticks of the wheel. A timer which expires within the
+ * current TIMER_SLOTS ticks is in a slot of the first level (one slot per
+ * tick), a later one in a slot of a higher level, every level covering
+ * TIMER_SLOTS times longer time than the one below. When the wheel gets to a
+ * slot of a higher level, its timers are moved down to the levels below.
+ * Timers later than the last level covers expire early, at its end (2^36
+ * ticks after the wheel was initialized at the earliest)
+ */
+#define TIMER_BITS 6
+#define TIMER_SLOTS (1 << TIMER_BITS)
+#define TIMER_LEVELS 6
+#define TIMER_NEVER UINT64_MAX
+
+
+/**
+ * Timer - embedded in whatever it times, linked to a slot of the wheel while
+ * it is armed
+ */
+struct timer{
+    struct timer *next;
+    struct timer *prev;
+    uint64_t expires; // Tick
+    int slot; // Index to the slots of the wheel, -1 if not armed
+    void *arg; // Owner of the timer
+};
+
+
+/**
+ * Timing wheel
+ */
+struct timer_wheel{
+    uint64_t tick_us;
+    uint64_t start_us; // Time of the tick 0
+    uint64_t now; // Current tick
+    uint64_t occupied[TIMER_LEVELS]; // Bitmaps of the slots with timers
+    struct timer slots[TIMER_LEVELS * TIMER_SLOTS + 1]; // Heads of lists of timers, the last one of expired timers
+};
+
+
+/**
+ * @brief Initialize a wheel without timers
+ *
+ * @param wheel
+ * @param tick_us - length of a tick, timers expire up to a tick late
+ * @param now_us - current time
+ */
+void timer_wheel_init(struct timer_wheel *wheel, uint64_t tick_us, uint64_t now_us);
+
+
+/**
+ * @brief Initialize a timer which is not armed
+ *
+ * @param timer
+ * @param arg - owner of the timer
+ */
+void timer_init(struct timer *timer, void *arg);
+
+
+/**
+ * @brief Arm a timer (again, if it is armed already)
+ *
+ * @param wheel
+ * @param timer
+ * @param deadline_us - when it expires
+ */
+void timer_arm(struct timer_wheel *wheel, struct timer *timer, uint64_t deadline_us);
+
+
+/**
+ * @brief Cancel a timer (nothing happens if it is not armed)
+ *
+ * @param wheel
+ * @param timer
+ */
+void timer_cancel(struct timer_wheel *wheel, struct timer *timer);
+
+
+/**
+ * @brief Take the next timer which expired - call until it returns NULL
+ *
+ * @param wheel
+ * @param now_us - current time
+ *
+ * @return the timer, no longer armed, NULL if no other timer expired
+ */
+struct timer *timer_expire(struct timer_wheel *wheel, uint64_t now_us);
+
+
+/**
+ * @brief Get the time when the wheel should be checked for expired timers -
+ * never after the first timer expires, but possibly before it (when timers
+ * of a higher level are to be moved down)
+ *
+ * @param wheel
+ *
+ * @return the time, TIMER_NEVER if no timer is armed
+ */
+uint64_t timer_next_us(struct timer_wheel *wheel);
+
+
+#endif //DNS_TIMER_H
@@ -5,12 +5,19 @@
  * @year 2022
  */
 
+#define _GNU_SOURCE // sched_setaffinity
+
 
 // Standard libraries
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sched.h>
 #include <sys/stat.h>
 
 // Networking libraries
@@ -21,7 +28,21 @@
 
 // Header files
 #include "dns_receiver.h"
+#include "dns_receiver_arena.h"
+#include "dns_receiver_cache.h"
+#include "dns_receiver_delta.h"
 #include "dns_receiver_events.h"
+#include "dns_receiver_fec.h"
+#include "dns_receiver_store.h"
+#include "dns_receiver_tcp.h"
+#include "dns_receiver_writer.h"
+#include "../common/dns_base64.h"
+#include "../common/dns_capture.h"
+#include "../common/dns_delta.h"
+#include "../common/dns_metrics.h"
+#include "../common/dns_net_io.h"
+#include "../common/dns_packet.h"
+#include "../common/dns_timer.h"
 
 
 /*
@@ -31,86 +52,55 @@
  */
 
 
-char *BASE_HOST = NULL;
+int PORT = 53; // Port to listen on
+
+char *BASE_HOST = NULL; // One or more base hosts separated by commas
+struct packet_domains DOMAINS; // The base hosts, to find them in questions
 char *DST_FILEPATH = NULL; // Folder where to save files
+int DEDUP = 0; // 1 to keep a store of received blocks (see dns_receiver_store.h)
+int IDLE_TIMEOUT_MS = SESSION_IDLE_TIMEOUT_MS; // 0 if communications are never closed for idleness
+int KEEP_PARTIAL = 0; // 1 to keep files of closed communications which did not end
+int BUSY_POLL_US = 0; // Time to keep checking the socket before waiting for it (0 to just wait)
+int PINNED_CPU = -1; // CPU the main loop runs on (-1 for any)
+char *CAPTURE_PATH = NULL; // Where to capture received UDP queries (NULL not to)
+struct capture CAPTURE;
+
+// Memory of the open communication (DST_PATH and DATA_B64), released at once
+struct arena *SESSION_ARENA = NULL;
 
 char *DST_PATH = NULL; // Real path where to save the next file
-char *DATA_B64 = NULL;
-int DATA_B64_SIZE = 0;
+char *FIRST_PAYLOAD_B64 = NULL; // Of the first packet, to recognize it when it is repeated
+char *DELTA_PATH = NULL; // Where to save the delta of DST_PATH (NULL if the whole file is sent)
+char *DATA_B64 = NULL; // Received data not passed to the writer yet
 int DATA_B64_LEN = 0;
+int64_t DATA_B64_WRITTEN = 0; // Base64 characters decoded and passed to the writer
+uint64_t CHUNK_INDEX = 0; // Index of the next chunk (see handle_indexed_payload)
 
+// Capabilities of the open communication (see PROTOCOL_VERSION) - all if the
+// sender did not negotiate them
+int SESSION_NEGOTIATED = 0;
+unsigned char SESSION_CAPABILITIES[4]; // Version, capabilities, window, chunk length
 
-/*
- *
- * MISCELLANEOUS
- *
- */
-
-
-/**
- * @brief Variables and functions for decoding a string from base64
- *
- * @param data to decode
- * @param input_length in characters
- * @param output_length - pointer where the output length in chars will be
- * written
- *
- * @return allocated string containing the output
- *
- * Taken and modified from: https://stackoverflow.com/a/6782480/17580261
- */
-static char encoding_table[] = {'A', 'B', 'C', 'D', 'E', 'F', 'G', 'H',
-    'I', 'J', 'K', 'L', 'M', 'N', 'O', 'P',
-    'Q', 'R', 'S', 'T', 'U', 'V', 'W', 'X',
-    'Y', 'Z', 'a', 'b', 'c', 'd', 'e', 'f',
-    'g', 'h', 'i', 'j', 'k', 'l', 'm', 'n',
-    'o', 'p', 'q', 'r', 's', 't', 'u', 'v',
-    'w', 'x', 'y', 'z', '0', '1', '2', '3',
-    '4', '5', '6', '7', '8', '9', '+', '/'};
-static char *decoding_table = NULL;
-static int mod_table[] = {0, 2, 1};
-void build_decoding_table() {
-
-    decoding_table = malloc(256);
-
-    for (int i = 0; i < 64; i++)
-        decoding_table[(unsigned char) encoding_table[i]] = i;
-}
-unsigned char *base64_decode(const char *data, int input_length, int *output_length){
-
-    if (decoding_table == NULL) build_decoding_table();
-
-    if (input_length % 4 != 0) return NULL;
+int FIRST_PACKET_RECEIVED = 0; // 1 if there is an open communication
 
-    *output_length = input_length / 4 * 3;
-    if (data[input_length - 1] == '=') (*output_length)--;
-    if (data[input_length - 2] == '=') (*output_length)--;
+// Timers of the receiver, only used with QUERY_LOCK held - the open
+// communication is closed when SESSION_TIMER expires
+struct timer_wheel TIMERS;
+struct timer SESSION_TIMER;
 
-    unsigned char *decoded_data = malloc(*output_length);
-    if (decoded_data == NULL) return NULL;
+// Chunks received before a missing chunk (see handle_offset_payload)
+struct pending_chunk PENDING_CHUNKS[MAX_PENDING_CHUNKS];
 
-    for (int i = 0, j = 0; i < input_length;) {
+pthread_mutex_t QUERY_LOCK = PTHREAD_MUTEX_INITIALIZER;
 
-        uint32_t sextet_a = data[i] == '=' ? 0 & i++ : decoding_table[data[i++]];
-        uint32_t sextet_b = data[i] == '=' ? 0 & i++ : decoding_table[data[i++]];
-        uint32_t sextet_c = data[i] == '=' ? 0 & i++ : decoding_table[data[i++]];
-        uint32_t sextet_d = data[i] == '=' ? 0 & i++ : decoding_table[data[i++]];
+volatile sig_atomic_t RUNNING = 1; // Cleared by SIGINT or SIGTERM
 
-        uint32_t triple = (sextet_a << 3 * 6)
-            + (sextet_b << 2 * 6)
-            + (sextet_c << 1 * 6)
-            + (sextet_d << 0 * 6);
 
-        if (j < *output_length) decoded_data[j++] = (triple >> 2 * 8) & 0xFF;
-        if (j < *output_length) decoded_data[j++] = (triple >> 1 * 8) & 0xFF;
-        if (j < *output_length) decoded_data[j++] = (triple >> 0 * 8) & 0xFF;
-    }
-
-    return decoded_data;
-}
-void base64_cleanup() {
-    free(decoding_table);
-}
+/*
+ *
+ * MISCELLANEOUS
+ *
+ */
 
 
 /**
@@ -119,9 +109,7 @@ void base64_cleanup() {
  * @param As for printf and similar functions
  */
 void err(char *format, ...){
-    free(DST_PATH);
-    free(DATA_B64);
-    free(decoding_table);
+    arena_release(SESSION_ARENA);
 
     fprintf(stderr, "Error! ");
     va_list argptr;
@@ -147,11 +135,101 @@ void err(char *format, ...){
  * @param argc
  */
 void parse_args(int argc, char **argv){
-    if(argc != 3){
+
+    int positional_arg_count = 0;
+
+    for(int i = 1; i < argc; i++){ // Start from one to ignore filename
+
+        if(!strcmp(argv[i], "-p")){
+
+            if(i + 1 >= argc){
+                err("No argument following \"-p\"");
+            }
+
+            // Get the port to listen on
+            i += 1;
+            char *endptr = NULL;
+            PORT = strtol(argv[i], &endptr, 10);
+            if(*endptr != '\0' || PORT < 1 || PORT > 65535){
+                err("Invalid port: \"%s\".", argv[i]);
+            }
+
+        }else if(!strcmp(argv[i], "-d")){
+            DEDUP = 1;
+
+        }else if(!strcmp(argv[i], "-i")){
+
+            if(i + 1 >= argc){
+                err("No argument following \"-i\"");
+            }
+
+            // Get the time after which an idle communication is closed
+            i += 1;
+            char *endptr = NULL;
+            long seconds = strtol(argv[i], &endptr, 10);
+            if(*endptr != '\0' || seconds < 0 || seconds > 86400){
+                err("Invalid idle timeout: \"%s\".", argv[i]);
+            }
+            IDLE_TIMEOUT_MS = seconds * 1000;
+
+        }else if(!strcmp(argv[i], "-k")){
+            KEEP_PARTIAL = 1;
+
+        }else if(!strcmp(argv[i], "-b")){
+
+            if(i + 1 >= argc){
+                err("No argument following \"-b\"");
+            }
+
+            // Get the time to busy-poll before waiting for a query
+            i += 1;
+            char *endptr = NULL;
+            long budget = strtol(argv[i], &endptr, 10);
+            if(*endptr != '\0' || budget < 0 || budget > 1000000){
+                err("Invalid busy poll time: \"%s\".", argv[i]);
+            }
+            BUSY_POLL_US = budget;
+
+        }else if(!strcmp(argv[i], "-w")){
+
+            if(i + 1 >= argc){
+                err("No argument following \"-w\"");
+            }
+
+            // Get the file to capture queries to
+            i += 1;
+            CAPTURE_PATH = argv[i];
+
+        }else if(!strcmp(argv[i], "-c")){
+
+            if(i + 1 >= argc){
+                err("No argument following \"-c\"");
+            }
+
+            // Get the CPU to run the main loop on
+            i += 1;
+            char *endptr = NULL;
+            long cpu = strtol(argv[i], &endptr, 10);
+            if(*endptr != '\0' || cpu < 0 || cpu >= CPU_SETSIZE){
+                err("Invalid CPU: \"%s\".", argv[i]);
+            }
+            PINNED_CPU = cpu;
+
+        }else{
+            if(positional_arg_count == 0){
+                BASE_HOST = argv[i];
+            }else if(positional_arg_count == 1){
+                DST_FILEPATH = argv[i];
+            }else{
+                err("Invalid amount of arguments");
+            }
+            positional_arg_count += 1;
+        }
+    }
+
+    if(positional_arg_count != 2){
         err("Invalid amount of arguments");
     }
-    BASE_HOST = argv[1];
-    DST_FILEPATH = argv[2];
 }
 
 
@@ -164,17 +242,25 @@ void check_args(){
     for(int i = 0, n = strlen(BASE_HOST); i < n; i++){
         char c = BASE_HOST[i];
         // Check if it is a character that can be in a host name (alphanumeric,
-        // '.' and '-')
-        if(c != 46 && c != 45 && !(c >= 48 && c <= 57) && !(c <= 65 && c <= 90) && !(c >= 97 && c <= 122)){
+        // '.' and '-') or a comma separating base hosts
+        if(c != 46 && c != 45 && c != 44 && !(c >= 48 && c <= 57) && !(c >= 65 && c <= 90) && !(c >= 97 && c <= 122)){
 
             err("Invalid characters in base host: \'%c\'.", c);
         }
     }
+    if(packet_domains_init(&DOMAINS, BASE_HOST)){
+        err("Invalid list of base hosts \"%s\" (at most %d base hosts of up to %d characters).",
+            BASE_HOST, PACKET_MAX_DOMAINS, PACKET_MAX_NAME_LEN - 1);
+    }
 
     struct stat sb;
     if(stat(DST_FILEPATH, &sb) != 0 || !S_ISDIR(sb.st_mode)){
         err("Destination path invalid or doesn't exist.");
     }
+
+    if(DEDUP && store_open(DST_FILEPATH)){
+        err("Failed to open the block store in \"%s\".", DST_FILEPATH);
+    }
 }
 
 
@@ -189,195 +275,657 @@ void check_args(){
  * @brief Extract b64 payload from a packet received
  *
  * @param payload_b64 - pointer where to save the payload
+ * @param control - pointer where to save the control label (first label if
+ * it contains '-', which is not a base64 character), at least 64 bytes long
  * @param buffer - packet
  * @param buffer_len - packet length in bytes
  * @param query_id - pointer where to save xid from the header
+ *
+ * @return 0 if the packet carries a question with one of the base hosts, 1
+ * if it should be ignored
  */
-void get_payload(char *payload_b64, char *buffer, int buffer_len, int *query_id){
-
-    // Create a.a.BASE_HOST url to compare with payload. If the question is
-    // equal to this, it is a fin datagram
-    char fin_question_url[512] = "a.a.";
-    strcat(fin_question_url, BASE_HOST);
-
-    *query_id = ((struct dns_header_t *)buffer)->xid;
-
-    // Skip the header to get to the question
-    unsigned char *query_tmp_ptr = &buffer[sizeof(struct dns_header_t)];
-
-    // Get the question URL
-    unsigned char url[512] = {'\0'};
-    while(1){
-
-        // Get label length: first byte
-        uint8_t label_len = (uint8_t)(*query_tmp_ptr);
-        query_tmp_ptr += 1;
-
-        // If label length is zero, this is end of labels
-        if(label_len == 0){
-            break;
-        }
-
-        // Otherwise, write the label to 'url'
-        for(int i = 0; i < label_len; i++){
-            url[strlen(url)] = *query_tmp_ptr;
-            query_tmp_ptr += 1;
-        }
-        url[strlen(url)] = '.';
-    }
-    url[strlen(url) - 1] = '\0'; // Remove the trailing '.'
-
-    // Check the domain - compare url and base host by characters from the
-    // end
-    int equal = 1;
-    for(int BASE_HOST_i = strlen(BASE_HOST) - 1, url_i = strlen(url) - 1;
-            BASE_HOST_i >= 0 && url_i >= 0; 
-            BASE_HOST_i--, url_i--){
-        if(BASE_HOST[BASE_HOST_i] != url[url_i]){
-            equal = 0;
-            break;
-        }
-    }
-    if(!equal){
-        // If the domain is not what the user set up, ignore this packet
-        return;
+int get_payload(char *payload_b64, char *control, char *buffer, int buffer_len, int *query_id){
+
+    char url[512];
+    uint64_t stage = metrics_stage_start();
+    int ret = packet_parse_query((unsigned char *)buffer, buffer_len, &DOMAINS, NULL, url, payload_b64, control, query_id);
+    metrics_stage_end(STAGE_PARSE, stage);
+    if(ret){
+        return 1;
     }
 
     // Trigger query parsed event
     dns_receiver__on_query_parsed(DST_PATH, url);
 
-    // If the url equals url of a fin question, return with payload being empty
-    if(!strcmp(url, fin_question_url)){
-        payload_b64[0] = '\0';
-        return;
-    }
-
-    // Get the real payload, without the domain - iter from the end, char
-    // by char and only start copying characters after encountering the
-    // second '.'. Then, still ignore the '.' characters
-    int ignore = 2;
-    for(int i = strlen(url) - 1; i >= 0; i--){
-        if(url[i] == '.' && ignore){
-            ignore -= 1;
-        }
-        if(!ignore){
-            payload_b64[i] = url[i];
-        }
-    }
-
-    // Remove all '.' from the labels
-    for(int i = 0; i < strlen(payload_b64); i++){
-        if(payload_b64[i] == '.'){
-            for(int j = i; j < strlen(payload_b64); j++){
-                payload_b64[j] = payload_b64[j + 1];
-            }
-        }
-    }
+    return 0;
 }
 
 
 /**
  * @param Handle the first packet of a communication - extract the payload
- * (path, where to save the upcoming data), save it and prepare everything for
- * the communication
+ * (path, where to save the upcoming data, followed by the handshake of a
+ * sender which negotiates, see PROTOCOL_VERSION), save it and prepare
+ * everything for the communication
  *
  * @param payload_b64 - base64 payload in the packet
  */
 void handle_first_payload(char *payload_b64){
     
+    // Everything the communication needs is allocated from its arena
+    SESSION_ARENA = arena_acquire();
+    FIRST_PAYLOAD_B64 = arena_alloc(SESSION_ARENA, strlen(payload_b64) + 1);
+    strcpy(FIRST_PAYLOAD_B64, payload_b64);
+
     // Add padding back to the b64 and decode it
     while(strlen(payload_b64) % 4 != 0){
         payload_b64[strlen(payload_b64)] = '=';
     }
-    int payload_len = 0;
-    char *payload = base64_decode(payload_b64, strlen(payload_b64), &payload_len);
+    char *payload = arena_alloc(SESSION_ARENA, strlen(payload_b64) / 4 * 3);
+    int payload_len = base64_decode_to((unsigned char *)payload, payload_b64, strlen(payload_b64));
 
     // Fill the DST_PATH variable
-    DST_PATH = malloc(512);
-    if(!DST_PATH){
-        err("Could not allocate memory");
-    }
+    DST_PATH = arena_alloc(SESSION_ARENA, 512);
     memset(DST_PATH, '\0', 512);
     strcpy(DST_PATH, DST_FILEPATH);
     strcat(DST_PATH, "/");
     strncat(DST_PATH, payload, payload_len);
 
-    free(payload);
+    // Get the announced size and select capabilities supported by both from
+    // the handshake after the path
+    int path_len = strnlen(payload, payload_len);
+    const unsigned char *handshake = (unsigned char *)payload + path_len + 1;
+    SESSION_NEGOTIATED = payload_len - path_len - 1 >= HANDSHAKE_LEN && handshake[0] > 0;
+    unsigned int version = SESSION_NEGOTIATED ? handshake[0] : 0;
+    unsigned int capabilities = SESSION_NEGOTIATED ? handshake[1] : 0;
+    unsigned int window = SESSION_NEGOTIATED ? handshake[2] : 0;
+    int64_t size = SESSION_NEGOTIATED ? (int64_t)delta_get(handshake + 3, 8) : -1;
+    if(size < 0){
+        size = -1;
+    }
+    SESSION_CAPABILITIES[0] = version < PROTOCOL_VERSION ? version : PROTOCOL_VERSION;
+    SESSION_CAPABILITIES[1] = SESSION_NEGOTIATED ? capabilities & RECEIVER_CAPABILITIES : RECEIVER_CAPABILITIES;
+    SESSION_CAPABILITIES[2] = window < MAX_PENDING_CHUNKS ? window : MAX_PENDING_CHUNKS;
+    SESSION_CAPABILITIES[3] = MAX_PAYLOAD_LEN;
+
+    // A sender which can send a delta of the existing file is sent its
+    // signatures, a sender which can refer to stored blocks is told which
+    // ones the store has, and the delta is written next to the file
+    DELTA_PATH = NULL;
+    int delta_fits = strlen(DST_PATH) + strlen(DELTA_SUFFIX) < 512;
+    if(!SESSION_NEGOTIATED || !delta_fits || delta_prepare(DST_PATH)){
+        SESSION_CAPABILITIES[1] &= ~CAP_DELTA;
+    }
+    if(!SESSION_NEGOTIATED || !delta_fits || !store_enabled()){
+        SESSION_CAPABILITIES[1] &= ~CAP_DEDUP;
+    }
+    if(SESSION_CAPABILITIES[1] & (CAP_DELTA | CAP_DEDUP)){
+        DELTA_PATH = arena_alloc(SESSION_ARENA, 512);
+        strcpy(DELTA_PATH, DST_PATH);
+        strcat(DELTA_PATH, DELTA_SUFFIX);
+    }
 
-    // Allocate DATA_B64 var
-    if(!DATA_B64){
-        DATA_B64 = malloc(512);
-        if(!DATA_B64){
-            err("Failed to allocate memory");
+    // Open the file, allocated to the announced size
+    writer_open(DELTA_PATH ? DELTA_PATH : DST_PATH, DELTA_PATH ? -1 : size);
+    DATA_B64_WRITTEN = 0;
+    CHUNK_INDEX = 0;
+
+    fec_reset();
+    memset(PENDING_CHUNKS, 0, sizeof(PENDING_CHUNKS));
+
+    // Allocate DATA_B64 var, it never holds more than a block and a chunk
+    DATA_B64 = arena_alloc(SESSION_ARENA, DATA_B64_SIZE);
+    DATA_B64_LEN = 0;
+}
+
+
+/**
+ * @brief Decode the data collected in DATA_B64 and pass them to the writer
+ *
+ * @param fin - 1 if no more data will come (the end is padded and decoded
+ * too), 0 to keep the characters after the last full group of 4 in DATA_B64
+ */
+void write_data(int fin){
+    int len = DATA_B64_LEN - DATA_B64_LEN % 4;
+    if(fin){
+        // Add padding back to the b64
+        while(DATA_B64_LEN % 4 != 0){
+            DATA_B64[DATA_B64_LEN] = '=';
+            DATA_B64_LEN += 1;
         }
-        DATA_B64_SIZE = 512;
-        DATA_B64_LEN = 0;
+        len = DATA_B64_LEN;
+    }
+    if(!len){
+        return;
     }
+
+    // Decode b64 data to an arena released by the writer and write them
+    // after the data decoded before
+    struct arena *block = arena_acquire();
+    unsigned char *data = arena_alloc(block, len / 4 * 3);
+    int data_len = base64_decode_to(data, DATA_B64, len);
+    writer_write(DATA_B64_WRITTEN / 4 * 3, data, data_len, block);
+    DATA_B64_WRITTEN += len;
+
+    DATA_B64_LEN -= len;
+    memmove(DATA_B64, DATA_B64 + len, DATA_B64_LEN);
+    DATA_B64[DATA_B64_LEN] = '\0';
 }
 
 
 /**
  * @brief Handles a payload which is not the first and not the last packet - so
- * just append the payload to DATA_B64 string, which will be decoded and saved
- * to file at the end
+ * just append the payload to DATA_B64 string, which is decoded and passed to
+ * the writer in blocks of WRITER_BLOCK_B64_LEN characters
  *
  * @param payload_b64 - payload in the packet, encoded in base64
  */
 void handle_next_payload(char *payload_b64){
 
-    // Realloc DATA_B64 if it's too small
+    // DATA_B64 is emptied before it is full (see DATA_B64_SIZE)
     if(DATA_B64_SIZE <= DATA_B64_LEN + strlen(payload_b64) + 8){ // 8 for future b64 padding, null byte, ...
-        DATA_B64 = realloc(DATA_B64, DATA_B64_SIZE * 2);
-        if(!DATA_B64){
-            err("Failed to allocate memory.");
-        }
-        DATA_B64_SIZE *= 2;
+        err("Received data don't fit to the buffer.");
     }
 
     // Copy payload to DATA_B64
     strcpy(DATA_B64 + DATA_B64_LEN, payload_b64);
     DATA_B64_LEN += strlen(payload_b64);
+
+    if(DATA_B64_LEN >= WRITER_BLOCK_B64_LEN){
+        write_data(0);
+    }
 }
 
 
 /**
- * @param Handle the final message of a communication - decode the received
- * data, save it to a provided file and free all resources
+ * @param Handle the final message of a communication - decode the rest of the
+ * received data, pass it to the writer to save and close the file and free
+ * all resources
  */
 void handle_fin_msg(){
-    // Add padding back to the b64
-    while(DATA_B64_LEN % 4 != 0){
-        DATA_B64[DATA_B64_LEN] = '=';
-        DATA_B64_LEN += 1;
+    // Decode the rest, the size of the file is known only after that
+    // (decoded padding doesn't count)
+    int padding = (4 - DATA_B64_LEN % 4) % 4;
+    write_data(1);
+    int64_t data_len = DATA_B64_WRITTEN / 4 * 3 - padding;
+    writer_close(data_len);
+    if(DELTA_PATH){
+        delta_apply(DST_PATH, DELTA_PATH);
+        delta_reset();
     }
-
-    // Decode b64 data
-    int data_len = 0;
-    char *data = base64_decode(DATA_B64, DATA_B64_LEN, &data_len);
-
-    // Save to file
-    FILE *f = fopen(DST_PATH, "wb");
-    if(!f){
-        err("Could not open destination file");
+    if(store_enabled()){
+        // Blocks of the file may be referred to by later communications
+        store_add_later(DST_PATH);
     }
 
-    size_t written = fwrite(data, 1, data_len, f);
-    if(written != data_len){
-        err("Failed to save data to file");
-    }
-
-    fclose(f);
-
     // Trigger transfer complete event
     dns_receiver__on_transfer_completed(DST_PATH, data_len);
 
-    free(data);
-    free(DST_PATH);
+    reset_session();
+}
+
+
+/**
+ * @brief Free the memory of the open communication and forget its state
+ */
+void reset_session(){
+    arena_release(SESSION_ARENA);
+    SESSION_ARENA = NULL;
     DST_PATH = NULL;
-    free(DATA_B64);
+    DELTA_PATH = NULL;
     DATA_B64 = NULL;
-    DATA_B64_SIZE = 0;
     DATA_B64_LEN = 0;
+    DATA_B64_WRITTEN = 0;
+    CHUNK_INDEX = 0;
+    fec_reset();
+    memset(PENDING_CHUNKS, 0, sizeof(PENDING_CHUNKS));
+}
+
+
+/**
+ * @brief Remove a file once the writer closed it (called by the writer)
+ *
+ * @param arg - path of the file, freed
+ */
+void remove_written(void *arg){
+    remove((char *)arg);
+    free(arg);
+}
+
+
+/**
+ * @brief Close the open communication once its sender has not sent anything
+ * for IDLE_TIMEOUT_MS (it was stopped or lost the connection), so that the
+ * next communication is not taken for its continuation, and release
+ * everything it holds. The data received in order are written and the file
+ * is closed - and kept if KEEP_PARTIAL is set (a delta of the complete file
+ * against it can be sent later), removed otherwise. The delta of an existing
+ * file is always removed, the existing file stays as it was
+ */
+void expire_session(){
+    write_data(0);
+    writer_close(DATA_B64_WRITTEN / 4 * 3);
+    if(DELTA_PATH){
+        delta_reset();
+    }
+
+    char *path = DELTA_PATH ? DELTA_PATH : KEEP_PARTIAL ? NULL : DST_PATH;
+    fprintf(stderr, "Error! No query for \"%s\" came for %d s, closing the communication%s\n",
+        DST_PATH, IDLE_TIMEOUT_MS / 1000, DELTA_PATH || !KEEP_PARTIAL ? "" : " and keeping the partial file");
+    if(path){
+        char *copy = strdup(path);
+        if(copy){
+            writer_notify(remove_written, copy);
+        }
+    }
+    reset_session();
+
+    FIRST_PACKET_RECEIVED = 0;
+    metrics_add(METRIC_ACTIVE_SESSIONS, -1);
+    metrics_add(METRIC_TRANSFERS_FAILED, 1);
+    metrics_add(METRIC_SESSIONS_EXPIRED, 1);
+}
+
+
+/**
+ * @brief Handle the timers which expired (call with QUERY_LOCK held)
+ */
+void run_timers(){
+    struct timer *timer = NULL;
+    while((timer = timer_expire(&TIMERS, net_now_us()))){
+        if(timer == &SESSION_TIMER && FIRST_PACKET_RECEIVED){
+            expire_session();
+        }
+    }
+}
+
+
+/**
+ * @brief Handle a chunk identified by a control label "o-OFFSET" (hexadecimal
+ * offset of the chunk in the base64 data), sent by a sender which doesn't
+ * wait for confirmations of previous chunks (over TCP). Chunks may come out
+ * of order, so the ones following a missing chunk wait in PENDING_CHUNKS
+ *
+ * @param control - control label of the chunk
+ * @param payload_b64 - base64 data of the chunk
+ *
+ * @return 1 if the chunk should be confirmed, 0 if it is invalid or there is
+ * no space to keep it
+ */
+int handle_offset_payload(char *control, char *payload_b64){
+    char *endptr = NULL;
+    int64_t offset = strtoll(control + 2, &endptr, 16);
+    if(control[1] != '-' || *endptr != '\0' || offset < 0 || !DATA_B64){
+        return 0;
+    }
+
+    if(offset < DATA_B64_WRITTEN + DATA_B64_LEN){
+        // Received already (a repeated query)
+        return 1;
+    }
+
+    if(offset > DATA_B64_WRITTEN + DATA_B64_LEN){
+        // A chunk before this one is missing - keep it until it comes
+        int free_slot = -1;
+        for(int i = 0; i < MAX_PENDING_CHUNKS; i++){
+            if(PENDING_CHUNKS[i].used && PENDING_CHUNKS[i].offset == offset){
+                return 1;
+            }
+            if(!PENDING_CHUNKS[i].used && free_slot < 0){
+                free_slot = i;
+            }
+        }
+        if(free_slot < 0){
+            return 0;
+        }
+        PENDING_CHUNKS[free_slot].used = 1;
+        PENDING_CHUNKS[free_slot].offset = offset;
+        strcpy(PENDING_CHUNKS[free_slot].payload_b64, payload_b64);
+        return 1;
+    }
+
+    // Append the chunk and the waiting chunks which follow it
+    handle_next_payload(payload_b64);
+    for(int i = 0; i < MAX_PENDING_CHUNKS; i++){
+        if(PENDING_CHUNKS[i].used && PENDING_CHUNKS[i].offset == DATA_B64_WRITTEN + DATA_B64_LEN){
+            handle_next_payload(PENDING_CHUNKS[i].payload_b64);
+            PENDING_CHUNKS[i].used = 0;
+            i = -1; // Look for the next one from the start
+        }
+    }
+    return 1;
+}
+
+
+/**
+ * @brief Handle a chunk identified by a control label "i-INDEX" (hexadecimal
+ * index of the chunk in the communication), sent by a sender which waits for
+ * the confirmation of every chunk. A repeated chunk (eg. a query sent again
+ * by a resolver) is only confirmed
+ *
+ * @param control - control label of the chunk
+ * @param payload_b64 - base64 data of the chunk
+ *
+ * @return 1 if the chunk should be confirmed, 0 if it is invalid or a chunk
+ * before it is missing
+ */
+int handle_indexed_payload(char *control, char *payload_b64){
+    char *endptr = NULL;
+    uint64_t index = strtoull(control + 2, &endptr, 16);
+    if(control[1] != '-' || *endptr != '\0' || !strlen(payload_b64)){
+        return 0;
+    }
+
+    if(index < CHUNK_INDEX){
+        // Received already (a repeated query)
+        return 1;
+    }
+    if(index > CHUNK_INDEX){
+        return 0;
+    }
+
+    handle_next_payload(payload_b64);
+    CHUNK_INDEX += 1;
+    return 1;
+}
+
+
+/**
+ * @brief Handle an offer of blocks identified by a control label "h-INDEX"
+ * (hexadecimal index of the first offered block) - the payload carries
+ * their hashes (8 bytes each)
+ *
+ * @param control - control label of the offer
+ * @param payload_b64 - base64 hashes
+ * @param bitmap - output, 4 bytes, bit of every offered block the store has
+ * (the highest bit of the first byte is the first block)
+ *
+ * @return 1 if the offer should be answered, 0 if it is invalid
+ */
+int handle_block_offer(char *control, char *payload_b64, unsigned char *bitmap){
+    char *endptr = NULL;
+    strtoull(control + 2, &endptr, 16);
+    int b64_len = strlen(payload_b64);
+    if(control[1] != '-' || *endptr != '\0' || !b64_len || b64_len > DEDUP_MAX_OFFER * 8 / 3 * 4 + 4){
+        return 0;
+    }
+
+    // Add padding back to the b64 and decode it
+    char hashes_b64[DEDUP_MAX_OFFER * 8 / 3 * 4 + 8];
+    strcpy(hashes_b64, payload_b64);
+    while(b64_len % 4 != 0){
+        hashes_b64[b64_len++] = '=';
+    }
+    unsigned char hashes[DEDUP_MAX_OFFER * 8 + 8];
+    int count = base64_decode_to(hashes, hashes_b64, b64_len) / 8;
+    if(count > DEDUP_MAX_OFFER){
+        count = DEDUP_MAX_OFFER;
+    }
+
+    memset(bitmap, 0, 4);
+    for(int i = 0; i < count; i++){
+        if(store_has(delta_get(hashes + i * 8, 8))){
+            bitmap[i / 8] |= 0x80 >> (i % 8);
+        }
+    }
+    return 1;
+}
+
+
+/**
+ * @brief Trigger the chunk received event of the client's address family
+ *
+ * @param family - AF_INET or AF_INET6
+ * @param host - struct in_addr or struct in6_addr of the client
+ * @param query_id - ID of the query carrying the chunk
+ * @param chunk_len - length of the chunk in bytes
+ */
+void trigger_chunk_received(int family, const void *host, int query_id, int chunk_len){
+    if(family == AF_INET6){
+        dns_receiver__on_chunk_received6((struct in6_addr *)host, DST_PATH, query_id, chunk_len);
+    }else{
+        dns_receiver__on_chunk_received((struct in_addr *)host, DST_PATH, query_id, chunk_len);
+    }
+}
+
+
+/**
+ * @brief Handle a query received over UDP or TCP and turn it to the
+ * confirmation response (the same message with the response flag set, the
+ * first packet of a communication answered by selected capabilities)
+ *
+ * @param buffer - the query, replaced by the response, at least 512 bytes long
+ * @param buffer_len - length of the query in bytes, replaced by the length
+ * of the response
+ * @param client - address of the client
+ *
+ * @return 1 if the response should be sent, 2 if it should be sent once the
+ * received file is written (by writer_notify), 0 if not
+ */
+int handle_query(unsigned char *buffer, int *buffer_len, struct sockaddr *client){
+
+    // Queries of UDP and TCP clients are handled one at a time, after the
+    // communication is closed if its sender went silent
+    pthread_mutex_lock(&QUERY_LOCK);
+    run_timers();
+
+    // Get payload in b64 from the packet
+    unsigned char payload_b64[256] = {'\0'};
+    char control[64] = {'\0'};
+    int query_id = 0;
+    metrics_add(METRIC_PACKETS_IN, 1);
+    metrics_add(METRIC_BYTES_IN, *buffer_len);
+    if(get_payload(payload_b64, control, buffer, *buffer_len, &query_id)){
+        metrics_add(METRIC_DROPS, 1);
+        pthread_mutex_unlock(&QUERY_LOCK);
+        return 0;
+    }
+    const void *client_host = NULL;
+    int client_family = net_addr_host(client, &client_host);
+
+    int confirm = 1; // 0 if the packet should not be confirmed, 2 if after writing
+    int answer = 0; // 1 to answer by rdata
+    unsigned char rdata[4]; // Address to answer by (capabilities or a bitmap)
+    unsigned char page[DELTA_PAGE_SIZE]; // Signatures to answer by
+    int page_len = 0;
+
+    if(control[0] == 'p'){
+        // Probe of the sender measuring how fast a path to us is - just
+        // confirm it
+
+    }else if(!FIRST_PACKET_RECEIVED && !strlen(payload_b64)){
+        // Fin message without an open communication - the sender closes
+        // a communication whose first packet was lost, so just confirm it,
+        // or repeats the fin message of the communication which ended, so
+        // confirm it only if its file was written
+        confirm = 2;
+
+    }else if(!FIRST_PACKET_RECEIVED && control[0]){
+        // Data chunk without an open communication (a repeated query of a
+        // communication which ended) - there is no chunk it could belong to
+        confirm = 0;
+
+    }else if(FIRST_PACKET_RECEIVED && SESSION_NEGOTIATED && !control[0]
+            && !strcmp((char *)payload_b64, FIRST_PAYLOAD_B64)){
+        // Repeated first packet of the open communication - just confirm it
+        // (a sender which negotiated sends data chunks with control labels)
+        answer = 1;
+        memcpy(rdata, SESSION_CAPABILITIES, sizeof(rdata));
+
+    }else if(!FIRST_PACKET_RECEIVED){
+        // First packet of comm
+
+        // We received a destination file path - decode and save it
+        handle_first_payload(payload_b64);
+        answer = SESSION_NEGOTIATED;
+        memcpy(rdata, SESSION_CAPABILITIES, sizeof(rdata));
+
+        // Trigger transfer init event
+        if(client_family == AF_INET6){
+            dns_receiver__on_transfer_init6((struct in6_addr *)client_host);
+        }else{
+            dns_receiver__on_transfer_init((struct in_addr *)client_host);
+        }
+        FIRST_PACKET_RECEIVED = 1;
+        metrics_add(METRIC_ACTIVE_SESSIONS, 1);
+
+    }else if(control[0] == 'g'){
+        // Sender of a delta asks for signatures of the existing file
+        char *endptr = NULL;
+        uint64_t index = strtoull(control + 2, &endptr, 16);
+        if(control[1] == '-' && *endptr == '\0' && (SESSION_CAPABILITIES[1] & CAP_DELTA)){
+            page_len = delta_page(index, page);
+        }
+        confirm = page_len > 0;
+
+    }else if(control[0] == 'h'){
+        // Sender offers blocks the store may have
+        confirm = SESSION_CAPABILITIES[1] & CAP_DEDUP ? handle_block_offer(control, payload_b64, rdata) : 0;
+        answer = confirm;
+
+    }else if(control[0] == 'f'){
+        // Data protected by parity chunks
+
+        // Trigger chunk received event
+        trigger_chunk_received(client_family, client_host, query_id, strlen(payload_b64));
+
+        confirm = SESSION_CAPABILITIES[1] & CAP_FEC ? fec_handle_chunk(control, payload_b64) : 0;
+
+    }else if(control[0] == 'o'){
+        // Data sent without waiting for previous confirmations
+
+        // Trigger chunk received event
+        trigger_chunk_received(client_family, client_host, query_id, strlen(payload_b64));
+
+        confirm = SESSION_CAPABILITIES[1] & CAP_OFFSET ? handle_offset_payload(control, payload_b64) : 0;
+
+    }else if(control[0] == 'i'){
+        // Data sent one by one, each after the previous one was confirmed
+
+        // Trigger chunk received event
+        trigger_chunk_received(client_family, client_host, query_id, strlen(payload_b64));
+
+        confirm = SESSION_CAPABILITIES[1] & CAP_INDEX ? handle_indexed_payload(control, payload_b64) : 0;
+
+    }else if(strlen(payload_b64)){
+        // Another payload containing encoded data
+
+        // Trigger chunk received event
+        trigger_chunk_received(client_family, client_host, query_id, strlen(payload_b64));
+
+        // If this is not empty - not a fin message, it is just the next
+        // payload to save
+        handle_next_payload(payload_b64);
+
+    }else{
+        // If the message is empty, it is the fin message (connection
+        // close)
+        handle_fin_msg();
+
+        FIRST_PACKET_RECEIVED = 0;
+        metrics_add(METRIC_ACTIVE_SESSIONS, -1);
+        metrics_add(METRIC_TRANSFERS_COMPLETED, 1);
+
+        // The sender may delete or change the file after the confirmation,
+        // so confirm once the file is written
+        confirm = 2;
+    }
+
+    // Any query of the open communication keeps it open
+    if(FIRST_PACKET_RECEIVED && IDLE_TIMEOUT_MS){
+        timer_arm(&TIMERS, &SESSION_TIMER, net_now_us() + (uint64_t)IDLE_TIMEOUT_MS * 1000);
+    }else{
+        timer_cancel(&TIMERS, &SESSION_TIMER);
+    }
+
+    pthread_mutex_unlock(&QUERY_LOCK);
+
+    if(!confirm){
+        metrics_add(METRIC_DROPS, 1);
+        return 0;
+    }
+
+    // Set the "response" flag (first bit of 16bit flags = 32768 decimal)
+    ((struct dns_header_t *)buffer)->flags += (uint16_t)htons(32768);
+    if(answer){
+        *buffer_len = packet_add_answer(buffer, *buffer_len, rdata);
+    }else if(page_len > 0){
+        *buffer_len = packet_add_txt_answer(buffer, *buffer_len, page, page_len);
+    }
+    return confirm;
+}
+
+
+/**
+ * @brief Send a response to a UDP client (called by the writer when a
+ * response was deferred until the file is written) - not if the file could
+ * not be written, so that the sender doesn't take the transfer for done
+ *
+ * @param arg - struct deferred_response, freed
+ */
+void send_deferred_response(void *arg){
+    struct deferred_response *response = arg;
+    if(writer_failed()){
+        metrics_add(METRIC_DROPS, 1);
+        free(response);
+        return;
+    }
+    uint64_t stage = metrics_stage_start();
+    int sent_len = net_send(response->sock, response->buffer, response->buffer_len, 0x800,
+        (struct sockaddr *)&response->client, response->client_len);
+    metrics_stage_end(STAGE_SEND, stage);
+    if(sent_len == response->buffer_len){
+        metrics_add(METRIC_PACKETS_OUT, 1);
+        metrics_add(METRIC_BYTES_OUT, sent_len);
+    }
+    free(response);
+}
+
+
+/**
+ * @brief Receive a UDP query - in the low-latency mode (option "-b"), the
+ * socket is checked without waiting for up to BUSY_POLL_US first, so that a
+ * query which comes meanwhile is received without the wakeup of a blocking
+ * read
+ *
+ * @param sock
+ * @param buffer - output, at least 512 bytes long
+ * @param client - output, address of the client
+ * @param client_len - size of client, replaced by the length of the address
+ * @param timeout_ms - max time to wait (forever if negative)
+ *
+ * @return length of the query or -1 if none came in time
+ */
+int receive_query(int sock, unsigned char *buffer, struct sockaddr_storage *client, socklen_t *client_len, int timeout_ms){
+    if(BUSY_POLL_US && timeout_ms){
+        uint64_t now = net_now_us();
+        uint64_t spin_end = now + BUSY_POLL_US;
+        uint64_t deadline = timeout_ms < 0 ? UINT64_MAX : now + (uint64_t)timeout_ms * 1000;
+        while(RUNNING && now < spin_end && now < deadline){
+            int len = net_recv(sock, buffer, 512, (struct sockaddr *)client, client_len, 0);
+            if(len >= 0){
+                return len;
+            }
+            now = net_now_us();
+        }
+        if(!RUNNING || now >= deadline){
+            return -1;
+        }
+        if(timeout_ms > 0){
+            timeout_ms = (deadline - now + 999) / 1000;
+        }
+    }
+    return net_recv(sock, buffer, 512, (struct sockaddr *)client, client_len, timeout_ms);
+}
+
+
+/**
+ * @brief Stop receiving (on SIGINT or SIGTERM), so that resources are freed
+ * and pending events written
+ *
+ * @param signum
+ */
+void stop_receiving(int signum){
+    RUNNING = 0;
 }
 
 
@@ -394,84 +942,143 @@ int main(int argc, char **argv){
     parse_args(argc, argv);
     check_args();
 
-    // Create a socket
-    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    metrics_init("dns_receiver");
+    writer_init();
+    timer_wheel_init(&TIMERS, RECEIVER_TICK_US, net_now_us());
+    timer_init(&SESSION_TIMER, NULL);
+
+    // Create a socket bound to the port (53 by default), dual-stack to
+    // receive both IPv6 and IPv4 queries, or IPv4 only if IPv6 is disabled
+    int sock = net_socket(AF_INET6, PORT);
     if(sock == -1){
-        err("Failed to open socket");
+        sock = net_socket(AF_INET, PORT);
+    }
+    if(sock == -1){
+        err("Failed to bind socket to port %d.", PORT);
     }
 
-    // Set reuse address option
-    int optval = 1;
-    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const void *)&optval , sizeof(int));
+    // Accept queries over TCP too, if the port is free
+    tcp_start(PORT);
 
-    // Bind socket to port 53
-    struct sockaddr_in server;
-    server.sin_family = AF_INET;
-    server.sin_addr.s_addr = htonl(INADDR_ANY);
-    server.sin_port = htons(53); // DNS port = 53
-    if(bind(sock, (struct sockaddr *)&server, sizeof(server))){
-        err("Failed to bind socket to port 53.\n");
+    // Capture of received queries, to be replayed later (see dns_replay)
+    if(CAPTURE_PATH && capture_create(&CAPTURE, CAPTURE_PATH, PORT)){
+        err("Failed to create the capture file \"%s\".", CAPTURE_PATH);
+    }
+
+    // Kernel timestamps of queries and responses, if stages are timed
+    if(metrics_stages_enabled() && net_timestamping(sock, metrics_kernel_delay)){
+        fprintf(stderr, "Kernel timestamps are not available, kernel stages are not timed.\n");
+    }
+
+    // Low-latency mode - the kernel busy-polls the network device too (if the
+    // driver supports it) and the main loop keeps its CPU (the threads
+    // started already are not pinned)
+    if(BUSY_POLL_US && net_busy_poll(sock, BUSY_POLL_US)){
+        fprintf(stderr, "Busy polling of the network device is not available, only the socket is busy-polled.\n");
+    }
+    if(PINNED_CPU >= 0){
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(PINNED_CPU, &cpus);
+        if(sched_setaffinity(0, sizeof(cpus), &cpus)){
+            err("Failed to pin the receiver to CPU %d.", PINNED_CPU);
+        }
     }
 
     // Prep client address
-    struct sockaddr_in client;
-    int client_len = sizeof(client);
+    struct sockaddr_storage client;
+    socklen_t client_len = sizeof(client);
 
     // Prep buffer
     unsigned char buffer[512];
 
-    int first_packet_received = 0; // 1 if there is an open communication
+    // Stop on SIGINT and SIGTERM - without SA_RESTART, recvfrom is
+    // interrupted
+    struct sigaction stop_action;
+    memset(&stop_action, 0, sizeof(stop_action));
+    stop_action.sa_handler = stop_receiving;
+    sigaction(SIGINT, &stop_action, NULL);
+    sigaction(SIGTERM, &stop_action, NULL);
 
     // Receive in a loop
-    while(1){
+    while(RUNNING){
+
+        // Wait until the next timer expires (timers armed by TCP clients
+        // meanwhile are handled with the next query at the latest)
+        pthread_mutex_lock(&QUERY_LOCK);
+        uint64_t deadline = timer_next_us(&TIMERS);
+        pthread_mutex_unlock(&QUERY_LOCK);
+        int timeout_ms = -1;
+        if(deadline != TIMER_NEVER){
+            uint64_t now = net_now_us();
+            timeout_ms = deadline > now ? (deadline - now + 999) / 1000 : 0;
+        }
 
         // Receive
-        int buffer_len = recvfrom(sock, buffer, 512, 0, (struct sockaddr *)&client, &client_len);
-
-        // Get payload in b64 from the packet
-        unsigned char payload_b64[256] = {'\0'};
-        int query_id = 0;
-        get_payload(payload_b64, buffer, buffer_len, &query_id);
-
-        if(!first_packet_received){
-            // First packet of comm
-
-            // We received a destination file path - decode and save it
-            handle_first_payload(payload_b64);
-
-            // Trigger transfer init event
-            dns_receiver__on_transfer_init(&(client.sin_addr));
-            first_packet_received = 1;
-
-        }else if(strlen(payload_b64)){
-            // Another payload containing encoded data
-
-            // Trigger chunk received event
-            dns_receiver__on_chunk_received(&(client.sin_addr), DST_PATH, query_id, strlen(payload_b64));
-
-            // If this is not empty - not a fin message, it is just the next
-            // payload to save
-            handle_next_payload(payload_b64);
-
-        }else{
-            // If the message is empty, it is the fin message (connection
-            // close)
-            handle_fin_msg();
+        client_len = sizeof(client);
+        int buffer_len = receive_query(sock, buffer, &client, &client_len, timeout_ms);
+        if(buffer_len >= 0 && CAPTURE.file){
+            capture_write(&CAPTURE, buffer, buffer_len, (struct sockaddr *)&client, client_len);
+        }
+        if(buffer_len < (int)sizeof(struct dns_header_t)){
+            pthread_mutex_lock(&QUERY_LOCK);
+            run_timers();
+            pthread_mutex_unlock(&QUERY_LOCK);
+            continue;
+        }
 
-            first_packet_received = 0;
+        // A query repeated by a resolver is answered by the same response,
+        // without handling it again
+        uint64_t key = cache_key(buffer, buffer_len, (struct sockaddr *)&client, client_len);
+        int cached_len = cache_lookup(key, buffer);
+        if(cached_len){
+            metrics_add(METRIC_PACKETS_IN, 1);
+            metrics_add(METRIC_BYTES_IN, buffer_len);
+            metrics_add(METRIC_DUPLICATES, 1);
+            if(net_send(sock, buffer, cached_len, 0x800, (struct sockaddr *)&client, client_len) == cached_len){
+                metrics_add(METRIC_PACKETS_OUT, 1);
+                metrics_add(METRIC_BYTES_OUT, cached_len);
+            }
+            continue;
         }
 
         // Send confirmation response - the same packet as received but
-        // with "reponse" flag set (first bit of 16bit flags = 32768 decimal)
-        ((struct dns_header_t *)buffer)->flags += (uint16_t)htons(32768); 
-        int sent_len = sendto(sock, &buffer, buffer_len, 0x800, (struct sockaddr *)&client, client_len);
-        //                                               0x800 = MSG_CONFIRM
+        // with "reponse" flag set
+        uint64_t stage = metrics_stage_start();
+        int respond = handle_query(buffer, &buffer_len, (struct sockaddr *)&client);
+        metrics_stage_end(STAGE_HANDLE, stage);
+        if(respond == 2){
+            // Respond once the file is written, receive in the meantime
+            struct deferred_response *response = malloc(sizeof(struct deferred_response));
+            if(!response){
+                err("Failed to allocate memory.");
+            }
+            response->sock = sock;
+            memcpy(&response->client, &client, client_len);
+            response->client_len = client_len;
+            memcpy(response->buffer, buffer, buffer_len);
+            response->buffer_len = buffer_len;
+            writer_notify(send_deferred_response, response);
+        }else if(respond){
+            stage = metrics_stage_start();
+            int sent_len = net_send(sock, buffer, buffer_len, 0x800, (struct sockaddr *)&client, client_len);
+            //                                               0x800 = MSG_CONFIRM
+            metrics_stage_end(STAGE_SEND, stage);
+            if(sent_len == buffer_len){
+                metrics_add(METRIC_PACKETS_OUT, 1);
+                metrics_add(METRIC_BYTES_OUT, sent_len);
+            }
+            cache_store(key, buffer, buffer_len);
+        }
     }
 
-    // Clear resources
-    free(DST_PATH);
-    free(DATA_B64);
-    free(decoding_table);
+    // Clear resources (after the writer sends deferred responses)
+    writer_shutdown();
+    capture_close(&CAPTURE);
+    store_close();
+    net_close(sock);
+    arena_release(SESSION_ARENA);
+    arena_cleanup();
 
     return 0;
 }
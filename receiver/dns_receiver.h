@@ -10,43 +10,75 @@
 #include <stdlib.h>
 #include <stdint.h>
 
+// Networking libraries
+#include <sys/socket.h>
+
+// Header files
+#include "dns_receiver_writer.h"
+#include "../common/dns_packet.h"
+
 
 /**
- * DNS header structure
- * Taken from: https://opensource.apple.com/source/netinfo/netinfo-208/common/dns.h.auto.html
+ * Maximum number of chunks received (out of order) before a missing chunk,
+ * so also the maximum number of chunks a sender may send without waiting for
+ * their confirmations
  */
-struct dns_header_t{
-    uint16_t xid;
-    uint16_t flags;
-    uint16_t qdcount;
-    uint16_t ancount;
-    uint16_t nscount;
-    uint16_t arcount;
-};
+#define MAX_PENDING_CHUNKS 64
 
 
-/*
- *
- * MISCELLANEOUS
- *
+/**
+ * Capabilities of the receiver (see PROTOCOL_VERSION) and the maximum length
+ * of base64 data in one query
  */
+#define RECEIVER_CAPABILITIES (CAP_INDEX | CAP_FEC | CAP_OFFSET | CAP_DELTA | CAP_DEDUP)
+#define MAX_PAYLOAD_LEN 250
 
 
 /**
- * @brief Variables and functions for decoding a string from base64
- *
- * @param data to decode
- * @param input_length in characters
- * @param output_length - pointer where the output length in chars will be
- * written
+ * Size of the buffer of received base64 data (DATA_B64) - it is decoded and
+ * passed to the writer once it holds a block, so it only needs space for a
+ * block, a chunk and padding
+ */
+#define DATA_B64_SIZE (WRITER_BLOCK_B64_LEN + 512)
+
+
+/**
+ * The open communication is closed when its sender sends nothing for
+ * SESSION_IDLE_TIMEOUT_MS by default (option "-i") - longer than the sender
+ * waits for all tries of a query. Timers of the receiver expire up to
+ * RECEIVER_TICK_US late
+ */
+#define SESSION_IDLE_TIMEOUT_MS 30000
+#define RECEIVER_TICK_US 100000
+
+
+/**
+ * Chunk waiting for the chunks before it
+ */
+struct pending_chunk{
+    int used;
+    int64_t offset; // In the base64 data
+    char payload_b64[256];
+};
+
+
+/**
+ * Response to a UDP client waiting until the received file is written
+ */
+struct deferred_response{
+    int sock;
+    struct sockaddr_storage client;
+    socklen_t client_len;
+    unsigned char buffer[512];
+    int buffer_len;
+};
+
+
+/*
  *
- * @return allocated string containing the output
+ * MISCELLANEOUS
  *
- * Taken and modified from: https://stackoverflow.com/a/6782480/17580261
  */
-void build_decoding_table();
-unsigned char *base64_decode(const char *data, int input_length, int *output_length);
-void base64_cleanup();
 
 
 /**
@@ -91,27 +123,43 @@ void check_args();
  * @brief Extract b64 payload from a packet received
  *
  * @param payload_b64 - pointer where to save the payload
+ * @param control - pointer where to save the control label (first label if
+ * it contains '-', which is not a base64 character), at least 64 bytes long
  * @param buffer - packet
  * @param buffer_len - packet length in bytes
  * @param query_id - pointer where to save xid from the header
+ *
+ * @return 0 if the packet carries a question with one of the base hosts, 1
+ * if it should be ignored
  */
-void get_payload(char *payload_b64, char *buffer, int buffer_len, int *query_id);
+int get_payload(char *payload_b64, char *control, char *buffer, int buffer_len, int *query_id);
 
 
 /**
  * @param Handle the first packet of a communication - extract the payload
- * (path, where to save the upcoming data), save it and prepare everything for
- * the communication
+ * (path, where to save the upcoming data, followed by the handshake of a
+ * sender which negotiates, see PROTOCOL_VERSION), save it and prepare
+ * everything for the communication. If the sender can send a delta and the
+ * file exists, the delta is written next to it (see dns_receiver_delta.h)
  *
  * @param payload_b64 - base64 payload in the packet
  */
 void handle_first_payload(char *payload_b64);
 
 
+/**
+ * @brief Decode the data collected in DATA_B64 and pass them to the writer
+ *
+ * @param fin - 1 if no more data will come (the end is padded and decoded
+ * too), 0 to keep the characters after the last full group of 4 in DATA_B64
+ */
+void write_data(int fin);
+
+
 /**
  * @brief Handles a payload which is not the first and not the last packet - so
- * just append the payload to DATA_B64 string, which will be decoded and saved
- * to file at the end
+ * just append the payload to DATA_B64 string, which is decoded and passed to
+ * the writer in blocks of WRITER_BLOCK_B64_LEN characters
  *
  * @param payload_b64 - payload in the packet, encoded in base64
  */
@@ -119,7 +167,148 @@ void handle_next_payload(char *payload_b64);
 
 
 /**
- * @param Handle the final message of a communication - decode the received
- * data, save it to a provided file and free all resources
+ * @param Handle the final message of a communication - decode the rest of the
+ * received data, pass it to the writer to save and close the file and free
+ * all resources
  */
 void handle_fin_msg();
+
+
+/**
+ * @brief Free the memory of the open communication and forget its state
+ */
+void reset_session();
+
+
+/**
+ * @brief Remove a file once the writer closed it (called by the writer)
+ *
+ * @param arg - path of the file, freed
+ */
+void remove_written(void *arg);
+
+
+/**
+ * @brief Close the open communication once its sender has not sent anything
+ * for IDLE_TIMEOUT_MS (it was stopped or lost the connection), so that the
+ * next communication is not taken for its continuation, and release
+ * everything it holds. The data received in order are written and the file
+ * is closed - and kept if KEEP_PARTIAL is set (a delta of the complete file
+ * against it can be sent later), removed otherwise. The delta of an existing
+ * file is always removed, the existing file stays as it was
+ */
+void expire_session();
+
+
+/**
+ * @brief Handle the timers which expired (call with QUERY_LOCK held)
+ */
+void run_timers();
+
+
+/**
+ * @brief Handle a chunk identified by a control label "o-OFFSET" (hexadecimal
+ * offset of the chunk in the base64 data), sent by a sender which doesn't
+ * wait for confirmations of previous chunks (over TCP). Chunks may come out
+ * of order, so the ones following a missing chunk wait in PENDING_CHUNKS
+ *
+ * @param control - control label of the chunk
+ * @param payload_b64 - base64 data of the chunk
+ *
+ * @return 1 if the chunk should be confirmed, 0 if it is invalid or there is
+ * no space to keep it
+ */
+int handle_offset_payload(char *control, char *payload_b64);
+
+
+/**
+ * @brief Handle a chunk identified by a control label "i-INDEX" (hexadecimal
+ * index of the chunk in the communication), sent by a sender which waits for
+ * the confirmation of every chunk. A repeated chunk (eg. a query sent again
+ * by a resolver) is only confirmed
+ *
+ * @param control - control label of the chunk
+ * @param payload_b64 - base64 data of the chunk
+ *
+ * @return 1 if the chunk should be confirmed, 0 if it is invalid or a chunk
+ * before it is missing
+ */
+int handle_indexed_payload(char *control, char *payload_b64);
+
+
+/**
+ * @brief Handle an offer of blocks identified by a control label "h-INDEX"
+ * (hexadecimal index of the first offered block) - the payload carries
+ * their hashes (8 bytes each)
+ *
+ * @param control - control label of the offer
+ * @param payload_b64 - base64 hashes
+ * @param bitmap - output, 4 bytes, bit of every offered block the store has
+ * (the highest bit of the first byte is the first block)
+ *
+ * @return 1 if the offer should be answered, 0 if it is invalid
+ */
+int handle_block_offer(char *control, char *payload_b64, unsigned char *bitmap);
+
+
+/**
+ * @brief Trigger the chunk received event of the client's address family
+ *
+ * @param family - AF_INET or AF_INET6
+ * @param host - struct in_addr or struct in6_addr of the client
+ * @param query_id - ID of the query carrying the chunk
+ * @param chunk_len - length of the chunk in bytes
+ */
+void trigger_chunk_received(int family, const void *host, int query_id, int chunk_len);
+
+
+/**
+ * @brief Handle a query received over UDP or TCP and turn it to the
+ * confirmation response (the same message with the response flag set, the
+ * first packet of a communication answered by selected capabilities)
+ *
+ * @param buffer - the query, replaced by the response, at least 512 bytes long
+ * @param buffer_len - length of the query in bytes, replaced by the length
+ * of the response
+ * @param client - address of the client
+ *
+ * @return 1 if the response should be sent, 2 if it should be sent once the
+ * received file is written (by writer_notify), 0 if not
+ */
+int handle_query(unsigned char *buffer, int *buffer_len, struct sockaddr *client);
+
+
+/**
+ * @brief Send a response to a UDP client (called by the writer when a
+ * response was deferred until the file is written) - not if the file could
+ * not be written, so that the sender doesn't take the transfer for done
+ *
+ * @param arg - struct deferred_response, freed
+ */
+void send_deferred_response(void *arg);
+
+
+/**
+ * @brief Receive a UDP query - in the low-latency mode (option "-b"), the
+ * socket is checked without waiting for up to BUSY_POLL_US first, so that a
+ * query which comes meanwhile is received without the wakeup of a blocking
+ * read
+ *
+ * @param sock
+ * @param buffer - output, at least 512 bytes long
+ * @param client - output, address of the client
+ * @param client_len - size of client, replaced by the length of the address
+ * @param timeout_ms - max time to wait (forever if negative)
+ *
+ * @return length of the query or -1 if none came in time
+ */
+int receive_query(int sock, unsigned char *buffer, struct sockaddr_storage *client, socklen_t *client_len, int timeout_ms);
+
+
+/**
+ * @brief Stop receiving (on SIGINT or SIGTERM), so that resources are freed
+ * and pending events written
+ *
+ * @param signum
+ */
+void stop_receiving(int signum);
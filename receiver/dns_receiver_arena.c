@@ -0,0 +1,154 @@
+/**
+ * @brief Arena allocator of the DNS tunneling receiver - memory of a session
+ * is bump-allocated from an arena and released at once, and released arenas
+ * are kept for the next sessions
+ * @file dns_receiver_arena.c
+ * @author Patrik Skaloš
+ * @year 2022
+ */
+
+
+// Standard libraries
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+// Header files
+#include "dns_receiver_arena.h"
+
+
+static struct arena *FREE_ARENAS = NULL; // Released arenas
+static int FREE_ARENAS_COUNT = 0;
+static pthread_mutex_t FREE_ARENAS_LOCK = PTHREAD_MUTEX_INITIALIZER;
+
+
+/**
+ * @brief Allocate memory or exit
+ *
+ * @param size - in bytes
+ *
+ * @return the memory
+ */
+static void *arena_malloc(size_t size){
+    void *memory = malloc(size);
+    if(!memory){
+        fprintf(stderr, "Error! Could not allocate memory\n");
+        exit(1);
+    }
+    return memory;
+}
+
+
+/**
+ * @brief Allocate a block
+ *
+ * @param size - of data in bytes
+ *
+ * @return the block
+ */
+static struct arena_block *arena_block_new(size_t size){
+    struct arena_block *block = arena_malloc(sizeof(struct arena_block) + size);
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+    return block;
+}
+
+
+/**
+ * @brief Get an empty arena - a released one if there is any
+ *
+ * @return the arena (exits if there is no memory)
+ */
+struct arena *arena_acquire(){
+    pthread_mutex_lock(&FREE_ARENAS_LOCK);
+    struct arena *arena = FREE_ARENAS;
+    if(arena){
+        FREE_ARENAS = arena->next_free;
+        FREE_ARENAS_COUNT--;
+    }
+    pthread_mutex_unlock(&FREE_ARENAS_LOCK);
+
+    if(!arena){
+        arena = arena_malloc(sizeof(struct arena));
+        arena->blocks = arena_block_new(ARENA_BLOCK_SIZE);
+    }
+    arena->next_free = NULL;
+    return arena;
+}
+
+
+/**
+ * @brief Allocate memory from an arena, valid until the arena is released
+ *
+ * @param arena
+ * @param size - in bytes
+ *
+ * @return memory aligned to 16 bytes (exits if there is no memory)
+ */
+void *arena_alloc(struct arena *arena, size_t size){
+    size = (size + 15) & ~(size_t)15;
+
+    // Add a block if the current one is full
+    struct arena_block *block = arena->blocks;
+    if(block->size - block->used < size){
+        block = arena_block_new(size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE);
+        block->next = arena->blocks;
+        arena->blocks = block;
+    }
+
+    void *memory = block->data + block->used;
+    block->used += size;
+    return memory;
+}
+
+
+/**
+ * @brief Release an arena with all its allocations at once (may be called
+ * from any thread)
+ *
+ * @param arena - NULL is ignored
+ */
+void arena_release(struct arena *arena){
+    if(!arena){
+        return;
+    }
+
+    // Keep only the first block allocated (the last in the list)
+    while(arena->blocks->next){
+        struct arena_block *block = arena->blocks;
+        arena->blocks = block->next;
+        free(block);
+    }
+    arena->blocks->used = 0;
+
+    pthread_mutex_lock(&FREE_ARENAS_LOCK);
+    if(FREE_ARENAS_COUNT < ARENA_MAX_FREE){
+        arena->next_free = FREE_ARENAS;
+        FREE_ARENAS = arena;
+        FREE_ARENAS_COUNT++;
+        arena = NULL;
+    }
+    pthread_mutex_unlock(&FREE_ARENAS_LOCK);
+
+    if(arena){
+        free(arena->blocks);
+        free(arena);
+    }
+}
+
+
+/**
+ * @brief Free all released arenas
+ */
+void arena_cleanup(){
+    pthread_mutex_lock(&FREE_ARENAS_LOCK);
+    while(FREE_ARENAS){
+        struct arena *arena = FREE_ARENAS;
+        FREE_ARENAS = arena->next_free;
+        free(arena->blocks);
+        free(arena);
+    }
+    FREE_ARENAS_COUNT = 0;
+    pthread_mutex_unlock(&FREE_ARENAS_LOCK);
+}
@@ -0,0 +1,83 @@
+/**
+ * @brief Arena allocator of the DNS tunneling receiver - memory of a session
+ * is bump-allocated from an arena and released at once, and released arenas
+ * are kept for the next sessions
+ * @file dns_receiver_arena.h
+ * @author Patrik Skaloš
+ * @year 2022
+ */
+
+#ifndef DNS_RECEIVER_ARENA_H
+#define DNS_RECEIVER_ARENA_H
+
+#include <stddef.h>
+
+
+/**
+ * Size of the first block of an arena in bytes, enough for a session (or a
+ * decoded block of data), so usually an arena has only one block
+ */
+#define ARENA_BLOCK_SIZE (128 * 1024)
+
+
+/**
+ * Maximum number of released arenas kept for reuse, more are freed
+ */
+#define ARENA_MAX_FREE 8
+
+
+/**
+ * Block of memory of an arena
+ */
+struct arena_block{
+    struct arena_block *next;
+    size_t size; // Of data in bytes
+    size_t used;
+    _Alignas(16) unsigned char data[];
+};
+
+
+/**
+ * Arena - list of blocks, allocations are taken from the first one
+ */
+struct arena{
+    struct arena_block *blocks;
+    struct arena *next_free; // In the list of released arenas
+};
+
+
+/**
+ * @brief Get an empty arena - a released one if there is any
+ *
+ * @return the arena (exits if there is no memory)
+ */
+struct arena *arena_acquire();
+
+
+/**
+ * @brief Allocate memory from an arena, valid until the arena is released
+ *
+ * @param arena
+ * @param size - in bytes
+ *
+ * @return memory aligned to 16 bytes (exits if there is no memory)
+ */
+void *arena_alloc(struct arena *arena, size_t size);
+
+
+/**
+ * @brief Release an arena with all its allocations at once (may be called
+ * from any thread)
+ *
+ * @param arena - NULL is ignored
+ */
+void arena_release(struct arena *arena);
+
+
+/**
+ * @brief Free all released arenas
+ */
+void arena_cleanup();
+
+
+#endif //DNS_RECEIVER_ARENA_H
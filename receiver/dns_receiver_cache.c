@@ -0,0 +1,83 @@
+/**
+ * @brief Cache of recent responses of the DNS tunneling receiver - a query
+ * repeated by a resolver (from the same address, with the same query ID and
+ * question) is answered by the same response without handling it again
+ * @file dns_receiver_cache.c
+ * @author Patrik Skaloš
+ * @year 2022
+ */
+
+
+// Standard libraries
+#include <string.h>
+
+// Header files
+#include "dns_receiver_cache.h"
+#include "../common/dns_delta.h"
+#include "../common/dns_net_io.h"
+
+
+/**
+ * Response kept in the cache
+ */
+struct cache_entry{
+    uint64_t key;
+    uint64_t stored_us;
+    int len; // 0 if the slot is empty
+    unsigned char response[512];
+};
+
+
+// Responses by their keys (only used by the thread receiving UDP queries)
+static struct cache_entry CACHE[CACHE_SLOTS];
+
+
+/**
+ * @brief Get the key of a query - a hash of the client's address and of the
+ * whole query (its ID, flags and question)
+ *
+ * @param query
+ * @param query_len - in bytes
+ * @param client - address of the client
+ * @param client_len - length of the address
+ *
+ * @return key
+ */
+uint64_t cache_key(const unsigned char *query, int query_len, const struct sockaddr *client, socklen_t client_len){
+    uint64_t key = delta_strong(query, query_len);
+    return key ^ (delta_strong((const unsigned char *)client, client_len) * 0x9E3779B97F4A7C15ULL);
+}
+
+
+/**
+ * @brief Find the response to a query answered recently
+ *
+ * @param key - of the query (see cache_key)
+ * @param response - output, at least 512 bytes long
+ *
+ * @return length of the response, 0 if there is none
+ */
+int cache_lookup(uint64_t key, unsigned char *response){
+    struct cache_entry *entry = &CACHE[key % CACHE_SLOTS];
+    if(!entry->len || entry->key != key || net_now_us() - entry->stored_us > (uint64_t)CACHE_TTL_MS * 1000){
+        return 0;
+    }
+    memcpy(response, entry->response, entry->len);
+    return entry->len;
+}
+
+
+/**
+ * @brief Keep the response to a query
+ *
+ * @param key - of the query (see cache_key)
+ * @param response
+ * @param response_len - in bytes, at most 512
+ */
+void cache_store(uint64_t key, const unsigned char *response, int response_len){
+    struct cache_entry *entry = &CACHE[key % CACHE_SLOTS];
+    entry->key = key;
+    entry->stored_us = net_now_us();
+    entry->len = response_len;
+    memcpy(entry->response, response, response_len);
+}
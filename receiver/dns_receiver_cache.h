@@ -0,0 +1,64 @@
+/**
+ * @brief Cache of recent responses of the DNS tunneling receiver - a query
+ * repeated by a resolver (from the same address, with the same query ID and
+ * question) is answered by the same response without handling it again
+ * @file dns_receiver_cache.h
+ * @author Patrik Skaloš
+ * @year 2022
+ */
+
+#ifndef DNS_RECEIVER_CACHE_H
+#define DNS_RECEIVER_CACHE_H
+
+#include <stdint.h>
+
+// Networking libraries
+#include <sys/socket.h>
+
+
+/**
+ * Number of responses kept (a newer response replaces an older one with the
+ * same slot) and the time a response is kept for - resolvers repeat queries
+ * within seconds, while a client reusing its address and query IDs later
+ * sends new queries
+ */
+#define CACHE_SLOTS 1024
+#define CACHE_TTL_MS 10000
+
+
+/**
+ * @brief Get the key of a query - a hash of the client's address and of the
+ * whole query (its ID, flags and question)
+ *
+ * @param query
+ * @param query_len - in bytes
+ * @param client - address of the client
+ * @param client_len - length of the address
+ *
+ * @return key
+ */
+uint64_t cache_key(const unsigned char *query, int query_len, const struct sockaddr *client, socklen_t client_len);
+
+
+/**
+ * @brief Find the response to a query answered recently
+ *
+ * @param key - of the query (see cache_key)
+ * @param response - output, at least 512 bytes long
+ *
+ * @return length of the response, 0 if there is none
+ */
+int cache_lookup(uint64_t key, unsigned char *response);
+
+
+/**
+ * @brief Keep the response to a query
+ *
+ * @param key - of the query (see cache_key)
+ * @param response
+ * @param response_len - in bytes, at most 512
+ */
+void cache_store(uint64_t key, const unsigned char *response, int response_len);
+
+
+#endif //DNS_RECEIVER_CACHE_H
@@ -0,0 +1,331 @@
+/**
+ * @brief Delta transfers for the DNS tunneling receiver - signatures of the
+ * existing destination file and reconstruction of the new file from it and
+ * the received delta (see common/dns_delta.h)
+ * @file dns_receiver_delta.c
+ * @author Patrik Skaloš
+ * @year 2022
+ */
+
+
+// Standard libraries
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Header files
+#include "dns_receiver_delta.h"
+#include "dns_receiver_store.h"
+#include "dns_receiver_writer.h"
+#include "../common/dns_delta.h"
+#include "../common/dns_metrics.h"
+
+
+/**
+ * Reconstruction of a file, done by the writer once the delta is written
+ */
+struct delta_job{
+    char *path;
+    char *delta_path;
+    int block_size;
+};
+
+
+static struct delta_signature *DELTA_SIGNATURES = NULL; // Of the existing file
+static uint64_t DELTA_BLOCK_COUNT = 0;
+static int DELTA_BLOCK_SIZE = 0;
+
+
+/**
+ * @brief Map a file to memory for reading
+ *
+ * @param path
+ * @param size - output, size of the file
+ *
+ * @return the mapping, NULL if the file can't be mapped (or is empty)
+ */
+static unsigned char *delta_map(const char *path, int64_t *size){
+    int fd = open(path, O_RDONLY);
+    if(fd == -1){
+        return NULL;
+    }
+    struct stat st;
+    unsigned char *data = NULL;
+    if(!fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0){
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(data == MAP_FAILED){
+            data = NULL;
+        }
+        *size = st.st_size;
+    }
+    close(fd);
+    return data;
+}
+
+
+/**
+ * @brief Write all data to a file
+ *
+ * @param fd
+ * @param data
+ * @param len - in bytes
+ *
+ * @return 0 on success
+ */
+static int delta_write(int fd, const unsigned char *data, int64_t len){
+    while(len > 0){
+        ssize_t written = write(fd, data, len);
+        if(written <= 0){
+            return 1;
+        }
+        data += written;
+        len -= written;
+    }
+    return 0;
+}
+
+
+/**
+ * @brief Compute signatures of the blocks of the existing destination file
+ *
+ * @param path - destination file
+ *
+ * @return 0 if the signatures are ready, 1 if there is no file to make a
+ * delta against (or it is shorter than a block)
+ */
+int delta_prepare(const char *path){
+    delta_reset();
+
+    int64_t size = 0;
+    unsigned char *data = delta_map(path, &size);
+    if(!data){
+        return 1;
+    }
+    DELTA_BLOCK_SIZE = delta_block_size(size);
+    DELTA_BLOCK_COUNT = size / DELTA_BLOCK_SIZE;
+    if(DELTA_BLOCK_COUNT){
+        DELTA_SIGNATURES = malloc(DELTA_BLOCK_COUNT * sizeof(struct delta_signature));
+    }
+    if(!DELTA_SIGNATURES){
+        munmap(data, size);
+        delta_reset();
+        return 1;
+    }
+
+    // Only full blocks, the rest of the file is always sent
+    for(uint64_t i = 0; i < DELTA_BLOCK_COUNT; i++){
+        const unsigned char *block = data + i * DELTA_BLOCK_SIZE;
+        DELTA_SIGNATURES[i].weak = delta_weak(block, DELTA_BLOCK_SIZE);
+        DELTA_SIGNATURES[i].strong = delta_strong(block, DELTA_BLOCK_SIZE);
+    }
+    munmap(data, size);
+    return 0;
+}
+
+
+/**
+ * @brief Write a page of signatures, the answer to the query "g-PAGE"
+ *
+ * @param page - index of the page
+ * @param data - output, at least DELTA_PAGE_SIZE bytes long
+ *
+ * @return length of the page, -1 if there is no such page
+ */
+int delta_page(uint64_t page, unsigned char *data){
+    if(!DELTA_SIGNATURES || page > (DELTA_BLOCK_COUNT - 1) / DELTA_PAGE_SIGNATURES){
+        return -1;
+    }
+    delta_put(data, DELTA_BLOCK_SIZE, 4);
+    delta_put(data + 4, DELTA_BLOCK_COUNT, 8);
+    int len = DELTA_PAGE_HEADER;
+    uint64_t end = (page + 1) * DELTA_PAGE_SIGNATURES;
+    for(uint64_t i = page * DELTA_PAGE_SIGNATURES; i < end && i < DELTA_BLOCK_COUNT; i++){
+        delta_put(data + len, DELTA_SIGNATURES[i].weak, 4);
+        delta_put(data + len + 4, DELTA_SIGNATURES[i].strong, 8);
+        len += DELTA_SIGNATURE_SIZE;
+    }
+    return len;
+}
+
+
+/**
+ * @brief Forget the signatures - call when a communication ends
+ */
+void delta_reset(){
+    free(DELTA_SIGNATURES);
+    DELTA_SIGNATURES = NULL;
+    DELTA_BLOCK_COUNT = 0;
+    DELTA_BLOCK_SIZE = 0;
+}
+
+
+/**
+ * @brief Follow the instructions of a delta and write the new file
+ *
+ * @param fd - new file
+ * @param old - existing file (NULL if there is none)
+ * @param old_size - its size in bytes
+ * @param block_size - size of the blocks the delta copies (0 if there is no
+ * existing file)
+ * @param delta
+ * @param delta_size - its size in bytes
+ *
+ * @return 0 if the new file is complete and its hash is right, 2 if the
+ * delta is cut short (the sender gave up the try), 1 if it is wrong
+ */
+static int delta_reconstruct(int fd, const unsigned char *old, int64_t old_size, int block_size,
+        const unsigned char *delta, int64_t delta_size){
+    uint64_t blocks = old && block_size ? old_size / block_size : 0;
+    int64_t pos = 0;
+    int64_t written = 0;
+    while(pos < delta_size){
+        int64_t left = delta_size - pos;
+        if(delta[pos] == DELTA_COPY){
+            if(left < DELTA_COPY_LEN){
+                return 2;
+            }
+            uint64_t index = delta_get(delta + pos + 1, 8);
+            uint64_t count = delta_get(delta + pos + 9, 4);
+            if(index > blocks || count > blocks - index
+                    || delta_write(fd, old + index * block_size, count * block_size)){
+                return 1;
+            }
+            written += count * block_size;
+            pos += DELTA_COPY_LEN;
+
+        }else if(delta[pos] == DELTA_LITERAL){
+            if(left < DELTA_LITERAL_LEN){
+                return 2;
+            }
+            int64_t len = delta_get(delta + pos + 1, 4);
+            if(len > left - DELTA_LITERAL_LEN){
+                return 2;
+            }
+            if(delta_write(fd, delta + pos + DELTA_LITERAL_LEN, len)){
+                return 1;
+            }
+            written += len;
+            pos += DELTA_LITERAL_LEN + len;
+
+        }else if(delta[pos] == DELTA_STORED){
+            if(left < DELTA_STORED_LEN){
+                return 2;
+            }
+            unsigned char block[DEDUP_BLOCK_SIZE];
+            if(store_read(delta_get(delta + pos + 1, 8), block)
+                    || delta_write(fd, block, DEDUP_BLOCK_SIZE)){
+                return 1;
+            }
+            written += DEDUP_BLOCK_SIZE;
+            pos += DELTA_STORED_LEN;
+
+        }else if(delta[pos] == DELTA_END){
+            if(left < DELTA_END_LEN){
+                return 2;
+            }
+
+            // The last instruction - check the new file
+            if(left > DELTA_END_LEN || (int64_t)delta_get(delta + pos + 1, 8) != written){
+                return 1;
+            }
+            if(!written){
+                return delta_get(delta + pos + 9, 8) != delta_strong(NULL, 0);
+            }
+            unsigned char *data = mmap(NULL, written, PROT_READ, MAP_SHARED, fd, 0);
+            if(data == MAP_FAILED){
+                return 1;
+            }
+            int wrong = delta_get(delta + pos + 9, 8) != delta_strong(data, written);
+            munmap(data, written);
+            return wrong;
+
+        }else{
+            return 1;
+        }
+    }
+
+    // The delta did not end (the sender did not finish it)
+    return 2;
+}
+
+
+/**
+ * @brief Reconstruct the new file (called by the writer) - if the delta was
+ * not written or the new file is wrong, the delta is marked as not written,
+ * so that the fin message is not confirmed. A delta cut short is only
+ * removed - its sender gave up the try and waits for the fin message to be
+ * confirmed to try again
+ *
+ * @param arg - struct delta_job, freed
+ */
+static void delta_apply_job(void *arg){
+    struct delta_job *job = arg;
+    char *new_path = malloc(strlen(job->path) + strlen(DELTA_NEW_SUFFIX) + 1);
+    if(!new_path){
+        fprintf(stderr, "Error! Could not allocate memory\n");
+        exit(1);
+    }
+    strcpy(new_path, job->path);
+    strcat(new_path, DELTA_NEW_SUFFIX);
+
+    int64_t old_size = 0, delta_size = 0;
+    unsigned char *old = delta_map(job->path, &old_size);
+    unsigned char *delta = delta_map(job->delta_path, &delta_size);
+    int fd = open(new_path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+
+    int failed = writer_failed() || fd == -1 ? 1 : !delta ? 2
+        : delta_reconstruct(fd, old, old_size, job->block_size, delta, delta_size);
+    if(fd != -1){
+        close(fd);
+    }
+    if(!failed && rename(new_path, job->path)){
+        failed = 1;
+    }
+    if(failed){
+        unlink(new_path);
+    }
+    if(failed == 1){
+        fprintf(stderr, "Error! Could not reconstruct \"%s\" from the delta, keeping the existing file\n", job->path);
+        if(!writer_failed()){
+            metrics_add(METRIC_TRANSFERS_FAILED, 1);
+            writer_fail();
+        }
+    }
+
+    if(old){
+        munmap(old, old_size);
+    }
+    if(delta){
+        munmap(delta, delta_size);
+    }
+    unlink(job->delta_path);
+    free(new_path);
+    free(job->path);
+    free(job->delta_path);
+    free(job);
+}
+
+
+/**
+ * @brief Reconstruct the new file from the existing one (if there is one),
+ * stored blocks and the received delta once the writer wrote the delta, and
+ * replace the existing file by it if it is complete and its hash is right
+ * (the existing file is kept and the fin message is not confirmed
+ * otherwise). The delta file is removed
+ *
+ * @param path - destination file
+ * @param delta_path - received delta
+ */
+void delta_apply(const char *path, const char *delta_path){
+    struct delta_job *job = malloc(sizeof(struct delta_job));
+    if(!job || !(job->path = strdup(path)) || !(job->delta_path = strdup(delta_path))){
+        fprintf(stderr, "Error! Could not allocate memory\n");
+        exit(1);
+    }
+    job->block_size = DELTA_BLOCK_SIZE;
+    writer_notify(delta_apply_job, job);
+}
@@ -0,0 +1,65 @@
+/**
+ * @brief Delta transfers for the DNS tunneling receiver - signatures of the
+ * existing destination file and reconstruction of the new file from it and
+ * the received delta (see common/dns_delta.h)
+ * @file dns_receiver_delta.h
+ * @author Patrik Skaloš
+ * @year 2022
+ */
+
+#ifndef DNS_RECEIVER_DELTA_H
+#define DNS_RECEIVER_DELTA_H
+
+#include <stdint.h>
+
+
+/**
+ * Suffixes of the files next to the destination file - the received delta
+ * and the new file before it replaces the existing one
+ */
+#define DELTA_SUFFIX ".dns-delta"
+#define DELTA_NEW_SUFFIX ".dns-new"
+
+
+/**
+ * @brief Compute signatures of the blocks of the existing destination file
+ *
+ * @param path - destination file
+ *
+ * @return 0 if the signatures are ready, 1 if there is no file to make a
+ * delta against (or it is shorter than a block)
+ */
+int delta_prepare(const char *path);
+
+
+/**
+ * @brief Write a page of signatures, the answer to the query "g-PAGE"
+ *
+ * @param page - index of the page
+ * @param data - output, at least DELTA_PAGE_SIZE bytes long
+ *
+ * @return length of the page, -1 if there is no such page
+ */
+int delta_page(uint64_t page, unsigned char *data);
+
+
+/**
+ * @brief Forget the signatures - call when a communication ends
+ */
+void delta_reset();
+
+
+/**
+ * @brief Reconstruct the new file from the existing one (if there is one),
+ * stored blocks and the received delta once the writer wrote the delta, and
+ * replace the existing file by it if it is complete and its hash is right
+ * (the existing file is kept and the fin message is not confirmed
+ * otherwise). The delta file is removed
+ *
+ * @param path - destination file
+ * @param delta_path - received delta
+ */
+void delta_apply(const char *path, const char *delta_path);
+
+
+#endif //DNS_RECEIVER_DELTA_H
@@ -1,52 +1,120 @@
 #include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include "dns_receiver_events.h"
+#include "../common/dns_event_sink.h"
 
 #define NETADDR_STRLEN (INET6_ADDRSTRLEN > INET_ADDRSTRLEN ? INET6_ADDRSTRLEN : INET_ADDRSTRLEN)
-#define CREATE_IPV4STR(dst, src) char dst[NETADDR_STRLEN]; inet_ntop(AF_INET, src, dst, NETADDR_STRLEN)
-#define CREATE_IPV6STR(dst, src) char dst[NETADDR_STRLEN]; inet_ntop(AF_INET6, src, dst, NETADDR_STRLEN)
+
+enum
+{
+	EVENT_QUERY_PARSED,
+	EVENT_CHUNK_RECEIVED,
+	EVENT_TRANSFER_INIT,
+	EVENT_TRANSFER_COMPLETED
+};
+
+/**
+ * Formats a record as the text output of the receiver
+ */
+void dns_receiver__format_event(FILE *out, const struct event_record *record)
+{
+	char address[NETADDR_STRLEN] = "";
+	if (record->family)
+	{
+		inet_ntop(record->family, record->address, address, NETADDR_STRLEN);
+	}
+
+	switch (record->type)
+	{
+		case EVENT_QUERY_PARSED:
+			fprintf(out, "[PARS] %s '%s'\n", record->path, record->data);
+			break;
+		case EVENT_CHUNK_RECEIVED:
+			fprintf(out, "[RECV] %s %9d %dB from %s\n", record->path, record->chunk_id, (int)record->size, address);
+			break;
+		case EVENT_TRANSFER_INIT:
+			fprintf(out, "[INIT] %s\n", address);
+			break;
+		case EVENT_TRANSFER_COMPLETED:
+			fprintf(out, "[CMPL] %s of %" PRId64 "B\n", record->path, record->size);
+			break;
+	}
+}
+
+int dns_receiver__events_enabled()
+{
+	event_sink_init(dns_receiver__format_event);
+	return event_sink_enabled();
+}
+
+static void emit_address(struct event_record *record, int family, const void *address)
+{
+	record->family = family;
+	memcpy(record->address, address, family == AF_INET6 ? 16 : 4);
+}
 
 void dns_receiver__on_query_parsed(char *filePath, char *encodedData)
 {
-	fprintf(stderr, "[PARS] %s '%s'\n", filePath, encodedData);
+	if (!dns_receiver__events_enabled()) return;
+	struct event_record record;
+	event_record_init(&record, EVENT_QUERY_PARSED);
+	event_record_string(record.path, filePath, EVENT_PATH_LEN);
+	event_record_string(record.data, encodedData, EVENT_DATA_LEN);
+	event_sink_emit(&record);
 }
 
-void on_chunk_received(char *source, char *filePath, int chunkId, int chunkSize)
+static void on_chunk_received(int family, const void *source, char *filePath, int chunkId, int chunkSize)
 {
-	fprintf(stderr, "[RECV] %s %9d %dB from %s\n", filePath, chunkId, chunkSize, source);
+	struct event_record record;
+	event_record_init(&record, EVENT_CHUNK_RECEIVED);
+	emit_address(&record, family, source);
+	event_record_string(record.path, filePath, EVENT_PATH_LEN);
+	record.chunk_id = chunkId;
+	record.size = chunkSize;
+	event_sink_emit(&record);
 }
 
 void dns_receiver__on_chunk_received(struct in_addr *source, char *filePath, int chunkId, int chunkSize)
 {
-	CREATE_IPV4STR(address, source);
-	on_chunk_received(address, filePath, chunkId, chunkSize);
+	if (!dns_receiver__events_enabled()) return;
+	on_chunk_received(AF_INET, source, filePath, chunkId, chunkSize);
 }
 
 void dns_receiver__on_chunk_received6(struct in6_addr *source, char *filePath, int chunkId, int chunkSize)
 {
-	CREATE_IPV6STR(address, source);
-	on_chunk_received(address, filePath, chunkId, chunkSize);
+	if (!dns_receiver__events_enabled()) return;
+	on_chunk_received(AF_INET6, source, filePath, chunkId, chunkSize);
 }
 
-void on_transfer_init(char *source)
+static void on_transfer_init(int family, const void *source)
 {
-	fprintf(stderr, "[INIT] %s\n", source);
+	struct event_record record;
+	event_record_init(&record, EVENT_TRANSFER_INIT);
+	emit_address(&record, family, source);
+	event_sink_emit(&record);
 }
 
 void dns_receiver__on_transfer_init(struct in_addr *source)
 {
-	CREATE_IPV4STR(address, source);
-	on_transfer_init(address);
+	if (!dns_receiver__events_enabled()) return;
+	on_transfer_init(AF_INET, source);
 }
 
 void dns_receiver__on_transfer_init6(struct in6_addr *source)
 {
-	CREATE_IPV6STR(address, source);
-	on_transfer_init(address);
+	if (!dns_receiver__events_enabled()) return;
+	on_transfer_init(AF_INET6, source);
 }
 
-void dns_receiver__on_transfer_completed(char *filePath, int fileSize)
+void dns_receiver__on_transfer_completed(char *filePath, int64_t fileSize)
 {
-	fprintf(stderr, "[CMPL] %s of %dB\n", filePath, fileSize);
+	if (!dns_receiver__events_enabled()) return;
+	struct event_record record;
+	event_record_init(&record, EVENT_TRANSFER_COMPLETED);
+	event_record_string(record.path, filePath, EVENT_PATH_LEN);
+	record.size = fileSize;
+	event_sink_emit(&record);
 }
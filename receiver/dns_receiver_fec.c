@@ -0,0 +1,129 @@
+/**
+ * @brief Forward error correction for the DNS tunneling receiver
+ * @file dns_receiver_fec.c
+ * @author Patrik Skaloš
+ * @year 2022
+ */
+
+
+// Standard libraries
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+// Header files
+#include "dns_receiver.h"
+#include "dns_receiver_fec.h"
+#include "../common/dns_base64.h"
+
+
+static uint64_t FEC_NEXT_GROUP = 0; // Group which is being received
+static int FEC_RECEIVED[FEC_MAX_GROUP + 1]; // 1 if chunk of the group was received
+static int FEC_RECEIVED_COUNT = 0;
+static char FEC_CHUNKS[FEC_MAX_GROUP + 1][256]; // Chunks of the group
+
+
+/**
+ * @brief Get expected length of a chunk in a group - all chunks except the
+ * last data chunk are full (and the parity is as long as the first chunk)
+ *
+ * @param index - index of the chunk in the group
+ * @param n - number of data chunks in the group
+ * @param chunk_len - length of full chunks
+ * @param last_len - length of the last data chunk
+ *
+ * @return length of the chunk in characters
+ */
+static int fec_chunk_len(int index, int n, int chunk_len, int last_len){
+    if(index == n - 1 || (index == n && n == 1)){
+        return last_len;
+    }
+    return chunk_len;
+}
+
+
+/**
+ * @brief Forget the group being received - call when a communication starts
+ * or ends
+ */
+void fec_reset(){
+    FEC_NEXT_GROUP = 0;
+    FEC_RECEIVED_COUNT = 0;
+    memset(FEC_RECEIVED, 0, sizeof(FEC_RECEIVED));
+}
+
+
+/**
+ * @brief Handle a chunk identified by a FEC control label "f-G-I-N-C-L" (see
+ * the sender). Chunks of the current group are stored and once any N of the
+ * N + 1 chunks of the group are received, the missing data chunk (if any) is
+ * reconstructed from the parity and all data chunks of the group are
+ * appended to the received data in order
+ *
+ * @param control - control label of the chunk
+ * @param payload_b64 - base64 data of the chunk
+ *
+ * @return 1 if the chunk should be confirmed, 0 if it is invalid or does not
+ * belong to the group being received
+ */
+int fec_handle_chunk(char *control, char *payload_b64){
+    uint64_t group = 0;
+    unsigned int index = 0, n = 0, chunk_len = 0, last_len = 0;
+    if(sscanf(control, "f-%" SCNx64 "-%x-%x-%x-%x", &group, &index, &n, &chunk_len, &last_len) != 5){
+        return 0;
+    }
+    if(n < 1 || n > FEC_MAX_GROUP || index > n || chunk_len > 255 || last_len < 1 || last_len > chunk_len){
+        return 0;
+    }
+    if(strlen(payload_b64) != fec_chunk_len(index, n, chunk_len, last_len)){
+        return 0;
+    }
+
+    if(group < FEC_NEXT_GROUP){
+        // Group was already reconstructed, this is a repeated chunk
+        return 1;
+    }
+    if(group > FEC_NEXT_GROUP){
+        // The sender never starts a group before the previous one is done
+        return 0;
+    }
+
+    if(!FEC_RECEIVED[index]){
+        strcpy(FEC_CHUNKS[index], payload_b64);
+        FEC_RECEIVED[index] = 1;
+        FEC_RECEIVED_COUNT += 1;
+    }
+
+    if(FEC_RECEIVED_COUNT < n){
+        return 1;
+    }
+
+    // Reconstruct the missing data chunk from the parity and the others
+    for(int missing = 0; missing < n; missing++){
+        if(FEC_RECEIVED[missing]){
+            continue;
+        }
+        int len = fec_chunk_len(missing, n, chunk_len, last_len);
+        for(int i = 0; i < len; i++){
+            int value = base64_sextet(FEC_CHUNKS[n][i]);
+            for(int j = 0; j < n; j++){
+                if(j != missing && i < fec_chunk_len(j, n, chunk_len, last_len)){
+                    value ^= base64_sextet(FEC_CHUNKS[j][i]);
+                }
+            }
+            FEC_CHUNKS[missing][i] = base64_char(value);
+        }
+        FEC_CHUNKS[missing][len] = '\0';
+    }
+
+    // Save the data of the whole group
+    for(int i = 0; i < n; i++){
+        handle_next_payload(FEC_CHUNKS[i]);
+    }
+
+    FEC_NEXT_GROUP += 1;
+    FEC_RECEIVED_COUNT = 0;
+    memset(FEC_RECEIVED, 0, sizeof(FEC_RECEIVED));
+    return 1;
+}
@@ -0,0 +1,41 @@
+/**
+ * @brief Forward error correction for the DNS tunneling receiver
+ * @file dns_receiver_fec.h
+ * @author Patrik Skaloš
+ * @year 2022
+ */
+
+#ifndef DNS_RECEIVER_FEC_H
+#define DNS_RECEIVER_FEC_H
+
+
+/**
+ * Maximum amount of data chunks protected by one parity chunk
+ */
+#define FEC_MAX_GROUP 16
+
+
+/**
+ * @brief Forget the group being received - call when a communication starts
+ * or ends
+ */
+void fec_reset();
+
+
+/**
+ * @brief Handle a chunk identified by a FEC control label "f-G-I-N-C-L" (see
+ * the sender). Chunks of the current group are stored and once any N of the
+ * N + 1 chunks of the group are received, the missing data chunk (if any) is
+ * reconstructed from the parity and all data chunks of the group are
+ * appended to the received data in order
+ *
+ * @param control - control label of the chunk
+ * @param payload_b64 - base64 data of the chunk
+ *
+ * @return 1 if the chunk should be confirmed, 0 if it is invalid or does not
+ * belong to the group being received
+ */
+int fec_handle_chunk(char *control, char *payload_b64);
+
+
+#endif //DNS_RECEIVER_FEC_H
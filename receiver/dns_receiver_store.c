@@ -0,0 +1,268 @@
+/**
+ * @brief Content-addressed store of received blocks of the DNS tunneling
+ * receiver - blocks of received files are kept (once) and a sender refers to
+ * the blocks the store has instead of sending them again
+ * @file dns_receiver_store.c
+ * @author Patrik Skaloš
+ * @year 2022
+ */
+
+
+// Standard libraries
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+// Header files
+#include "dns_receiver_store.h"
+#include "dns_receiver_writer.h"
+#include "../common/dns_delta.h"
+
+
+/**
+ * Block in the index - open addressing by the hash
+ */
+struct store_entry{
+    uint64_t hash;
+    uint32_t block; // Index of the block in the pack
+    uint32_t used;
+};
+
+
+static int STORE_PACK_FD = -1;
+static int STORE_INDEX_FD = -1;
+static struct store_entry *STORE_ENTRIES = NULL;
+static uint64_t STORE_CAPACITY = 0; // Power of 2
+static uint64_t STORE_COUNT = 0; // Blocks in the pack
+static pthread_mutex_t STORE_LOCK = PTHREAD_MUTEX_INITIALIZER;
+
+
+/**
+ * @brief Find the entry of a hash or the free entry where it belongs
+ *
+ * @param hash
+ *
+ * @return the entry
+ */
+static struct store_entry *store_find(uint64_t hash){
+    uint64_t i = hash & (STORE_CAPACITY - 1);
+    while(STORE_ENTRIES[i].used && STORE_ENTRIES[i].hash != hash){
+        i = (i + 1) & (STORE_CAPACITY - 1);
+    }
+    return &STORE_ENTRIES[i];
+}
+
+
+/**
+ * @brief Put a block to the index, which grows to stay at most half full
+ *
+ * @param hash
+ * @param block - index of the block in the pack
+ */
+static void store_insert(uint64_t hash, uint32_t block){
+    if((STORE_COUNT + 1) * 2 > STORE_CAPACITY){
+        struct store_entry *old = STORE_ENTRIES;
+        uint64_t old_capacity = STORE_CAPACITY;
+        STORE_CAPACITY = STORE_CAPACITY ? STORE_CAPACITY * 2 : 4096;
+        STORE_ENTRIES = calloc(STORE_CAPACITY, sizeof(struct store_entry));
+        if(!STORE_ENTRIES){
+            fprintf(stderr, "Error! Could not allocate memory\n");
+            exit(1);
+        }
+        for(uint64_t i = 0; i < old_capacity; i++){
+            if(old[i].used){
+                *store_find(old[i].hash) = old[i];
+            }
+        }
+        free(old);
+    }
+    struct store_entry *entry = store_find(hash);
+    if(!entry->used){
+        entry->hash = hash;
+        entry->block = block;
+        entry->used = 1;
+    }
+}
+
+
+/**
+ * @brief Open the store in a directory (created if it doesn't exist) and load
+ * its index
+ *
+ * @param dir - destination directory
+ *
+ * @return 0 on success
+ */
+int store_open(const char *dir){
+    store_close();
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", dir, STORE_DIR);
+    if(mkdir(path, 0700) && errno != EEXIST){
+        return 1;
+    }
+    snprintf(path, sizeof(path), "%s/%s/%s", dir, STORE_DIR, STORE_PACK);
+    STORE_PACK_FD = open(path, O_RDWR | O_CREAT, 0600);
+    snprintf(path, sizeof(path), "%s/%s/%s", dir, STORE_DIR, STORE_INDEX);
+    STORE_INDEX_FD = open(path, O_RDWR | O_CREAT, 0600);
+    struct stat pack_st, index_st;
+    if(STORE_PACK_FD == -1 || STORE_INDEX_FD == -1
+            || fstat(STORE_PACK_FD, &pack_st) || fstat(STORE_INDEX_FD, &index_st)){
+        store_close();
+        return 1;
+    }
+
+    // Blocks are written before their hashes, so the index may only miss
+    // blocks written last (eg. when the receiver was killed) - forget them
+    uint64_t count = index_st.st_size / 8;
+    if(count > (uint64_t)pack_st.st_size / DEDUP_BLOCK_SIZE){
+        count = pack_st.st_size / DEDUP_BLOCK_SIZE;
+    }
+    if(count > STORE_MAX_BLOCKS){
+        count = STORE_MAX_BLOCKS;
+    }
+    if(ftruncate(STORE_PACK_FD, count * DEDUP_BLOCK_SIZE) || ftruncate(STORE_INDEX_FD, count * 8)){
+        store_close();
+        return 1;
+    }
+
+    unsigned char hashes[8 * 1024];
+    for(uint64_t block = 0; block < count; ){
+        int n = count - block < 1024 ? count - block : 1024;
+        if(pread(STORE_INDEX_FD, hashes, n * 8, block * 8) != n * 8){
+            store_close();
+            return 1;
+        }
+        for(int i = 0; i < n; i++, block++){
+            store_insert(delta_get(hashes + i * 8, 8), block);
+            STORE_COUNT = block + 1;
+        }
+    }
+    return 0;
+}
+
+
+/**
+ * @brief Check if the store is open
+ *
+ * @return 1 if it is
+ */
+int store_enabled(){
+    return STORE_PACK_FD != -1;
+}
+
+
+/**
+ * @brief Check if the store has a block
+ *
+ * @param hash - strong hash of the block
+ *
+ * @return 1 if it has
+ */
+int store_has(uint64_t hash){
+    pthread_mutex_lock(&STORE_LOCK);
+    int has = STORE_ENTRIES && store_find(hash)->used;
+    pthread_mutex_unlock(&STORE_LOCK);
+    return has;
+}
+
+
+/**
+ * @brief Read a block from the store
+ *
+ * @param hash - strong hash of the block
+ * @param block - output, DEDUP_BLOCK_SIZE bytes
+ *
+ * @return 0 on success, 1 if the store doesn't have the block
+ */
+int store_read(uint64_t hash, unsigned char *block){
+    pthread_mutex_lock(&STORE_LOCK);
+    struct store_entry *entry = STORE_ENTRIES ? store_find(hash) : NULL;
+    int missing = !entry || !entry->used
+        || pread(STORE_PACK_FD, block, DEDUP_BLOCK_SIZE, (off_t)entry->block * DEDUP_BLOCK_SIZE) != DEDUP_BLOCK_SIZE;
+    pthread_mutex_unlock(&STORE_LOCK);
+    return missing;
+}
+
+
+/**
+ * @brief Add all full blocks of a file (at offsets which are multiples of
+ * DEDUP_BLOCK_SIZE) the store doesn't have yet, up to STORE_MAX_BLOCKS
+ *
+ * @param path - the file
+ */
+void store_add_file(const char *path){
+    int fd = open(path, O_RDONLY);
+    if(fd == -1){
+        return;
+    }
+    unsigned char block[DEDUP_BLOCK_SIZE];
+    while(read(fd, block, DEDUP_BLOCK_SIZE) == DEDUP_BLOCK_SIZE){
+        uint64_t hash = delta_strong(block, DEDUP_BLOCK_SIZE);
+        pthread_mutex_lock(&STORE_LOCK);
+        if(store_enabled() && STORE_COUNT < STORE_MAX_BLOCKS && !(STORE_ENTRIES && store_find(hash)->used)){
+            unsigned char hash_be[8];
+            delta_put(hash_be, hash, 8);
+            if(pwrite(STORE_PACK_FD, block, DEDUP_BLOCK_SIZE, STORE_COUNT * DEDUP_BLOCK_SIZE) == DEDUP_BLOCK_SIZE
+                    && pwrite(STORE_INDEX_FD, hash_be, 8, STORE_COUNT * 8) == 8){
+                store_insert(hash, STORE_COUNT);
+                STORE_COUNT += 1;
+            }
+        }
+        pthread_mutex_unlock(&STORE_LOCK);
+    }
+    close(fd);
+}
+
+
+/**
+ * @brief Add blocks of a file to the store (called by the writer)
+ *
+ * @param arg - path of the file, freed
+ */
+static void store_add_job(void *arg){
+    store_add_file(arg);
+    free(arg);
+}
+
+
+/**
+ * @brief Add blocks of a file to the store once everything queued to the
+ * writer before is written (by the writer)
+ *
+ * @param path - the file
+ */
+void store_add_later(const char *path){
+    char *arg = strdup(path);
+    if(!arg){
+        fprintf(stderr, "Error! Could not allocate memory\n");
+        exit(1);
+    }
+    writer_notify(store_add_job, arg);
+}
+
+
+/**
+ * @brief Close the store and free its index
+ */
+void store_close(){
+    pthread_mutex_lock(&STORE_LOCK);
+    if(STORE_PACK_FD != -1){
+        close(STORE_PACK_FD);
+    }
+    if(STORE_INDEX_FD != -1){
+        close(STORE_INDEX_FD);
+    }
+    STORE_PACK_FD = -1;
+    STORE_INDEX_FD = -1;
+    free(STORE_ENTRIES);
+    STORE_ENTRIES = NULL;
+    STORE_CAPACITY = 0;
+    STORE_COUNT = 0;
+    pthread_mutex_unlock(&STORE_LOCK);
+}
@@ -0,0 +1,92 @@
+/**
+ * @brief Content-addressed store of received blocks of the DNS tunneling
+ * receiver - blocks of received files are kept (once) and a sender refers to
+ * the blocks the store has instead of sending them again
+ * @file dns_receiver_store.h
+ * @author Patrik Skaloš
+ * @year 2022
+ */
+
+#ifndef DNS_RECEIVER_STORE_H
+#define DNS_RECEIVER_STORE_H
+
+#include <stdint.h>
+
+
+/**
+ * Directory of the store (in the destination directory), with the file of
+ * blocks (each DEDUP_BLOCK_SIZE bytes, see common/dns_delta.h) and the index
+ * of their hashes (8 bytes per block, in the order of blocks), and the max
+ * number of blocks kept
+ */
+#define STORE_DIR ".dns-blocks"
+#define STORE_PACK "pack"
+#define STORE_INDEX "index"
+#define STORE_MAX_BLOCKS (1 << 22)
+
+
+/**
+ * @brief Open the store in a directory (created if it doesn't exist) and load
+ * its index
+ *
+ * @param dir - destination directory
+ *
+ * @return 0 on success
+ */
+int store_open(const char *dir);
+
+
+/**
+ * @brief Check if the store is open
+ *
+ * @return 1 if it is
+ */
+int store_enabled();
+
+
+/**
+ * @brief Check if the store has a block
+ *
+ * @param hash - strong hash of the block
+ *
+ * @return 1 if it has
+ */
+int store_has(uint64_t hash);
+
+
+/**
+ * @brief Read a block from the store
+ *
+ * @param hash - strong hash of the block
+ * @param block - output, DEDUP_BLOCK_SIZE bytes
+ *
+ * @return 0 on success, 1 if the store doesn't have the block
+ */
+int store_read(uint64_t hash, unsigned char *block);
+
+
+/**
+ * @brief Add all full blocks of a file (at offsets which are multiples of
+ * DEDUP_BLOCK_SIZE) the store doesn't have yet, up to STORE_MAX_BLOCKS
+ *
+ * @param path - the file
+ */
+void store_add_file(const char *path);
+
+
+/**
+ * @brief Add blocks of a file to the store once everything queued to the
+ * writer before is written (by the writer)
+ *
+ * @param path - the file
+ */
+void store_add_later(const char *path);
+
+
+/**
+ * @brief Close the store and free its index
+ */
+void store_close();
+
+
+#endif //DNS_RECEIVER_STORE_H
@@ -0,0 +1,177 @@
+/**
+ * @brief DNS over TCP (RFC 7766) for the DNS tunneling receiver
+ * @file dns_receiver_tcp.c
+ * @author Patrik Skaloš
+ * @year 2022
+ */
+
+
+// Standard libraries
+#include <stdlib.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+
+// Networking libraries
+#include <sys/socket.h>
+
+// Header files
+#include "dns_receiver.h"
+#include "dns_receiver_tcp.h"
+#include "dns_receiver_writer.h"
+#include "../common/dns_metrics.h"
+#include "../common/dns_net_io.h"
+#include "../common/dns_packet.h"
+
+
+/**
+ * Connection served by a thread
+ */
+struct tcp_connection{
+    int sock;
+    struct sockaddr_storage client;
+};
+
+
+// Connections being served
+static atomic_int TCP_CONNECTIONS = 0;
+
+
+/**
+ * Connection waiting until the received file is written
+ */
+struct tcp_waiting{
+    sem_t written;
+    int failed; // 1 if the file could not be written
+};
+
+
+/**
+ * @brief Wake up a connection waiting until the received file is written
+ *
+ * @param arg - struct tcp_waiting
+ */
+static void tcp_written(void *arg){
+    struct tcp_waiting *waiting = arg;
+    waiting->failed = writer_failed();
+    sem_post(&waiting->written);
+}
+
+
+/**
+ * @brief Serve a connection - handle its queries in the order they come
+ * until it is closed or idle for TCP_IDLE_TIMEOUT_MS
+ *
+ * @param arg - struct tcp_connection, freed at the end
+ */
+static void *tcp_serve(void *arg){
+    struct tcp_connection *conn = arg;
+    unsigned char *buffer = malloc(NET_MAX_MESSAGE_LEN);
+
+    while(buffer){
+        int buffer_len = net_recv_message(conn->sock, buffer, NET_MAX_MESSAGE_LEN, TCP_IDLE_TIMEOUT_MS);
+        if(buffer_len < 0){
+            break;
+        }
+        if(buffer_len < (int)sizeof(struct dns_header_t)){
+            continue;
+        }
+
+        int respond = handle_query(buffer, &buffer_len, (struct sockaddr *)&conn->client);
+        if(respond == 2){
+            // Only this connection waits until the file is written, and
+            // the sender is not told it was if it wasn't
+            struct tcp_waiting waiting;
+            sem_init(&waiting.written, 0, 0);
+            writer_notify(tcp_written, &waiting);
+            while(sem_wait(&waiting.written)){
+            }
+            sem_destroy(&waiting.written);
+            if(waiting.failed){
+                metrics_add(METRIC_DROPS, 1);
+                respond = 0;
+            }
+        }
+        if(respond){
+            if(net_send_message(conn->sock, buffer, buffer_len) != buffer_len){
+                break;
+            }
+            metrics_add(METRIC_PACKETS_OUT, 1);
+            metrics_add(METRIC_BYTES_OUT, buffer_len + 2);
+        }
+    }
+
+    free(buffer);
+    net_close(conn->sock);
+    free(conn);
+    atomic_fetch_sub(&TCP_CONNECTIONS, 1);
+    return NULL;
+}
+
+
+/**
+ * @brief Accept connections and start a thread for each of them
+ *
+ * @param arg - listening socket
+ */
+static void *tcp_accept(void *arg){
+    int sock = (int)(intptr_t)arg;
+
+    while(1){
+        struct tcp_connection *conn = malloc(sizeof(struct tcp_connection));
+        if(!conn){
+            return NULL;
+        }
+        socklen_t client_len = sizeof(conn->client);
+        conn->sock = net_accept(sock, (struct sockaddr *)&conn->client, &client_len);
+        if(conn->sock == -1){
+            free(conn);
+            continue;
+        }
+        if(atomic_fetch_add(&TCP_CONNECTIONS, 1) >= TCP_MAX_CONNECTIONS){
+            atomic_fetch_sub(&TCP_CONNECTIONS, 1);
+            net_close(conn->sock);
+            free(conn);
+            continue;
+        }
+
+        pthread_t thread;
+        if(pthread_create(&thread, NULL, tcp_serve, conn)){
+            atomic_fetch_sub(&TCP_CONNECTIONS, 1);
+            net_close(conn->sock);
+            free(conn);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+    return NULL;
+}
+
+
+/**
+ * @brief Start accepting TCP connections on the port in the background.
+ * Every connection is served by its own thread, which reads queries
+ * (prefixed by their length) and writes the responses, so a client may send
+ * many queries without waiting for the responses
+ *
+ * @param port
+ *
+ * @return 0 if listening, 1 if not (eg. the port is taken)
+ */
+int tcp_start(int port){
+    int sock = net_listen(AF_INET6, port);
+    if(sock == -1){
+        sock = net_listen(AF_INET, port);
+    }
+    if(sock == -1){
+        return 1;
+    }
+
+    pthread_t thread;
+    if(pthread_create(&thread, NULL, tcp_accept, (void *)(intptr_t)sock)){
+        net_close(sock);
+        return 1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
@@ -0,0 +1,34 @@
+/**
+ * @brief DNS over TCP (RFC 7766) for the DNS tunneling receiver
+ * @file dns_receiver_tcp.h
+ * @author Patrik Skaloš
+ * @year 2022
+ */
+
+#ifndef DNS_RECEIVER_TCP_H
+#define DNS_RECEIVER_TCP_H
+
+
+/**
+ * Time after which an idle connection is closed and the maximum number of
+ * open connections (more are closed right after they are accepted), so that
+ * clients which vanish can't hold more
+ */
+#define TCP_IDLE_TIMEOUT_MS 30000
+#define TCP_MAX_CONNECTIONS 256
+
+
+/**
+ * @brief Start accepting TCP connections on the port in the background.
+ * Every connection is served by its own thread, which reads queries
+ * (prefixed by their length) and writes the responses, so a client may send
+ * many queries without waiting for the responses
+ *
+ * @param port
+ *
+ * @return 0 if listening, 1 if not (eg. the port is taken)
+ */
+int tcp_start(int port);
+
+
+#endif //DNS_RECEIVER_TCP_H
@@ -0,0 +1,530 @@
+/**
+ * @brief Disk writer of the DNS tunneling receiver - received data are
+ * written by a background thread, so receiving never waits for the disk
+ * @file dns_receiver_writer.c
+ * @author Patrik Skaloš
+ * @year 2022
+ */
+
+#define _GNU_SOURCE // fallocate
+
+
+// Standard libraries
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+
+// Header files
+#include "dns_receiver_writer.h"
+#include "../common/dns_metrics.h"
+
+
+enum writer_type{
+    WRITER_OPEN,
+    WRITER_WRITE,
+    WRITER_CLOSE,
+    WRITER_NOTIFY
+};
+
+
+/**
+ * Command for the writer, a node of the queue
+ */
+struct writer_cmd{
+    struct writer_cmd *_Atomic next;
+    enum writer_type type;
+    int64_t offset; // Of WRITER_WRITE, size for WRITER_OPEN and WRITER_CLOSE
+    char *data; // Block of WRITER_WRITE, path of WRITER_OPEN
+    int len;
+    struct arena *arena; // Holding the block of WRITER_WRITE
+    void (*callback)(void *arg); // Of WRITER_NOTIFY
+    void *arg;
+};
+
+
+/**
+ * Unbounded queue of commands, many producers and one consumer (intrusive
+ * MPSC queue by Dmitry Vyukov) - pushing is never blocked and nothing is
+ * dropped. WRITER_HEAD is the last pushed command, WRITER_TAIL the next one
+ * to be taken
+ */
+static struct writer_cmd WRITER_STUB;
+static struct writer_cmd *_Atomic WRITER_HEAD = &WRITER_STUB;
+static struct writer_cmd *WRITER_TAIL = &WRITER_STUB; // Only used by the consumer
+
+static int WRITER_INITIALIZED = 0;
+static int WRITER_FD = -1; // Open file
+static int WRITER_FAILED = 0; // 1 if the open file could not be written (only used by the writing thread)
+
+static pthread_t WRITER_THREAD;
+static int WRITER_THREAD_STARTED = 0;
+static atomic_int WRITER_THREAD_RUNNING = 0; // 1 while commands are queued for the thread
+static atomic_int WRITER_STOP = 0;
+static atomic_int WRITER_PUSHING = 0; // Producers which may be pushing a command
+static atomic_int WRITER_SLEEPING = 0; // 1 if the thread may be waiting for WRITER_EVENT
+static int WRITER_EVENT = -1; // Eventfd the thread waits for when the queue is empty
+static pthread_mutex_t WRITER_SYNC_LOCK = PTHREAD_MUTEX_INITIALIZER; // Held while commands are done outside of the thread
+
+
+/*
+ *
+ * QUEUE
+ *
+ */
+
+
+/**
+ * @brief Put a command to the queue
+ *
+ * @param cmd
+ */
+static void writer_queue_push(struct writer_cmd *cmd){
+    atomic_store_explicit(&cmd->next, NULL, memory_order_relaxed);
+    struct writer_cmd *prev = atomic_exchange_explicit(&WRITER_HEAD, cmd, memory_order_acq_rel);
+    atomic_store_explicit(&prev->next, cmd, memory_order_release);
+}
+
+
+/**
+ * @brief Take a command from the queue
+ *
+ * @return the command or NULL if the queue is empty (or a push is not
+ * finished yet)
+ */
+static struct writer_cmd *writer_queue_pop(){
+    struct writer_cmd *tail = WRITER_TAIL;
+    struct writer_cmd *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if(tail == &WRITER_STUB){
+        if(!next){
+            return NULL;
+        }
+        WRITER_TAIL = next;
+        tail = next;
+        next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    }
+    if(next){
+        WRITER_TAIL = next;
+        return tail;
+    }
+    if(tail != atomic_load_explicit(&WRITER_HEAD, memory_order_acquire)){
+        return NULL;
+    }
+
+    // Tail is the last command - put the stub behind it to take it
+    writer_queue_push(&WRITER_STUB);
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if(next){
+        WRITER_TAIL = next;
+        return tail;
+    }
+    return NULL;
+}
+
+
+/**
+ * @brief Check whether the queue is empty (a push which is not finished yet
+ * counts as a command)
+ *
+ * @return 1 if it is empty
+ */
+static int writer_queue_empty(){
+    return WRITER_TAIL == atomic_load(&WRITER_HEAD);
+}
+
+
+/**
+ * @brief Take the next command which is already in the queue (the pusher
+ * may be a moment from finishing)
+ *
+ * @return the command or NULL if the queue is empty
+ */
+static struct writer_cmd *writer_queue_pop_waiting(){
+    struct writer_cmd *cmd;
+    while(!(cmd = writer_queue_pop())){
+        if(writer_queue_empty()){
+            return NULL;
+        }
+    }
+    return cmd;
+}
+
+
+/*
+ *
+ * WRITING
+ *
+ */
+
+
+/**
+ * @brief Write a batch of adjacent blocks by pwritev and release them
+ *
+ * @param batch - WRITER_WRITE commands with adjacent blocks
+ * @param count - number of commands
+ */
+static void writer_write_batch(struct writer_cmd **batch, int count){
+    if(!count){
+        return;
+    }
+
+    struct iovec iov[count];
+    int64_t len = 0;
+    for(int i = 0; i < count; i++){
+        iov[i].iov_base = batch[i]->data;
+        iov[i].iov_len = batch[i]->len;
+        len += batch[i]->len;
+    }
+
+    // Write all, pwritev may write less
+    struct iovec *next = iov;
+    int next_count = count;
+    int64_t offset = batch[0]->offset;
+    while(WRITER_FD != -1 && next_count){
+        ssize_t written = pwritev(WRITER_FD, next, next_count, offset);
+        if(written <= 0){
+            fprintf(stderr, "Error! Failed to save data to file\n");
+            metrics_add(METRIC_TRANSFERS_FAILED, 1);
+            close(WRITER_FD);
+            WRITER_FD = -1;
+            WRITER_FAILED = 1;
+            break;
+        }
+        offset += written;
+        while(next_count && (size_t)written >= next->iov_len){
+            written -= next->iov_len;
+            next++;
+            next_count--;
+        }
+        if(next_count){
+            next->iov_base = (char *)next->iov_base + written;
+            next->iov_len -= written;
+        }
+    }
+
+    for(int i = 0; i < count; i++){
+        arena_release(batch[i]->arena);
+        free(batch[i]);
+    }
+}
+
+
+/**
+ * @brief Do a command other than WRITER_WRITE and free it
+ *
+ * @param cmd
+ */
+static void writer_execute(struct writer_cmd *cmd){
+    if(cmd->type == WRITER_OPEN){
+        if(WRITER_FD != -1){
+            close(WRITER_FD);
+        }
+        WRITER_FD = open(cmd->data, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        WRITER_FAILED = WRITER_FD == -1;
+        if(WRITER_FD == -1){
+            fprintf(stderr, "Error! Could not open destination file\n");
+            metrics_add(METRIC_TRANSFERS_FAILED, 1);
+        }else if(cmd->offset > 0){
+            // Allocate the file at once, if the file system can
+            fallocate(WRITER_FD, 0, 0, cmd->offset);
+        }
+
+    }else if(cmd->type == WRITER_CLOSE){
+        if(WRITER_FD != -1){
+            if(ftruncate(WRITER_FD, cmd->offset)){
+                fprintf(stderr, "Error! Failed to save data to file\n");
+                WRITER_FAILED = 1;
+            }
+            close(WRITER_FD);
+            WRITER_FD = -1;
+        }
+
+    }else if(cmd->type == WRITER_NOTIFY){
+        cmd->callback(cmd->arg);
+    }
+    free(cmd->data);
+    free(cmd);
+}
+
+
+/**
+ * @brief Do all commands in the queue - adjacent blocks are written together
+ *
+ * @return 1 if any command was done
+ */
+static int writer_drain(){
+    struct writer_cmd *batch[IOV_MAX];
+    int count = 0;
+    int done = 0;
+
+    struct writer_cmd *cmd;
+    while((cmd = writer_queue_pop_waiting())){
+        done = 1;
+        if(cmd->type == WRITER_WRITE){
+            // Add the block to the batch if it follows it
+            struct writer_cmd *last = count ? batch[count - 1] : NULL;
+            if(count == IOV_MAX || (last && last->offset + last->len != cmd->offset)){
+                writer_write_batch(batch, count);
+                count = 0;
+            }
+            batch[count++] = cmd;
+            continue;
+        }
+        writer_write_batch(batch, count);
+        count = 0;
+        writer_execute(cmd);
+    }
+    writer_write_batch(batch, count);
+    return done;
+}
+
+
+/**
+ * @brief Wake up the thread waiting for WRITER_EVENT
+ */
+static void writer_wake(){
+    uint64_t one = 1;
+    if(write(WRITER_EVENT, &one, sizeof(one)) != sizeof(one)){
+        // The counter is full, so the thread is woken up anyway
+    }
+}
+
+
+/**
+ * @brief Background thread - do commands until stopped, sleep while there
+ * are none. Once stopped, the commands pushed meanwhile are done too
+ *
+ * @param arg - unused
+ */
+static void *writer_thread(void *arg){
+    // Signals (eg. SIGINT stopping the receiver) are left to other threads
+    sigset_t signals;
+    sigfillset(&signals);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    while(!atomic_load(&WRITER_STOP)){
+        if(writer_drain()){
+            continue;
+        }
+
+        // Tell producers to wake us up before checking the queue for the
+        // last time, so that a command pushed meanwhile is not missed
+        atomic_store(&WRITER_SLEEPING, 1);
+        if(writer_queue_empty() && !atomic_load(&WRITER_STOP)){
+            uint64_t count;
+            if(read(WRITER_EVENT, &count, sizeof(count)) != sizeof(count)){
+                // Interrupted by a signal, check the queue again
+            }
+        }
+        atomic_store(&WRITER_SLEEPING, 0);
+    }
+
+    // Commands submitted from now on are done right away (after these),
+    // wait for the ones being pushed and do everything in the queue
+    pthread_mutex_lock(&WRITER_SYNC_LOCK);
+    atomic_store(&WRITER_THREAD_RUNNING, 0);
+    while(atomic_load(&WRITER_PUSHING)){
+        sched_yield();
+    }
+    writer_drain();
+    pthread_mutex_unlock(&WRITER_SYNC_LOCK);
+    return NULL;
+}
+
+
+/**
+ * @brief Queue a command and wake up the thread if it sleeps, or do the
+ * command right away without the thread
+ *
+ * @param cmd
+ */
+static void writer_submit(struct writer_cmd *cmd){
+    atomic_fetch_add(&WRITER_PUSHING, 1);
+    if(atomic_load(&WRITER_THREAD_RUNNING)){
+        writer_queue_push(cmd);
+        atomic_fetch_sub(&WRITER_PUSHING, 1);
+        if(atomic_load(&WRITER_SLEEPING) && atomic_exchange(&WRITER_SLEEPING, 0)){
+            writer_wake();
+        }
+        return;
+    }
+    atomic_fetch_sub(&WRITER_PUSHING, 1);
+
+    pthread_mutex_lock(&WRITER_SYNC_LOCK);
+    if(cmd->type == WRITER_WRITE){
+        writer_write_batch(&cmd, 1);
+    }else{
+        writer_execute(cmd);
+    }
+    pthread_mutex_unlock(&WRITER_SYNC_LOCK);
+}
+
+
+/**
+ * @brief Allocate a command
+ *
+ * @param type
+ *
+ * @return the command (exits if there is no memory)
+ */
+static struct writer_cmd *writer_cmd_new(enum writer_type type){
+    struct writer_cmd *cmd = calloc(1, sizeof(struct writer_cmd));
+    if(!cmd){
+        fprintf(stderr, "Error! Could not allocate memory\n");
+        exit(1);
+    }
+    cmd->type = type;
+    return cmd;
+}
+
+
+/*
+ *
+ * INTERFACE
+ *
+ */
+
+
+/**
+ * @brief Start the writer (only the first call has an effect). The
+ * environment variable DNS_WRITER selects how files are written:
+ * - "thread" (default) - by a background thread, fed through a lock-free
+ *   queue and woken up by an eventfd when it is empty. Adjacent blocks
+ *   waiting in the queue are written by one pwritev
+ * - "sync" - right away (eg. for the simulation, which needs the programs
+ *   to be deterministic)
+ */
+void writer_init(){
+    if(WRITER_INITIALIZED){
+        return;
+    }
+    WRITER_INITIALIZED = 1;
+
+    char *mode = getenv("DNS_WRITER");
+    if(mode && !strcmp(mode, "sync")){
+        return;
+    }
+    if(mode && strcmp(mode, "thread")){
+        fprintf(stderr, "Unknown DNS_WRITER mode \"%s\", using \"thread\".\n", mode);
+    }
+
+    WRITER_EVENT = eventfd(0, EFD_CLOEXEC);
+    atomic_store(&WRITER_THREAD_RUNNING, 1);
+    if(WRITER_EVENT == -1 || pthread_create(&WRITER_THREAD, NULL, writer_thread, NULL)){
+        fprintf(stderr, "Could not start writer thread, writing synchronously.\n");
+        atomic_store(&WRITER_THREAD_RUNNING, 0);
+        return;
+    }
+    WRITER_THREAD_STARTED = 1;
+    atexit(writer_shutdown);
+}
+
+
+/**
+ * @brief Open (create or truncate) the file to write the next blocks to
+ *
+ * @param path
+ * @param size - expected size of the file to allocate, -1 if unknown
+ */
+void writer_open(const char *path, int64_t size){
+    struct writer_cmd *cmd = writer_cmd_new(WRITER_OPEN);
+    cmd->data = strdup(path);
+    cmd->offset = size;
+    writer_submit(cmd);
+}
+
+
+/**
+ * @brief Write a block of data to the open file
+ *
+ * @param offset - in the file
+ * @param data
+ * @param len - length of data in bytes
+ * @param arena - arena holding the data, released by the writer
+ */
+void writer_write(int64_t offset, unsigned char *data, int len, struct arena *arena){
+    struct writer_cmd *cmd = writer_cmd_new(WRITER_WRITE);
+    cmd->offset = offset;
+    cmd->data = (char *)data;
+    cmd->len = len;
+    cmd->arena = arena;
+    writer_submit(cmd);
+}
+
+
+/**
+ * @brief Close the open file
+ *
+ * @param size - final size of the file (cuts off space allocated in advance)
+ */
+void writer_close(int64_t size){
+    struct writer_cmd *cmd = writer_cmd_new(WRITER_CLOSE);
+    cmd->offset = size;
+    writer_submit(cmd);
+}
+
+
+/**
+ * @brief Call a function once everything queued before is written (from the
+ * writer's thread)
+ *
+ * @param callback
+ * @param arg - argument of the callback
+ */
+void writer_notify(void (*callback)(void *arg), void *arg){
+    struct writer_cmd *cmd = writer_cmd_new(WRITER_NOTIFY);
+    cmd->callback = callback;
+    cmd->arg = arg;
+    writer_submit(cmd);
+}
+
+
+/**
+ * @brief Check whether the file opened last could not be written - call from
+ * callbacks of writer_notify, which are called after everything queued
+ * before them is done
+ *
+ * @return 1 if opening or writing the file failed, 0 if not
+ */
+int writer_failed(){
+    return WRITER_FAILED;
+}
+
+
+/**
+ * @brief Mark the file opened last as not written, so that writer_failed
+ * tells later callbacks - call from callbacks of writer_notify (eg. when a
+ * file made from it turns out wrong)
+ */
+void writer_fail(){
+    WRITER_FAILED = 1;
+}
+
+
+/**
+ * @brief Write everything queued and stop the background thread. Called
+ * automatically at exit
+ */
+void writer_shutdown(){
+    if(!WRITER_THREAD_STARTED || atomic_exchange(&WRITER_STOP, 1)){
+        return;
+    }
+    writer_wake();
+    pthread_join(WRITER_THREAD, NULL);
+    close(WRITER_EVENT);
+
+    pthread_mutex_lock(&WRITER_SYNC_LOCK);
+    if(WRITER_FD != -1){
+        close(WRITER_FD);
+        WRITER_FD = -1;
+    }
+    pthread_mutex_unlock(&WRITER_SYNC_LOCK);
+}
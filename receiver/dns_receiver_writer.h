@@ -0,0 +1,99 @@
+/**
+ * @brief Disk writer of the DNS tunneling receiver - received data are
+ * written by a background thread, so receiving never waits for the disk
+ * @file dns_receiver_writer.h
+ * @author Patrik Skaloš
+ * @year 2022
+ */
+
+#ifndef DNS_RECEIVER_WRITER_H
+#define DNS_RECEIVER_WRITER_H
+
+#include <stdint.h>
+
+#include "dns_receiver_arena.h"
+
+
+/**
+ * Number of base64 characters collected before they are decoded and written
+ * as one block (a multiple of 4)
+ */
+#define WRITER_BLOCK_B64_LEN 65536
+
+
+/**
+ * @brief Start the writer (only the first call has an effect). The
+ * environment variable DNS_WRITER selects how files are written:
+ * - "thread" (default) - by a background thread, fed through a lock-free
+ *   queue and woken up by an eventfd when it is empty. Adjacent blocks
+ *   waiting in the queue are written by one pwritev
+ * - "sync" - right away (eg. for the simulation, which needs the programs
+ *   to be deterministic)
+ */
+void writer_init();
+
+
+/**
+ * @brief Open (create or truncate) the file to write the next blocks to
+ *
+ * @param path
+ * @param size - expected size of the file to allocate, -1 if unknown
+ */
+void writer_open(const char *path, int64_t size);
+
+
+/**
+ * @brief Write a block of data to the open file
+ *
+ * @param offset - in the file
+ * @param data
+ * @param len - length of data in bytes
+ * @param arena - arena holding the data, released by the writer
+ */
+void writer_write(int64_t offset, unsigned char *data, int len, struct arena *arena);
+
+
+/**
+ * @brief Close the open file
+ *
+ * @param size - final size of the file (cuts off space allocated in advance)
+ */
+void writer_close(int64_t size);
+
+
+/**
+ * @brief Call a function once everything queued before is written (from the
+ * writer's thread)
+ *
+ * @param callback
+ * @param arg - argument of the callback
+ */
+void writer_notify(void (*callback)(void *arg), void *arg);
+
+
+/**
+ * @brief Check whether the file opened last could not be written - call from
+ * callbacks of writer_notify, which are called after everything queued
+ * before them is done
+ *
+ * @return 1 if opening or writing the file failed, 0 if not
+ */
+int writer_failed();
+
+
+/**
+ * @brief Mark the file opened last as not written, so that writer_failed
+ * tells later callbacks - call from callbacks of writer_notify (eg. when a
+ * file made from it turns out wrong)
+ */
+void writer_fail();
+
+
+/**
+ * @brief Write everything queued and stop the background thread. Called
+ * automatically at exit
+ */
+void writer_shutdown();
+
+
+#endif //DNS_RECEIVER_WRITER_H
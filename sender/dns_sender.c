@@ -11,16 +11,31 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <strings.h>
+#include <inttypes.h>
+#include <limits.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 // Networking libraries
 #include <arpa/inet.h>
+#include <netdb.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
 
 // Header files
 #include "dns_sender.h"
+#include "dns_sender_daemon.h"
+#include "dns_sender_engine.h"
 #include "dns_sender_events.h"
+#include "dns_sender_fec.h"
+#include "dns_sender_delta.h"
+#include "../common/dns_base64.h"
+#include "../common/dns_delta.h"
+#include "../common/dns_metrics.h"
+#include "../common/dns_net_io.h"
+#include "../common/dns_packet.h"
 
 
 /*
@@ -33,18 +48,22 @@
 const int MAX_TRIES = 3; // Max tries for sending a packet
 
 char *UPSTREAM_DNS_IP = NULL; // IP of DNS server provided by the user
-char *UPSTREAM_DNS_IP_MALLOCD = NULL; // IP of DNS server from the system (if user didn't provide one)
+struct upstream UPSTREAMS[MAX_UPSTREAMS]; // The user's DNS server or the system's ones
+int UPSTREAM_COUNT = 0;
+struct upstream *SELECTED_UPSTREAM = NULL; // Kept while transfers to it succeed (see start_try)
+int SOCKET_FAMILY = AF_INET6; // AF_INET if IPv6 is not available
 char *BASE_HOST = NULL; // Hostname to use when sending a DNS request
 char *DST_FILEPATH = NULL; // Path where to save the data on the server machine
 char *SRC_FILEPATH = NULL; // Path to a file to send (null if file not provided)
+char *DAEMON_SOCKET = NULL; // UNIX socket of the daemon to run or to submit a transfer to
+int SUBMIT = 0; // 1 to submit the transfer to the daemon
+int PRIORITY = 0; // Of the submitted transfer, higher first
 
-FILE *SRC_FILE = NULL; // Open file or stdin
-
-int FILE_SIZE = 0; // Length of the file to send, because we need it...
-char *PAYLOAD_B64 = NULL; // Payload to send, encoded in base64, without padding
-int PAYLOAD_B64_LEN = 0; // Length of payload in bytes
-
-int QUERY_ID = 0;
+int PORT = 53; // Port of the DNS server
+int CHUNK_LEN = 126; // Max length of base64 data in one packet
+int FEC_GROUP = 0; // Data chunks per parity chunk (0 if FEC is disabled)
+int TCP = 0; // 1 to send queries over a TCP connection
+struct upstream *TCP_UPSTREAM = NULL; // Server of the connection
 
 
 /*
@@ -55,73 +74,11 @@ int QUERY_ID = 0;
 
 
 /**
- * @brief Variables and functions for encoding a string to base64
- *
- * @param data to encode
- * @param input_length in characters
- * @param output_length - pointer where the output length in chars will be
- * written
- *
- * @return allocated string containing the output
- *
- * Taken and modified from: https://stackoverflow.com/a/6782480/17580261
- */
-static char encoding_table[] = {'A', 'B', 'C', 'D', 'E', 'F', 'G', 'H',
-                                'I', 'J', 'K', 'L', 'M', 'N', 'O', 'P',
-                                'Q', 'R', 'S', 'T', 'U', 'V', 'W', 'X',
-                                'Y', 'Z', 'a', 'b', 'c', 'd', 'e', 'f',
-                                'g', 'h', 'i', 'j', 'k', 'l', 'm', 'n',
-                                'o', 'p', 'q', 'r', 's', 't', 'u', 'v',
-                                'w', 'x', 'y', 'z', '0', '1', '2', '3',
-                                '4', '5', '6', '7', '8', '9', '+', '/'};
-static int mod_table[] = {0, 2, 1};
-char *base64_encode(const unsigned char *data, int input_length, int *output_length){
-
-    *output_length = 4 * ((input_length + 2) / 3);
-
-    char *encoded_data = malloc(*output_length);
-    if (encoded_data == NULL) return NULL;
-
-    for (int i = 0, j = 0; i < input_length;) {
-
-        uint32_t octet_a = i < input_length ? (unsigned char)data[i++] : 0;
-        uint32_t octet_b = i < input_length ? (unsigned char)data[i++] : 0;
-        uint32_t octet_c = i < input_length ? (unsigned char)data[i++] : 0;
-
-        uint32_t triple = (octet_a << 0x10) + (octet_b << 0x08) + octet_c;
-
-        encoded_data[j++] = encoding_table[(triple >> 3 * 6) & 0x3F];
-        encoded_data[j++] = encoding_table[(triple >> 2 * 6) & 0x3F];
-        encoded_data[j++] = encoding_table[(triple >> 1 * 6) & 0x3F];
-        encoded_data[j++] = encoding_table[(triple >> 0 * 6) & 0x3F];
-    }
-
-    for (int i = 0; i < mod_table[input_length % 3]; i++)
-        encoded_data[*output_length - 1 - i] = '=';
-
-    // Remove '=' padding
-    if(encoded_data[*output_length - 1] == '=') (*output_length)--;
-    if(encoded_data[*output_length - 1] == '=') (*output_length)--;
-    if(encoded_data[*output_length - 1] == '=') (*output_length)--;
-    if(encoded_data[*output_length - 1] == '=') (*output_length)--;
-
-
-    return encoded_data;
-}
-
-
-/**
- * @brief Free all resources, write the error message to stdout and exit
+ * @brief Write the error message to stderr and exit
  *
  * @param As for printf and similar functions
  */
 void err(char *format, ...){
-    if(SRC_FILE){
-        fclose(SRC_FILE);
-    }
-    free(UPSTREAM_DNS_IP_MALLOCD);
-    free(PAYLOAD_B64);
-
     fprintf(stderr, "Error! ");
     va_list argptr;
     va_start(argptr, format);
@@ -140,8 +97,44 @@ void err(char *format, ...){
 
 
 /**
- * @brief Get upstream DNS IP address from the system's /etc/resolv.conf and
- * save it to UPSTREAM_DNS_IP_MALLOCD (allocate it first)
+ * @brief Add a DNS server to UPSTREAMS
+ *
+ * @param ip - IPv4 or IPv6 address (with a scope for link-local IPv6
+ * addresses, eg. "fe80::1%eth0")
+ *
+ * @return 0 if the address is valid
+ */
+int add_upstream(char *ip){
+    if(UPSTREAM_COUNT >= MAX_UPSTREAMS){
+        return 0;
+    }
+
+    // Only parse the address, don't resolve names
+    struct addrinfo hints, *info = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_NUMERICHOST;
+    if(getaddrinfo(ip, NULL, &hints, &info) || !info){
+        return 1;
+    }
+
+    struct upstream *upstream = &UPSTREAMS[UPSTREAM_COUNT++];
+    memcpy(&upstream->addr, info->ai_addr, info->ai_addrlen);
+    upstream->addr_len = info->ai_addrlen;
+    if(upstream->addr.ss_family == AF_INET6){
+        ((struct sockaddr_in6 *)&upstream->addr)->sin6_port = htons(PORT);
+    }else{
+        ((struct sockaddr_in *)&upstream->addr)->sin_port = htons(PORT);
+    }
+    freeaddrinfo(info);
+    return 0;
+}
+
+
+/**
+ * @brief Get upstream DNS IP addresses (IPv4 and IPv6) from the system's
+ * /etc/resolv.conf and add them to UPSTREAMS
  */
 void get_upstream_dns_ip(){
     
@@ -153,16 +146,17 @@ void get_upstream_dns_ip(){
     char buffer[1024];
     while(fgets(buffer, 1024, f) != NULL){
         if(!strncmp(buffer, "nameserver ", strlen("nameserver "))){
-            break;
+            char *ip = buffer + strlen("nameserver ");
+            ip[strcspn(ip, " \t\r\n")] = '\0';
+            add_upstream(ip);
         }
     }
-    UPSTREAM_DNS_IP_MALLOCD = malloc(17 * sizeof(char));
-    if(!UPSTREAM_DNS_IP_MALLOCD){
-        err("Malloc failed");
-    }
-    strcpy(UPSTREAM_DNS_IP_MALLOCD, buffer + strlen("nameserver "));
 
     fclose(f);
+
+    if(!UPSTREAM_COUNT){
+        err("No nameserver found in \"/etc/resolv.conf\".");
+    }
 }
 
 
@@ -189,6 +183,69 @@ void parse_args(int argc, char **argv){
             i += 1;
             UPSTREAM_DNS_IP = argv[i];
 
+        }else if(!strcmp(argv[i], "-p") || !strcmp(argv[i], "-c")){
+
+            if(i + 1 >= argc){
+                err("No argument following \"%s\"", argv[i]);
+            }
+
+            // Get the port or the chunk length
+            char *endptr = NULL;
+            long value = strtol(argv[i + 1], &endptr, 10);
+            if(*endptr != '\0' || value < 1 || value > 65535){
+                err("Invalid number following \"%s\": \"%s\".", argv[i], argv[i + 1]);
+            }
+            if(!strcmp(argv[i], "-p")){
+                PORT = value;
+            }else{
+                CHUNK_LEN = value;
+            }
+            i += 1;
+
+        }else if(!strcmp(argv[i], "-t")){
+
+            // Send queries over TCP
+            TCP = 1;
+
+        }else if(!strcmp(argv[i], "-D") || !strcmp(argv[i], "-S")){
+
+            if(i + 1 >= argc){
+                err("No argument following \"%s\"", argv[i]);
+            }
+
+            // Run the daemon or submit the transfer to it
+            SUBMIT = !strcmp(argv[i], "-S");
+            i += 1;
+            DAEMON_SOCKET = argv[i];
+
+        }else if(!strcmp(argv[i], "-P")){
+
+            if(i + 1 >= argc){
+                err("No argument following \"-P\"");
+            }
+
+            // Get the priority of the submitted transfer
+            i += 1;
+            char *endptr = NULL;
+            PRIORITY = strtol(argv[i], &endptr, 10);
+            if(*endptr != '\0'){
+                err("Invalid priority: \"%s\".", argv[i]);
+            }
+
+        }else if(!strcmp(argv[i], "-f")){
+
+            if(i + 1 >= argc){
+                err("No argument following \"-f\"");
+            }
+
+            // Get the FEC group size
+            i += 1;
+            char *endptr = NULL;
+            FEC_GROUP = strtol(argv[i], &endptr, 10);
+            if(*endptr != '\0' || FEC_GROUP < 1 || FEC_GROUP > FEC_MAX_GROUP){
+                err("FEC group size must be a number from 1 to %d.", FEC_MAX_GROUP);
+            }
+
         }else{
             if(positional_arg_count == 0){
                 // Arg is BASE_HOST
@@ -213,41 +270,55 @@ void parse_args(int argc, char **argv){
 
 
 /**
- * @brief Validate arguments provided by the user: check if everything is
- * specified and in the right format. If not, raise an error.
+ * @brief Check the base host and the destination path of a transfer
+ *
+ * @param base_host - one or more, separated by commas
+ * @param dst_filepath
+ *
+ * @return NULL if they are valid, the error message otherwise
  */
-void check_args(){
-    if(!BASE_HOST || !DST_FILEPATH){
-        // If base host or dst filepath were not provided -> error
-        err("Base host or Destination filepath argument missing.");
-    }
+const char *check_transfer(const char *base_host, const char *dst_filepath){
+    static char message[128];
 
     // TODO check if DST_FILEPATH is under 126 / 4 * 3 characters long
-    if(strlen(DST_FILEPATH) > 94){
-        err("Sorry, destination filepath must be shorter or equal to 94 characters");
+    if(strlen(dst_filepath) > 94){
+        return "Sorry, destination filepath must be shorter or equal to 94 characters";
     }
 
-    if(!UPSTREAM_DNS_IP){
-        // If no upstream DNS IP was provided in args, generate it or something
-        get_upstream_dns_ip();
-
-    }else{
-        // Else, check if the IP is valid
-        // https://stackoverflow.com/questions/791982/determine-if-a-string-is-a-valid-ipv4-address-in-c
-        struct sockaddr_in sa;
-        int result = inet_pton(AF_INET, UPSTREAM_DNS_IP, &(sa.sin_addr));
-        if(result == 0){
-            err("Upstream DNS IP is invalid: \"%s\".", UPSTREAM_DNS_IP);
+    // Check if base host is valid - one or more, separated by commas
+    if(strlen(base_host) > MAX_BASE_HOSTS_LEN){
+        snprintf(message, sizeof(message), "Sorry, base hosts must be shorter or equal to %d characters", MAX_BASE_HOSTS_LEN);
+        return message;
+    }
+    int host_count = 0;
+    const char *host = base_host;
+    while(1){
+        const char *comma = strchr(host, ',');
+        int host_len = comma ? comma - host : (int)strlen(host);
+        if(host_len < 1){
+            return "Sorry, base host must not be empty";
+        }
+        if(host_len > MAX_BASE_HOST_LEN){
+            snprintf(message, sizeof(message), "Sorry, base host must be shorter or equal to %d characters", MAX_BASE_HOST_LEN);
+            return message;
+        }
+        host_count += 1;
+        if(!comma){
+            break;
         }
+        host = comma + 1;
     }
-
-    // Check if base host is valid
-    for(int i = 0, n = strlen(BASE_HOST); i < n; i++){
-        char c = BASE_HOST[i];
+    if(host_count > PACKET_MAX_DOMAINS){
+        snprintf(message, sizeof(message), "Sorry, at most %d base hosts can be used", PACKET_MAX_DOMAINS);
+        return message;
+    }
+    for(int i = 0, n = strlen(base_host); i < n; i++){
+        char c = base_host[i];
         // Check if it is a character that can be in a host name (alphanumeric,
-        // '.' and '-')
-        if(c != 46 && c != 45 && !(c >= 48 && c <= 57) && !(c <= 65 && c <= 90) && !(c >= 97 && c <= 122)){
-            err("Invalid characters in base host: \'%c\'.", c);
+        // '.' and '-') or a comma separating base hosts
+        if(c != 46 && c != 45 && c != 44 && !(c >= 48 && c <= 57) && !(c >= 65 && c <= 90) && !(c >= 97 && c <= 122)){
+            snprintf(message, sizeof(message), "Invalid characters in base host: \'%c\'.", c);
+            return message;
         }
     }
 
@@ -255,359 +326,1067 @@ void check_args(){
     // opening)
     char forbidden_chars[] = "#%&{}\\<>*?$!'\":@+`|=";
     int forbidden_chars_len = strlen(forbidden_chars);
-    for(int i = 0, n = strlen(DST_FILEPATH); i < n; i++){
+    for(int i = 0, n = strlen(dst_filepath); i < n; i++){
         for(int j = 0; j < forbidden_chars_len; j++){
-            if(DST_FILEPATH[i] == forbidden_chars[j]){
-                err("Destination path contains forbidden characters: \'%c\'.", forbidden_chars[j]);
+            if(dst_filepath[i] == forbidden_chars[j]){
+                snprintf(message, sizeof(message), "Destination path contains forbidden characters: \'%c\'.", forbidden_chars[j]);
+                return message;
             }
         }
     }
+    return NULL;
 }
 
 
 /**
- * @brief Read from the provided file to send or from STDIN to then encode it
- * to base64 and save it to a global variable
+ * @brief Validate arguments provided by the user: check if everything is
+ * specified and in the right format. If not, raise an error.
  */
-void get_payload(){
+void check_args(){
+    if((!BASE_HOST || !DST_FILEPATH) && (!DAEMON_SOCKET || SUBMIT)){
+        // If base host or dst filepath were not provided -> error (the
+        // daemon gets them with every transfer)
+        err("Base host or Destination filepath argument missing.");
+    }
+    if(SUBMIT && !SRC_FILEPATH){
+        err("The daemon can't read STDIN, source filepath argument missing.");
+    }
+
+    if(TCP && FEC_GROUP){
+        // Nothing is lost over TCP
+        err("Forward error correction can't be used over TCP.");
+    }
+
+    const char *message = BASE_HOST && DST_FILEPATH ? check_transfer(BASE_HOST, DST_FILEPATH) : NULL;
+    if(message){
+        err("%s", message);
+    }
+    if(SUBMIT){
+        // The daemon has its own servers
+        return;
+    }
+
+    if(!UPSTREAM_DNS_IP){
+        // If no upstream DNS IP was provided in args, generate it or something
+        get_upstream_dns_ip();
+
+    }else if(add_upstream(UPSTREAM_DNS_IP)){
+        // Else, check if the IP (IPv4 or IPv6) is valid
+        err("Upstream DNS IP is invalid: \"%s\".", UPSTREAM_DNS_IP);
+    }
+}
+
+
+/**
+ * @brief Get the payload of a transfer - map its file to memory, or read
+ * STDIN (or a file which can't be mapped) to its payload
+ *
+ * @param transfer
+ *
+ * @return 0 on success, 1 if the file can't be opened
+ */
+int get_payload(struct transfer *transfer){
 
     // Set source file to stdin or provided path
-    SRC_FILE = SRC_FILEPATH ? fopen(SRC_FILEPATH, "rb") : stdin;
-    if(!SRC_FILE){
-        err("Could not open file \"%s\".", SRC_FILEPATH);
+    transfer->file_size = 0;
+    FILE *src_file = transfer->src_filepath ? fopen(transfer->src_filepath, "rb") : stdin;
+    if(!src_file){
+        return 1;
     }
 
-    // Prepare payload string
-    int payload_size = 1024;
-    unsigned char *payload = malloc(payload_size);
-    if(!payload){
-        err("Allocating memory failed.");
+    // Map a regular file, so that files larger than the memory can be sent
+    struct stat st;
+    if(!fstat(fileno(src_file), &st) && S_ISREG(st.st_mode) && st.st_size > 0){
+        transfer->payload = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(src_file), 0);
+        if(transfer->payload != MAP_FAILED){
+            transfer->payload_mapped = 1;
+            transfer->file_size = st.st_size;
+            madvise(transfer->payload, transfer->file_size, MADV_SEQUENTIAL);
+        }else{
+            transfer->payload = NULL;
+        }
     }
 
-    // Read from the file (or stdin) till EOF to payload string
-    size_t read = 1024;
-    while(read == 1024){
+    if(!transfer->payload_mapped){
+        // Prepare payload string
+        size_t payload_size = 65536;
+        transfer->payload = malloc(payload_size);
+        if(!transfer->payload){
+            err("Allocating memory failed.");
+        }
 
-        // Realloc if there's not enough space
-        if(payload_size < FILE_SIZE + 1024){
-            payload_size *= 2;
-            payload = realloc(payload, payload_size);
-            if(!payload){
-                err("Memory reallocation failed.");
+        // Read from the file (or stdin) till EOF to payload string
+        size_t read = 65536;
+        while(read == 65536){
+
+            // Realloc if there's not enough space
+            if(payload_size < transfer->file_size + 65536){
+                payload_size *= 2;
+                unsigned char *payload = realloc(transfer->payload, payload_size);
+                if(!payload){
+                    err("Memory reallocation failed.");
+                }
+                transfer->payload = payload;
             }
+
+            read = fread(transfer->payload + transfer->file_size, 1, 65536, src_file);
+            transfer->file_size += read;
         }
+    }
+
+    // Close the file (a mapping stays valid)
+    if(src_file != stdin){
+        fclose(src_file);
+    }
+    return 0;
+}
+
 
-        read = fread(payload + FILE_SIZE, 1, 1024, SRC_FILE);
-        FILE_SIZE += read;
+/**
+ * @brief Free the payload of a transfer (unmap the file)
+ *
+ * @param transfer
+ */
+void free_payload(struct transfer *transfer){
+    if(transfer->payload_mapped){
+        munmap(transfer->payload, transfer->file_size);
+    }else{
+        free(transfer->payload);
     }
+    transfer->payload = NULL;
+    transfer->payload_mapped = 0;
+}
+
 
-    // Close the file
-    fclose(SRC_FILE);
-    SRC_FILE = NULL;
+/**
+ * @brief Encode a chunk of the payload (or the delta) to base64 - chunks are
+ * encoded right before they are sent, so the payload is never encoded as a
+ * whole
+ *
+ * @param transfer
+ * @param buffer - output, at least len + 8 characters long
+ * @param offset - of the chunk in the base64 payload
+ * @param len - length of the chunk in characters
+ *
+ * @return the chunk (in buffer, not terminated)
+ */
+char *payload_chunk(struct transfer *transfer, char *buffer, int64_t offset, int len){
+    // Encode whole groups of 3 bytes (4 characters) containing the chunk
+    int64_t start = offset / 4 * 3;
+    int64_t end = (offset + len + 3) / 4 * 3;
+    if(end > transfer->send_size){
+        end = transfer->send_size;
+    }
+    if(transfer->send_delta){
+        unsigned char delta[MAX_CHUNK_LEN];
+        delta_read(&transfer->delta, delta, start, end - start);
+        base64_encode_to(buffer, delta, end - start);
+    }else{
+        base64_encode_to(buffer, transfer->payload + start, end - start);
+    }
+    return buffer + offset % 4;
+}
+
+
+/**
+ * @brief Prepare parts of packets of a transfer which are the same for all
+ * packets: the DNS header (except for the query ID) and the end of the
+ * question - the base host in the wire format, terminating zero byte, type
+ * and class of the question (one template for every base host)
+ *
+ * @param transfer
+ *
+ * @return NULL on success, the error message if a base host can't be used
+ */
+const char *prepare_packet_template(struct transfer *transfer){
+    static char message[256];
 
-    // Encode payload to base64
-    PAYLOAD_B64 = base64_encode(payload, FILE_SIZE, &PAYLOAD_B64_LEN);
-    if(!PAYLOAD_B64){
-        err("Failed to convert input to base64");
+    if(packet_domains_init(&transfer->domains, transfer->base_host)){
+        snprintf(message, sizeof(message), "Invalid base hosts \"%s\".", transfer->base_host);
+        return message;
     }
+    for(int i = 0; i < transfer->domains.count; i++){
+        const char *base_host = transfer->domains.names[i];
+        if(packet_template_init(&transfer->templates[i], base_host)){
+            snprintf(message, sizeof(message), "Invalid label in base host \"%s\".", base_host);
+            return message;
+        }
 
-    free(payload);
-    payload = NULL;
+        // Check that the longest question fits to 255 bytes: control label,
+        // data split to labels of up to 63 characters and the base host
+        int name_len = MAX_CONTROL_LEN + 1 + CHUNK_LEN + (CHUNK_LEN + 62) / 63
+            + transfer->templates[i].suffix_len - sizeof(struct dns_question_info_t);
+        if(CHUNK_LEN > MAX_CHUNK_LEN || name_len > 255){
+            snprintf(message, sizeof(message), "Chunk length %d is too long for base host \"%s\".", CHUNK_LEN, base_host);
+            return message;
+        }
+    }
+    transfer->next_domain = 0;
+    return NULL;
 }
 
 
 /*
  *
- * TRANSMITTING AND RECEIVING DATA
+ * SOCKETS AND SERVERS
  *
  */
 
 
 /**
- * @brief Construct a DNS packet containing data provided to buffer and save its
- * length to buffer_len. 
+ * @brief Open a TCP connection to the first DNS server which accepts it, in
+ * the order of order_upstreams, and save the server to TCP_UPSTREAM
  *
- * @param buffer - allocated output string
- * @param buffer_len - pointer to an integer - will contain packet length in
- * bytes
- * @param data - data to encapsulate in the packet. If null, datagram with
- * question a.a.BASE_HOST will be created
- * @param len - length of the data in bytes
+ * @return socket
  */
-void create_packet(unsigned char *buffer, int *buffer_len, char *data, int len){
+int open_connection(){
+    int order[MAX_UPSTREAMS];
+    int n = order_upstreams(order);
+    for(int i = 0; i < n; i++){
+        int sock = net_connect((struct sockaddr *)&UPSTREAMS[order[i]].addr, UPSTREAMS[order[i]].addr_len);
+        if(sock != -1){
+            TCP_UPSTREAM = &UPSTREAMS[order[i]];
+            return sock;
+        }
+    }
+    err("Could not connect to the DNS server over TCP.");
+    return -1;
+}
 
-    // Create a DNS header
-    struct dns_header_t *header = (struct dns_header_t *)buffer;
-    header->xid = htons(++QUERY_ID); // Query ID
-    header->flags = htons(256); // 00000001 00000000b = 256: Standard query, desire recursion
-    header->qdcount = htons(1); // Number of questions
-    // Leave ancount (answers), nscount (authority RRs) and arcount (additional
-    // RRs) as 0
 
-    // Get pointer to question in the buffer (right after the header)
-    unsigned char *question_tmp_ptr = &buffer[sizeof(struct dns_header_t)];
+/**
+ * @brief Open the socket for DNS queries - dual-stack, so both IPv6 and IPv4
+ * servers can be reached, or IPv4 only if IPv6 is not available. Over TCP,
+ * open the connection
+ *
+ * @return socket
+ */
+int open_socket(){
+    int sock = net_socket(AF_INET6, 0);
+    if(sock == -1){
+        SOCKET_FAMILY = AF_INET;
+        sock = net_socket(AF_INET, 0);
+    }
+    if(sock == -1){
+        err("Failed to open socket");
+    }
+
+    // IPv4 servers are reached by IPv4-mapped addresses through the
+    // dual-stack socket
+    for(int i = 0; i < UPSTREAM_COUNT && SOCKET_FAMILY == AF_INET6; i++){
+        net_addr_map_v6(&UPSTREAMS[i].addr, &UPSTREAMS[i].addr_len);
+    }
 
-    if(data){
-        // If data is not NULL, put it to two labels
+    if(TCP){
+        // The UDP socket only tells if IPv6 can be used
+        net_close(sock);
+        return open_connection();
+    }
+    if(metrics_stages_enabled() && net_timestamping(sock, metrics_kernel_delay)){
+        fprintf(stderr, "Kernel timestamps are not available, kernel stages are not timed.\n");
+    }
+    return sock;
+}
 
-        int len1 = len > 63 ? 63 : len;
-        int len2 = len > 63 ? len - 63 : 0;
 
-        // Create URL string because we need to trigger an event
-        char url[512] = {'\0'};
-        if(len1){
-            strncpy(url, data, len1);
-            strcpy(url + len1, ".");
+/**
+ * @brief Check whether a server confirmed a larger share of the queries sent
+ * to it than another one (a server which was not used yet counts as one
+ * which confirmed all)
+ *
+ * @param a - index to UPSTREAMS
+ * @param b - index to UPSTREAMS
+ *
+ * @return 1 if a should be tried before b
+ */
+static int upstream_better(int a, int b){
+    uint64_t a_confirmed = UPSTREAMS[a].sent ? UPSTREAMS[a].confirmed : 1;
+    uint64_t a_sent = UPSTREAMS[a].sent ? UPSTREAMS[a].sent : 1;
+    uint64_t b_confirmed = UPSTREAMS[b].sent ? UPSTREAMS[b].confirmed : 1;
+    uint64_t b_sent = UPSTREAMS[b].sent ? UPSTREAMS[b].sent : 1;
+    return a_confirmed * b_sent > b_confirmed * a_sent;
+}
+
+
+/**
+ * @brief Sort servers by the share of queries they confirmed, keeping the
+ * order of servers which confirmed the same share
+ *
+ * @param servers - indexes to UPSTREAMS
+ * @param count - number of servers
+ */
+static void sort_upstreams(int *servers, int count){
+    for(int i = 1; i < count; i++){
+        int server = servers[i];
+        int j = i;
+        for(; j > 0 && upstream_better(server, servers[j - 1]); j--){
+            servers[j] = servers[j - 1];
         }
-        if(len2){
-            strncpy(url + len1 + 1, data + len1, len2);
-            strcpy(url + len1 + 1 + len2, ".");
+        servers[j] = server;
+    }
+}
+
+
+/**
+ * @brief Order the DNS servers which can be reached by the socket in which
+ * they should be tried - alternating IPv6 and IPv4 servers, starting with
+ * IPv6 (RFC 8305). Servers of a family which lost more of the queries sent
+ * to them (by earlier transfers of the daemon) come later
+ *
+ * @param order - output, indexes to UPSTREAMS, MAX_UPSTREAMS long
+ *
+ * @return number of servers in the order
+ */
+int order_upstreams(int *order){
+    // Split the servers by family (IPv6 servers can't be reached by an IPv4
+    // socket)
+    int v6[MAX_UPSTREAMS], v4[MAX_UPSTREAMS];
+    int v6_count = 0, v4_count = 0;
+    for(int i = 0; i < UPSTREAM_COUNT; i++){
+        const void *host = NULL;
+        if(net_addr_host((struct sockaddr *)&UPSTREAMS[i].addr, &host) == AF_INET){
+            v4[v4_count++] = i;
+        }else if(SOCKET_FAMILY == AF_INET6){
+            v6[v6_count++] = i;
         }
-        strcpy(url + len1 + 1 + len2 + 1, BASE_HOST);
-        dns_sender__on_chunk_encoded(DST_FILEPATH, QUERY_ID, url);
+    }
 
-        // Label 1
-        if(len1){
-            *question_tmp_ptr = (unsigned char)len1;
-            question_tmp_ptr += 1;
-            for(int i = 0; i < len1; i++){
-                question_tmp_ptr[i] = data[i];
-            }
-            question_tmp_ptr += len1;
-        }
-        
-        // Label 2
-        if(len2){
-            *question_tmp_ptr = (unsigned char)len2;
-            question_tmp_ptr += 1;
-            for(int i = 63; i < 63 + len2; i++){
-                question_tmp_ptr[i - 63] = data[i];
-            }
-            question_tmp_ptr += len2;
+    // Order them alternating the families, IPv6 first
+    sort_upstreams(v6, v6_count);
+    sort_upstreams(v4, v4_count);
+    int n = 0;
+    for(int i = 0; i < v6_count || i < v4_count; i++){
+        if(i < v6_count){
+            order[n++] = v6[i];
+        }
+        if(i < v4_count){
+            order[n++] = v4[i];
         }
+    }
+    return n;
+}
 
-    }else{
-        // Otherwise, put a.a.BASE_HOST to the question as an empty message
-        // which will signal end of communication
 
-        // Label 1
-        *question_tmp_ptr = (unsigned char)1;
-        question_tmp_ptr += 1;
-        *question_tmp_ptr = 'a';
-        question_tmp_ptr += 1;
+/*
+ *
+ * TRANSFERS
+ *
+ */
+
+
+/**
+ * @brief Select the capabilities, window and chunk length of the current try
+ * from the answer to the first query. A response which only echoes the
+ * query, without an address, comes from an old receiver: it took the path
+ * from the first query (and didn't read the handshake after it) and takes
+ * any later query with data for a data chunk, so chunks are sent one by one
+ * without control labels
+ *
+ * @param transfer
+ * @param answer - response to the first query
+ * @param len - its length in bytes
+ */
+void negotiate(struct transfer *transfer, const unsigned char *answer, int len){
+    unsigned char selected[4];
+    transfer->negotiated = !packet_parse_answer(answer, len, selected) && selected[0];
+    if(!transfer->negotiated){
+        transfer->capabilities = 0;
+        transfer->window = 1;
+        transfer->chunk_len = CHUNK_LEN;
+        return;
+    }
 
-        // Label 2
-        *question_tmp_ptr = (unsigned char)1;
-        question_tmp_ptr += 1;
-        *question_tmp_ptr = 'a';
-        question_tmp_ptr += 1;
+    // The receiver selects from what we advertised, but don't trust it
+    transfer->capabilities = selected[1] & SENDER_CAPABILITIES;
+    transfer->window = selected[2] < TCP_WINDOW ? selected[2] : TCP_WINDOW;
+    if(transfer->window < 1){
+        transfer->window = 1;
+    }
+    transfer->chunk_len = selected[3] < CHUNK_LEN ? selected[3] : CHUNK_LEN;
+    if(transfer->chunk_len < 1){
+        transfer->chunk_len = 1;
     }
+}
 
-    int BASE_HOST_i = 0;
 
-    // Domain name
-    unsigned char *name_len_byte = question_tmp_ptr;
-    question_tmp_ptr += 1;
-    for( ; BASE_HOST[BASE_HOST_i] != '.'; BASE_HOST_i++){
-        *question_tmp_ptr = BASE_HOST[BASE_HOST_i];
-        question_tmp_ptr += 1;
+/**
+ * @brief Take a query of a transfer which is not in flight
+ *
+ * @param transfer
+ * @param type - QUERY_...
+ * @param index - of the page, first offered block, chunk, ...
+ *
+ * @return the query, to the server of the current try
+ */
+static struct query *new_query(struct transfer *transfer, char type, uint64_t index){
+    struct query *query = NULL;
+    for(int i = 0; i < TRANSFER_MAX_QUERIES && !query; i++){
+        if(!transfer->queries[i].in_flight){
+            query = &transfer->queries[i];
+        }
     }
-    *name_len_byte = (unsigned char)(question_tmp_ptr - name_len_byte - 1);
+    query->type = type;
+    query->index = index;
+    query->offset = 0;
+    query->len = 0;
+    query->control[0] = '\0';
+    query->tries = 0;
+    query->upstream = transfer->upstream;
+    return query;
+}
 
-    BASE_HOST_i += 1; // Skip the '.'
 
-    // Domain extension
-    unsigned char *extension_len_byte = question_tmp_ptr;
-    question_tmp_ptr += 1;
-    for( ; BASE_HOST[BASE_HOST_i] != '\0'; BASE_HOST_i++){
-        *question_tmp_ptr = BASE_HOST[BASE_HOST_i];
-        question_tmp_ptr += 1;
+/**
+ * @brief Get the time to wait for the confirmation of a query by a server -
+ * its retransmission timeout, doubled for every repeated try (see
+ * CONFIRMATION_TIMEOUT_MS)
+ *
+ * @param upstream - the server
+ * @param tries - number of times the query was sent, including this one
+ *
+ * @return the timeout in milliseconds
+ */
+static int retransmit_timeout_ms(struct upstream *upstream, int tries){
+    if(!upstream->confirmed){
+        return CONFIRMATION_TIMEOUT_MS;
+    }
+    uint64_t variation = 4 * upstream->rttvar_us > ENGINE_TICK_US ? 4 * upstream->rttvar_us : ENGINE_TICK_US;
+    uint64_t timeout_ms = (upstream->srtt_us + variation + 999) / 1000;
+    if(timeout_ms < MIN_RETRANSMIT_TIMEOUT_MS){
+        timeout_ms = MIN_RETRANSMIT_TIMEOUT_MS;
+    }
+    for(int i = 1; i < tries && timeout_ms < CONFIRMATION_TIMEOUT_MS; i++){
+        timeout_ms *= 2;
     }
-    *extension_len_byte = (unsigned char)(question_tmp_ptr - extension_len_byte - 1);
+    return timeout_ms < CONFIRMATION_TIMEOUT_MS ? timeout_ms : CONFIRMATION_TIMEOUT_MS;
+}
+
+
+/**
+ * @brief Send a query (again) - its data are prepared right before, so that
+ * a repeated query carries the same data
+ *
+ * @param sock - socket
+ * @param query
+ *
+ * @return 0 if it was sent, 1 if not - other queries than probes which
+ * can't be sent end the program, except in the daemon, where they are
+ * handled like lost ones when their timer expires, so that only their
+ * transfer fails (the transfer can't be ended right here, its caller may
+ * still use it)
+ */
+static int send_query(int sock, struct query *query){
+    struct transfer *transfer = query->transfer;
+    char buffer[MAX_CHUNK_LEN + 8];
+    char *data = buffer;
+    int len = 0;
+    int timeout_ms = CONFIRMATION_TIMEOUT_MS;
+
+    if(query->type == QUERY_PROBE){
+        // The last probe gets the whole timeout
+        data = "";
+        if(query->index + 1 < (uint64_t)transfer->probe_count){
+            timeout_ms = UPSTREAM_RACE_DELAY_MS;
+        }
+
+    }else if(query->type == QUERY_START){
+        // The path (checked to fit to a query), a zero byte and the
+        // handshake, which old receivers don't read past the path
+        unsigned char start[256 + 1 + HANDSHAKE_LEN];
+        int path_len = strlen(transfer->dst_filepath);
+        unsigned char *handshake = start + path_len + 1;
+        memcpy(start, transfer->dst_filepath, path_len + 1);
+        handshake[0] = PROTOCOL_VERSION;
+        handshake[1] = SENDER_CAPABILITIES;
+        handshake[2] = TCP_WINDOW;
+        delta_put(handshake + 3, transfer->file_size, 8);
+        len = base64_encode_to(buffer, start, path_len + 1 + HANDSHAKE_LEN);
+
+    }else if(query->type == QUERY_SIGNATURES){
+        data = "";
+
+    }else if(query->type == QUERY_OFFER){
+        // Hashes of the offered blocks
+        unsigned char hashes[DEDUP_MAX_OFFER * 8];
+        uint64_t count = transfer->count - query->index < (uint64_t)transfer->offer
+            ? transfer->count - query->index : (uint64_t)transfer->offer;
+        for(uint64_t i = 0; i < count; i++){
+            const unsigned char *block = transfer->payload + (query->index + i) * DEDUP_BLOCK_SIZE;
+            delta_put(hashes + i * 8, delta_strong(block, DEDUP_BLOCK_SIZE), 8);
+        }
+        len = base64_encode_to(buffer, hashes, count * 8);
+
+    }else if(query->type == QUERY_CHUNK || query->type == QUERY_OFFSET){
+        data = payload_chunk(transfer, buffer, query->offset, query->len);
+        len = query->len;
 
-    // Terminate with zero byte
-    *question_tmp_ptr = (unsigned char)'\0';
-    question_tmp_ptr += 1;
+    }else if(query->type == QUERY_FEC){
+        data = transfer->fec_chunks[query->index];
+        len = transfer->fec_lens[query->index];
+
+    }else{
+        data = NULL;
+    }
+
+    query->tries += 1;
+    if(query->tries > 1){
+        metrics_add(METRIC_RETRANSMITS, 1);
+    }
+    if(query->type != QUERY_PROBE && query->type != QUERY_START && query->type != QUERY_FIN){
+        timeout_ms = retransmit_timeout_ms(query->upstream, query->tries);
+    }
+    if(engine_send(sock, query, data, len, timeout_ms)){
+        if(query->type != QUERY_PROBE){
+            if(!DAEMON_SOCKET){
+                err("Failed to send a packet.");
+            }
+            fprintf(stderr, "Error! Failed to send a packet.\n");
+        }
+        return 1;
+    }
+    return 0;
+}
 
-    // Set type and class of the DNS query
-    struct dns_question_info_t *question_info_ptr
-        = (struct dns_question_info_t *)question_tmp_ptr;
-    question_info_ptr->type = htons(1); // Type is A - host address
-    question_info_ptr->class = htons(1); // Class is internet address
-    question_tmp_ptr += 4;
 
-    *buffer_len = question_tmp_ptr - buffer;
+/**
+ * @brief Stop waiting for all queries of a transfer
+ *
+ * @param transfer
+ */
+static void cancel_queries(struct transfer *transfer){
+    for(int i = 0; i < TRANSFER_MAX_QUERIES; i++){
+        engine_cancel(&transfer->queries[i]);
+    }
 }
 
 
 /**
- * @brief Send a packet through a socket to provided address
+ * @brief Send probes to the servers from the i-th one, until one of them
+ * can be sent (see start_try)
  *
- * @param sock - UDP socket
- * @param addr - sockaddr_in structure representing destination address
- * @param data - packet
- * @param len - packet length in bytes
+ * @param sock - socket
+ * @param transfer
+ * @param i - index to the probe order
  */
-void send_packet(int sock, struct sockaddr_in addr, unsigned char *data, int len){
-    int ret = sendto(sock, (char *)data, len, 0, (struct sockaddr *)&addr, sizeof(addr));
-    if(ret != len){
-        err("Failed to send a packet.");
+static void send_probe(int sock, struct transfer *transfer, int i){
+    for(; i < transfer->probe_count; i++){
+        struct query *query = new_query(transfer, QUERY_PROBE, i);
+        strcpy(query->control, "p-0");
+        query->upstream = &UPSTREAMS[transfer->probe_order[i]];
+        if(!send_query(sock, query) || i + 1 == transfer->probe_count){
+            return;
+        }
+
+        // The server can't be reached (eg. no IPv6 route), try the next one
+        // right away
+        engine_cancel(query);
     }
-    // Trigger event
-    dns_sender__on_chunk_sent(&(addr.sin_addr), DST_FILEPATH, QUERY_ID, len);
 }
 
 
 /**
- * @brief Receives data from the server. If no data is received (after a
- * constant timeout), return 1. Otherwise, return 0 since the confirmation was
- * received.
+ * @brief Send the destination path and the handshake - what we support and
+ * the size of the file, so that the receiver can allocate the file at once
+ * (see PROTOCOL_VERSION)
  *
  * @param sock - socket
- * @param addr - server address
+ * @param transfer
+ */
+static void start_handshake(int sock, struct transfer *transfer){
+
+    // Trigger transfer init event
+    const void *host = NULL;
+    if(net_addr_host((struct sockaddr *)&transfer->upstream->addr, &host) == AF_INET6){
+        dns_sender__on_transfer_init6((struct in6_addr *)host);
+    }else{
+        dns_sender__on_transfer_init((struct in_addr *)host);
+    }
+
+    transfer->state = TRANSFER_STARTING;
+    transfer->starts += 1;
+    send_query(sock, new_query(transfer, QUERY_START, 0));
+}
+
+
+/**
+ * @brief Start a try of a transfer with the server which answers first,
+ * like Happy Eyeballs (RFC 8305): probes (queries "p-0.BASE_HOST", only
+ * confirmed by the receiver) are sent to the servers one by one, alternating
+ * IPv6 and IPv4 servers and starting with IPv6, UPSTREAM_RACE_DELAY_MS apart
+ * until any server answers (the first one is used if none does). The server
+ * which answered is kept in SELECTED_UPSTREAM until a try fails, and later
+ * tries and transfers use it without probing. Over TCP, the server of the
+ * connection is used
  *
- * @return 0 if confirmation was received
+ * @param sock - socket
+ * @param transfer
  */
-int wait_for_confirmation(int sock, struct sockaddr_in addr){
-    char buffer[512] = {'\0'};
-    int addr_len = sizeof(addr);
-    int len = recvfrom(sock, buffer, 512, 0, (struct sockaddr *)&addr, &addr_len);
-    return len > 0 ? 0 : 1;
+static void start_try(int sock, struct transfer *transfer){
+    transfer->try += 1;
+    transfer->failed = 0;
+    transfer->starts = 0;
+    transfer->packets = 0;
+
+    transfer->upstream = TCP ? TCP_UPSTREAM : SELECTED_UPSTREAM;
+    if(transfer->upstream){
+        start_handshake(sock, transfer);
+        return;
+    }
+
+    transfer->probe_count = order_upstreams(transfer->probe_order);
+    if(!transfer->probe_count){
+        err("No upstream DNS server can be reached without IPv6.");
+    }
+    if(transfer->probe_count == 1){
+        SELECTED_UPSTREAM = &UPSTREAMS[transfer->probe_order[0]];
+        transfer->upstream = SELECTED_UPSTREAM;
+        start_handshake(sock, transfer);
+        return;
+    }
+
+    // Start the probes one by one until any of them is confirmed
+    transfer->state = TRANSFER_PROBING;
+    send_probe(sock, transfer, 0);
 }
 
 
 /**
- * @brief Send an empty packet and ensure it is received. Try for a total of
- * MAX_TRIES if no confirmation is received from the server.
+ * @brief End the communication of the current try by the empty query
  *
  * @param sock - socket
- * @param addr - server address
+ * @param transfer
+ * @param failed - 1 if the try failed (and the transfer is tried again), 2
+ * if the first query is sent again once the communication is closed
+ */
+static void end_try(int sock, struct transfer *transfer, int failed){
+    cancel_queries(transfer);
+    transfer->failed = failed;
+    transfer->state = TRANSFER_ENDING;
+    send_query(sock, new_query(transfer, QUERY_FIN, 0));
+}
+
+
+/**
+ * @brief End a transfer, count it in metrics and tell whoever waits for it
  *
- * @return 0 if empty packet was sent successfully
+ * @param transfer
+ * @param result - 0 if transmitted successfully, 2 if not
  */
-int ensure_send_empty(int sock, struct sockaddr_in addr){
-    for(int i = 0; i < MAX_TRIES; i++){
-        char packet[512] = {'\0'};
-        int packet_len = 0;
-        create_packet(packet, &packet_len, NULL, 0);
-        send_packet(sock, addr, packet, packet_len);
-        if(!wait_for_confirmation(sock, addr)){
-            return 0;
-        }
+static void end_transfer(struct transfer *transfer, int result){
+    metrics_add(METRIC_ACTIVE_SESSIONS, -1);
+    metrics_add(result ? METRIC_TRANSFERS_FAILED : METRIC_TRANSFERS_COMPLETED, 1);
+    if(result){
+        fprintf(stderr, "Could not transmit data. Is the server listening?\n");
+    }
+
+    transfer->result = result;
+    transfer->state = TRANSFER_DONE;
+    if(transfer->done){
+        // May free the transfer
+        transfer->done(transfer, transfer->arg);
     }
-    return 1;
 }
 
 
 /**
- * @brief Wait for confirmation (of packet receival) from the server. If none
- * comes, ensure that the server receives an empty message to close the
- * connection.
+ * @brief Finish the current try once the empty query was confirmed (or not)
+ * and try again, up to MAX_TRIES times, if it failed
  *
  * @param sock - socket
- * @param addr - server address
- *
- * @return 0 if confirmation was received, 1 if a packet confirmation was not
- * received but connection was successfully closed, -1 if connection close
- * confirmation was not received
- */
-int handle_confirmation(int sock, struct sockaddr_in addr){
-    int ret = wait_for_confirmation(sock, addr);
-    if(ret){
-        // If we didn't receive the confirmation, send empty packet to finalize the
-        // transfer and try to transfer again, from the start
-        ret = ensure_send_empty(sock, addr);
-        if(!ret){
-            return 1;
-        }else{
-            return -1;
+ * @param transfer
+ * @param ret - 0 if transmitted successfully, 1 if the try failed but the
+ * communication was closed, 2 if the first query is to be sent again, -1 if
+ * the communication could not be closed
+ */
+static void finish_try(int sock, struct transfer *transfer, int ret){
+    if(transfer->try > 1){
+        // Everything sent by a repeated try is sent again
+        metrics_add(METRIC_RETRANSMITS, transfer->packets);
+    }
+    if(ret == 0){
+        // Trigger transfer complete event
+        dns_sender__on_transfer_completed(transfer->dst_filepath, transfer->file_size);
+        end_transfer(transfer, 0);
+        return;
+    }
+    if(ret == 2){
+        start_handshake(sock, transfer);
+        return;
+    }
+
+    // The next try (or transfer) looks for the fastest server again
+    SELECTED_UPSTREAM = NULL;
+    if(ret == -1){
+        fprintf(stderr, "Try %d of %d for transmitting the data failed and connection could not be closed. Not trying again.\n", transfer->try, MAX_TRIES);
+        end_transfer(transfer, 2);
+        return;
+    }
+
+    fprintf(stderr, "Try %d of %d for transmitting the data failed.\n", transfer->try, MAX_TRIES);
+    if(transfer->try < MAX_TRIES){
+        start_try(sock, transfer);
+    }else{
+        end_transfer(transfer, 2);
+    }
+}
+
+
+/**
+ * @brief Start sending the data (or the delta) - protected by parity chunks
+ * if FEC is enabled or without waiting for every confirmation over TCP, if
+ * the receiver supports it, one by one otherwise
+ *
+ * @param transfer
+ */
+static void start_sending(struct transfer *transfer){
+    transfer->state = TRANSFER_SENDING;
+    transfer->payload_b64_len = (transfer->send_size * 4 + 2) / 3;
+    transfer->bytes_sent = 0;
+    transfer->next = 0;
+    transfer->fec = FEC_GROUP && (transfer->capabilities & CAP_FEC);
+    transfer->pipelined = TCP && (transfer->capabilities & CAP_OFFSET);
+    if(FEC_GROUP && !transfer->fec){
+        fprintf(stderr, "The receiver does not support FEC, sending without it.\n");
+    }
+}
+
+
+/**
+ * @brief Send the next group of FEC_GROUP data chunks followed by a parity
+ * chunk. Chunks of a group are sent without waiting for each confirmation
+ * and the group is delivered once any FEC_GROUP of its chunks are confirmed,
+ * since the server can reconstruct a single missing chunk from the parity.
+ * Otherwise, only the unconfirmed chunks are sent again
+ *
+ * @param sock - socket
+ * @param transfer
+ */
+static void send_fec_group(int sock, struct transfer *transfer){
+
+    // Split the next part of the payload to up to FEC_GROUP chunks
+    int n = 0;
+    while(n < FEC_GROUP && transfer->bytes_sent < transfer->payload_b64_len){
+        int len = transfer->chunk_len;
+        if(len > transfer->payload_b64_len - transfer->bytes_sent){
+            len = transfer->payload_b64_len - transfer->bytes_sent;
         }
+        transfer->fec_chunks[n] = payload_chunk(transfer, transfer->fec_buffers[n], transfer->bytes_sent, len);
+        transfer->fec_lens[n] = len;
+        transfer->bytes_sent += len;
+        n++;
+    }
 
+    // Append the parity chunk (first chunk is always the longest)
+    fec_parity(transfer->fec_parity, transfer->fec_lens[0], transfer->fec_chunks, transfer->fec_lens, n);
+    transfer->fec_chunks[n] = transfer->fec_parity;
+    transfer->fec_lens[n] = transfer->fec_lens[0];
+    transfer->fec_n = n;
+    transfer->fec_confirmed = 0;
+
+    for(int i = 0; i <= n; i++){
+        struct query *query = new_query(transfer, QUERY_FEC, i);
+        fec_control_label(query->control, transfer->next, i, n, transfer->fec_lens[0], transfer->fec_lens[n - 1]);
+        send_query(sock, query);
     }
-    return 0;
+    transfer->next += 1;
 }
 
 
 /**
- * @brief Transmit all base64 data in PAYLOAD_B64 in DNS packets to the server.
- * First packet will contain the destination file path, following packets will
- * contain the encoded data and the last packet will be empty, signaling
- * connection close.
+ * @brief Send the queries of the current state of a transfer, up to its
+ * window, or move to the next state once all were answered: signatures of
+ * the receiver's file ("g-PAGE"), offers of blocks to the receiver's store
+ * ("h-INDEX" with hashes of the blocks) - then the delta of the payload
+ * against both is sent instead of the payload - data chunks and the empty
+ * query
  *
- * @return 0 if transmitted successfully, 1 if a packet confirmation was not
- * received but connection was successfully closed, -1 if connection close
- * confirmation was not received
+ * @param sock - socket
+ * @param transfer
  */
-int transmit(){
+static void continue_transfer(int sock, struct transfer *transfer){
+
+    if(transfer->state == TRANSFER_SIGNATURES){
+        // The first page tells how many pages there are
+        while(transfer->in_flight < transfer->window && transfer->next < transfer->count){
+            struct query *query = new_query(transfer, QUERY_SIGNATURES, transfer->next++);
+            snprintf(query->control, sizeof(query->control), "g-%" PRIx64, query->index);
+            send_query(sock, query);
+        }
+        if(transfer->in_flight){
+            return;
+        }
 
-    // Create a socket
-    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP); // UDP packet for DNS queries
-    if(sock == -1){
-        err("Failed to open socket");
+        // Offer as many hashes as fit to a chunk
+        transfer->state = TRANSFER_OFFERING;
+        transfer->offer = (transfer->chunk_len * 3 / 4) / 8;
+        if(transfer->offer > DEDUP_MAX_OFFER){
+            transfer->offer = DEDUP_MAX_OFFER;
+        }
+        transfer->count = transfer->capabilities & CAP_DEDUP && transfer->offer > 0
+            ? transfer->file_size / DEDUP_BLOCK_SIZE : 0;
+        transfer->next = 0;
+        if(transfer->count){
+            delta_init_stored(&transfer->delta, transfer->count);
+        }
     }
 
-    // Set 1s receive timeout (for confirmation messages)
-    struct timeval timeout;
-    timeout.tv_sec = 1;
-    timeout.tv_usec = 100000;
-    if(setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0) {
-        err("Failed to set socket timeout option");
+    if(transfer->state == TRANSFER_OFFERING){
+        while(transfer->in_flight < transfer->window && transfer->next < transfer->count){
+            struct query *query = new_query(transfer, QUERY_OFFER, transfer->next);
+            snprintf(query->control, sizeof(query->control), "h-%" PRIx64, query->index);
+            send_query(sock, query);
+            transfer->next += transfer->offer;
+        }
+        if(transfer->in_flight){
+            return;
+        }
+        transfer->send_size = delta_compute(&transfer->delta, transfer->payload, transfer->file_size);
+        transfer->send_delta = 1;
+        start_sending(transfer);
     }
 
-    // Get destination address
-    struct sockaddr_in dst;
-    dst.sin_family = AF_INET;
-    dst.sin_port = htons(53);
-    // Use mallocd upstream DNS if it exists (user didn't specify '-u')
-    if(UPSTREAM_DNS_IP_MALLOCD){
-        dst.sin_addr.s_addr = inet_addr(UPSTREAM_DNS_IP_MALLOCD);
+    if(transfer->fec){
+        if(!transfer->in_flight && transfer->bytes_sent < transfer->payload_b64_len){
+            send_fec_group(sock, transfer);
+        }
+
     }else{
-        dst.sin_addr.s_addr = inet_addr(UPSTREAM_DNS_IP);
+        // Every chunk with its index ("i-INDEX") if the receiver supports
+        // it, so that it recognizes a repeated query, or its offset
+        // ("o-OFFSET") when pipelined, so that the receiver can put chunks
+        // which come out of order in place
+        int window = transfer->pipelined ? transfer->window : 1;
+        while(transfer->in_flight < window && transfer->bytes_sent < transfer->payload_b64_len){
+            struct query *query = new_query(transfer, transfer->pipelined ? QUERY_OFFSET : QUERY_CHUNK, transfer->next++);
+            query->offset = transfer->bytes_sent;
+            query->len = transfer->chunk_len;
+            if(query->len > transfer->payload_b64_len - transfer->bytes_sent){
+                query->len = transfer->payload_b64_len - transfer->bytes_sent;
+            }
+            if(transfer->pipelined){
+                snprintf(query->control, sizeof(query->control), "o-%" PRIx64, query->offset);
+            }else if(transfer->capabilities & CAP_INDEX){
+                snprintf(query->control, sizeof(query->control), "i-%" PRIx64, query->index);
+            }
+            send_query(sock, query);
+            transfer->bytes_sent += query->len;
+        }
     }
 
-    // Trigger transfer init event
-    dns_sender__on_transfer_init(&(dst.sin_addr));
+    if(!transfer->in_flight){
+        // Send empty packet to finalize the transfer
+        end_try(sock, transfer, 0);
+    }
+}
+
+
+/**
+ * @brief Handle the answer to a query of a transfer (called by the engine)
+ *
+ * @param sock - socket
+ * @param query - the answered query, still in flight
+ * @param answer - the response
+ * @param len - its length in bytes
+ */
+void transfer_answer(int sock, struct query *query, const unsigned char *answer, int len){
+    struct transfer *transfer = query->transfer;
+
+    if(query->type == QUERY_PROBE){
+        // The server which answered first is used
+        SELECTED_UPSTREAM = query->upstream;
+        transfer->upstream = SELECTED_UPSTREAM;
+        cancel_queries(transfer);
+        start_handshake(sock, transfer);
+        return;
+    }
+
+    if(query->type == QUERY_FIN){
+        engine_cancel(query);
+        finish_try(sock, transfer, transfer->failed);
+        return;
+    }
+
+    if(query->type == QUERY_START){
+        engine_cancel(query);
+        negotiate(transfer, answer, len);
+
+        // Send only what changed if the file exists on the receiver's
+        // machine and blocks its store doesn't have
+        transfer->send_delta = 0;
+        transfer->send_size = transfer->file_size;
+        if(transfer->capabilities & (CAP_DELTA | CAP_DEDUP)){
+            delta_free(&transfer->delta);
+            transfer->state = TRANSFER_SIGNATURES;
+            transfer->count = transfer->capabilities & CAP_DELTA ? 1 : 0;
+            transfer->next = 0;
+        }else{
+            start_sending(transfer);
+        }
+
+    }else if(query->type == QUERY_SIGNATURES){
+        unsigned char data[512];
+        int data_len = packet_parse_txt_answer(answer, len, data);
+        if(delta_add_page(&transfer->delta, query->index, data, data_len)){
+            return; // Wait for a valid answer
+        }
+        engine_cancel(query);
+        transfer->count = delta_page_count(&transfer->delta);
+
+    }else if(query->type == QUERY_OFFER){
+        // Blocks the receiver has - the highest bit is the first block
+        unsigned char bitmap[4];
+        if(packet_parse_answer(answer, len, bitmap)){
+            return;
+        }
+        engine_cancel(query);
+        for(int i = 0; i < transfer->offer && query->index + i < transfer->count; i++){
+            if(bitmap[i / 8] & (0x80 >> (i % 8))){
+                delta_add_stored(&transfer->delta, query->index + i);
+            }
+        }
+
+    }else if(query->type == QUERY_FEC){
+        engine_cancel(query);
+        transfer->fec_confirmed += 1;
+        if(transfer->fec_confirmed >= transfer->fec_n){
+            // The group is delivered, the last chunk is not needed
+            cancel_queries(transfer);
+        }
 
-    // Send the destination path
-    int dst_path_b64_len = 0;
-    char *dst_path_b64 = base64_encode(DST_FILEPATH, strlen(DST_FILEPATH), &dst_path_b64_len);
-    char dst_path_packet[512] = {'\0'};
-    int dst_path_packet_len = 0;
-    create_packet(dst_path_packet, &dst_path_packet_len, dst_path_b64, dst_path_b64_len);
-    send_packet(sock, dst, dst_path_packet, dst_path_packet_len);
-    int ret = handle_confirmation(sock, dst);
-    if(ret){
-        return ret;
+    }else{
+        engine_cancel(query);
     }
-    free(dst_path_b64);
 
-    // Send all data:
-    int bytes_sent = 0;
-    while(bytes_sent < PAYLOAD_B64_LEN){
+    continue_transfer(sock, transfer);
+}
+
 
-        // Take up to 126 bytes from PAYLOAD_B64 per packet
-        char packet_payload[127] = {'\0'};
-        int packet_payload_len = PAYLOAD_B64_LEN - bytes_sent;
-        if(packet_payload_len > 126){
-            packet_payload_len = 126;
+/**
+ * @brief Handle a query of a transfer whose answer did not come in time
+ * (called by the engine) - send it again or give up the try
+ *
+ * @param sock - socket
+ * @param query - the query, still in flight
+ */
+void transfer_timeout(int sock, struct query *query){
+    struct transfer *transfer = query->transfer;
+
+    if(query->type == QUERY_PROBE){
+        // Earlier probes may still be answered
+        if(query->index + 1 < (uint64_t)transfer->probe_count){
+            send_probe(sock, transfer, query->index + 1);
+            return;
         }
-        strncpy(packet_payload, PAYLOAD_B64 + bytes_sent, packet_payload_len);
+        cancel_queries(transfer);
+        transfer->upstream = &UPSTREAMS[transfer->probe_order[0]];
+        start_handshake(sock, transfer);
+        return;
+    }
+
+    // The receiver recognizes chunks identified by their index or offset and
+    // a repeated first query, if it negotiated in an earlier try (an old
+    // receiver would take it for data), so they are sent again. Other
+    // chunks are only sent once, so that the receiver doesn't take them
+    // twice - the try starts again instead
+    int repeated = (query->type == QUERY_START && transfer->negotiated) || query->type == QUERY_SIGNATURES
+        || query->type == QUERY_OFFER || query->type == QUERY_FEC || query->type == QUERY_FIN
+        || query->type == QUERY_OFFSET
+        || (query->type == QUERY_CHUNK && transfer->capabilities & CAP_INDEX);
+    if(repeated && query->tries < MAX_TRIES){
+        send_query(sock, query);
+        return;
+    }
+    if(query->type == QUERY_START && !transfer->negotiated && transfer->starts < MAX_TRIES){
+        // An old receiver may have taken the path already, so the
+        // communication is closed before the first query is sent again
+        end_try(sock, transfer, 2);
+        return;
+    }
 
-        // Create and send the packet
-        char packet[512] = {'\0'};
-        int packet_len = 0;
-        create_packet(packet, &packet_len, packet_payload, packet_payload_len);
-        send_packet(sock, dst, packet, packet_len);
-        int ret = handle_confirmation(sock, dst);
-        if(ret){
-            return ret;
+    if(query->type == QUERY_FIN){
+        finish_try(sock, transfer, -1);
+        return;
+    }
+    if(query->type == QUERY_FEC){
+        // The group can still be delivered without one chunk
+        engine_cancel(query);
+        if(transfer->fec_confirmed + transfer->in_flight >= transfer->fec_n){
+            return;
         }
+    }
+
+    // Close the communication and try again
+    end_try(sock, transfer, 1);
+}
 
-        bytes_sent += packet_payload_len;
+
+/**
+ * @brief Prepare a transfer - check it, prepare its packets and get its
+ * payload
+ *
+ * @param transfer - output, zeroed
+ * @param base_host
+ * @param dst_filepath - where to save the file on the server machine
+ * @param src_filepath - file to send, NULL for STDIN
+ *
+ * @return NULL on success, the error message otherwise
+ */
+const char *transfer_init(struct transfer *transfer, char *base_host, char *dst_filepath, char *src_filepath){
+    static char message[PATH_MAX + 64];
+
+    transfer->base_host = base_host;
+    transfer->dst_filepath = dst_filepath;
+    transfer->src_filepath = src_filepath;
+    for(int i = 0; i < TRANSFER_MAX_QUERIES; i++){
+        transfer->queries[i].transfer = transfer;
+        timer_init(&transfer->queries[i].timer, &transfer->queries[i]);
     }
 
-    // Send empty packet to finalize the transfer
-    return ensure_send_empty(sock, dst);
+    const char *error = check_transfer(base_host, dst_filepath);
+    if(!error){
+        error = prepare_packet_template(transfer);
+    }
+    if(error){
+        return error;
+    }
+    if(get_payload(transfer)){
+        snprintf(message, sizeof(message), "Could not open file \"%s\".", src_filepath);
+        return message;
+    }
+    transfer->send_size = transfer->file_size;
+    return NULL;
+}
+
+
+/**
+ * @brief Start a transfer prepared by transfer_init - it is then driven by
+ * engine_poll until it is done, up to MAX_TRIES tries
+ *
+ * @param sock - socket opened by open_socket
+ * @param transfer
+ * @param done - called once the transfer is done (or NULL), its result is in
+ * transfer->result
+ * @param arg - passed to done
+ */
+void transfer_start(int sock, struct transfer *transfer,
+        void (*done)(struct transfer *transfer, void *arg), void *arg){
+    transfer->done = done;
+    transfer->arg = arg;
+    metrics_add(METRIC_ACTIVE_SESSIONS, 1);
+    start_try(sock, transfer);
+}
+
+
+/**
+ * @brief Free the payload and the delta of a transfer, stop waiting for its
+ * queries
+ *
+ * @param transfer
+ */
+void transfer_free(struct transfer *transfer){
+    cancel_queries(transfer);
+    free_payload(transfer);
+    delta_free(&transfer->delta);
 }
 
 
@@ -620,40 +1399,45 @@ int transmit(){
 
 int main(int argc, char **argv){
 
-    // Parse and check arguments and save the payload to send (encode it first)
+    // Parse and check arguments
     parse_args(argc, argv);
     check_args();
-    get_payload();
-
-    int ret_val = 0;
+    if(SUBMIT){
+        // The daemon sends the file
+        return daemon_submit(DAEMON_SOCKET, PRIORITY, BASE_HOST, DST_FILEPATH, SRC_FILEPATH);
+    }
 
-    for(int i = 0; i < MAX_TRIES; i++){
-        // Try to transmit the data. If it fails, try again for total of
-        // MAX_TRIES. If that fails, return 2
-        int ret = transmit();
-        if(ret == 0){
-            // Trigger transfer complete event
-            dns_sender__on_transfer_completed(DST_FILEPATH, FILE_SIZE);
-            break;
-        }else if(ret == -1){
-            fprintf(stderr, "Try %d of %d for transmitting the data failed and connection could not be closed. Not trying again.\n", i + 1, MAX_TRIES);
-            ret_val = 2;
-            break;
-        }
-        
-        fprintf(stderr, "Try %d of %d for transmitting the data failed.\n", i + 1, MAX_TRIES);
+    metrics_init("dns_sender");
+    if(DAEMON_SOCKET){
+        // Send files submitted to the daemon over one socket
+        int sock = open_socket();
+        int ret_val = daemon_run(DAEMON_SOCKET, sock);
+        net_close(sock);
+        return ret_val;
     }
 
-    // Free resources
-    if(SRC_FILE){
-        fclose(SRC_FILE);
+    // Save the payload to send
+    struct transfer *transfer = calloc(1, sizeof(struct transfer));
+    if(!transfer){
+        err("Allocating memory failed.");
+    }
+    const char *message = transfer_init(transfer, BASE_HOST, DST_FILEPATH, SRC_FILEPATH);
+    if(message){
+        err("%s", message);
     }
-    free(UPSTREAM_DNS_IP_MALLOCD);
-    free(PAYLOAD_B64);
 
-    if(ret_val){
-        fprintf(stderr, "Could not transmit data. Is the server listening?\n");
+    int sock = open_socket();
+
+    transfer_start(sock, transfer, NULL, NULL);
+    while(transfer->state != TRANSFER_DONE){
+        engine_poll(sock, -1);
     }
+    int ret_val = transfer->result;
+
+    // Free resources
+    net_close(sock);
+    transfer_free(transfer);
+    free(transfer);
 
     return ret_val;
 }
@@ -14,55 +14,209 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 
+// Header files
+#include "dns_sender_delta.h"
+#include "dns_sender_fec.h"
+#include "../common/dns_packet.h"
+#include "../common/dns_timer.h"
+
+
+/**
+ * Maximum length of the base host, so that the longest question (control
+ * label, two full data labels and the base host) fits to 255 bytes, and of a
+ * list of base hosts separated by commas (see PACKET_MAX_DOMAINS)
+ */
+#define MAX_BASE_HOST_LEN 100
+#define MAX_BASE_HOSTS_LEN 1023
+
+
+/**
+ * Maximum length of base64 data in one packet (a longer base host leaves
+ * less space for data) and maximum length of a control label
+ */
+#define MAX_CHUNK_LEN 250
+#define MAX_CONTROL_LEN 32
+
+
+/**
+ * Time to wait for a confirmation of a packet before it is considered lost -
+ * until the server confirmed anything and for the queries the receiver
+ * confirms only after work on the file (the first and the empty one).
+ * Other queries wait for the retransmission timeout of the server, computed
+ * from its round-trip times like by TCP (RFC 6298), at least
+ * MIN_RETRANSMIT_TIMEOUT_MS and doubled for every repeated query
+ */
+#define CONFIRMATION_TIMEOUT_MS 1100
+#define MIN_RETRANSMIT_TIMEOUT_MS 200
+
+
+/**
+ * Maximum number of DNS servers taken from resolv.conf and time between
+ * probes of the servers when selecting the fastest one
+ */
+#define MAX_UPSTREAMS 8
+#define UPSTREAM_RACE_DELAY_MS 250
+
+
+/**
+ * Maximum number of chunks sent over TCP without waiting for their
+ * confirmations (at most MAX_PENDING_CHUNKS of the receiver)
+ */
+#define TCP_WINDOW 32
+
+
+/**
+ * Capabilities advertised in the first query (see PROTOCOL_VERSION)
+ */
+#define SENDER_CAPABILITIES (CAP_INDEX | CAP_FEC | CAP_OFFSET | CAP_DELTA | CAP_DEDUP)
+
+
+/**
+ * Address of a DNS server (IPv4, IPv6 or IPv4 mapped to IPv6) and what was
+ * learned about the path to it (kept between transfers of the daemon)
+ */
+struct upstream{
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    uint64_t srtt_us; // Smoothed round-trip time of confirmations
+    uint64_t rttvar_us; // Its variation
+    uint64_t sent; // Queries sent to it
+    uint64_t confirmed; // Queries whose confirmation came in time to be measured
+};
+
 
 /**
- * DNS header structure
- * https://opensource.apple.com/source/netinfo/netinfo-208/common/dns.h.auto.html
+ * Maximum number of queries of a transfer in flight - chunks of the window,
+ * a FEC group with its parity chunk or probes of all servers
  */
-struct dns_header_t{
-    uint16_t xid;
-    uint16_t flags;
-    uint16_t qdcount;
-    uint16_t ancount;
-    uint16_t nscount;
-    uint16_t arcount;
+#define TRANSFER_MAX_QUERIES TCP_WINDOW
+
+
+/**
+ * Kinds of queries of a transfer (the first characters of their control
+ * labels, except for the first query, data chunks without an index and the
+ * empty query)
+ */
+#define QUERY_PROBE 'p' // "p-0", selects the server
+#define QUERY_START 's' // No control label, the destination path and the handshake
+#define QUERY_SIGNATURES 'g' // "g-PAGE", a page of signatures of the receiver's file
+#define QUERY_OFFER 'h' // "h-INDEX", hashes of blocks offered to the receiver's store
+#define QUERY_CHUNK 'i' // "i-INDEX" (or no control label), a data chunk
+#define QUERY_OFFSET 'o' // "o-OFFSET", a pipelined data chunk
+#define QUERY_FEC 'f' // "f-G-I-N-C-L", a data or parity chunk of a FEC group
+#define QUERY_FIN 'e' // No control label and no data, closes the communication
+
+
+/**
+ * Query of a transfer - sent again (with a new query ID) when it is repeated
+ */
+struct query{
+    struct transfer *transfer;
+    char type; // QUERY_...
+    uint64_t index; // Of the page, first offered block, chunk, ...
+    int64_t offset; // Of a data chunk in the base64 payload
+    int len; // Of a data chunk
+    char control[64]; // Control label, empty if there is none
+    int tries;
+    struct upstream *upstream;
+
+    // Kept by the engine (see dns_sender_engine.h)
+    int in_flight;
+    int xid;
+    uint64_t sent_us; // 0 once the latency was measured
+    struct timer timer; // Armed while the answer is awaited
 };
 
 
 /**
- * DNS question structure
- * https://opensource.apple.com/source/netinfo/netinfo-208/common/dns.h.auto.html
+ * States of a transfer - every try goes through them in this order (skipping
+ * some), until the transfer is done
  */
-struct dns_question_info_t{
-    uint16_t type;
-    uint16_t class;
+enum transfer_state{
+    TRANSFER_PROBING, // Selecting the server which answers first
+    TRANSFER_STARTING, // The destination path and negotiation
+    TRANSFER_SIGNATURES, // Getting signatures of the receiver's file
+    TRANSFER_OFFERING, // Offering blocks to the receiver's store
+    TRANSFER_SENDING, // Data chunks
+    TRANSFER_ENDING, // The empty query
+    TRANSFER_DONE
 };
 
 
-/*
- *
- * MISCELLANEOUS
- *
+/**
+ * Transfer of one file - driven by answers and timeouts of its queries, so
+ * that any number of transfers can share one thread and one socket
  */
+struct transfer{
+    char *base_host; // One or more, separated by commas
+    char *dst_filepath; // Where to save the data on the server machine
+    char *src_filepath; // File to send (NULL for STDIN)
+    struct packet_domains domains;
+    struct packet_template templates[PACKET_MAX_DOMAINS]; // Header and end of the question of every query, by base hosts
+    int next_domain; // Base host of the next query sent, they take turns
+
+    // The payload and what is sent of it
+    unsigned char *payload; // The mapped file or a copy
+    int payload_mapped;
+    int64_t file_size;
+    struct delta delta;
+    int send_delta; // 1 if the delta is sent instead of the payload
+    int64_t send_size; // Bytes sent - of the payload or the delta
+    int64_t payload_b64_len; // Without padding
+
+    // The current try and what was negotiated with the receiver in it
+    enum transfer_state state;
+    int try;
+    int failed; // 1 if the try failed, the empty query only closes the communication, 2 if the first query follows it
+    int starts; // First queries sent in the try
+    int64_t packets; // Sent in the try
+    struct upstream *upstream;
+    int negotiated; // 1 if the receiver answered the first query by its capabilities (when it was answered last)
+    int capabilities;
+    int window; // Max unconfirmed queries
+    int chunk_len; // Max length of base64 data in one query, at most CHUNK_LEN
+    int fec; // 1 if data are sent in FEC groups
+    int pipelined; // 1 if data chunks are sent without waiting for each confirmation
+
+    // Progress of the current state
+    int probe_order[MAX_UPSTREAMS]; // Indexes to UPSTREAMS
+    int probe_count;
+    uint64_t next; // Next page, offered block, chunk or FEC group
+    uint64_t count; // Pages or blocks to offer
+    int offer; // Blocks in one offer
+    int64_t bytes_sent; // Of the base64 payload
+    struct query queries[TRANSFER_MAX_QUERIES];
+    int in_flight; // Queries in flight (kept by the engine)
+
+    // The current FEC group - data chunks and the parity chunk
+    char fec_buffers[FEC_MAX_GROUP][MAX_CHUNK_LEN + 8];
+    char fec_parity[MAX_CHUNK_LEN + 1];
+    char *fec_chunks[FEC_MAX_GROUP + 1];
+    int fec_lens[FEC_MAX_GROUP + 1];
+    int fec_n; // Data chunks
+    int fec_confirmed;
+
+    int result; // Once done: 0 if transmitted successfully, 2 if not
+    void (*done)(struct transfer *transfer, void *arg); // Called once done (or NULL)
+    void *arg;
+};
 
 
 /**
- * @brief Variables and functions for encoding a string to base64
- *
- * @param data to encode
- * @param input_length in characters
- * @param output_length - pointer where the output length in chars will be
- * written
+ * Queries are sent over a TCP connection instead of UDP (option "-t")
+ */
+extern int TCP;
+
+
+/*
  *
- * @return allocated string containing the output
+ * MISCELLANEOUS
  *
- * Taken and modified from: https://stackoverflow.com/a/6782480/17580261
  */
-char *base64_encode(const unsigned char *data, int input_length, int *output_length);
 
 
 /**
- * @brief Free all resources, write the error message to stdout and exit
+ * @brief Write the error message to stderr and exit
  *
  * @param As for printf and similar functions
  */
@@ -77,8 +231,19 @@ void err(char *format, ...);
 
 
 /**
- * @brief Get upstream DNS IP address from the system's /etc/resolv.conf and
- * save it to UPSTREAM_DNS_IP_MALLOCD (allocate it first)
+ * @brief Add a DNS server to UPSTREAMS
+ *
+ * @param ip - IPv4 or IPv6 address (with a scope for link-local IPv6
+ * addresses, eg. "fe80::1%eth0")
+ *
+ * @return 0 if the address is valid
+ */
+int add_upstream(char *ip);
+
+
+/**
+ * @brief Get upstream DNS IP addresses (IPv4 and IPv6) from the system's
+ * /etc/resolv.conf and add them to UPSTREAMS
  */
 void get_upstream_dns_ip();
 
@@ -92,6 +257,17 @@ void get_upstream_dns_ip();
 void parse_args(int argc, char **argv);
 
 
+/**
+ * @brief Check the base host and the destination path of a transfer
+ *
+ * @param base_host - one or more, separated by commas
+ * @param dst_filepath
+ *
+ * @return NULL if they are valid, the error message otherwise
+ */
+const char *check_transfer(const char *base_host, const char *dst_filepath);
+
+
 /**
  * @brief Validate arguments provided by the user: check if everything is
  * specified and in the right format. If not, raise an error.
@@ -100,91 +276,165 @@ void check_args();
 
 
 /**
- * @brief Read from the provided file to send or from STDIN to then encode it
- * to base64 and save it to a global variable
+ * @brief Get the payload of a transfer - map its file to memory, or read
+ * STDIN (or a file which can't be mapped) to its payload
+ *
+ * @param transfer
+ *
+ * @return 0 on success, 1 if the file can't be opened
+ */
+int get_payload(struct transfer *transfer);
+
+
+/**
+ * @brief Free the payload of a transfer (unmap the file)
+ *
+ * @param transfer
+ */
+void free_payload(struct transfer *transfer);
+
+
+/**
+ * @brief Encode a chunk of the payload (or the delta) to base64 - chunks are
+ * encoded right before they are sent, so the payload is never encoded as a
+ * whole
+ *
+ * @param transfer
+ * @param buffer - output, at least len + 8 characters long
+ * @param offset - of the chunk in the base64 payload
+ * @param len - length of the chunk in characters
+ *
+ * @return the chunk (in buffer, not terminated)
+ */
+char *payload_chunk(struct transfer *transfer, char *buffer, int64_t offset, int len);
+
+
+/**
+ * @brief Prepare parts of packets of a transfer which are the same for all
+ * packets: the DNS header (except for the query ID) and the end of the
+ * question - the base host in the wire format, terminating zero byte, type
+ * and class of the question (one template for every base host)
+ *
+ * @param transfer
+ *
+ * @return NULL on success, the error message if a base host can't be used
  */
-void get_payload();
+const char *prepare_packet_template(struct transfer *transfer);
 
 
 /*
  *
- * TRANSMITTING AND RECEIVING DATA
+ * SOCKETS AND SERVERS
  *
  */
 
 
 /**
- * @brief Construct a DNS packet containing data provided to buffer and save its
- * length to buffer_len. 
+ * @brief Open a TCP connection to the first DNS server which accepts it, in
+ * the order of order_upstreams, and save the server to TCP_UPSTREAM
  *
- * @param buffer - allocated output string
- * @param buffer_len - pointer to an integer - will contain packet length in
- * bytes
- * @param data - data to encapsulate in the packet
- * @param len - length of the data in bytes
+ * @return socket
  */
-void create_packet(unsigned char *buffer, int *buffer_len, char *data, int len);
+int open_connection();
 
 
 /**
- * @brief Send a packet through a socket to provided address
+ * @brief Open the socket for DNS queries - dual-stack, so both IPv6 and IPv4
+ * servers can be reached, or IPv4 only if IPv6 is not available. Over TCP,
+ * open the connection
  *
- * @param sock - UDP socket
- * @param addr - sockaddr_in structure representing destination address
- * @param data - packet
- * @param len - packet length in bytes
+ * @return socket
  */
-void send_packet(int sock, struct sockaddr_in addr, unsigned char *data, int len);
+int open_socket();
 
 
 /**
- * @brief Receives data from the server. If no data is received (after a
- * constant timeout), return 1. Otherwise, return 0 since the confirmation was
- * received.
+ * @brief Order the DNS servers which can be reached by the socket in which
+ * they should be tried - alternating IPv6 and IPv4 servers, starting with
+ * IPv6 (RFC 8305)
  *
- * @param sock - socket
- * @param addr - server address
+ * @param order - output, indexes to UPSTREAMS, MAX_UPSTREAMS long
+ *
+ * @return number of servers in the order
+ */
+int order_upstreams(int *order);
+
+
+/*
+ *
+ * TRANSFERS
  *
- * @return 0 if confirmation was received
  */
-int wait_for_confirmation(int sock, struct sockaddr_in addr);
 
 
 /**
- * @brief Send an empty packet and ensure it is received. Try for a total of
- * MAX_TRIES if no confirmation is received from the server.
+ * @brief Select the capabilities, window and chunk length of the current try
+ * from the answer to the first query. A response which only echoes the
+ * query, without an address, comes from an old receiver: it took the path
+ * from the first query (and didn't read the handshake after it) and takes
+ * any later query with data for a data chunk, so chunks are sent one by one
+ * without control labels
  *
- * @param sock - socket
- * @param addr - server address
+ * @param transfer
+ * @param answer - response to the first query
+ * @param len - its length in bytes
+ */
+void negotiate(struct transfer *transfer, const unsigned char *answer, int len);
+
+
+/**
+ * @brief Handle the answer to a query of a transfer (called by the engine)
  *
- * @return 0 if empty packet was sent successfully
+ * @param sock - socket
+ * @param query - the answered query, still in flight
+ * @param answer - the response
+ * @param len - its length in bytes
  */
-int ensure_send_empty(int sock, struct sockaddr_in addr);
+void transfer_answer(int sock, struct query *query, const unsigned char *answer, int len);
 
 
 /**
- * @brief Wait for confirmation (of packet receival) from the server. If none
- * comes, ensure that the server receives an empty message to close the
- * connection.
+ * @brief Handle a query of a transfer whose answer did not come in time
+ * (called by the engine) - send it again or give up the try
  *
  * @param sock - socket
- * @param addr - server address
+ * @param query - the query, still in flight
+ */
+void transfer_timeout(int sock, struct query *query);
+
+
+/**
+ * @brief Prepare a transfer - check it, prepare its packets and get its
+ * payload
+ *
+ * @param transfer - output, zeroed
+ * @param base_host
+ * @param dst_filepath - where to save the file on the server machine
+ * @param src_filepath - file to send, NULL for STDIN
+ *
+ * @return NULL on success, the error message otherwise
+ */
+const char *transfer_init(struct transfer *transfer, char *base_host, char *dst_filepath, char *src_filepath);
+
+
+/**
+ * @brief Start a transfer prepared by transfer_init - it is then driven by
+ * engine_poll until it is done, up to MAX_TRIES tries
  *
- * @return 0 if confirmation was received, 1 if a packet confirmation was not
- * received but connection was successfully closed, -1 if connection close
- * confirmation was not received
+ * @param sock - socket opened by open_socket
+ * @param transfer
+ * @param done - called once the transfer is done (or NULL), its result is in
+ * transfer->result
+ * @param arg - passed to done
  */
-int handle_confirmation(int sock, struct sockaddr_in addr);
+void transfer_start(int sock, struct transfer *transfer,
+        void (*done)(struct transfer *transfer, void *arg), void *arg);
 
 
 /**
- * @brief Transmit all base64 data in PAYLOAD_B64 in DNS packets to the server.
- * First packet will contain the destination file path, following packets will
- * contain the encoded data and the last packet will be empty, signaling
- * connection close.
+ * @brief Free the payload and the delta of a transfer, stop waiting for its
+ * queries
  *
- * @return 0 if transmitted successfully, 1 if a packet confirmation was not
- * received but connection was successfully closed, -1 if connection close
- * confirmation was not received
+ * @param transfer
  */
-int transmit();
+void transfer_free(struct transfer *transfer);
@@ -0,0 +1,637 @@
+/**
+ * @brief Daemon of the DNS tunneling sender - stays resident, accepts
+ * transfers over a UNIX socket and sends them by priority over one socket,
+ * many at once, keeping what it learned about the DNS servers between them
+ * @file dns_sender_daemon.c
+ * @author Patrik Skaloš
+ * @year 2022
+ */
+
+
+// Standard libraries
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Header files
+#include "dns_sender.h"
+#include "dns_sender_daemon.h"
+#include "dns_sender_engine.h"
+
+
+/**
+ * Transfer submitted to the daemon
+ */
+struct daemon_job{
+    uint64_t id; // Also the order of submission
+    int priority;
+    int fd; // Connection of the client, told the result
+    char base_host[MAX_BASE_HOSTS_LEN + 1];
+    char dst_filepath[256];
+    char src_filepath[PATH_MAX];
+    struct transfer transfer; // Once started
+};
+
+
+// Queued jobs - binary heap, the highest priority (the oldest one of the
+// same priority) first
+static struct daemon_job *DAEMON_QUEUE[DAEMON_MAX_JOBS];
+static int DAEMON_QUEUE_LEN = 0;
+static uint64_t DAEMON_NEXT_ID = 1;
+static pthread_mutex_t DAEMON_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t DAEMON_COND = PTHREAD_COND_INITIALIZER;
+static int DAEMON_CHANGED = 0; // Set when a job is queued or ends
+
+// Jobs being sent (only used by the sending thread) and jobs put aside while
+// looking for the next ones to start
+static struct daemon_job *DAEMON_ACTIVE[ENGINE_MAX_TRANSFERS];
+static int DAEMON_ACTIVE_COUNT = 0;
+static struct daemon_job *DAEMON_WAITING[DAEMON_MAX_JOBS];
+
+// Connections of clients whose transfer is being read (only used by the
+// accepting thread)
+struct daemon_client{
+    int fd;
+    int len; // Of the line read so far
+    uint64_t accepted_ms;
+    char line[DAEMON_MAX_LINE];
+};
+static struct daemon_client DAEMON_CLIENTS[DAEMON_MAX_CLIENTS];
+static int DAEMON_CLIENT_COUNT = 0;
+
+static int DAEMON_LISTEN_FD = -1;
+static volatile sig_atomic_t DAEMON_RUNNING = 1; // Cleared by SIGINT or SIGTERM
+
+
+/**
+ * @brief Check if a job goes before another one
+ *
+ * @param a
+ * @param b
+ *
+ * @return 1 if a goes first
+ */
+static int daemon_job_first(struct daemon_job *a, struct daemon_job *b){
+    return a->priority != b->priority ? a->priority > b->priority : a->id < b->id;
+}
+
+
+/**
+ * @brief Add a job to the queue (call with DAEMON_LOCK held)
+ *
+ * @param job
+ *
+ * @return 0 on success, 1 if the queue is full
+ */
+static int daemon_push(struct daemon_job *job){
+    if(DAEMON_QUEUE_LEN == DAEMON_MAX_JOBS){
+        return 1;
+    }
+    int i = DAEMON_QUEUE_LEN++;
+    while(i > 0 && daemon_job_first(job, DAEMON_QUEUE[(i - 1) / 2])){
+        DAEMON_QUEUE[i] = DAEMON_QUEUE[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    DAEMON_QUEUE[i] = job;
+    return 0;
+}
+
+
+/**
+ * @brief Take the first job from the queue (call with DAEMON_LOCK held)
+ *
+ * @return the job, NULL if the queue is empty
+ */
+static struct daemon_job *daemon_pop(){
+    if(!DAEMON_QUEUE_LEN){
+        return NULL;
+    }
+    struct daemon_job *first = DAEMON_QUEUE[0];
+    struct daemon_job *last = DAEMON_QUEUE[--DAEMON_QUEUE_LEN];
+    int i = 0;
+    while(2 * i + 1 < DAEMON_QUEUE_LEN){
+        int child = 2 * i + 1;
+        if(child + 1 < DAEMON_QUEUE_LEN && daemon_job_first(DAEMON_QUEUE[child + 1], DAEMON_QUEUE[child])){
+            child += 1;
+        }
+        if(!daemon_job_first(DAEMON_QUEUE[child], last)){
+            break;
+        }
+        DAEMON_QUEUE[i] = DAEMON_QUEUE[child];
+        i = child;
+    }
+    DAEMON_QUEUE[i] = last;
+    return first;
+}
+
+
+/**
+ * @brief Write a line to a client (which may be gone already)
+ *
+ * @param fd - connection of the client
+ * @param As for printf and similar functions
+ */
+static void daemon_reply(int fd, const char *format, ...){
+    char line[DAEMON_MAX_LINE];
+    va_list argptr;
+    va_start(argptr, format);
+    int len = vsnprintf(line, sizeof(line), format, argptr);
+    va_end(argptr);
+    if(len > 0 && len < (int)sizeof(line)){
+        send(fd, line, len, MSG_NOSIGNAL);
+    }
+}
+
+
+/**
+ * @brief Read a line from a connection, byte by byte (lines are short)
+ *
+ * @param fd - the connection
+ * @param line - output, terminated without the '\n'
+ * @param size - of line
+ * @param timeout_ms - max time to wait for every byte, -1 to wait forever
+ *
+ * @return length of the line, -1 if the connection was closed, the time ran
+ * out or the line is too long
+ */
+static int daemon_read_line(int fd, char *line, int size, int timeout_ms){
+    int len = 0;
+    while(len < size - 1){
+        struct pollfd pfd = {fd, POLLIN, 0};
+        if(poll(&pfd, 1, timeout_ms) <= 0 || recv(fd, line + len, 1, 0) != 1){
+            return -1;
+        }
+        if(line[len] == '\n'){
+            line[len] = '\0';
+            return len;
+        }
+        len += 1;
+    }
+    return -1;
+}
+
+
+/**
+ * @brief Check a transfer submitted by a client and queue it
+ *
+ * @param fd - connection of the client, closed unless the transfer is queued
+ * @param line - the submitted line, without the '\n' (split in place)
+ */
+static void daemon_queue_job(int fd, char *line){
+
+    // Split the fields
+    char *fields[4];
+    int count = 0;
+    for(char *field = line; field && count < 4; count++){
+        fields[count] = field;
+        field = strchr(field, '\t');
+        if(field){
+            *field++ = '\0';
+        }
+    }
+    char *endptr = NULL;
+    int priority = count == 4 ? strtol(fields[0], &endptr, 10) : 0;
+    const char *message = NULL;
+    if(count != 4 || *endptr != '\0' || strchr(fields[3], '\t')){
+        message = "Invalid transfer, expected PRIORITY, BASE_HOST, DST_FILEPATH and SRC_FILEPATH separated by tabs.";
+    }else if(fields[3][0] != '/' || strlen(fields[3]) >= PATH_MAX){
+        message = "Source filepath must be absolute.";
+    }else{
+        message = check_transfer(fields[1], fields[2]);
+    }
+    if(message){
+        daemon_reply(fd, "error %s\n", message);
+        close(fd);
+        return;
+    }
+
+    struct daemon_job *job = calloc(1, sizeof(struct daemon_job));
+    if(!job){
+        err("Failed to allocate memory.");
+    }
+    job->priority = priority;
+    job->fd = fd;
+    strcpy(job->base_host, fields[1]);
+    strcpy(job->dst_filepath, fields[2]);
+    strcpy(job->src_filepath, fields[3]);
+
+    pthread_mutex_lock(&DAEMON_LOCK);
+    job->id = DAEMON_NEXT_ID++;
+    int full = daemon_push(job);
+    if(!full){
+        // Answered before the job can end (and be answered by the sending
+        // thread)
+        daemon_reply(fd, "queued %llu\n", (unsigned long long)job->id);
+        DAEMON_CHANGED = 1;
+        pthread_cond_signal(&DAEMON_COND);
+    }
+    pthread_mutex_unlock(&DAEMON_LOCK);
+
+    if(full){
+        daemon_reply(fd, "error Too many queued transfers.\n");
+        close(fd);
+        free(job);
+    }
+}
+
+
+/**
+ * @brief Get the time for timeouts of clients
+ *
+ * @return monotonic time in milliseconds
+ */
+static uint64_t daemon_now_ms(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+
+/**
+ * @brief Close the connection of a client whose transfer is being read
+ *
+ * @param i - index to DAEMON_CLIENTS
+ */
+static void daemon_drop_client(int i){
+    close(DAEMON_CLIENTS[i].fd);
+    DAEMON_CLIENTS[i] = DAEMON_CLIENTS[--DAEMON_CLIENT_COUNT];
+}
+
+
+/**
+ * @brief Read what a client sent without waiting and queue its transfer
+ * once the whole line came
+ *
+ * @param i - index to DAEMON_CLIENTS
+ *
+ * @return 1 if the client is done (and removed from DAEMON_CLIENTS), 0 if
+ * the rest of the line is still to come
+ */
+static int daemon_read_client(int i){
+    struct daemon_client *client = &DAEMON_CLIENTS[i];
+    int len = recv(client->fd, client->line + client->len, sizeof(client->line) - 1 - client->len, MSG_DONTWAIT);
+    if(len <= 0){
+        if(len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)){
+            return 0;
+        }
+        daemon_drop_client(i);
+        return 1;
+    }
+    char *end = memchr(client->line + client->len, '\n', len);
+    client->len += len;
+    if(!end){
+        if(client->len == (int)sizeof(client->line) - 1){
+            // The line is too long
+            daemon_drop_client(i);
+            return 1;
+        }
+        return 0;
+    }
+
+    // The client is told the result by the sending thread from now on
+    *end = '\0';
+    daemon_queue_job(client->fd, client->line);
+    DAEMON_CLIENTS[i] = DAEMON_CLIENTS[--DAEMON_CLIENT_COUNT];
+    return 1;
+}
+
+
+/**
+ * @brief Thread accepting clients until the daemon stops - the transfers
+ * they submit are read by polling all their connections at once, so a slow
+ * client doesn't hold up the others. Clients which don't send the whole
+ * line within DAEMON_READ_TIMEOUT_MS are dropped
+ *
+ * @param arg - unused
+ */
+static void *daemon_accept(void *arg){
+    struct pollfd pfds[DAEMON_MAX_CLIENTS + 1];
+    while(DAEMON_RUNNING){
+        // New clients wait in the backlog while there are too many
+        int count = DAEMON_CLIENT_COUNT;
+        for(int i = 0; i < count; i++){
+            pfds[i] = (struct pollfd){DAEMON_CLIENTS[i].fd, POLLIN, 0};
+        }
+        pfds[count] = (struct pollfd){DAEMON_LISTEN_FD, POLLIN, 0};
+        int listening = count < DAEMON_MAX_CLIENTS;
+        if(poll(pfds, count + listening, DAEMON_POLL_MS) < 0){
+            continue;
+        }
+
+        // From the last one, so that removed clients don't move the ones
+        // which are still to be checked
+        uint64_t now = daemon_now_ms();
+        for(int i = count - 1; i >= 0; i--){
+            if(pfds[i].revents && daemon_read_client(i)){
+                continue;
+            }
+            if(now - DAEMON_CLIENTS[i].accepted_ms > DAEMON_READ_TIMEOUT_MS){
+                daemon_drop_client(i);
+            }
+        }
+
+        if(listening && pfds[count].revents & POLLIN){
+            int fd = accept(DAEMON_LISTEN_FD, NULL, NULL);
+            if(fd != -1){
+                struct daemon_client *client = &DAEMON_CLIENTS[DAEMON_CLIENT_COUNT++];
+                client->fd = fd;
+                client->len = 0;
+                client->accepted_ms = now;
+            }
+        }
+    }
+    for(int i = DAEMON_CLIENT_COUNT - 1; i >= 0; i--){
+        daemon_drop_client(i);
+    }
+    return NULL;
+}
+
+
+/**
+ * @brief Stop the daemon (on SIGINT or SIGTERM) once the current transfers
+ * end
+ *
+ * @param signum
+ */
+static void daemon_stop(int signum){
+    DAEMON_RUNNING = 0;
+}
+
+
+/**
+ * @brief Tell the client of a job that its transfer ended and free the job
+ * (called when the transfer is done)
+ *
+ * @param transfer - of the job
+ * @param arg - the job
+ */
+static void daemon_done(struct transfer *transfer, void *arg){
+    struct daemon_job *job = arg;
+    daemon_reply(job->fd, "done %llu %d\n", (unsigned long long)job->id, transfer->result);
+    close(job->fd);
+
+    for(int i = 0; i < DAEMON_ACTIVE_COUNT; i++){
+        if(DAEMON_ACTIVE[i] == job){
+            DAEMON_ACTIVE[i] = DAEMON_ACTIVE[--DAEMON_ACTIVE_COUNT];
+            break;
+        }
+    }
+    transfer_free(transfer);
+    free(job);
+
+    pthread_mutex_lock(&DAEMON_LOCK);
+    DAEMON_CHANGED = 1;
+    pthread_mutex_unlock(&DAEMON_LOCK);
+}
+
+
+/**
+ * @brief Check if two lists of base hosts share a base host
+ *
+ * @param a - base hosts separated by commas
+ * @param b - base hosts separated by commas
+ *
+ * @return 1 if they do
+ */
+static int daemon_same_host(const char *a, const char *b){
+    for(const char *host = a; host; host = strchr(host, ',')){
+        host += *host == ',';
+        int len = strcspn(host, ",");
+        for(const char *other = b; other; other = strchr(other, ',')){
+            other += *other == ',';
+            if((int)strcspn(other, ",") == len && !strncasecmp(host, other, len)){
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+
+/**
+ * @brief Check if a job can be started now - the receiver keeps one session
+ * at a time, so transfers to the same base host are sent one by one
+ *
+ * @param job
+ *
+ * @return 1 if it can be started
+ */
+static int daemon_can_start(struct daemon_job *job){
+    for(int i = 0; i < DAEMON_ACTIVE_COUNT; i++){
+        if(daemon_same_host(DAEMON_ACTIVE[i]->base_host, job->base_host)){
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+/**
+ * @brief Start the queued jobs which can be started, by priority, while
+ * fewer than ENGINE_MAX_TRANSFERS jobs are being sent
+ *
+ * @param sock - socket for DNS queries
+ */
+static void daemon_start_jobs(int sock){
+    struct daemon_job *ready[ENGINE_MAX_TRANSFERS];
+    int ready_count = 0;
+    int waiting_count = 0;
+
+    pthread_mutex_lock(&DAEMON_LOCK);
+    if(!DAEMON_CHANGED){
+        pthread_mutex_unlock(&DAEMON_LOCK);
+        return;
+    }
+    DAEMON_CHANGED = 0;
+    while(DAEMON_ACTIVE_COUNT + ready_count < ENGINE_MAX_TRANSFERS){
+        struct daemon_job *job = daemon_pop();
+        if(!job){
+            break;
+        }
+        int blocked = !daemon_can_start(job);
+        for(int i = 0; i < ready_count && !blocked; i++){
+            blocked = daemon_same_host(ready[i]->base_host, job->base_host);
+        }
+        if(blocked){
+            DAEMON_WAITING[waiting_count++] = job;
+        }else{
+            ready[ready_count++] = job;
+        }
+    }
+    while(waiting_count){
+        daemon_push(DAEMON_WAITING[--waiting_count]);
+    }
+    pthread_mutex_unlock(&DAEMON_LOCK);
+
+    for(int i = 0; i < ready_count; i++){
+        struct daemon_job *job = ready[i];
+        const char *message = transfer_init(&job->transfer, job->base_host, job->dst_filepath, job->src_filepath);
+        if(message){
+            daemon_reply(job->fd, "error %s\n", message);
+            close(job->fd);
+            transfer_free(&job->transfer);
+            free(job);
+            continue;
+        }
+        DAEMON_ACTIVE[DAEMON_ACTIVE_COUNT++] = job;
+        transfer_start(sock, &job->transfer, daemon_done, job);
+    }
+}
+
+
+/**
+ * @brief Run the daemon until SIGINT or SIGTERM - accept transfers on a UNIX
+ * socket (by a thread, so that they are accepted during transfers too) and
+ * send them by the engine, many at once, the highest priority first (the
+ * oldest one of the same priority). Transfers to the same base host are sent
+ * one by one
+ *
+ * @param path - path of the UNIX socket, replaced if it exists
+ * @param sock - socket for DNS queries, opened by open_socket
+ *
+ * @return 0 when stopped
+ */
+int daemon_run(const char *path, int sock){
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(addr.sun_path)){
+        err("Daemon socket path is too long: \"%s\".", path);
+    }
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    DAEMON_LISTEN_FD = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(DAEMON_LISTEN_FD == -1 || bind(DAEMON_LISTEN_FD, (struct sockaddr *)&addr, sizeof(addr))
+            || listen(DAEMON_LISTEN_FD, 64)){
+        err("Failed to listen on \"%s\".", path);
+    }
+
+    // Stop on SIGINT and SIGTERM, clients which are gone don't stop us
+    struct sigaction stop_action;
+    memset(&stop_action, 0, sizeof(stop_action));
+    stop_action.sa_handler = daemon_stop;
+    sigaction(SIGINT, &stop_action, NULL);
+    sigaction(SIGTERM, &stop_action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    pthread_t thread;
+    if(pthread_create(&thread, NULL, daemon_accept, NULL)){
+        err("Failed to start the daemon.");
+    }
+
+    while(DAEMON_RUNNING || DAEMON_ACTIVE_COUNT){
+        if(DAEMON_RUNNING){
+            daemon_start_jobs(sock);
+        }
+        if(DAEMON_ACTIVE_COUNT){
+            engine_poll(sock, DAEMON_POLL_MS);
+            continue;
+        }
+
+        // Wait for a job, checking if we should stop now and then
+        pthread_mutex_lock(&DAEMON_LOCK);
+        if(!DAEMON_CHANGED){
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += DAEMON_POLL_MS * 1000000L;
+            deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+            deadline.tv_nsec %= 1000000000L;
+            pthread_cond_timedwait(&DAEMON_COND, &DAEMON_LOCK, &deadline);
+        }
+        pthread_mutex_unlock(&DAEMON_LOCK);
+    }
+
+    // Clients of jobs which were not sent are told so
+    pthread_join(thread, NULL);
+    for(struct daemon_job *job = daemon_pop(); job; job = daemon_pop()){
+        daemon_reply(job->fd, "error The daemon stopped before the transfer.\n");
+        close(job->fd);
+        free(job);
+    }
+    close(DAEMON_LISTEN_FD);
+    unlink(path);
+    return 0;
+}
+
+
+/**
+ * @brief Submit a transfer to the daemon and wait until it ends
+ *
+ * @param path - path of the daemon's UNIX socket
+ * @param priority - of the transfer, higher first
+ * @param base_host
+ * @param dst_filepath - where to save the file on the server machine
+ * @param src_filepath - file to send
+ *
+ * @return exit code of the transfer (0 if the file was transferred), 1 if
+ * it could not be submitted
+ */
+int daemon_submit(const char *path, int priority, const char *base_host,
+        const char *dst_filepath, const char *src_filepath){
+    // The daemon has another working directory
+    char src_path[PATH_MAX];
+    if(!realpath(src_filepath, src_path)){
+        fprintf(stderr, "Error! Could not open file \"%s\".\n", src_filepath);
+        return 1;
+    }
+    if(strpbrk(dst_filepath, "\t\n") || strpbrk(src_path, "\t\n")){
+        fprintf(stderr, "Error! Paths submitted to the daemon can't contain tabs and newlines.\n");
+        return 1;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr))){
+        fprintf(stderr, "Error! Could not connect to the daemon at \"%s\".\n", path);
+        if(fd != -1){
+            close(fd);
+        }
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    char line[DAEMON_MAX_LINE];
+    int len = snprintf(line, sizeof(line), "%d\t%s\t%s\t%s\n", priority, base_host, dst_filepath, src_path);
+    if(len >= (int)sizeof(line) || send(fd, line, len, 0) != len){
+        fprintf(stderr, "Error! Could not submit the transfer.\n");
+        close(fd);
+        return 1;
+    }
+
+    // Wait for the end of the transfer
+    int ret = 2;
+    while(daemon_read_line(fd, line, sizeof(line), -1) >= 0){
+        unsigned long long id = 0;
+        int code = 0;
+        if(!strncmp(line, "error ", strlen("error "))){
+            fprintf(stderr, "Error! %s\n", line + strlen("error "));
+            ret = 1;
+            break;
+        }
+        if(sscanf(line, "queued %llu", &id) == 1){
+            fprintf(stderr, "Transfer queued as %llu.\n", id);
+        }else if(sscanf(line, "done %llu %d", &id, &code) == 2){
+            ret = code;
+            break;
+        }
+    }
+    if(ret == 2){
+        fprintf(stderr, "Could not transmit data. Is the server listening?\n");
+    }
+    close(fd);
+    return ret;
+}
@@ -0,0 +1,61 @@
+/**
+ * @brief Daemon of the DNS tunneling sender - stays resident, accepts
+ * transfers over a UNIX socket and sends them by priority over one socket,
+ * many at once, keeping what it learned about the DNS servers between them
+ * @file dns_sender_daemon.h
+ * @author Patrik Skaloš
+ * @year 2022
+ */
+
+#ifndef DNS_SENDER_DAEMON_H
+#define DNS_SENDER_DAEMON_H
+
+
+/**
+ * A client submits a transfer by a line "PRIORITY\tBASE_HOST\tDST_FILEPATH\t
+ * SRC_FILEPATH\n" (an absolute source path, the daemon has its own working
+ * directory). The daemon answers "queued ID\n" right away (or "error
+ * MESSAGE\n") and "done ID CODE\n" once the transfer ends, CODE being the
+ * exit code of the sender (0 if the file was transferred). Up to
+ * DAEMON_MAX_CLIENTS lines are read at once, each has to come in
+ * DAEMON_READ_TIMEOUT_MS
+ */
+#define DAEMON_MAX_LINE 8192
+#define DAEMON_MAX_JOBS 65536
+#define DAEMON_MAX_CLIENTS 64
+#define DAEMON_READ_TIMEOUT_MS 1000
+#define DAEMON_POLL_MS 200
+
+
+/**
+ * @brief Run the daemon until SIGINT or SIGTERM - accept transfers on a UNIX
+ * socket (by a thread, so that they are accepted during transfers too) and
+ * send them by the engine, many at once, the highest priority first (the
+ * oldest one of the same priority). Transfers to the same base host are sent
+ * one by one
+ *
+ * @param path - path of the UNIX socket, replaced if it exists
+ * @param sock - socket for DNS queries, opened by open_socket
+ *
+ * @return 0 when stopped
+ */
+int daemon_run(const char *path, int sock);
+
+
+/**
+ * @brief Submit a transfer to the daemon and wait until it ends
+ *
+ * @param path - path of the daemon's UNIX socket
+ * @param priority - of the transfer, higher first
+ * @param base_host
+ * @param dst_filepath - where to save the file on the server machine
+ * @param src_filepath - file to send
+ *
+ * @return exit code of the transfer (0 if the file was transferred), 1 if
+ * it could not be submitted
+ */
+int daemon_submit(const char *path, int priority, const char *base_host,
+        const char *dst_filepath, const char *src_filepath);
+
+
+#endif //DNS_SENDER_DAEMON_H
@@ -0,0 +1,406 @@
+/**
+ * @brief Delta transfers for the DNS tunneling sender - signatures of the
+ * file on the receiver's machine and the delta of the payload against it
+ * (see common/dns_delta.h)
+ * @file dns_sender_delta.c
+ * @author Patrik Skaloš
+ * @year 2022
+ */
+
+
+// Standard libraries
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Header files
+#include "dns_sender_delta.h"
+#include "../common/dns_delta.h"
+
+
+/**
+ * Instruction of the delta - its header in the delta is followed by len
+ * bytes of data (of a literal)
+ */
+struct delta_op{
+    int64_t offset; // In the delta
+    unsigned char header[DELTA_END_LEN];
+    int header_len;
+    const unsigned char *data;
+    int64_t len;
+};
+
+
+/**
+ * @brief Append an instruction to the delta
+ *
+ * @param delta
+ *
+ * @return the instruction (exits if there is no memory)
+ */
+static struct delta_op *delta_add_op(struct delta *delta){
+    if(delta->op_count == delta->op_capacity){
+        delta->op_capacity = delta->op_capacity ? delta->op_capacity * 2 : 1024;
+        struct delta_op *ops = realloc(delta->ops, delta->op_capacity * sizeof(struct delta_op));
+        if(!ops){
+            fprintf(stderr, "Error! Could not allocate memory\n");
+            exit(1);
+        }
+        delta->ops = ops;
+    }
+    struct delta_op *op = &delta->ops[delta->op_count++];
+    memset(op, 0, sizeof(struct delta_op));
+    op->offset = delta->size;
+    return op;
+}
+
+
+/**
+ * @brief Append data sent as they are
+ *
+ * @param delta
+ * @param data
+ * @param len - in bytes
+ */
+static void delta_add_literal(struct delta *delta, const unsigned char *data, int64_t len){
+    while(len > 0){
+        // Length of a literal has 4 bytes
+        int64_t part = len < (1 << 30) ? len : (1 << 30);
+        struct delta_op *op = delta_add_op(delta);
+        op->header[0] = DELTA_LITERAL;
+        delta_put(op->header + 1, part, 4);
+        op->header_len = DELTA_LITERAL_LEN;
+        op->data = data;
+        op->len = part;
+        delta->size += DELTA_LITERAL_LEN + part;
+        data += part;
+        len -= part;
+    }
+}
+
+
+/**
+ * @brief Append a block copied from the receiver's file - merged with the
+ * previous instruction if it copies the blocks right before
+ *
+ * @param delta
+ * @param index - of the block
+ */
+static void delta_add_copy(struct delta *delta, uint64_t index){
+    struct delta_op *last = delta->op_count ? &delta->ops[delta->op_count - 1] : NULL;
+    if(last && last->header[0] == DELTA_COPY){
+        uint64_t first = delta_get(last->header + 1, 8);
+        uint64_t count = delta_get(last->header + 9, 4);
+        if(first + count == index && count < 0xFFFFFFFF){
+            delta_put(last->header + 9, count + 1, 4);
+            return;
+        }
+    }
+    struct delta_op *op = delta_add_op(delta);
+    op->header[0] = DELTA_COPY;
+    delta_put(op->header + 1, index, 8);
+    delta_put(op->header + 9, 1, 4);
+    op->header_len = DELTA_COPY_LEN;
+    delta->size += DELTA_COPY_LEN;
+}
+
+
+/**
+ * @brief Append a block read from the receiver's store
+ *
+ * @param delta
+ * @param hash - strong hash of the block
+ */
+static void delta_add_stored_op(struct delta *delta, uint64_t hash){
+    struct delta_op *op = delta_add_op(delta);
+    op->header[0] = DELTA_STORED;
+    delta_put(op->header + 1, hash, 8);
+    op->header_len = DELTA_STORED_LEN;
+    delta->size += DELTA_STORED_LEN;
+}
+
+
+/**
+ * @brief Check if the receiver's store has a block of the payload
+ *
+ * @param delta
+ * @param block - index of the block of DEDUP_BLOCK_SIZE
+ *
+ * @return 1 if it has
+ */
+static int delta_is_stored(struct delta *delta, uint64_t block){
+    return block < delta->stored_count && (delta->stored_blocks[block / 8] & (1 << (block % 8)));
+}
+
+
+/**
+ * @brief Save a page of signatures, the answer to the query "g-PAGE"
+ *
+ * @param delta
+ * @param page - index of the page
+ * @param data - the page
+ * @param len - its length in bytes
+ *
+ * @return 0 if the page is valid (and agrees with the pages before)
+ */
+int delta_add_page(struct delta *delta, uint64_t page, const unsigned char *data, int len){
+    if(len < DELTA_PAGE_HEADER){
+        return 1;
+    }
+    int block_size = delta_get(data, 4);
+    uint64_t count = delta_get(data + 4, 8);
+
+    if(!delta->signatures){
+        // The first page received
+        if(block_size < DELTA_MIN_BLOCK || block_size > DELTA_MAX_BLOCK
+                || !count || count > DELTA_MAX_BLOCKS){
+            return 1;
+        }
+        delta->signatures = malloc(count * sizeof(struct delta_signature));
+        if(!delta->signatures){
+            return 1;
+        }
+        delta->block_size = block_size;
+        delta->block_count = count;
+    }
+
+    uint64_t first = page * DELTA_PAGE_SIGNATURES;
+    if(block_size != delta->block_size || count != delta->block_count || first >= count){
+        return 1;
+    }
+    uint64_t n = count - first < DELTA_PAGE_SIGNATURES ? count - first : DELTA_PAGE_SIGNATURES;
+    if(len != DELTA_PAGE_HEADER + (int)n * DELTA_SIGNATURE_SIZE){
+        return 1;
+    }
+    for(uint64_t i = 0; i < n; i++){
+        const unsigned char *signature = data + DELTA_PAGE_HEADER + i * DELTA_SIGNATURE_SIZE;
+        delta->signatures[first + i].weak = delta_get(signature, 4);
+        delta->signatures[first + i].strong = delta_get(signature + 4, 8);
+    }
+    return 0;
+}
+
+
+/**
+ * @brief Get the number of pages of signatures
+ *
+ * @param delta
+ *
+ * @return the number of pages, 0 if no page was saved yet
+ */
+uint64_t delta_page_count(struct delta *delta){
+    return (delta->block_count + DELTA_PAGE_SIGNATURES - 1) / DELTA_PAGE_SIGNATURES;
+}
+
+
+/**
+ * @brief Prepare to save which blocks of the payload the receiver's store has
+ *
+ * @param delta
+ * @param blocks - number of full blocks of DEDUP_BLOCK_SIZE of the payload
+ */
+void delta_init_stored(struct delta *delta, uint64_t blocks){
+    free(delta->stored_blocks);
+    delta->stored_blocks = calloc((blocks + 7) / 8, 1);
+    if(!delta->stored_blocks){
+        fprintf(stderr, "Error! Could not allocate memory\n");
+        exit(1);
+    }
+    delta->stored_count = blocks;
+}
+
+
+/**
+ * @brief Save that the receiver's store has a block of the payload
+ *
+ * @param delta
+ * @param block - index of the block of DEDUP_BLOCK_SIZE
+ */
+void delta_add_stored(struct delta *delta, uint64_t block){
+    if(block < delta->stored_count){
+        delta->stored_blocks[block / 8] |= 1 << (block % 8);
+    }
+}
+
+
+/**
+ * @brief Compute the delta of data against the file whose signatures were
+ * saved - blocks found in the data (at any offset, by the rolling checksum)
+ * are copied from the file, other blocks the receiver's store has are read
+ * from it and the rest is sent. The delta refers to the data, so it has to
+ * stay unchanged until the delta is freed
+ *
+ * @param delta
+ * @param data - the new file
+ * @param size - its size in bytes
+ *
+ * @return size of the delta in bytes
+ */
+int64_t delta_compute(struct delta *delta, const unsigned char *data, int64_t size){
+    delta->op_count = 0;
+    delta->size = 0;
+    int block = delta->block_size;
+
+    // Blocks by their weak checksums - chained hash table, lower indexes
+    // first
+    uint64_t buckets = 1;
+    while(buckets < 2 * delta->block_count){
+        buckets *= 2;
+    }
+    int64_t *heads = malloc(buckets * sizeof(int64_t));
+    int64_t *next = malloc((delta->block_count + 1) * sizeof(int64_t));
+    if(!heads || !next){
+        fprintf(stderr, "Error! Could not allocate memory\n");
+        exit(1);
+    }
+    memset(heads, 0xFF, buckets * sizeof(int64_t));
+    for(int64_t i = (int64_t)delta->block_count - 1; i >= 0; i--){
+        uint64_t bucket = (delta->signatures[i].weak * 0x9E3779B1u) & (buckets - 1);
+        next[i] = heads[bucket];
+        heads[bucket] = i;
+    }
+
+    // Roll the weak checksum over the data, a block which has the same
+    // checksums is copied and the search continues after it. Where no block
+    // is found, stored blocks (at offsets which are multiples of their size)
+    // are read from the store
+    int64_t pos = 0;
+    int64_t literal = 0; // Start of data not sent yet
+    uint64_t expected = delta->block_count; // Block after the last copied one
+    uint32_t weak = block && size >= block ? delta_weak(data, block) : 0;
+    while(pos < size){
+        int rolling = block && pos <= size - block;
+        int64_t match = -1;
+        uint64_t strong = 0;
+        int strong_known = 0;
+
+        // Prefer the block following the last copied one, so that copies
+        // are merged
+        if(rolling && expected < delta->block_count && delta->signatures[expected].weak == weak){
+            strong = delta_strong(data + pos, block);
+            strong_known = 1;
+            if(delta->signatures[expected].strong == strong){
+                match = expected;
+            }
+        }
+        uint64_t bucket = (weak * 0x9E3779B1u) & (buckets - 1);
+        for(int64_t i = rolling ? heads[bucket] : -1; match < 0 && i >= 0; i = next[i]){
+            if(delta->signatures[i].weak != weak){
+                continue;
+            }
+            if(!strong_known){
+                strong = delta_strong(data + pos, block);
+                strong_known = 1;
+            }
+            if(delta->signatures[i].strong == strong){
+                match = i;
+            }
+        }
+
+        if(match >= 0){
+            delta_add_literal(delta, data + literal, pos - literal);
+            delta_add_copy(delta, match);
+            expected = match + 1;
+            pos += block;
+            literal = pos;
+            if(pos <= size - block){
+                weak = delta_weak(data + pos, block);
+            }
+            continue;
+        }
+
+        if(pos % DEDUP_BLOCK_SIZE == 0 && delta_is_stored(delta, pos / DEDUP_BLOCK_SIZE)){
+            delta_add_literal(delta, data + literal, pos - literal);
+            delta_add_stored_op(delta, delta_strong(data + pos, DEDUP_BLOCK_SIZE));
+            expected = delta->block_count;
+            pos += DEDUP_BLOCK_SIZE;
+            literal = pos;
+            if(block && pos <= size - block){
+                weak = delta_weak(data + pos, block);
+            }
+            continue;
+        }
+
+        if(block && pos < size - block){
+            weak = delta_weak_roll(weak, data[pos], data[pos + block], block);
+            pos++;
+        }else{
+            // No block can start here, only a stored one
+            pos = (pos / DEDUP_BLOCK_SIZE + 1) * DEDUP_BLOCK_SIZE;
+        }
+    }
+    delta_add_literal(delta, data + literal, size - literal);
+    free(heads);
+    free(next);
+
+    // The receiver checks that the new file is complete and right
+    struct delta_op *op = delta_add_op(delta);
+    op->header[0] = DELTA_END;
+    delta_put(op->header + 1, size, 8);
+    delta_put(op->header + 9, delta_strong(data, size), 8);
+    op->header_len = DELTA_END_LEN;
+    delta->size += DELTA_END_LEN;
+    return delta->size;
+}
+
+
+/**
+ * @brief Get bytes of the delta
+ *
+ * @param delta
+ * @param buffer - output, at least len bytes long
+ * @param offset - in the delta
+ * @param len - number of bytes
+ */
+void delta_read(struct delta *delta, unsigned char *buffer, int64_t offset, int len){
+    // Find the instruction containing the offset
+    int64_t low = 0, high = delta->op_count - 1;
+    while(low < high){
+        int64_t middle = (low + high + 1) / 2;
+        if(delta->ops[middle].offset <= offset){
+            low = middle;
+        }else{
+            high = middle - 1;
+        }
+    }
+
+    for(int64_t i = low; len > 0 && i < delta->op_count; i++){
+        struct delta_op *op = &delta->ops[i];
+        int64_t local = offset - op->offset;
+        while(len > 0 && local < op->header_len + op->len){
+            int64_t n;
+            if(local < op->header_len){
+                n = op->header_len - local < len ? op->header_len - local : len;
+                memcpy(buffer, op->header + local, n);
+            }else{
+                n = op->header_len + op->len - local < len ? op->header_len + op->len - local : len;
+                memcpy(buffer, op->data + local - op->header_len, n);
+            }
+            buffer += n;
+            offset += n;
+            local += n;
+            len -= n;
+        }
+    }
+}
+
+
+/**
+ * @brief Free the signatures, stored blocks and the delta
+ *
+ * @param delta
+ */
+void delta_free(struct delta *delta){
+    free(delta->signatures);
+    delta->signatures = NULL;
+    free(delta->stored_blocks);
+    delta->stored_blocks = NULL;
+    delta->stored_count = 0;
+    delta->block_count = 0;
+    delta->block_size = 0;
+    free(delta->ops);
+    delta->ops = NULL;
+    delta->op_count = 0;
+    delta->op_capacity = 0;
+    delta->size = 0;
+}
@@ -0,0 +1,122 @@
+/**
+ * @brief Delta transfers for the DNS tunneling sender - signatures of the
+ * file on the receiver's machine and the delta of the payload against it
+ * (see common/dns_delta.h)
+ * @file dns_sender_delta.h
+ * @author Patrik Skaloš
+ * @year 2022
+ */
+
+#ifndef DNS_SENDER_DELTA_H
+#define DNS_SENDER_DELTA_H
+
+#include <stdint.h>
+
+#include "../common/dns_delta.h"
+
+
+/**
+ * Maximum number of blocks of the receiver's file (signatures kept in memory)
+ */
+#define DELTA_MAX_BLOCKS (1 << 26)
+
+
+/**
+ * Delta of a transfer - signatures of the receiver's file, blocks of the
+ * payload the receiver's store has and instructions of the delta (zeroed
+ * before the first use)
+ */
+struct delta{
+    struct delta_signature *signatures; // Of the receiver's file
+    uint64_t block_count;
+    int block_size;
+
+    // Bit of every block of DEDUP_BLOCK_SIZE of the payload the receiver's
+    // store has
+    unsigned char *stored_blocks;
+    uint64_t stored_count;
+
+    struct delta_op *ops;
+    int64_t op_count;
+    int64_t op_capacity;
+    int64_t size;
+};
+
+
+/**
+ * @brief Save a page of signatures, the answer to the query "g-PAGE"
+ *
+ * @param delta
+ * @param page - index of the page
+ * @param data - the page
+ * @param len - its length in bytes
+ *
+ * @return 0 if the page is valid (and agrees with the pages before)
+ */
+int delta_add_page(struct delta *delta, uint64_t page, const unsigned char *data, int len);
+
+
+/**
+ * @brief Get the number of pages of signatures
+ *
+ * @param delta
+ *
+ * @return the number of pages, 0 if no page was saved yet
+ */
+uint64_t delta_page_count(struct delta *delta);
+
+
+/**
+ * @brief Prepare to save which blocks of the payload the receiver's store has
+ *
+ * @param delta
+ * @param blocks - number of full blocks of DEDUP_BLOCK_SIZE of the payload
+ */
+void delta_init_stored(struct delta *delta, uint64_t blocks);
+
+
+/**
+ * @brief Save that the receiver's store has a block of the payload
+ *
+ * @param delta
+ * @param block - index of the block of DEDUP_BLOCK_SIZE
+ */
+void delta_add_stored(struct delta *delta, uint64_t block);
+
+
+/**
+ * @brief Compute the delta of data against the file whose signatures were
+ * saved - blocks found in the data (at any offset, by the rolling checksum)
+ * are copied from the file, other blocks the receiver's store has are read
+ * from it and the rest is sent. The delta refers to the data, so it has to
+ * stay unchanged until the delta is freed
+ *
+ * @param delta
+ * @param data - the new file
+ * @param size - its size in bytes
+ *
+ * @return size of the delta in bytes
+ */
+int64_t delta_compute(struct delta *delta, const unsigned char *data, int64_t size);
+
+
+/**
+ * @brief Get bytes of the delta
+ *
+ * @param delta
+ * @param buffer - output, at least len bytes long
+ * @param offset - in the delta
+ * @param len - number of bytes
+ */
+void delta_read(struct delta *delta, unsigned char *buffer, int64_t offset, int len);
+
+
+/**
+ * @brief Free the signatures, stored blocks and the delta
+ *
+ * @param delta
+ */
+void delta_free(struct delta *delta);
+
+
+#endif //DNS_SENDER_DELTA_H
@@ -0,0 +1,277 @@
+/**
+ * @brief Event loop of the DNS tunneling sender - drives any number of
+ * transfers on one thread over one socket: queries in flight are matched to
+ * their answers by query IDs and every query has its own timer
+ * @file dns_sender_engine.c
+ * @author Patrik Skaloš
+ * @year 2022
+ */
+
+
+// Standard libraries
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+// Networking libraries
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+// Header files
+#include "dns_sender.h"
+#include "dns_sender_engine.h"
+#include "dns_sender_events.h"
+#include "../common/dns_metrics.h"
+#include "../common/dns_net_io.h"
+#include "../common/dns_timer.h"
+
+
+
+
+// Sequence number of queries, the lower 16 bits are the DNS query ID
+static int64_t QUERY_ID = 0;
+
+// Queries in flight by their query IDs
+static struct query *ENGINE_QUERIES[ENGINE_MAX_QUERIES];
+
+// Timers of the queries in flight
+static struct timer_wheel ENGINE_TIMERS;
+static int ENGINE_TIMERS_READY = 0;
+
+
+/*
+ *
+ * QUERIES
+ *
+ */
+
+
+/**
+ * @brief Format a question in the DNS wire format as a dotted URL (eg.
+ * "data.example.com")
+ *
+ * @param url - output string, at least 256 bytes long
+ * @param question - labels terminated by a zero byte
+ */
+static void question_to_url(char *url, const unsigned char *question){
+    int url_len = 0;
+    while(*question){
+        int label_len = *question;
+        if(url_len){
+            url[url_len++] = '.';
+        }
+        memcpy(url + url_len, question + 1, label_len);
+        url_len += label_len;
+        question += 1 + label_len;
+    }
+    url[url_len] = '\0';
+}
+
+
+/**
+ * @brief Send a query with a new query ID and wait for its answer - the
+ * answer is passed to transfer_answer, or transfer_timeout is called if
+ * none comes in time. A query which is in flight already is sent again
+ * (answers to the previous query ID are ignored). The query stays in flight
+ * until it is cancelled
+ *
+ * @param sock - socket opened by open_socket
+ * @param query - to query->upstream, with query->control
+ * @param data - base64 data of the query, NULL for the empty query
+ * @param len - length of the data
+ * @param timeout_ms - time to wait for the answer
+ *
+ * @return 0 if the query was sent, 1 if not (eg. the network is
+ * unreachable), it is in flight anyway
+ */
+int engine_send(int sock, struct query *query, const char *data, int len, int timeout_ms){
+    struct transfer *transfer = query->transfer;
+    if(!ENGINE_TIMERS_READY){
+        timer_wheel_init(&ENGINE_TIMERS, ENGINE_TICK_US, net_now_us());
+        ENGINE_TIMERS_READY = 1;
+    }
+    if(query->in_flight){
+        ENGINE_QUERIES[query->xid] = NULL;
+    }else{
+        query->in_flight = 1;
+        transfer->in_flight += 1;
+    }
+
+    // The next query ID which is not in flight (query IDs wrap after 65536
+    // queries)
+    do{
+        QUERY_ID += 1;
+    }while(ENGINE_QUERIES[QUERY_ID % ENGINE_MAX_QUERIES]);
+    query->xid = QUERY_ID % ENGINE_MAX_QUERIES;
+    ENGINE_QUERIES[query->xid] = query;
+
+    // Queries of a transfer take turns in its base hosts, so that each zone
+    // only gets a part of them
+    struct packet_template *template = &transfer->templates[transfer->next_domain];
+    transfer->next_domain = (transfer->next_domain + 1) % transfer->domains.count;
+
+    uint64_t stage = metrics_stage_start();
+    unsigned char packet[512];
+    int packet_len = packet_build(template, packet, query->xid,
+        query->control[0] ? query->control : NULL, data, len);
+    metrics_stage_end(STAGE_BUILD, stage);
+
+    // Trigger event - only create the URL string if someone listens
+    if(data && dns_sender__events_enabled()){
+        char url[256];
+        question_to_url(url, &packet[sizeof(struct dns_header_t)]);
+        dns_sender__on_chunk_encoded(transfer->dst_filepath, QUERY_ID, url);
+    }
+
+    uint64_t now = net_now_us();
+    timer_arm(&ENGINE_TIMERS, &query->timer, now + (uint64_t)timeout_ms * 1000);
+
+    struct upstream *upstream = query->upstream;
+    stage = metrics_stage_start();
+    int ret = TCP
+        ? net_send_message(sock, packet, packet_len)
+        : net_send(sock, packet, packet_len, 0, (struct sockaddr *)&upstream->addr, upstream->addr_len);
+    metrics_stage_end(STAGE_SEND, stage);
+    if(ret != packet_len){
+        query->sent_us = 0;
+        return 1;
+    }
+    metrics_add(METRIC_PACKETS_OUT, 1);
+    metrics_add(METRIC_BYTES_OUT, packet_len);
+    query->sent_us = now;
+    upstream->sent += 1;
+    transfer->packets += 1;
+
+    // Trigger event
+    const void *host = NULL;
+    if(net_addr_host((struct sockaddr *)&upstream->addr, &host) == AF_INET6){
+        dns_sender__on_chunk_sent6((struct in6_addr *)host, transfer->dst_filepath, QUERY_ID, packet_len);
+    }else{
+        dns_sender__on_chunk_sent((struct in_addr *)host, transfer->dst_filepath, QUERY_ID, packet_len);
+    }
+    return 0;
+}
+
+
+/**
+ * @brief Stop waiting for the answer to a query (nothing happens if it is
+ * not in flight)
+ *
+ * @param query
+ */
+void engine_cancel(struct query *query){
+    if(!query->in_flight){
+        return;
+    }
+    ENGINE_QUERIES[query->xid] = NULL;
+    timer_cancel(&ENGINE_TIMERS, &query->timer);
+    query->in_flight = 0;
+    query->transfer->in_flight -= 1;
+}
+
+
+/**
+ * @brief Pass a response to the query it answers - the query ID and the
+ * control label of its question have to be those of a query in flight, and
+ * the response has to come from the server the query was sent to
+ *
+ * @param sock - socket
+ * @param buffer - the response
+ * @param len - its length in bytes
+ * @param from - address the response came from (NULL over TCP)
+ */
+static void engine_answer(int sock, unsigned char *buffer, int len, const struct sockaddr *from){
+    metrics_add(METRIC_PACKETS_IN, 1);
+    metrics_add(METRIC_BYTES_IN, len);
+
+    struct query *query = ENGINE_QUERIES[ntohs(((struct dns_header_t *)buffer)->xid)];
+    if(!query){
+        // Late answer to a query sent again or given up
+        return;
+    }
+    if(from && !net_addr_equal(from, (struct sockaddr *)&query->upstream->addr)){
+        metrics_add(METRIC_DROPS, 1);
+        return;
+    }
+
+    // The confirmation echoes the question
+    char url[512], payload_b64[256], control[64];
+    int xid = 0;
+    if(packet_parse_query(buffer, len, &query->transfer->domains, NULL, url, payload_b64, control, &xid)){
+        control[0] = '\0';
+    }
+    if(strcasecmp(control, query->control)){
+        return;
+    }
+
+    // Record latency (only once for repeated confirmations)
+    if(query->sent_us){
+        uint64_t latency = net_now_us() - query->sent_us;
+        histogram_record(&METRIC_ACK_LATENCY, latency);
+        query->sent_us = 0;
+
+        // Smoothed round-trip time of the server and its variation, which
+        // set the retransmission timeout (like TCP, RFC 6298). Repeated
+        // queries get new query IDs, so the latency is never ambiguous
+        struct upstream *upstream = query->upstream;
+        if(upstream->confirmed){
+            uint64_t deviation = upstream->srtt_us > latency ? upstream->srtt_us - latency : latency - upstream->srtt_us;
+            upstream->rttvar_us = (3 * upstream->rttvar_us + deviation) / 4;
+            upstream->srtt_us = (7 * upstream->srtt_us + latency) / 8;
+        }else{
+            upstream->rttvar_us = latency / 2;
+            upstream->srtt_us = latency;
+        }
+        upstream->confirmed += 1;
+    }
+
+    transfer_answer(sock, query, buffer, len);
+}
+
+
+/**
+ * @brief Wait until answers come or a timer expires and handle them
+ *
+ * @param sock - socket opened by open_socket
+ * @param timeout_ms - max time to wait (forever if negative)
+ */
+void engine_poll(int sock, int timeout_ms){
+
+    // Wait at most until the first timer expires
+    int wait_ms = timeout_ms;
+    uint64_t deadline = ENGINE_TIMERS_READY ? timer_next_us(&ENGINE_TIMERS) : TIMER_NEVER;
+    if(deadline != TIMER_NEVER){
+        uint64_t now = net_now_us();
+        int until_ms = deadline > now ? (deadline - now + 999) / 1000 : 0;
+        if(wait_ms < 0 || until_ms < wait_ms){
+            wait_ms = until_ms;
+        }
+    }
+
+    // Handle the answers which came, then those which are already waiting
+    for(int i = 0; i < ENGINE_MAX_BATCH; i++){
+        unsigned char buffer[512];
+        struct sockaddr_storage from;
+        socklen_t from_len = sizeof(from);
+        int len = TCP
+            ? net_recv_message(sock, buffer, sizeof(buffer), i ? 0 : wait_ms)
+            : net_recv(sock, buffer, sizeof(buffer), (struct sockaddr *)&from, &from_len, i ? 0 : wait_ms);
+        if(len < 0){
+            break;
+        }
+        if(len >= (int)sizeof(struct dns_header_t)){
+            engine_answer(sock, buffer, len, TCP ? NULL : (struct sockaddr *)&from);
+        }
+    }
+
+    // Expired timers - their queries are sent again or given up
+    if(!ENGINE_TIMERS_READY){
+        return;
+    }
+    uint64_t now = net_now_us();
+    struct timer *timer = NULL;
+    while((timer = timer_expire(&ENGINE_TIMERS, now))){
+        metrics_add(METRIC_TIMEOUTS, 1);
+        transfer_timeout(sock, timer->arg);
+    }
+}
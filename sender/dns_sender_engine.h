@@ -0,0 +1,78 @@
+/**
+ * @brief Event loop of the DNS tunneling sender - drives any number of
+ * transfers on one thread over one socket: queries in flight are matched to
+ * their answers by query IDs and every query has its own timer
+ * @file dns_sender_engine.h
+ * @author Patrik Skaloš
+ * @year 2022
+ */
+
+#ifndef DNS_SENDER_ENGINE_H
+#define DNS_SENDER_ENGINE_H
+
+#include <stdint.h>
+
+
+/**
+ * Queries in flight are found by their query IDs, so there can be at most
+ * ENGINE_MAX_QUERIES of them - ENGINE_MAX_TRANSFERS transfers with up to
+ * TRANSFER_MAX_QUERIES queries each fit
+ */
+#define ENGINE_MAX_QUERIES 65536
+#define ENGINE_MAX_TRANSFERS 1024
+
+
+/**
+ * Maximum number of answers handled by one call of engine_poll before the
+ * timers are checked
+ */
+#define ENGINE_MAX_BATCH 64
+
+
+/**
+ * Length of a tick of the timers of queries - they expire up to a tick late
+ */
+#define ENGINE_TICK_US 1000
+
+
+struct query;
+
+
+/**
+ * @brief Send a query with a new query ID and wait for its answer - the
+ * answer is passed to transfer_answer, or transfer_timeout is called if
+ * none comes in time. A query which is in flight already is sent again
+ * (answers to the previous query ID are ignored). The query stays in flight
+ * until it is cancelled
+ *
+ * @param sock - socket opened by open_socket
+ * @param query - to query->upstream, with query->control
+ * @param data - base64 data of the query, NULL for the empty query
+ * @param len - length of the data
+ * @param timeout_ms - time to wait for the answer
+ *
+ * @return 0 if the query was sent, 1 if not (eg. the network is
+ * unreachable), it is in flight anyway
+ */
+int engine_send(int sock, struct query *query, const char *data, int len, int timeout_ms);
+
+
+/**
+ * @brief Stop waiting for the answer to a query (nothing happens if it is
+ * not in flight)
+ *
+ * @param query
+ */
+void engine_cancel(struct query *query);
+
+
+/**
+ * @brief Wait until answers come or a timer expires and handle them
+ *
+ * @param sock - socket opened by open_socket
+ * @param timeout_ms - max time to wait (forever if negative)
+ */
+void engine_poll(int sock, int timeout_ms);
+
+
+#endif //DNS_SENDER_ENGINE_H
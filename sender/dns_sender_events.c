@@ -1,53 +1,123 @@
 #include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include "dns_sender_events.h"
+#include "../common/dns_event_sink.h"
 
 #define NETADDR_STRLEN (INET6_ADDRSTRLEN > INET_ADDRSTRLEN ? INET6_ADDRSTRLEN : INET_ADDRSTRLEN)
-#define CREATE_IPV4STR(dst, src) char dst[NETADDR_STRLEN]; inet_ntop(AF_INET, src, dst, NETADDR_STRLEN)
-#define CREATE_IPV6STR(dst, src) char dst[NETADDR_STRLEN]; inet_ntop(AF_INET6, src, dst, NETADDR_STRLEN)
+
+enum
+{
+	EVENT_CHUNK_ENCODED,
+	EVENT_CHUNK_SENT,
+	EVENT_TRANSFER_INIT,
+	EVENT_TRANSFER_COMPLETED
+};
+
+
+/**
+ * Formats a record as the text output of the sender
+ */
+void dns_sender__format_event(FILE *out, const struct event_record *record)
+{
+	char address[NETADDR_STRLEN] = "";
+	if (record->family)
+	{
+		inet_ntop(record->family, record->address, address, NETADDR_STRLEN);
+	}
+
+	switch (record->type)
+	{
+		case EVENT_CHUNK_ENCODED:
+			fprintf(out, "[ENCD] %s %9d '%s'\n", record->path, record->chunk_id, record->data);
+			break;
+		case EVENT_CHUNK_SENT:
+			fprintf(out, "[SENT] %s %9d %dB to %s\n", record->path, record->chunk_id, (int)record->size, address);
+			break;
+		case EVENT_TRANSFER_INIT:
+			fprintf(out, "[INIT] %s\n", address);
+			break;
+		case EVENT_TRANSFER_COMPLETED:
+			fprintf(out, "[CMPL] %s of %" PRId64 "B\n", record->path, record->size);
+			break;
+	}
+}
+
+int dns_sender__events_enabled()
+{
+	event_sink_init(dns_sender__format_event);
+	return event_sink_enabled();
+}
+
+static void emit_address(struct event_record *record, int family, const void *address)
+{
+	record->family = family;
+	memcpy(record->address, address, family == AF_INET6 ? 16 : 4);
+}
 
 
 void dns_sender__on_chunk_encoded(char *filePath, int chunkId, char *encodedData)
 {
-	fprintf(stderr, "[ENCD] %s %9d '%s'\n", filePath, chunkId, encodedData);
+	if (!dns_sender__events_enabled()) return;
+	struct event_record record;
+	event_record_init(&record, EVENT_CHUNK_ENCODED);
+	event_record_string(record.path, filePath, EVENT_PATH_LEN);
+	event_record_string(record.data, encodedData, EVENT_DATA_LEN);
+	record.chunk_id = chunkId;
+	event_sink_emit(&record);
 }
 
-void on_chunk_sent(char *source, char *filePath, int chunkId, int chunkSize)
+static void on_chunk_sent(int family, const void *dest, char *filePath, int chunkId, int chunkSize)
 {
-	fprintf(stderr, "[SENT] %s %9d %dB to %s\n", filePath, chunkId, chunkSize, source);
+	struct event_record record;
+	event_record_init(&record, EVENT_CHUNK_SENT);
+	emit_address(&record, family, dest);
+	event_record_string(record.path, filePath, EVENT_PATH_LEN);
+	record.chunk_id = chunkId;
+	record.size = chunkSize;
+	event_sink_emit(&record);
 }
 
 void dns_sender__on_chunk_sent(struct in_addr *dest, char *filePath, int chunkId, int chunkSize)
 {
-	CREATE_IPV4STR(address, dest);
-	on_chunk_sent(address, filePath, chunkId, chunkSize);
+	if (!dns_sender__events_enabled()) return;
+	on_chunk_sent(AF_INET, dest, filePath, chunkId, chunkSize);
 }
 
 void dns_sender__on_chunk_sent6(struct in6_addr *dest, char *filePath, int chunkId, int chunkSize)
 {
-	CREATE_IPV6STR(address, dest);
-	on_chunk_sent(address, filePath, chunkId, chunkSize);
+	if (!dns_sender__events_enabled()) return;
+	on_chunk_sent(AF_INET6, dest, filePath, chunkId, chunkSize);
 }
 
-void on_transfer_init(char *source)
+static void on_transfer_init(int family, const void *dest)
 {
-	fprintf(stderr, "[INIT] %s\n", source);
+	struct event_record record;
+	event_record_init(&record, EVENT_TRANSFER_INIT);
+	emit_address(&record, family, dest);
+	event_sink_emit(&record);
 }
 
 void dns_sender__on_transfer_init(struct in_addr *dest)
 {
-	CREATE_IPV4STR(address, dest);
-	on_transfer_init(address);
+	if (!dns_sender__events_enabled()) return;
+	on_transfer_init(AF_INET, dest);
 }
 
 void dns_sender__on_transfer_init6(struct in6_addr *dest)
 {
-	CREATE_IPV6STR(address, dest);
-	on_transfer_init(address);
+	if (!dns_sender__events_enabled()) return;
+	on_transfer_init(AF_INET6, dest);
 }
 
-void dns_sender__on_transfer_completed( char *filePath, int fileSize)
+void dns_sender__on_transfer_completed( char *filePath, int64_t fileSize)
 {
-	fprintf(stderr, "[CMPL] %s of %dB\n", filePath, fileSize);
+	if (!dns_sender__events_enabled()) return;
+	struct event_record record;
+	event_record_init(&record, EVENT_TRANSFER_COMPLETED);
+	event_record_string(record.path, filePath, EVENT_PATH_LEN);
+	record.size = fileSize;
+	event_sink_emit(&record);
 }
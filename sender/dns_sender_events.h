@@ -1,7 +1,22 @@
 #ifndef ISA22_DNS_SENDER_EVENTS_H
 #define ISA22_DNS_SENDER_EVENTS_H
 
+#include <stdint.h>
 #include <netinet/in.h>
+#include "../common/dns_event_sink.h"
+
+/**
+ * Returns 1 if events should be written. Events can be turned off by setting
+ * the DNS_EVENTS environment variable to "off", so that callers can skip
+ * preparing their arguments.
+ */
+int dns_sender__events_enabled();
+
+/**
+ * Formats a record as the text output of the sender (also used to decode
+ * binary event files, see bench/dns_events.c).
+ */
+void dns_sender__format_event(FILE *out, const struct event_record *record);
 
 /**
  * Tato metoda je volána klientem (odesílatelem) při zakódování části dat do doménového jména.
@@ -53,6 +68,6 @@ void dns_sender__on_transfer_init6(struct in6_addr *dest);
  * @param filePath Cesta k cílovému souboru
  * @param fileSize Celková velikost přijatého souboru v bytech
  */
-void dns_sender__on_transfer_completed( char *filePath, int fileSize);
+void dns_sender__on_transfer_completed( char *filePath, int64_t fileSize);
 
 #endif //ISA22_DNS_SENDER_EVENTS_H
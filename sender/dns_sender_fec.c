@@ -0,0 +1,61 @@
+/**
+ * @brief Forward error correction for the DNS tunneling sender
+ * @file dns_sender_fec.c
+ * @author Patrik Skaloš
+ * @year 2022
+ */
+
+
+// Standard libraries
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+// Header files
+#include "dns_sender_fec.h"
+#include "../common/dns_base64.h"
+
+
+/**
+ * @brief Compute a parity chunk of a group of base64 chunks. Every character
+ * of the parity is a XOR of 6-bit values of characters on the same position
+ * in all chunks (shorter chunks are treated as if padded with 'A' = 0), so the
+ * parity is a valid base64 string itself
+ *
+ * @param parity - output buffer, at least parity_len + 1 bytes long
+ * @param parity_len - length of the longest chunk in the group
+ * @param chunks - array of pointers to the data chunks
+ * @param lens - array of lengths of the data chunks
+ * @param n - number of data chunks in the group
+ */
+void fec_parity(char *parity, int parity_len, char **chunks, int *lens, int n){
+    for(int i = 0; i < parity_len; i++){
+        int value = 0;
+        for(int j = 0; j < n; j++){
+            if(i < lens[j]){
+                value ^= base64_sextet(chunks[j][i]);
+            }
+        }
+        parity[i] = base64_char(value);
+    }
+    parity[parity_len] = '\0';
+}
+
+
+/**
+ * @brief Write a control label identifying a FEC chunk: "f-G-I-N-C-L" where
+ * (all numbers are hexadecimal) G is the group number, I is index of the
+ * chunk in the group (I == N marks the parity chunk), N is the number of data
+ * chunks in the group, C is the length of full chunks and L is the length of
+ * the last data chunk of the group
+ *
+ * @param label - output buffer, at least 64 bytes long
+ * @param group
+ * @param index
+ * @param n
+ * @param chunk_len
+ * @param last_len
+ */
+void fec_control_label(char *label, uint64_t group, int index, int n, int chunk_len, int last_len){
+    snprintf(label, 64, "f-%" PRIx64 "-%x-%x-%x-%x", group, index, n, chunk_len, last_len);
+}